@@ -0,0 +1,281 @@
+#!/usr/bin/env perl
+
+# End-to-end benchmark for approximate nearest neighbor search
+#
+# Loads a dataset, builds an index, and sweeps a search option, reporting
+# recall, throughput, latency, build time, and index size as CSV
+#
+# perl bench/ann.pl --dataset sift --base sift_base.fvecs \
+#     --queries sift_query.fvecs --truth sift_groundtruth.ivecs \
+#     --opclass vector_l2_ops --m 16 --ef-construction 64 \
+#     --ef-search 10,20,40,80,160 --clients 1,8
+#
+# Vectors can be in .fvecs format or text with one value per line (for
+# instance, [1,2,3] or {1:1.5,3:2}/5). Ground truth can be in .ivecs format
+# (zero-based ids) and is computed with an exact search when not given.
+# Connection settings come from the standard PG* environment variables.
+
+use strict;
+use warnings FATAL => 'all';
+use File::Temp qw(tempfile);
+use Getopt::Long;
+use Time::HiRes qw(time);
+
+my %opt = (
+	type => 'vector',
+	method => 'hnsw',
+	k => 10,
+	clients => '1',
+	duration => 30,
+);
+
+GetOptions(\%opt,
+	'dataset=s', 'base=s', 'queries=s', 'truth=s', 'type=s', 'opclass=s',
+	'method=s', 'm=i', 'ef-construction=i', 'lists=i', 'ef-search=s',
+	'probes=s', 'k=i', 'clients=s', 'duration=i', 'skip-load',
+	'maintenance-work-mem=s', 'workers=i')
+  or die "invalid options\n";
+
+for my $name ('dataset', 'opclass')
+{
+	die "--$name is required\n" unless defined($opt{$name});
+}
+die "--dataset must be an identifier\n" unless $opt{dataset} =~ /^[a-z_][a-z0-9_]*$/;
+
+my %operators = (l2 => '<->', ip => '<#>', cosine => '<=>', l1 => '<+>', hamming => '<~>', jaccard => '<%>');
+my ($distance) = $opt{opclass} =~ /_([a-z0-9]+)_ops$/;
+my $operator = $operators{$distance // ''} or die "unknown opclass: $opt{opclass}\n";
+
+my $base_table = "$opt{dataset}_base";
+my $query_table = "$opt{dataset}_query";
+my $truth_table = "$opt{dataset}_truth";
+my $index = "$opt{dataset}_idx";
+my $k = $opt{k};
+
+my ($search_option, $search_values, @with);
+if ($opt{method} eq 'hnsw')
+{
+	$search_option = 'hnsw.ef_search';
+	$search_values = $opt{'ef-search'} // '40';
+	push(@with, "m = $opt{m}") if defined($opt{m});
+	push(@with, "ef_construction = $opt{'ef-construction'}") if defined($opt{'ef-construction'});
+}
+elsif ($opt{method} eq 'ivfflat')
+{
+	$search_option = 'ivfflat.probes';
+	$search_values = $opt{probes} // '1';
+	push(@with, "lists = $opt{lists}") if defined($opt{lists});
+}
+else
+{
+	die "unknown method: $opt{method}\n";
+}
+
+sub psql
+{
+	my ($sql) = @_;
+
+	open(my $fh, '-|', 'psql', '-X', '-q', '-A', '-t', '-v', 'ON_ERROR_STOP=1', '-c', $sql)
+	  or die "could not run psql: $!\n";
+	my $output = do { local $/; <$fh> };
+	close($fh) or die "psql failed: $sql\n";
+	chomp($output);
+	return $output;
+}
+
+# Read vectors as rows of id and text value until the callback returns false
+sub read_vectors
+{
+	my ($path, $callback) = @_;
+	my $id = 0;
+
+	open(my $fh, '<', $path) or die "could not open $path: $!\n";
+	binmode($fh);
+
+	if ($path =~ /\.fvecs$/)
+	{
+		my $header;
+		while (read($fh, $header, 4) == 4)
+		{
+			my $dim = unpack('l<', $header);
+			read($fh, my $data, 4 * $dim) == 4 * $dim or die "truncated file: $path\n";
+			last unless $callback->($id++, '[' . join(',', unpack('f<*', $data)) . ']', $dim);
+		}
+	}
+	else
+	{
+		while (my $line = <$fh>)
+		{
+			chomp($line);
+			next if $line eq '';
+
+			my $dim;
+			if ($line =~ m{/(\d+)$})
+			{
+				$dim = $1;
+			}
+			else
+			{
+				$dim = ($line =~ tr/,//) + 1;
+			}
+			last unless $callback->($id++, $line, $dim);
+		}
+	}
+
+	close($fh);
+}
+
+# Load vectors with COPY and return the number of dimensions
+sub load_vectors
+{
+	my ($path, $table) = @_;
+	my $dim;
+
+	# Get dimensions from the first vector
+	read_vectors($path, sub { $dim = $_[2]; return 0; });
+
+	psql("DROP TABLE IF EXISTS $table; CREATE TABLE $table (id int4, v $opt{type}($dim));");
+
+	open(my $copy, '|-', 'psql', '-X', '-q', '-v', 'ON_ERROR_STOP=1', '-c', "COPY $table (id, v) FROM STDIN")
+	  or die "could not run psql: $!\n";
+	read_vectors($path, sub { return print $copy "$_[0]\t$_[1]\n"; });
+	close($copy) or die "could not load $path\n";
+
+	return $dim;
+}
+
+sub load_truth
+{
+	my ($path) = @_;
+
+	psql("DROP TABLE IF EXISTS $truth_table; CREATE TABLE $truth_table (id int4 PRIMARY KEY, neighbors int4[]);");
+
+	open(my $fh, '<', $path) or die "could not open $path: $!\n";
+	binmode($fh);
+	open(my $copy, '|-', 'psql', '-X', '-q', '-v', 'ON_ERROR_STOP=1', '-c', "COPY $truth_table (id, neighbors) FROM STDIN")
+	  or die "could not run psql: $!\n";
+
+	my $id = 0;
+	my $header;
+	while (read($fh, $header, 4) == 4)
+	{
+		my $n = unpack('l<', $header);
+		read($fh, my $data, 4 * $n) == 4 * $n or die "truncated file: $path\n";
+		print $copy $id++ . "\t{" . join(',', unpack('l<*', $data)) . "}\n";
+	}
+
+	close($copy) or die "could not load $path\n";
+	close($fh);
+}
+
+sub compute_truth
+{
+	psql(qq(
+		DROP TABLE IF EXISTS $truth_table;
+		CREATE TABLE $truth_table (id int4 PRIMARY KEY, neighbors int4[]);
+		SET enable_indexscan = off;
+		INSERT INTO $truth_table
+			SELECT q.id, ARRAY(SELECT b.id FROM $base_table b ORDER BY b.v $operator q.v LIMIT $k)
+			FROM $query_table q;
+	));
+}
+
+if (!$opt{'skip-load'})
+{
+	die "--base and --queries are required\n" unless defined($opt{base}) && defined($opt{queries});
+
+	load_vectors($opt{base}, $base_table);
+	load_vectors($opt{queries}, $query_table);
+	psql("ALTER TABLE $query_table ADD PRIMARY KEY (id); ANALYZE $base_table;");
+
+	if (defined($opt{truth}))
+	{
+		load_truth($opt{truth});
+	}
+	else
+	{
+		compute_truth();
+	}
+}
+
+my $nqueries = psql("SELECT COUNT(*) FROM $query_table;");
+die "no queries\n" if $nqueries == 0;
+
+# Build index
+my $settings = '';
+$settings .= "SET maintenance_work_mem = '$opt{'maintenance-work-mem'}';" if defined($opt{'maintenance-work-mem'});
+$settings .= "SET max_parallel_maintenance_workers = $opt{workers};" if defined($opt{workers});
+my $with = @with ? ' WITH (' . join(', ', @with) . ')' : '';
+
+psql("DROP INDEX IF EXISTS $index;");
+my $start = time();
+psql("$settings CREATE INDEX $index ON $base_table USING $opt{method} (v $opt{opclass})$with;");
+my $build_seconds = time() - $start;
+my $index_bytes = psql("SELECT pg_relation_size('$index');");
+
+# Warm the cache
+psql("SELECT pg_prewarm('$index');") if psql("SELECT COUNT(*) FROM pg_extension WHERE extname = 'pg_prewarm';");
+
+# Run queries one at a time for recall and latency
+sub measure_recall
+{
+	my ($value) = @_;
+
+	return split(/\|/, psql(qq(
+		CREATE FUNCTION pg_temp.ann_search() RETURNS TABLE (recall float8, duration float8) AS \$\$
+		DECLARE
+			q record;
+			started timestamptz;
+			ids int4[];
+		BEGIN
+			FOR q IN SELECT v, neighbors[1:$k] AS neighbors FROM $query_table JOIN $truth_table USING (id) LOOP
+				started := clock_timestamp();
+				ids := ARRAY(SELECT id FROM $base_table ORDER BY v $operator q.v LIMIT $k);
+				duration := 1000 * extract(epoch FROM clock_timestamp() - started);
+				recall := (SELECT COUNT(*) FROM unnest(ids) i WHERE i = ANY (q.neighbors))::float8 / $k;
+				RETURN NEXT;
+			END LOOP;
+		END
+		\$\$ LANGUAGE plpgsql;
+		SET $search_option = $value;
+		SELECT round(avg(recall)::numeric, 4),
+			round(percentile_cont(0.5) WITHIN GROUP (ORDER BY duration)::numeric, 3),
+			round(percentile_cont(0.99) WITHIN GROUP (ORDER BY duration)::numeric, 3)
+		FROM pg_temp.ann_search();
+	)));
+}
+
+# Run queries with concurrent clients for throughput
+sub measure_qps
+{
+	my ($value, $clients) = @_;
+
+	my ($fh, $script) = tempfile(SUFFIX => '.sql', UNLINK => 1);
+	print $fh "\\set qid random(0, " . ($nqueries - 1) . ")\n";
+	print $fh "SELECT id FROM $base_table ORDER BY v $operator (SELECT v FROM $query_table WHERE id = :qid) LIMIT $k;\n";
+	close($fh);
+
+	local $ENV{PGOPTIONS} = ($ENV{PGOPTIONS} // '') . " -c $search_option=$value";
+	open(my $pgbench, '-|', 'pgbench', '-n', '-M', 'prepared', '-f', $script, '-c', $clients, '-j', $clients, '-T', $opt{duration})
+	  or die "could not run pgbench: $!\n";
+	my $output = do { local $/; <$pgbench> };
+	close($pgbench) or die "pgbench failed\n";
+
+	my ($tps) = $output =~ /tps = ([\d.]+)/ or die "could not parse pgbench output\n";
+	return sprintf('%.1f', $tps);
+}
+
+print "dataset,method,build_options,search_option,search_value,clients,recall,qps,p50_ms,p99_ms,build_seconds,index_bytes\n";
+
+for my $value (split(/,/, $search_values))
+{
+	my ($recall, $p50, $p99) = measure_recall($value);
+
+	for my $clients (split(/,/, $opt{clients}))
+	{
+		my $qps = measure_qps($value, $clients);
+		printf("%s,%s,\"%s\",%s,%s,%d,%s,%s,%s,%s,%.1f,%s\n",
+			$opt{dataset}, $opt{method}, join(' ', @with), $search_option, $value,
+			$clients, $recall, $qps, $p50, $p99, $build_seconds, $index_bytes);
+	}
+}
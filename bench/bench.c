@@ -0,0 +1,689 @@
+/*
+ * Microbenchmarks for distance kernels, along with k-means and graph search
+ * loops that exercise them the way index builds and scans do
+ *
+ * Build and run with: make bench
+ */
+#include "postgres.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bitutils.h"
+#include "halfutils.h"
+#include "halfvec.h"
+#include "portability/instr_time.h"
+#include "sparsevecutils.h"
+#include "vectorutils.h"
+
+/* Cycle through enough vectors that they do not all fit in cache */
+#define BENCH_VECTORS 1024
+#define BENCH_BATCH 32
+#define BENCH_MIN_SECONDS 0.1
+#define BENCH_KMEANS_CENTERS 64
+#define BENCH_GRAPH_VECTORS 8192
+#define BENCH_GRAPH_M 16
+#define BENCH_GRAPH_EF 40
+
+typedef double (*BenchFunc) (int i);
+
+typedef struct BenchData
+{
+	int			dim;
+	float	   *fx;
+	half	   *hx;
+	uint8	   *qx;
+	unsigned char *bx;
+	unsigned char *bxs[BENCH_VECTORS];
+	int32	   *ai;
+	int32	   *bi;
+	int			an;
+	int			bn;
+	float	   *centers;
+	float	   *sums;
+	int		   *counts;
+}			BenchData;
+
+/*
+ * An in-memory graph with the structure of the bottom layer of an HNSW index
+ */
+typedef struct BenchGraph
+{
+	int			dim;
+	int			n;
+	int			entry;
+	float	   *x;
+	int		   *neighbors;
+	float	   *neighborDistances;
+	int		   *neighborCounts;
+	uint32	   *visited;
+	uint32		visitId;
+}			BenchGraph;
+
+typedef struct BenchCandidate
+{
+	int			id;
+	float		distance;
+	bool		expanded;
+}			BenchCandidate;
+
+static BenchData data;
+static BenchGraph graph;
+static double sink;
+static uint64 seed = 0x9E3779B97F4A7C15;
+
+static const int vectorDims[] = {128, 384, 768, 1536, 2000};
+static const int bitDims[] = {1024, 4096, 16000, 64000};
+static const int sparseNnz[] = {32, 256, 1024};
+static const int graphDims[] = {128, 768};
+
+/*
+ * Get a pseudorandom number (xorshift64*)
+ */
+static uint64
+NextRandom(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545F4914F6CDD1D;
+}
+
+static float
+RandomFloat(void)
+{
+	return (NextRandom() >> 40) / (float) (1 << 24);
+}
+
+static void *
+BenchAlloc(size_t size)
+{
+	void	   *ptr = malloc(size);
+
+	if (ptr == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+/*
+ * Run a function until enough time has elapsed and report results
+ */
+static void
+RunBench(const char *name, int dim, double bytes, BenchFunc func)
+{
+	long		iterations = 1024;
+
+	for (;;)
+	{
+		instr_time	start;
+		instr_time	duration;
+		double		seconds;
+		double		result = 0;
+
+		INSTR_TIME_SET_CURRENT(start);
+		for (long i = 0; i < iterations; i++)
+			result += func(i % BENCH_VECTORS);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		seconds = INSTR_TIME_GET_DOUBLE(duration);
+
+		/* Prevent the compiler from removing calls */
+		sink += result;
+
+		if (seconds >= BENCH_MIN_SECONDS)
+		{
+			double		ns = seconds * 1e9 / iterations;
+
+			if (bytes > 0)
+				printf("%-32s %6d %12.1f ns/op %8.2f GB/s\n", name, dim, ns, bytes / ns);
+			else
+				printf("%-32s %6d %12.1f ns/op\n", name, dim, ns);
+			return;
+		}
+
+		iterations *= 2;
+	}
+}
+
+/* Compare the first vector with each of the others */
+
+static double
+BenchVectorL2SquaredDistance(int i)
+{
+	return VectorL2SquaredDistance(data.dim, data.fx, data.fx + (size_t) i * data.dim);
+}
+
+static double
+BenchVectorInnerProduct(int i)
+{
+	return VectorInnerProduct(data.dim, data.fx, data.fx + (size_t) i * data.dim);
+}
+
+static double
+BenchVectorL2SquaredDistanceBatch(int i)
+{
+	float	   *bxs[BENCH_BATCH];
+	float		distances[BENCH_BATCH];
+
+	i = Min(i, BENCH_VECTORS - BENCH_BATCH);
+	for (int j = 0; j < BENCH_BATCH; j++)
+		bxs[j] = data.fx + (size_t) (i + j) * data.dim;
+	VectorL2SquaredDistanceBatch(data.dim, data.fx, bxs, BENCH_BATCH, distances);
+	return distances[0];
+}
+
+static double
+BenchVectorInnerProductBatch(int i)
+{
+	float	   *bxs[BENCH_BATCH];
+	float		distances[BENCH_BATCH];
+
+	i = Min(i, BENCH_VECTORS - BENCH_BATCH);
+	for (int j = 0; j < BENCH_BATCH; j++)
+		bxs[j] = data.fx + (size_t) (i + j) * data.dim;
+	VectorInnerProductBatch(data.dim, data.fx, bxs, BENCH_BATCH, distances);
+	return distances[0];
+}
+
+static double
+BenchVectorCosineSimilarity(int i)
+{
+	return VectorCosineSimilarity(data.dim, data.fx, data.fx + (size_t) i * data.dim);
+}
+
+static double
+BenchVectorL1Distance(int i)
+{
+	return VectorL1Distance(data.dim, data.fx, data.fx + (size_t) i * data.dim);
+}
+
+static double
+BenchVectorQuantizedL2SquaredDistance(int i)
+{
+	return VectorQuantizedL2SquaredDistance(data.dim, data.fx, 0, 1.0 / 255, data.qx + (size_t) i * data.dim);
+}
+
+static double
+BenchHalfvecL2SquaredDistance(int i)
+{
+	return HalfvecL2SquaredDistance(data.dim, data.hx, data.hx + (size_t) i * data.dim);
+}
+
+static double
+BenchHalfvecInnerProduct(int i)
+{
+	return HalfvecInnerProduct(data.dim, data.hx, data.hx + (size_t) i * data.dim);
+}
+
+static double
+BenchHalfvecCosineSimilarity(int i)
+{
+	return HalfvecCosineSimilarity(data.dim, data.hx, data.hx + (size_t) i * data.dim);
+}
+
+static double
+BenchHalfvecL1Distance(int i)
+{
+	return HalfvecL1Distance(data.dim, data.hx, data.hx + (size_t) i * data.dim);
+}
+
+static double
+BenchHalfToFloat4Array(int i)
+{
+	/* Reuse the first vector as output */
+	HalfToFloat4Array(data.dim, data.hx + (size_t) i * data.dim, data.fx);
+	return data.fx[0];
+}
+
+static double
+BenchBitHammingDistance(int i)
+{
+	return BitHammingDistance(data.dim / 8, data.bx, data.bxs[i], 0);
+}
+
+static double
+BenchBitJaccardDistance(int i)
+{
+	return BitJaccardDistance(data.dim / 8, data.bx, data.bxs[i], 0, 0, 0);
+}
+
+static double
+BenchBitHammingDistanceBatch(int i)
+{
+	uint64		distances[BENCH_BATCH];
+
+	i = Min(i, BENCH_VECTORS - BENCH_BATCH);
+	BitHammingDistanceBatch(data.dim / 8, data.bx, data.bxs + i, BENCH_BATCH, distances);
+	return distances[0];
+}
+
+static double
+BenchBitJaccardDistanceBatch(int i)
+{
+	double		distances[BENCH_BATCH];
+
+	i = Min(i, BENCH_VECTORS - BENCH_BATCH);
+	BitJaccardDistanceBatch(data.dim / 8, data.bx, data.bxs + i, BENCH_BATCH, distances);
+	return distances[0];
+}
+
+static double
+BenchSparsevecIntersect(int i)
+{
+	SparsevecIntersectState state;
+	int			matches = 0;
+	int			n;
+
+	SparsevecIntersectInit(&state, data.ai, data.an, data.bi, data.bn);
+	while ((n = SparsevecIntersectNext(&state)) > 0)
+		matches += n;
+
+	return matches;
+}
+
+/*
+ * Run one iteration of Lloyd's algorithm, assigning each vector to its
+ * closest center with the batched kernel like IVFFlat builds
+ */
+static double
+BenchKmeansIteration(int i)
+{
+	int			dim = data.dim;
+	float	   *bxs[BENCH_KMEANS_CENTERS];
+	float		distances[BENCH_KMEANS_CENTERS];
+
+	for (int j = 0; j < BENCH_KMEANS_CENTERS; j++)
+		bxs[j] = data.centers + (size_t) j * dim;
+
+	memset(data.sums, 0, (size_t) BENCH_KMEANS_CENTERS * dim * sizeof(float));
+	memset(data.counts, 0, BENCH_KMEANS_CENTERS * sizeof(int));
+
+	for (int v = 0; v < BENCH_VECTORS; v++)
+	{
+		float	   *x = data.fx + (size_t) v * dim;
+		float	   *sum;
+		int			closest = 0;
+
+		VectorL2SquaredDistanceBatch(dim, x, bxs, BENCH_KMEANS_CENTERS, distances);
+		for (int j = 1; j < BENCH_KMEANS_CENTERS; j++)
+		{
+			if (distances[j] < distances[closest])
+				closest = j;
+		}
+
+		sum = data.sums + (size_t) closest * dim;
+		for (int k = 0; k < dim; k++)
+			sum[k] += x[k];
+		data.counts[closest]++;
+	}
+
+	/* Keep the previous center for empty clusters */
+	for (int j = 0; j < BENCH_KMEANS_CENTERS; j++)
+	{
+		if (data.counts[j] == 0)
+			continue;
+
+		for (int k = 0; k < dim; k++)
+			bxs[j][k] = data.sums[(size_t) j * dim + k] / data.counts[j];
+	}
+
+	return data.centers[0];
+}
+
+static void
+RunKmeans(void)
+{
+	size_t		n = (size_t) BENCH_KMEANS_CENTERS * data.dim;
+
+	data.centers = BenchAlloc(n * sizeof(float));
+	data.sums = BenchAlloc(n * sizeof(float));
+	data.counts = BenchAlloc(BENCH_KMEANS_CENTERS * sizeof(int));
+
+	/* Use the first vectors as initial centers */
+	memcpy(data.centers, data.fx, n * sizeof(float));
+
+	RunBench("KmeansIteration", data.dim, (1.0 + BENCH_KMEANS_CENTERS) * BENCH_VECTORS * data.dim * sizeof(float), BenchKmeansIteration);
+
+	free(data.centers);
+	free(data.sums);
+	free(data.counts);
+}
+
+/*
+ * Search the graph from the entry point, keeping the ef closest elements
+ * sorted by distance and expanding the closest unexpanded one each step
+ */
+static int
+GraphSearch(float *q, int ef, BenchCandidate * w)
+{
+	int			wlen = 1;
+
+	if (++graph.visitId == 0)
+	{
+		memset(graph.visited, 0, BENCH_GRAPH_VECTORS * sizeof(uint32));
+		graph.visitId = 1;
+	}
+
+	w[0].id = graph.entry;
+	w[0].distance = VectorL2SquaredDistance(graph.dim, q, graph.x + (size_t) graph.entry * graph.dim);
+	w[0].expanded = false;
+	graph.visited[graph.entry] = graph.visitId;
+
+	for (;;)
+	{
+		int		   *neighbors;
+		int			ids[BENCH_GRAPH_M * 2];
+		float	   *bxs[BENCH_GRAPH_M * 2];
+		float		distances[BENCH_GRAPH_M * 2];
+		int			count = 0;
+		int			c;
+
+		for (c = 0; c < wlen; c++)
+		{
+			if (!w[c].expanded)
+				break;
+		}
+
+		if (c == wlen)
+			break;
+
+		w[c].expanded = true;
+		neighbors = graph.neighbors + (size_t) w[c].id * BENCH_GRAPH_M * 2;
+
+		for (int j = 0; j < graph.neighborCounts[w[c].id]; j++)
+		{
+			int			id = neighbors[j];
+
+			if (graph.visited[id] == graph.visitId)
+				continue;
+
+			graph.visited[id] = graph.visitId;
+			ids[count] = id;
+			bxs[count] = graph.x + (size_t) id * graph.dim;
+			count++;
+		}
+
+		if (count == 0)
+			continue;
+
+		VectorL2SquaredDistanceBatch(graph.dim, q, bxs, count, distances);
+
+		for (int j = 0; j < count; j++)
+		{
+			int			k;
+
+			if (wlen == ef && distances[j] >= w[wlen - 1].distance)
+				continue;
+
+			if (wlen < ef)
+				wlen++;
+
+			for (k = wlen - 1; k > 0 && w[k - 1].distance > distances[j]; k--)
+				w[k] = w[k - 1];
+
+			w[k].id = ids[j];
+			w[k].distance = distances[j];
+			w[k].expanded = false;
+		}
+	}
+
+	return wlen;
+}
+
+/*
+ * Add an edge, replacing the furthest neighbor when the list is full
+ */
+static void
+GraphAddEdge(int from, int to, float distance)
+{
+	int		   *neighbors = graph.neighbors + (size_t) from * BENCH_GRAPH_M * 2;
+	float	   *neighborDistances = graph.neighborDistances + (size_t) from * BENCH_GRAPH_M * 2;
+	int			furthest = 0;
+
+	if (graph.neighborCounts[from] < BENCH_GRAPH_M * 2)
+	{
+		neighbors[graph.neighborCounts[from]] = to;
+		neighborDistances[graph.neighborCounts[from]] = distance;
+		graph.neighborCounts[from]++;
+		return;
+	}
+
+	for (int j = 1; j < BENCH_GRAPH_M * 2; j++)
+	{
+		if (neighborDistances[j] > neighborDistances[furthest])
+			furthest = j;
+	}
+
+	if (distance < neighborDistances[furthest])
+	{
+		neighbors[furthest] = to;
+		neighborDistances[furthest] = distance;
+	}
+}
+
+/*
+ * Insert the next vector, starting over once the graph is full so the cost
+ * is averaged over graph sizes
+ */
+static double
+BenchGraphInsert(int i)
+{
+	BenchCandidate w[BENCH_GRAPH_EF];
+	int			id;
+	int			wlen;
+
+	if (graph.n == BENCH_GRAPH_VECTORS)
+		graph.n = 0;
+
+	id = graph.n++;
+	graph.neighborCounts[id] = 0;
+
+	if (id == 0)
+	{
+		graph.entry = id;
+		return 0;
+	}
+
+	wlen = GraphSearch(graph.x + (size_t) id * graph.dim, BENCH_GRAPH_EF, w);
+	for (int j = 0; j < Min(wlen, BENCH_GRAPH_M * 2); j++)
+	{
+		GraphAddEdge(id, w[j].id, w[j].distance);
+		GraphAddEdge(w[j].id, id, w[j].distance);
+	}
+
+	return wlen;
+}
+
+static double
+BenchGraphSearch(int i)
+{
+	BenchCandidate w[BENCH_GRAPH_EF];
+
+	GraphSearch(data.fx + (size_t) i * data.dim, BENCH_GRAPH_EF, w);
+	return w[0].distance;
+}
+
+static void
+RunGraph(void)
+{
+	size_t		n = (size_t) BENCH_GRAPH_VECTORS * data.dim;
+
+	graph.dim = data.dim;
+	graph.n = 0;
+	graph.visitId = 0;
+	graph.x = BenchAlloc(n * sizeof(float));
+	graph.neighbors = BenchAlloc((size_t) BENCH_GRAPH_VECTORS * BENCH_GRAPH_M * 2 * sizeof(int));
+	graph.neighborDistances = BenchAlloc((size_t) BENCH_GRAPH_VECTORS * BENCH_GRAPH_M * 2 * sizeof(float));
+	graph.neighborCounts = BenchAlloc(BENCH_GRAPH_VECTORS * sizeof(int));
+	graph.visited = BenchAlloc(BENCH_GRAPH_VECTORS * sizeof(uint32));
+	memset(graph.visited, 0, BENCH_GRAPH_VECTORS * sizeof(uint32));
+
+	for (size_t i = 0; i < n; i++)
+		graph.x[i] = RandomFloat();
+
+	RunBench("GraphInsert", data.dim, 0, BenchGraphInsert);
+
+	/* Search a complete graph */
+	while (graph.n < BENCH_GRAPH_VECTORS)
+		BenchGraphInsert(0);
+
+	RunBench("GraphSearch", data.dim, 0, BenchGraphSearch);
+
+	free(graph.x);
+	free(graph.neighbors);
+	free(graph.neighborDistances);
+	free(graph.neighborCounts);
+	free(graph.visited);
+}
+
+static void
+InitVectors(int dim)
+{
+	size_t		n = (size_t) BENCH_VECTORS * dim;
+
+	data.dim = dim;
+	data.fx = BenchAlloc(n * sizeof(float));
+	data.hx = BenchAlloc(n * sizeof(half));
+	data.qx = BenchAlloc(n * sizeof(uint8));
+
+	for (size_t i = 0; i < n; i++)
+	{
+		data.fx[i] = RandomFloat();
+		data.hx[i] = Float4ToHalfUnchecked(data.fx[i]);
+		data.qx[i] = NextRandom() & 0xFF;
+	}
+}
+
+static void
+FreeVectors(void)
+{
+	free(data.fx);
+	free(data.hx);
+	free(data.qx);
+}
+
+static void
+InitBits(int dim)
+{
+	size_t		bytes = dim / 8;
+
+	data.dim = dim;
+	data.bx = BenchAlloc(BENCH_VECTORS * bytes);
+
+	for (size_t i = 0; i < BENCH_VECTORS * bytes; i++)
+		data.bx[i] = NextRandom() & 0xFF;
+
+	for (int i = 0; i < BENCH_VECTORS; i++)
+		data.bxs[i] = data.bx + i * bytes;
+}
+
+/*
+ * Generate sorted indices spread over a range
+ */
+static int32 *
+RandomIndices(int nnz, int range)
+{
+	int32	   *indices = BenchAlloc(nnz * sizeof(int32));
+	int			n = 0;
+
+	for (int i = 0; n < nnz; i++)
+	{
+		if ((int) (NextRandom() % range) < nnz)
+			indices[n++] = i;
+	}
+
+	return indices;
+}
+
+static void
+RunSparsevec(int an, int bn)
+{
+	char		name[32];
+
+	data.an = an;
+	data.bn = bn;
+	data.ai = RandomIndices(an, Max(an, bn) * 2);
+	data.bi = RandomIndices(bn, Max(an, bn) * 2);
+
+	snprintf(name, sizeof(name), "SparsevecIntersect(%d)", an);
+	RunBench(name, bn, (an + bn) * sizeof(int32), BenchSparsevecIntersect);
+
+	free(data.ai);
+	free(data.bi);
+}
+
+int
+main(int argc, char **argv)
+{
+	VectorInit();
+	HalfvecInit();
+	BitvecInit();
+	SparsevecInit();
+
+#ifdef USE_DISPATCH
+	printf("dispatch: enabled\n");
+#else
+	printf("dispatch: disabled\n");
+#endif
+	printf("%-32s %6s %15s %13s\n", "kernel", "dim", "time", "throughput");
+
+	for (int d = 0; d < lengthof(vectorDims); d++)
+	{
+		int			dim = vectorDims[d];
+
+		InitVectors(dim);
+		RunBench("VectorL2SquaredDistance", dim, 2.0 * dim * sizeof(float), BenchVectorL2SquaredDistance);
+		RunBench("VectorInnerProduct", dim, 2.0 * dim * sizeof(float), BenchVectorInnerProduct);
+		RunBench("VectorL2SquaredDistanceBatch", dim, (1.0 + BENCH_BATCH) * dim * sizeof(float), BenchVectorL2SquaredDistanceBatch);
+		RunBench("VectorInnerProductBatch", dim, (1.0 + BENCH_BATCH) * dim * sizeof(float), BenchVectorInnerProductBatch);
+		RunBench("VectorCosineSimilarity", dim, 2.0 * dim * sizeof(float), BenchVectorCosineSimilarity);
+		RunBench("VectorL1Distance", dim, 2.0 * dim * sizeof(float), BenchVectorL1Distance);
+		RunBench("VectorQuantizedL2SquaredDistance", dim, dim * (sizeof(float) + sizeof(uint8)), BenchVectorQuantizedL2SquaredDistance);
+		RunBench("HalfvecL2SquaredDistance", dim, 2.0 * dim * sizeof(half), BenchHalfvecL2SquaredDistance);
+		RunBench("HalfvecInnerProduct", dim, 2.0 * dim * sizeof(half), BenchHalfvecInnerProduct);
+		RunBench("HalfvecCosineSimilarity", dim, 2.0 * dim * sizeof(half), BenchHalfvecCosineSimilarity);
+		RunBench("HalfvecL1Distance", dim, 2.0 * dim * sizeof(half), BenchHalfvecL1Distance);
+		RunBench("HalfToFloat4Array", dim, dim * (sizeof(half) + sizeof(float)), BenchHalfToFloat4Array);
+		FreeVectors();
+	}
+
+	for (int d = 0; d < lengthof(bitDims); d++)
+	{
+		int			dim = bitDims[d];
+
+		InitBits(dim);
+		RunBench("BitHammingDistance", dim, 2.0 * dim / 8, BenchBitHammingDistance);
+		RunBench("BitJaccardDistance", dim, 2.0 * dim / 8, BenchBitJaccardDistance);
+		RunBench("BitHammingDistanceBatch", dim, (1.0 + BENCH_BATCH) * dim / 8, BenchBitHammingDistanceBatch);
+		RunBench("BitJaccardDistanceBatch", dim, (1.0 + BENCH_BATCH) * dim / 8, BenchBitJaccardDistanceBatch);
+		free(data.bx);
+	}
+
+	for (int d = 0; d < lengthof(sparseNnz); d++)
+	{
+		int			nnz = sparseNnz[d];
+
+		RunSparsevec(nnz, nnz);
+
+		/* Galloping */
+		RunSparsevec(nnz, nnz * SPARSEVEC_GALLOP_RATIO * 2);
+	}
+
+	for (int d = 0; d < lengthof(graphDims); d++)
+	{
+		InitVectors(graphDims[d]);
+		RunKmeans();
+		RunGraph();
+		FreeVectors();
+	}
+
+	/* Keep result observable */
+	if (isnan(sink))
+		printf("nan\n");
+
+	return 0;
+}
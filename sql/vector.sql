@@ -261,6 +261,13 @@ CREATE ACCESS METHOD hnsw TYPE INDEX HANDLER hnswhandler;
 
 COMMENT ON ACCESS METHOD hnsw IS 'hnsw index access method';
 
+CREATE FUNCTION invertedhandler(internal) RETURNS index_am_handler
+	AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE ACCESS METHOD inverted TYPE INDEX HANDLER invertedhandler;
+
+COMMENT ON ACCESS METHOD inverted IS 'inverted index access method';
+
 -- access method private functions
 
 CREATE FUNCTION ivfflat_halfvec_support(internal) RETURNS internal
@@ -916,3 +923,60 @@ CREATE OPERATOR CLASS sparsevec_l1_ops
 	OPERATOR 1 <+> (sparsevec, sparsevec) FOR ORDER BY float_ops,
 	FUNCTION 1 l1_distance(sparsevec, sparsevec),
 	FUNCTION 3 hnsw_sparsevec_support(internal);
+
+-- hnsw filter opclasses
+
+CREATE OPERATOR CLASS int2_ops
+	DEFAULT FOR TYPE smallint USING hnsw AS
+	OPERATOR 1 = (smallint, smallint);
+
+CREATE OPERATOR CLASS int4_ops
+	DEFAULT FOR TYPE integer USING hnsw AS
+	OPERATOR 1 = (integer, integer);
+
+CREATE OPERATOR CLASS int8_ops
+	DEFAULT FOR TYPE bigint USING hnsw AS
+	OPERATOR 1 = (bigint, bigint);
+
+-- inverted opclasses
+
+CREATE OPERATOR CLASS sparsevec_ip_ops
+	FOR TYPE sparsevec USING inverted AS
+	OPERATOR 1 <#> (sparsevec, sparsevec) FOR ORDER BY float_ops;
+
+-- scan stats
+
+CREATE FUNCTION pg_stat_vector_scans(OUT access_method text, OUT scans bigint, OUT distances bigint,
+	OUT upper_hops bigint, OUT layer0_hops bigint, OUT lists bigint, OUT tuples bigint, OUT resumes bigint,
+	OUT discarded bigint, OUT shared_blks_hit bigint, OUT shared_blks_read bigint) RETURNS SETOF record
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION pg_stat_vector_scans_reset() RETURNS void
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION pg_stat_vector_scans_reset() FROM PUBLIC;
+
+CREATE VIEW pg_stat_vector_scans AS
+	SELECT * FROM pg_stat_vector_scans();
+
+-- batch search
+
+CREATE FUNCTION hnsw_search_batch(index regclass, queries vector[], k int, OUT query int, OUT rank int, OUT ctid tid) RETURNS SETOF record
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION hnsw_search_batch(index regclass, queries halfvec[], k int, OUT query int, OUT rank int, OUT ctid tid) RETURNS SETOF record
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION hnsw_search_batch(index regclass, queries sparsevec[], k int, OUT query int, OUT rank int, OUT ctid tid) RETURNS SETOF record
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- snapshot
+
+CREATE FUNCTION hnsw_export_snapshot(index regclass) RETURNS bool
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+-- rebalance
+
+CREATE FUNCTION ivfflat_rebalance(index regclass, split_ratio float8 DEFAULT 4, merge_ratio float8 DEFAULT 0.25,
+	OUT splits int, OUT merges int) RETURNS record
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
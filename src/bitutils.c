@@ -18,12 +18,20 @@
 #endif
 
 #ifdef _MSC_VER
+#define TARGET_AVX2
 #define TARGET_AVX512_POPCOUNT
 #else
+#define TARGET_AVX2 __attribute__((target("avx2")))
 #define TARGET_AVX512_POPCOUNT __attribute__((target("avx512f,avx512vpopcntdq")))
 #endif
 #endif
 
+/* NEON is part of the base instruction set on AArch64 */
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define BIT_NEON
+#include <arm_neon.h>
+#endif
+
 /* Disable for LLVM due to crash with bitcode generation */
 #if defined(USE_TARGET_CLONES) && !defined(__POPCNT__) && !defined(__llvm__)
 #define BIT_TARGET_CLONES __attribute__((target_clones("default", "popcnt")))
@@ -42,10 +50,12 @@
 #endif
 
 uint64		(*BitHammingDistance) (uint32 bytes, unsigned char *ax, unsigned char *bx, uint64 distance);
+void		(*BitHammingDistanceBatch) (uint32 bytes, unsigned char *ax, unsigned char **bxs, int n, uint64 *distances);
 double		(*BitJaccardDistance) (uint32 bytes, unsigned char *ax, unsigned char *bx, uint64 ab, uint64 aa, uint64 bb);
+void		(*BitJaccardDistanceBatch) (uint32 bytes, unsigned char *ax, unsigned char **bxs, int n, double *distances);
 
-BIT_TARGET_CLONES static uint64
-BitHammingDistanceDefault(uint32 bytes, unsigned char *ax, unsigned char *bx, uint64 distance)
+static inline uint64
+BitHammingDistanceInline(uint32 bytes, unsigned char *ax, unsigned char *bx, uint64 distance)
 {
 #ifdef popcount64
 	for (; bytes >= sizeof(uint64); bytes -= sizeof(uint64))
@@ -70,7 +80,84 @@ BitHammingDistanceDefault(uint32 bytes, unsigned char *ax, unsigned char *bx, ui
 	return distance;
 }
 
+BIT_TARGET_CLONES static uint64
+BitHammingDistanceDefault(uint32 bytes, unsigned char *ax, unsigned char *bx, uint64 distance)
+{
+	return BitHammingDistanceInline(bytes, ax, bx, distance);
+}
+
+/*
+ * Short codes spend more time in calls than in popcounts, so score all of
+ * them in a single call
+ */
+BIT_TARGET_CLONES static void
+BitHammingDistanceBatchDefault(uint32 bytes, unsigned char *ax, unsigned char **bxs, int n, uint64 *distances)
+{
+	for (int i = 0; i < n; i++)
+		distances[i] = BitHammingDistanceInline(bytes, ax, bxs[i], 0);
+}
+
 #ifdef BIT_DISPATCH
+/*
+ * Count the bits in each 64-bit lane with a nibble lookup table
+ */
+TARGET_AVX2 static inline __m256i
+PopcountLanesAvx2(__m256i v)
+{
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+											0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	__m256i		lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+	__m256i		hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+
+	return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+TARGET_AVX2 static void
+BitHammingDistanceBatchAvx2(uint32 bytes, unsigned char *ax, unsigned char **bxs, int n, uint64 *distances)
+{
+	int			i = 0;
+
+	/*
+	 * Score four short codes at a time, one per lane. Scalar popcounts are
+	 * as fast for a single word.
+	 */
+	if (bytes >= 2 * sizeof(uint64) && bytes < 2 * sizeof(__m256i))
+	{
+		uint32		words = bytes / sizeof(uint64);
+		uint32		tail = words * sizeof(uint64);
+
+		for (; i + 4 <= n; i += 4)
+		{
+			__m256i		dist = _mm256_setzero_si256();
+
+			for (uint32 w = 0; w < words; w++)
+			{
+				uint64		axs;
+				uint64		lanes[4];
+
+				/* Ensure aligned */
+				memcpy(&axs, ax + w * sizeof(uint64), sizeof(uint64));
+				for (int j = 0; j < 4; j++)
+					memcpy(&lanes[j], bxs[i + j] + w * sizeof(uint64), sizeof(uint64));
+
+				dist = _mm256_add_epi64(dist, PopcountLanesAvx2(_mm256_xor_si256(_mm256_set_epi64x((long long) lanes[3], (long long) lanes[2], (long long) lanes[1], (long long) lanes[0]), _mm256_set1_epi64x((long long) axs))));
+			}
+
+			_mm256_storeu_si256((__m256i *) &distances[i], dist);
+
+			if (tail < bytes)
+			{
+				for (int j = 0; j < 4; j++)
+					distances[i + j] = BitHammingDistanceDefault(bytes - tail, ax + tail, bxs[i + j] + tail, distances[i + j]);
+			}
+		}
+	}
+
+	for (; i < n; i++)
+		distances[i] = BitHammingDistanceDefault(bytes, ax, bxs[i], 0);
+}
+
 TARGET_AVX512_POPCOUNT static uint64
 BitHammingDistanceAvx512Popcount(uint32 bytes, unsigned char *ax, unsigned char *bx, uint64 distance)
 {
@@ -91,10 +178,90 @@ BitHammingDistanceAvx512Popcount(uint32 bytes, unsigned char *ax, unsigned char
 
 	return BitHammingDistanceDefault(bytes, ax, bx, distance);
 }
+
+TARGET_AVX512_POPCOUNT static void
+BitHammingDistanceBatchAvx512Popcount(uint32 bytes, unsigned char *ax, unsigned char **bxs, int n, uint64 *distances)
+{
+	int			i = 0;
+
+	/* Score eight codes shorter than a register at a time, one per lane */
+	if (bytes < sizeof(__m512i))
+	{
+		uint32		words = bytes / sizeof(uint64);
+		uint32		tail = words * sizeof(uint64);
+
+		for (; i + 8 <= n; i += 8)
+		{
+			__m512i		dist = _mm512_setzero_si512();
+
+			for (uint32 w = 0; w < words; w++)
+			{
+				uint64		axs;
+				uint64		lanes[8];
+
+				/* Ensure aligned */
+				memcpy(&axs, ax + w * sizeof(uint64), sizeof(uint64));
+				for (int j = 0; j < 8; j++)
+					memcpy(&lanes[j], bxs[i + j] + w * sizeof(uint64), sizeof(uint64));
+
+				dist = _mm512_add_epi64(dist, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512((const __m512i *) lanes), _mm512_set1_epi64((long long) axs))));
+			}
+
+			_mm512_storeu_si512((__m512i *) &distances[i], dist);
+
+			if (tail < bytes)
+			{
+				for (int j = 0; j < 8; j++)
+					distances[i + j] = BitHammingDistanceDefault(bytes - tail, ax + tail, bxs[i + j] + tail, distances[i + j]);
+			}
+		}
+	}
+
+	for (; i < n; i++)
+		distances[i] = BitHammingDistanceAvx512Popcount(bytes, ax, bxs[i], 0);
+}
 #endif
 
-BIT_TARGET_CLONES static double
-BitJaccardDistanceDefault(uint32 bytes, unsigned char *ax, unsigned char *bx, uint64 ab, uint64 aa, uint64 bb)
+#ifdef BIT_NEON
+static void
+BitHammingDistanceBatchNeon(uint32 bytes, unsigned char *ax, unsigned char **bxs, int n, uint64 *distances)
+{
+	uint32		words = bytes / sizeof(uint64);
+	uint32		tail = words * sizeof(uint64);
+	int			i = 0;
+
+	/* Score two codes at a time, one per lane */
+	for (; i + 2 <= n; i += 2)
+	{
+		uint64x2_t	dist = vdupq_n_u64(0);
+
+		for (uint32 w = 0; w < words; w++)
+		{
+			uint64		axs;
+			uint64		b0;
+			uint64		b1;
+			uint8x16_t	x;
+
+			/* Ensure aligned */
+			memcpy(&axs, ax + w * sizeof(uint64), sizeof(uint64));
+			memcpy(&b0, bxs[i] + w * sizeof(uint64), sizeof(uint64));
+			memcpy(&b1, bxs[i + 1] + w * sizeof(uint64), sizeof(uint64));
+
+			x = veorq_u8(vreinterpretq_u8_u64(vcombine_u64(vcreate_u64(b0), vcreate_u64(b1))), vreinterpretq_u8_u64(vdupq_n_u64(axs)));
+			dist = vaddq_u64(dist, vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vcntq_u8(x)))));
+		}
+
+		distances[i] = BitHammingDistanceInline(bytes - tail, ax + tail, bxs[i] + tail, vgetq_lane_u64(dist, 0));
+		distances[i + 1] = BitHammingDistanceInline(bytes - tail, ax + tail, bxs[i + 1] + tail, vgetq_lane_u64(dist, 1));
+	}
+
+	for (; i < n; i++)
+		distances[i] = BitHammingDistanceInline(bytes, ax, bxs[i], 0);
+}
+#endif
+
+static inline double
+BitJaccardDistanceInline(uint32 bytes, unsigned char *ax, unsigned char *bx, uint64 ab, uint64 aa, uint64 bb)
 {
 #ifdef popcount64
 	for (; bytes >= sizeof(uint64); bytes -= sizeof(uint64))
@@ -128,6 +295,22 @@ BitJaccardDistanceDefault(uint32 bytes, unsigned char *ax, unsigned char *bx, ui
 		return 1 - (ab / ((double) (aa + bb - ab)));
 }
 
+BIT_TARGET_CLONES static double
+BitJaccardDistanceDefault(uint32 bytes, unsigned char *ax, unsigned char *bx, uint64 ab, uint64 aa, uint64 bb)
+{
+	return BitJaccardDistanceInline(bytes, ax, bx, ab, aa, bb);
+}
+
+/*
+ * Score all codes in a single call, like BitHammingDistanceBatch
+ */
+BIT_TARGET_CLONES static void
+BitJaccardDistanceBatchDefault(uint32 bytes, unsigned char *ax, unsigned char **bxs, int n, double *distances)
+{
+	for (int i = 0; i < n; i++)
+		distances[i] = BitJaccardDistanceInline(bytes, ax, bxs[i], 0, 0, 0);
+}
+
 #ifdef BIT_DISPATCH
 TARGET_AVX512_POPCOUNT static double
 BitJaccardDistanceAvx512Popcount(uint32 bytes, unsigned char *ax, unsigned char *bx, uint64 ab, uint64 aa, uint64 bb)
@@ -155,10 +338,68 @@ BitJaccardDistanceAvx512Popcount(uint32 bytes, unsigned char *ax, unsigned char
 
 	return BitJaccardDistanceDefault(bytes, ax, bx, ab, aa, bb);
 }
+
+TARGET_AVX512_POPCOUNT static void
+BitJaccardDistanceBatchAvx512Popcount(uint32 bytes, unsigned char *ax, unsigned char **bxs, int n, double *distances)
+{
+	int			i = 0;
+
+	/* Score eight codes shorter than a register at a time, one per lane */
+	if (bytes < sizeof(__m512i))
+	{
+		uint32		words = bytes / sizeof(uint64);
+		uint32		tail = words * sizeof(uint64);
+		uint64		aa = 0;
+
+		/* The query count is the same for every code */
+		for (uint32 w = 0; w < words; w++)
+		{
+			uint64		axs;
+
+			memcpy(&axs, ax + w * sizeof(uint64), sizeof(uint64));
+			aa += pg_popcount64(axs);
+		}
+
+		for (; i + 8 <= n; i += 8)
+		{
+			__m512i		abx = _mm512_setzero_si512();
+			__m512i		bbx = _mm512_setzero_si512();
+			uint64		ab[8];
+			uint64		bb[8];
+
+			for (uint32 w = 0; w < words; w++)
+			{
+				uint64		axs;
+				uint64		lanes[8];
+				__m512i		bxs8;
+
+				/* Ensure aligned */
+				memcpy(&axs, ax + w * sizeof(uint64), sizeof(uint64));
+				for (int j = 0; j < 8; j++)
+					memcpy(&lanes[j], bxs[i + j] + w * sizeof(uint64), sizeof(uint64));
+
+				bxs8 = _mm512_loadu_si512((const __m512i *) lanes);
+				abx = _mm512_add_epi64(abx, _mm512_popcnt_epi64(_mm512_and_si512(bxs8, _mm512_set1_epi64((long long) axs))));
+				bbx = _mm512_add_epi64(bbx, _mm512_popcnt_epi64(bxs8));
+			}
+
+			_mm512_storeu_si512((__m512i *) ab, abx);
+			_mm512_storeu_si512((__m512i *) bb, bbx);
+
+			/* Count any remaining bytes and compute the distances */
+			for (int j = 0; j < 8; j++)
+				distances[i + j] = BitJaccardDistanceDefault(bytes - tail, ax + tail, bxs[i + j] + tail, ab[j], aa, bb[j]);
+		}
+	}
+
+	for (; i < n; i++)
+		distances[i] = BitJaccardDistanceAvx512Popcount(bytes, ax, bxs[i], 0, 0, 0);
+}
 #endif
 
 #ifdef BIT_DISPATCH
 #define CPU_FEATURE_OSXSAVE         (1 << 27)	/* F1 ECX */
+#define CPU_FEATURE_AVX2            (1 << 5)	/* F7,0 EBX */
 #define CPU_FEATURE_AVX512F         (1 << 16)	/* F7,0 EBX */
 #define CPU_FEATURE_AVX512VPOPCNTDQ (1 << 14)	/* F7,0 ECX */
 
@@ -168,6 +409,35 @@ BitJaccardDistanceAvx512Popcount(uint32 bytes, unsigned char *ax, unsigned char
 #define TARGET_XSAVE __attribute__((target("xsave")))
 #endif
 
+TARGET_XSAVE static bool
+SupportsAvx2()
+{
+	unsigned int exx[4] = {0, 0, 0, 0};
+
+#if defined(USE__GET_CPUID)
+	__get_cpuid(1, &exx[0], &exx[1], &exx[2], &exx[3]);
+#else
+	__cpuid(exx, 1);
+#endif
+
+	/* Check OS supports XSAVE */
+	if ((exx[2] & CPU_FEATURE_OSXSAVE) != CPU_FEATURE_OSXSAVE)
+		return false;
+
+	/* Check XMM and YMM registers are enabled */
+	if ((_xgetbv(0) & 6) != 6)
+		return false;
+
+#if defined(USE__GET_CPUID)
+	__get_cpuid_count(7, 0, &exx[0], &exx[1], &exx[2], &exx[3]);
+#else
+	__cpuidex(exx, 7, 0);
+#endif
+
+	/* Check AVX2 */
+	return (exx[1] & CPU_FEATURE_AVX2) == CPU_FEATURE_AVX2;
+}
+
 TARGET_XSAVE static bool
 SupportsAvx512Popcount()
 {
@@ -210,13 +480,23 @@ BitvecInit(void)
 	 * performance
 	 */
 	BitHammingDistance = BitHammingDistanceDefault;
+	BitHammingDistanceBatch = BitHammingDistanceBatchDefault;
 	BitJaccardDistance = BitJaccardDistanceDefault;
+	BitJaccardDistanceBatch = BitJaccardDistanceBatchDefault;
 
 #ifdef BIT_DISPATCH
 	if (SupportsAvx512Popcount())
 	{
 		BitHammingDistance = BitHammingDistanceAvx512Popcount;
+		BitHammingDistanceBatch = BitHammingDistanceBatchAvx512Popcount;
 		BitJaccardDistance = BitJaccardDistanceAvx512Popcount;
+		BitJaccardDistanceBatch = BitJaccardDistanceBatchAvx512Popcount;
 	}
+	else if (SupportsAvx2())
+		BitHammingDistanceBatch = BitHammingDistanceBatchAvx2;
+#endif
+
+#ifdef BIT_NEON
+	BitHammingDistanceBatch = BitHammingDistanceBatchNeon;
 #endif
 }
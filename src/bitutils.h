@@ -9,7 +9,9 @@
 #endif
 
 extern uint64 (*BitHammingDistance) (uint32 bytes, unsigned char *ax, unsigned char *bx, uint64 distance);
+extern void (*BitHammingDistanceBatch) (uint32 bytes, unsigned char *ax, unsigned char **bxs, int n, uint64 *distances);
 extern double (*BitJaccardDistance) (uint32 bytes, unsigned char *ax, unsigned char *bx, uint64 ab, uint64 aa, uint64 bb);
+extern void (*BitJaccardDistanceBatch) (uint32 bytes, unsigned char *ax, unsigned char **bxs, int n, double *distances);
 
 void		BitvecInit(void);
 
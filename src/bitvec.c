@@ -1,6 +1,6 @@
 #include "postgres.h"
 
-#include "../src_cpp/bitutils_c.h"
+#include "bitutils.h"
 #include "bitvec.h"
 #include "utils/varbit.h"
 #include "vector.h"
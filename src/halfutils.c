@@ -23,6 +23,10 @@ float		(*HalfvecL2SquaredDistance) (int dim, half * ax, half * bx);
 float		(*HalfvecInnerProduct) (int dim, half * ax, half * bx);
 double		(*HalfvecCosineSimilarity) (int dim, half * ax, half * bx);
 float		(*HalfvecL1Distance) (int dim, half * ax, half * bx);
+void		(*HalfvecAccumulate) (int dim, double *sums, half * x);
+void		(*HalfvecAccumulateFloat) (int dim, float *sums, half * x);
+void		(*HalfToFloat4Array) (int n, half * x, float *result);
+void		(*Float4ToHalfArray) (int n, float *x, half * result);
 
 static float
 HalfvecL2SquaredDistanceDefault(int dim, half * ax, half * bx)
@@ -237,6 +241,110 @@ HalfvecL1DistanceF16c(int dim, half * ax, half * bx)
 }
 #endif
 
+static void
+HalfvecAccumulateDefault(int dim, double *sums, half * x)
+{
+	/* Auto-vectorized on aarch64 */
+	for (int i = 0; i < dim; i++)
+		sums[i] += (double) HalfToFloat4(x[i]);
+}
+
+#ifdef HALFVEC_DISPATCH
+TARGET_F16C static void
+HalfvecAccumulateF16c(int dim, double *sums, half * x)
+{
+	int			i;
+	int			count = (dim / 8) * 8;
+
+	for (i = 0; i < count; i += 8)
+	{
+		__m256		xs = _mm256_cvtph_ps(_mm_loadu_si128((__m128i *) (x + i)));
+		__m256d		lo = _mm256_cvtps_pd(_mm256_castps256_ps128(xs));
+		__m256d		hi = _mm256_cvtps_pd(_mm256_extractf128_ps(xs, 1));
+
+		_mm256_storeu_pd(sums + i, _mm256_add_pd(_mm256_loadu_pd(sums + i), lo));
+		_mm256_storeu_pd(sums + i + 4, _mm256_add_pd(_mm256_loadu_pd(sums + i + 4), hi));
+	}
+
+	for (; i < dim; i++)
+		sums[i] += (double) HalfToFloat4(x[i]);
+}
+#endif
+
+static void
+HalfvecAccumulateFloatDefault(int dim, float *sums, half * x)
+{
+	/* Auto-vectorized on aarch64 */
+	for (int i = 0; i < dim; i++)
+		sums[i] += HalfToFloat4(x[i]);
+}
+
+#ifdef HALFVEC_DISPATCH
+TARGET_F16C static void
+HalfvecAccumulateFloatF16c(int dim, float *sums, half * x)
+{
+	int			i;
+	int			count = (dim / 8) * 8;
+
+	for (i = 0; i < count; i += 8)
+	{
+		__m256		xs = _mm256_cvtph_ps(_mm_loadu_si128((__m128i *) (x + i)));
+
+		_mm256_storeu_ps(sums + i, _mm256_add_ps(_mm256_loadu_ps(sums + i), xs));
+	}
+
+	for (; i < dim; i++)
+		sums[i] += HalfToFloat4(x[i]);
+}
+#endif
+
+static void
+HalfToFloat4ArrayDefault(int n, half * x, float *result)
+{
+	/* Auto-vectorized with _Float16 */
+	for (int i = 0; i < n; i++)
+		result[i] = HalfToFloat4(x[i]);
+}
+
+#ifdef HALFVEC_DISPATCH
+TARGET_F16C static void
+HalfToFloat4ArrayF16c(int n, half * x, float *result)
+{
+	int			i;
+	int			count = (n / 8) * 8;
+
+	for (i = 0; i < count; i += 8)
+		_mm256_storeu_ps(result + i, _mm256_cvtph_ps(_mm_loadu_si128((__m128i *) (x + i))));
+
+	for (; i < n; i++)
+		result[i] = HalfToFloat4(x[i]);
+}
+#endif
+
+static void
+Float4ToHalfArrayDefault(int n, float *x, half * result)
+{
+	/* Auto-vectorized with _Float16 */
+	for (int i = 0; i < n; i++)
+		result[i] = Float4ToHalfUnchecked(x[i]);
+}
+
+#ifdef HALFVEC_DISPATCH
+TARGET_F16C static void
+Float4ToHalfArrayF16c(int n, float *x, half * result)
+{
+	int			i;
+	int			count = (n / 8) * 8;
+
+	/* Round to nearest even like Float4ToHalfUnchecked */
+	for (i = 0; i < count; i += 8)
+		_mm_storeu_si128((__m128i *) (result + i), _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT));
+
+	for (; i < n; i++)
+		result[i] = Float4ToHalfUnchecked(x[i]);
+}
+#endif
+
 #ifdef HALFVEC_DISPATCH
 #define CPU_FEATURE_FMA     (1 << 12)
 #define CPU_FEATURE_OSXSAVE (1 << 27)
@@ -284,6 +392,10 @@ HalfvecInit(void)
 	HalfvecInnerProduct = HalfvecInnerProductDefault;
 	HalfvecCosineSimilarity = HalfvecCosineSimilarityDefault;
 	HalfvecL1Distance = HalfvecL1DistanceDefault;
+	HalfvecAccumulate = HalfvecAccumulateDefault;
+	HalfvecAccumulateFloat = HalfvecAccumulateFloatDefault;
+	HalfToFloat4Array = HalfToFloat4ArrayDefault;
+	Float4ToHalfArray = Float4ToHalfArrayDefault;
 
 #ifdef HALFVEC_DISPATCH
 	if (SupportsCpuFeature(CPU_FEATURE_AVX | CPU_FEATURE_F16C | CPU_FEATURE_FMA))
@@ -293,6 +405,11 @@ HalfvecInit(void)
 		HalfvecCosineSimilarity = HalfvecCosineSimilarityF16c;
 		/* Does not require FMA, but keep logic simple */
 		HalfvecL1Distance = HalfvecL1DistanceF16c;
+		HalfvecAccumulate = HalfvecAccumulateF16c;
+		HalfvecAccumulateFloat = HalfvecAccumulateFloatF16c;
+		/* Do not require FMA, but keep logic simple */
+		HalfToFloat4Array = HalfToFloat4ArrayF16c;
+		Float4ToHalfArray = Float4ToHalfArrayF16c;
 	}
 #endif
 }
@@ -14,6 +14,10 @@ extern float (*HalfvecL2SquaredDistance) (int dim, half * ax, half * bx);
 extern float (*HalfvecInnerProduct) (int dim, half * ax, half * bx);
 extern double (*HalfvecCosineSimilarity) (int dim, half * ax, half * bx);
 extern float (*HalfvecL1Distance) (int dim, half * ax, half * bx);
+extern void (*HalfvecAccumulate) (int dim, double *sums, half * x);
+extern void (*HalfvecAccumulateFloat) (int dim, float *sums, half * x);
+extern void (*HalfToFloat4Array) (int n, half * x, float *result);
+extern void (*Float4ToHalfArray) (int n, float *x, half * result);
 
 void		HalfvecInit(void);
 
@@ -10,7 +10,6 @@
 #include "halfvec.h"
 #include "lib/stringinfo.h"
 #include "libpq/pqformat.h"
-#include "port.h"				/* for strtof() */
 #include "sparsevec.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
@@ -18,25 +17,20 @@
 #include "utils/lsyscache.h"
 #include "utils/numeric.h"
 #include "vector.h"
+#include "vectorutils.h"
 
 #define STATE_DIMS(x) (ARR_DIMS(x)[0] - 1)
 #define CreateStateDatums(dim) palloc(sizeof(Datum) * (dim + 1))
 
-/*
- * Get a half from a message buffer
- */
-static half
-pq_getmsghalf(StringInfo msg)
-{
-	union
-	{
-		half		h;
-		uint16		i;
-	}			swap;
+/* Elements converted at a time by whole-vector operations */
+#define HALFVEC_CHUNK_SIZE 256
 
-	swap.i = pq_getmsgint(msg, 2);
-	return swap.h;
-}
+typedef enum HalfvecOperation
+{
+	HALFVEC_ADD,
+	HALFVEC_SUB,
+	HALFVEC_MUL
+}			HalfvecOperation;
 
 /*
  * Append a half to a StringInfo buffer
@@ -112,6 +106,62 @@ CheckElement(half value)
 				 errmsg("infinite value not allowed in halfvec")));
 }
 
+/*
+ * Check if all elements are finite
+ */
+static inline bool
+HalfvecAllFinite(int dim, half * x)
+{
+	uint16	   *bits = (uint16 *) x;
+	uint16		invalid = 0;
+
+	/* NaN and infinity have all exponent bits set */
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+		invalid |= (bits[i] & 0x7C00) == 0x7C00;
+
+	return invalid == 0;
+}
+
+#ifndef FLT16_SUPPORT
+/*
+ * Apply an element-wise operation with bulk conversions
+ */
+static inline void
+HalfvecElementwise(int dim, half * ax, half * bx, half * rx, HalfvecOperation op)
+{
+	float		fa[HALFVEC_CHUNK_SIZE];
+	float		fb[HALFVEC_CHUNK_SIZE];
+
+	for (int i = 0; i < dim; i += HALFVEC_CHUNK_SIZE)
+	{
+		int			n = Min(dim - i, HALFVEC_CHUNK_SIZE);
+
+		HalfToFloat4Array(n, ax + i, fa);
+		HalfToFloat4Array(n, bx + i, fb);
+
+		/* Auto-vectorized */
+		switch (op)
+		{
+			case HALFVEC_ADD:
+				for (int j = 0; j < n; j++)
+					fa[j] += fb[j];
+				break;
+			case HALFVEC_SUB:
+				for (int j = 0; j < n; j++)
+					fa[j] -= fb[j];
+				break;
+			case HALFVEC_MUL:
+				for (int j = 0; j < n; j++)
+					fa[j] *= fb[j];
+				break;
+		}
+
+		Float4ToHalfArray(n, fa, rx + i);
+	}
+}
+#endif
+
 /*
  * Allocate and initialize a new half vector
  */
@@ -214,7 +264,7 @@ halfvec_in(PG_FUNCTION_ARGS)
 		errno = 0;
 
 		/* Postgres sets LC_NUMERIC to C on startup */
-		val = strtof(pt, &stringEnd);
+		val = VectorStrtof(pt, &stringEnd);
 
 		if (stringEnd == pt)
 			ereport(ERROR,
@@ -375,10 +425,16 @@ halfvec_recv(PG_FUNCTION_ARGS)
 				 errmsg("expected unused to be 0, not %d", unused)));
 
 	result = InitHalfVector(dim);
-	for (int i = 0; i < dim; i++)
+
+	/* Copy and convert all elements at once */
+	pq_copymsgbytes(buf, (char *) result->x, dim * sizeof(half));
+	VectorNetworkToHost16(dim, (uint16 *) result->x);
+
+	/* Find the element for the error if needed */
+	if (!HalfvecAllFinite(dim, result->x))
 	{
-		result->x[i] = pq_getmsghalf(buf);
-		CheckElement(result->x[i]);
+		for (int i = 0; i < dim; i++)
+			CheckElement(result->x[i]);
 	}
 
 	PG_RETURN_POINTER(result);
@@ -533,8 +589,14 @@ vector_to_halfvec(PG_FUNCTION_ARGS)
 
 	result = InitHalfVector(vec->dim);
 
+	Float4ToHalfArray(vec->dim, vec->x, result->x);
+
+	/* Check for overflow */
 	for (int i = 0; i < vec->dim; i++)
-		result->x[i] = Float4ToHalf(vec->x[i]);
+	{
+		if (unlikely(HalfIsInf(result->x[i])))
+			result->x[i] = Float4ToHalf(vec->x[i]);
+	}
 
 	PG_RETURN_POINTER(result);
 }
@@ -716,21 +778,38 @@ halfvec_l2_normalize(PG_FUNCTION_ARGS)
 	double		norm = 0;
 	HalfVector *result;
 	half	   *rx;
+	float		fx[HALFVEC_CHUNK_SIZE];
 
 	result = InitHalfVector(a->dim);
 	rx = result->x;
 
-	/* Auto-vectorized */
-	for (int i = 0; i < a->dim; i++)
-		norm += (double) HalfToFloat4(ax[i]) * (double) HalfToFloat4(ax[i]);
+	for (int i = 0; i < a->dim; i += HALFVEC_CHUNK_SIZE)
+	{
+		int			n = Min(a->dim - i, HALFVEC_CHUNK_SIZE);
+
+		HalfToFloat4Array(n, ax + i, fx);
+
+		/* Auto-vectorized */
+		for (int j = 0; j < n; j++)
+			norm += (double) fx[j] * (double) fx[j];
+	}
 
 	norm = sqrt(norm);
 
 	/* Return zero vector for zero norm */
 	if (norm > 0)
 	{
-		for (int i = 0; i < a->dim; i++)
-			rx[i] = Float4ToHalfUnchecked(HalfToFloat4(ax[i]) / norm);
+		for (int i = 0; i < a->dim; i += HALFVEC_CHUNK_SIZE)
+		{
+			int			n = Min(a->dim - i, HALFVEC_CHUNK_SIZE);
+
+			HalfToFloat4Array(n, ax + i, fx);
+
+			for (int j = 0; j < n; j++)
+				fx[j] = fx[j] / norm;
+
+			Float4ToHalfArray(n, fx, rx + i);
+		}
 
 		/* Check for overflow */
 		for (int i = 0; i < a->dim; i++)
@@ -762,15 +841,13 @@ halfvec_add(PG_FUNCTION_ARGS)
 	result = InitHalfVector(a->dim);
 	rx = result->x;
 
+#ifdef FLT16_SUPPORT
 	/* Auto-vectorized */
 	for (int i = 0, imax = a->dim; i < imax; i++)
-	{
-#ifdef FLT16_SUPPORT
 		rx[i] = ax[i] + bx[i];
 #else
-		rx[i] = Float4ToHalfUnchecked(HalfToFloat4(ax[i]) + HalfToFloat4(bx[i]));
+	HalfvecElementwise(a->dim, ax, bx, rx, HALFVEC_ADD);
 #endif
-	}
 
 	/* Check for overflow */
 	for (int i = 0, imax = a->dim; i < imax; i++)
@@ -801,15 +878,13 @@ halfvec_sub(PG_FUNCTION_ARGS)
 	result = InitHalfVector(a->dim);
 	rx = result->x;
 
+#ifdef FLT16_SUPPORT
 	/* Auto-vectorized */
 	for (int i = 0, imax = a->dim; i < imax; i++)
-	{
-#ifdef FLT16_SUPPORT
 		rx[i] = ax[i] - bx[i];
 #else
-		rx[i] = Float4ToHalfUnchecked(HalfToFloat4(ax[i]) - HalfToFloat4(bx[i]));
+	HalfvecElementwise(a->dim, ax, bx, rx, HALFVEC_SUB);
 #endif
-	}
 
 	/* Check for overflow */
 	for (int i = 0, imax = a->dim; i < imax; i++)
@@ -840,15 +915,13 @@ halfvec_mul(PG_FUNCTION_ARGS)
 	result = InitHalfVector(a->dim);
 	rx = result->x;
 
+#ifdef FLT16_SUPPORT
 	/* Auto-vectorized */
 	for (int i = 0, imax = a->dim; i < imax; i++)
-	{
-#ifdef FLT16_SUPPORT
 		rx[i] = ax[i] * bx[i];
 #else
-		rx[i] = Float4ToHalfUnchecked(HalfToFloat4(ax[i]) * HalfToFloat4(bx[i]));
+	HalfvecElementwise(a->dim, ax, bx, rx, HALFVEC_MUL);
 #endif
-	}
 
 	/* Check for overflow and underflow */
 	for (int i = 0, imax = a->dim; i < imax; i++)
@@ -1112,6 +1185,18 @@ halfvec_accum(PG_FUNCTION_ARGS)
 
 	n = statevalues[0] + 1.0;
 
+	/*
+	 * If called as an aggregate, update the state in place like float8_accum
+	 * instead of building a new array for each row. Sums of finite floats
+	 * cannot overflow a double for any realistic number of rows.
+	 */
+	if (!newarr && AggCheckCallContext(fcinfo, NULL))
+	{
+		statevalues[0] = n;
+		HalfvecAccumulate(dim, statevalues + 1, x);
+		PG_RETURN_ARRAYTYPE_P(statearray);
+	}
+
 	statedatums = CreateStateDatums(dim);
 	statedatums[0] = Float8GetDatum(n);
 
@@ -25,11 +25,23 @@ static const struct config_enum_entry hnsw_iterative_scan_options[] = {
 	{NULL, 0, false}
 };
 
+static relopt_enum_elt_def hnsw_quantization_options[] = {
+	{"none", HNSW_QUANTIZATION_NONE},
+	{"int8", HNSW_QUANTIZATION_INT8},
+	{"binary", HNSW_QUANTIZATION_BINARY},
+	{(const char *) NULL}
+};
+
 int			hnsw_ef_search;
 int			hnsw_iterative_scan;
 int			hnsw_max_scan_tuples;
 double		hnsw_scan_mem_multiplier;
 int			hnsw_lock_tranche_id;
+bool		hnsw_quantized_rerank;
+char	   *hnsw_build_source_index;
+int			hnsw_upper_cache_size;
+int			hnsw_build_log_interval;
+int			hnsw_search_patience;
 static relopt_kind hnsw_relopt_kind;
 
 /*
@@ -82,6 +94,13 @@ HnswInit(void)
 					  HNSW_DEFAULT_M, HNSW_MIN_M, HNSW_MAX_M, AccessExclusiveLock);
 	add_int_reloption(hnsw_relopt_kind, "ef_construction", "Size of the dynamic candidate list for construction",
 					  HNSW_DEFAULT_EF_CONSTRUCTION, HNSW_MIN_EF_CONSTRUCTION, HNSW_MAX_EF_CONSTRUCTION, AccessExclusiveLock);
+	add_enum_reloption(hnsw_relopt_kind, "quantization", "Storage for element values",
+					   hnsw_quantization_options, HNSW_QUANTIZATION_NONE,
+					   "Valid values are \"none\", \"int8\", and \"binary\".", AccessExclusiveLock);
+	add_bool_reloption(hnsw_relopt_kind, "partitioned", "Builds a separate graph for each filter value",
+					   false, AccessExclusiveLock);
+	add_bool_reloption(hnsw_relopt_kind, "snapshot", "Exports a read-only copy of the graph for scans",
+					   false, AccessExclusiveLock);
 
 	DefineCustomIntVariable("hnsw.ef_search", "Sets the size of the dynamic candidate list for search",
 							"Valid range is 1..1000.", &hnsw_ef_search,
@@ -101,7 +120,32 @@ HnswInit(void)
 							 NULL, &hnsw_scan_mem_multiplier,
 							 1, 1, 1000, PGC_USERSET, 0, NULL, NULL, NULL);
 
+	DefineCustomBoolVariable("hnsw.quantized_rerank", "Re-ranks candidates with exact distances for quantized indexes",
+							 NULL, &hnsw_quantized_rerank,
+							 true, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("hnsw.build_source_index", "Sets an existing index to reuse the graph from for builds",
+							   NULL, &hnsw_build_source_index,
+							   "", PGC_USERSET, 0, NULL, NULL, NULL);
+
+	/* Similar to ef_search, but adapts to each query */
+	DefineCustomIntVariable("hnsw.search_patience", "Sets the number of candidates to expand without finding closer results before a scan stops",
+							"Zero disables stopping early.", &hnsw_search_patience,
+							0, 0, INT_MAX, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	/* Per index in each backend */
+	DefineCustomIntVariable("hnsw.upper_cache_size", "Sets the max memory to cache the upper layers of the graph for scans",
+							NULL, &hnsw_upper_cache_size,
+							16 * 1024, 0, MAX_KILOBYTES, PGC_USERSET, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	/* Writes to the server log, so same context as log_min_duration_statement */
+	DefineCustomIntVariable("hnsw.build_log_interval", "Sets the interval to log build progress",
+							"Zero disables logging.", &hnsw_build_log_interval,
+							0, 0, INT_MAX, PGC_SUSET, GUC_UNIT_S, NULL, NULL, NULL);
+
 	MarkGUCPrefixReserved("hnsw");
+
+	HnswSnapshotInit();
 }
 
 /*
@@ -116,6 +160,8 @@ hnswbuildphasename(int64 phasenum)
 			return "initializing";
 		case PROGRESS_HNSW_PHASE_LOAD:
 			return "loading tuples";
+		case PROGRESS_HNSW_PHASE_WRITE:
+			return "writing graph";
 		default:
 			return NULL;
 	}
@@ -136,9 +182,22 @@ hnswcostestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 	double		startupPages;
 	double		spc_seq_page_cost;
 	Relation	index;
+	bool		partitioned = false;
 
-	/* Never use index without order */
-	if (path->indexorderbys == NIL)
+	/* Skip reading the metapage for paths that are never used */
+	if (path->indexorderbys != NIL)
+	{
+		index = index_open(path->indexinfo->indexoid, NoLock);
+		HnswGetMetaPageInfo(index, &m, NULL);
+		partitioned = HnswIsPartitioned(index);
+		index_close(index, NoLock);
+	}
+
+	/*
+	 * Never use index without order, or without a filter value if
+	 * partitioned
+	 */
+	if (path->indexorderbys == NIL || (partitioned && path->indexclauses == NIL))
 	{
 		*indexStartupCost = get_float8_infinity();
 		*indexTotalCost = get_float8_infinity();
@@ -156,10 +215,6 @@ hnswcostestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 
 	genericcostestimate(root, path, loop_count, &costs);
 
-	index = index_open(path->indexinfo->indexoid, NoLock);
-	HnswGetMetaPageInfo(index, &m, NULL);
-	index_close(index, NoLock);
-
 	/*
 	 * HNSW cost estimation follows a formula that accounts for the total
 	 * number of tuples indexed combined with the parameters that most
@@ -234,6 +289,9 @@ hnswoptions(Datum reloptions, bool validate)
 	static const relopt_parse_elt tab[] = {
 		{"m", RELOPT_TYPE_INT, offsetof(HnswOptions, m)},
 		{"ef_construction", RELOPT_TYPE_INT, offsetof(HnswOptions, efConstruction)},
+		{"quantization", RELOPT_TYPE_ENUM, offsetof(HnswOptions, quantization)},
+		{"partitioned", RELOPT_TYPE_BOOL, offsetof(HnswOptions, partitioned)},
+		{"snapshot", RELOPT_TYPE_BOOL, offsetof(HnswOptions, snapshot)},
 	};
 
 	return (bytea *) build_reloptions(reloptions, validate,
@@ -274,7 +332,7 @@ hnswhandler(PG_FUNCTION_ARGS)
 #endif
 	amroutine->amcanbackward = false;	/* can change direction mid-scan */
 	amroutine->amcanunique = false;
-	amroutine->amcanmulticol = false;
+	amroutine->amcanmulticol = true;
 	amroutine->amoptionalkey = true;
 	amroutine->amsearcharray = false;
 	amroutine->amsearchnulls = false;
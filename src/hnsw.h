@@ -8,11 +8,16 @@
 #include "lib/pairingheap.h"
 #include "nodes/execnodes.h"
 #include "port.h"				/* for random() */
+#include "portability/instr_time.h"
+#include "rerank.h"
+#include "scanstats.h"
 #include "utils/relptr.h"
 #include "utils/sampling.h"
 #include "vector.h"
 
 #define HNSW_MAX_DIM 2000
+#define HNSW_MAX_QUANTIZED_DIM 8000
+#define HNSW_MAX_BINARY_DIM 1920
 #define HNSW_MAX_NNZ 1000
 
 /* Support functions */
@@ -31,6 +36,7 @@
 /* Must correspond to page numbers since page lock is used */
 #define HNSW_UPDATE_LOCK 	0
 #define HNSW_SCAN_LOCK		1
+#define HNSW_SNAPSHOT_LOCK	2
 
 /* HNSW parameters */
 #define HNSW_DEFAULT_M	16
@@ -56,17 +62,25 @@
 /* Build phases */
 /* PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE is 1 */
 #define PROGRESS_HNSW_PHASE_LOAD		2
+#define PROGRESS_HNSW_PHASE_WRITE		3
 
 #define HNSW_MAX_SIZE (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(HnswPageOpaqueData)) - sizeof(ItemIdData))
 #define HNSW_TUPLE_ALLOC_SIZE BLCKSZ
 
 #define HNSW_ELEMENT_TUPLE_SIZE(size)	MAXALIGN(offsetof(HnswElementTupleData, data) + (size))
+#define HNSW_FILTER_SIZE	MAXALIGN(sizeof(HnswFilterData))
 #define HNSW_NEIGHBOR_TUPLE_SIZE(level, m)	MAXALIGN(offsetof(HnswNeighborTupleData, indextids) + ((level) + 2) * (m) * sizeof(ItemPointerData))
 
+#define HNSW_QUANTIZED_VECTOR_SIZE(dim)	(offsetof(HnswQuantizedVector, x) + (dim))
+#define HNSW_BINARY_SKETCH_SIZE(dim)	(offsetof(HnswBinarySketch, x) + ((dim) + 7) / 8)
+
 #define HNSW_NEIGHBOR_ARRAY_SIZE(lm)	(offsetof(HnswNeighborArray, items) + sizeof(HnswCandidate) * (lm))
 
 #define HnswPageGetOpaque(page)	((HnswPageOpaque) PageGetSpecialPointer(page))
 #define HnswPageGetMeta(page)	((HnswMetaPageData *) PageGetContents(page))
+#define HnswPageGetDirectory(page)	((HnswDirectoryEntry *) PageGetContents(page))
+#define HnswPageGetDirectoryLength(page)	((((PageHeader) (page))->pd_lower - ((char *) PageGetContents(page) - (char *) (page))) / sizeof(HnswDirectoryEntry))
+#define HNSW_DIRECTORY_MAX_ENTRIES	((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(HnswPageOpaqueData))) / sizeof(HnswDirectoryEntry))
 
 #if PG_VERSION_NUM >= 150000
 #define RandomDouble() pg_prng_double(&pg_global_prng_state)
@@ -79,6 +93,13 @@
 #define HnswIsElementTuple(tup) ((tup)->type == HNSW_ELEMENT_TUPLE_TYPE)
 #define HnswIsNeighborTuple(tup) ((tup)->type == HNSW_NEIGHBOR_TUPLE_TYPE)
 
+/* Sketch is stored after the element value for binary quantization */
+#define HnswElementTupleGetSketch(etup) ((HnswBinarySketch *) ((char *) (etup) + HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(&(etup)->data))))
+#define HnswElementTupleSketchSize(etup) ((etup)->quantization == HNSW_QUANTIZATION_BINARY ? MAXALIGN(HNSW_BINARY_SKETCH_SIZE((etup)->data.dim)) : 0)
+
+/* Filter value is stored after the element value and sketch */
+#define HnswElementTupleGetFilter(etup) ((HnswFilterData *) ((char *) (etup) + HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(&(etup)->data)) + HnswElementTupleSketchSize(etup)))
+
 /* 2 * M connections for ground layer */
 #define HnswGetLayerM(m, layer) (layer == 0 ? (m) * 2 : (m))
 
@@ -113,6 +134,11 @@ extern int	hnsw_iterative_scan;
 extern int	hnsw_max_scan_tuples;
 extern double hnsw_scan_mem_multiplier;
 extern int	hnsw_lock_tranche_id;
+extern bool hnsw_quantized_rerank;
+extern char *hnsw_build_source_index;
+extern int	hnsw_upper_cache_size;
+extern int	hnsw_build_log_interval;
+extern int	hnsw_search_patience;
 
 typedef enum HnswIterativeScanMode
 {
@@ -121,9 +147,23 @@ typedef enum HnswIterativeScanMode
 	HNSW_ITERATIVE_SCAN_STRICT
 }			HnswIterativeScanMode;
 
+typedef enum HnswQuantization
+{
+	HNSW_QUANTIZATION_NONE,
+	HNSW_QUANTIZATION_INT8,
+	HNSW_QUANTIZATION_BINARY
+}			HnswQuantization;
+
 typedef struct HnswElementData HnswElementData;
 typedef struct HnswNeighborArray HnswNeighborArray;
 
+/* Value of the filter column */
+typedef struct HnswFilterData
+{
+	int64		value;
+	bool		isnull;
+}			HnswFilterData;
+
 #define HnswPtrDeclare(type, relptrtype, ptrtype) \
 	relptr_declare(type, relptrtype); \
 	typedef union { type *ptr; relptrtype relptr; } ptrtype
@@ -149,6 +189,8 @@ struct HnswElementData
 	OffsetNumber offno;
 	OffsetNumber neighborOffno;
 	BlockNumber neighborPage;
+	uint32		ordinal;		/* dense within an in-memory graph */
+	HnswFilterData filter;
 	DatumPtr	value;
 	LWLock		lock;
 };
@@ -183,6 +225,9 @@ typedef struct HnswOptions
 	int32		vl_len_;		/* varlena header (do not touch directly!) */
 	int			m;				/* number of connections */
 	int			efConstruction; /* size of dynamic candidate list */
+	int			quantization;	/* storage for element values */
+	bool		partitioned;	/* separate graph for each filter value */
+	bool		snapshot;		/* export a read-only copy for scans */
 }			HnswOptions;
 
 typedef struct HnswGraph
@@ -191,10 +236,12 @@ typedef struct HnswGraph
 	slock_t		lock;
 	HnswElementPtr head;
 	double		indtuples;
+	pg_atomic_uint32 elementCount;
 
 	/* Entry state */
 	LWLock		entryLock;
 	LWLock		entryWaitLock;
+	pg_atomic_uint32 entryWaiters;
 	HnswElementPtr entryPoint;
 
 	/* Allocations state */
@@ -205,6 +252,11 @@ typedef struct HnswGraph
 	/* Flushed state */
 	LWLock		flushLock;
 	bool		flushed;
+	int			segments;
+	bool		merging;
+
+	/* Max memory used by a segment */
+	Size		memoryPeak;
 }			HnswGraph;
 
 typedef struct HnswShared
@@ -251,16 +303,84 @@ typedef struct HnswTypeInfo
 	void		(*checkValue) (Pointer v);
 }			HnswTypeInfo;
 
+/* Vector with each element stored as offset + scale * x[i] */
+typedef struct HnswQuantizedVector
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	int16		dim;			/* number of dimensions */
+	int16		unused;			/* reserved for future use, always zero */
+	float		offset;
+	float		scale;
+	uint8		x[FLEXIBLE_ARRAY_MEMBER];
+}			HnswQuantizedVector;
+
+/* Signs of a vector after subtracting its mean */
+typedef struct HnswBinarySketch
+{
+	int16		dim;			/* number of dimensions */
+	int16		unused;			/* reserved for future use, always zero */
+	float		mean;
+	float		norm;			/* norm after subtracting the mean */
+	uint8		x[FLEXIBLE_ARRAY_MEMBER];
+}			HnswBinarySketch;
+
+/* Distance function that skips fmgr, returns false if fmgr is needed */
+typedef bool (*HnswDistanceFunc) (Datum a, Datum b, double *distance);
+
+/* Distance function for multiple values, returns false if fmgr is needed */
+typedef bool (*HnswBatchDistanceFunc) (Datum a, Datum *values, int n, double *distances);
+
+/* Distance function for quantized values, returns false if decoding is needed */
+typedef bool (*HnswQuantizedDistanceFunc) (Datum a, HnswQuantizedVector * b, double *distance);
+
+/* Estimated distance between sketches */
+typedef double (*HnswSketchDistanceFunc) (HnswBinarySketch * a, HnswBinarySketch * b);
+
+/* Generation-stamped visited set indexed by element ordinal */
+typedef struct HnswVisitedArray
+{
+	uint32	   *stamps;
+	uint32		size;
+	uint32		generation;
+	MemoryContext ctx;
+}			HnswVisitedArray;
+
 typedef struct HnswSupport
 {
 	FmgrInfo   *procinfo;
 	FmgrInfo   *normprocinfo;
 	Oid			collation;
+	HnswDistanceFunc distance;
+	HnswBatchDistanceFunc batchDistance;
+	int			quantization;
+	HnswQuantizedDistanceFunc quantizedDistance;
+	HnswSketchDistanceFunc sketchDistance;
+	Oid			filterType;		/* InvalidOid if no filter column */
+
+	/* Reused across searches for in-memory builds, otherwise NULL */
+	HnswVisitedArray *visited;
+
+	/* Slabs for candidates and elements loaded by scans, otherwise NULL */
+	MemoryContext candidateCtx;
+	MemoryContext elementCtx;
+
+	/* Counters for scans and logged builds, otherwise NULL */
+	VectorScanStats *stats;
+
+	/* Time spent waiting on element locks for logged builds, otherwise NULL */
+	instr_time *lockWait;
 }			HnswSupport;
 
 typedef struct HnswQuery
 {
 	Datum		value;
+
+	/* Score elements with sketches if set */
+	HnswBinarySketch *sketch;
+
+	/* Only return elements with this filter value */
+	bool		filtered;
+	HnswFilterData filter;
 }			HnswQuery;
 
 typedef struct HnswBuildState
@@ -289,16 +409,46 @@ typedef struct HnswBuildState
 	HnswGraph  *graph;
 	double		ml;
 	int			maxLevel;
+	Size		maxElementSize;
 
 	/* Memory */
 	MemoryContext graphCtx;
 	MemoryContext tmpCtx;
 	HnswAllocator allocator;
 
+	/* Arena reserved from the shared area by this process */
+	char	   *arena;
+	Size		arenaFree;
+	Size		arenaSize;
+	int			arenaSegment;
+
+	/* Visited array for in-memory searches */
+	HnswVisitedArray visited;
+
+	/* Entry points for each filter value in partitioned builds */
+	bool		partitioned;
+	struct partitionhash_hash *partitions;
+
+	/* Graph reused from an existing index, keyed by heap TID */
+	struct elementhash_hash *sourceTids;
+	int			sourceQuantization;
+	bool		sourceFailed;
+	Bitmapset  *sourceRepair;
+	MemoryContext sourceCtx;
+
 	/* Parallel builds */
 	HnswLeader *hnswleader;
 	HnswShared *hnswshared;
 	char	   *hnswarea;
+
+	/* Instrumentation for hnsw.build_log_interval */
+	bool		logging;
+	VectorScanStats stats;
+	int64		inserted;
+	instr_time	insertStart;
+	instr_time	lastLog;
+	instr_time	entryLockWait;
+	instr_time	elementLockWait;
 }			HnswBuildState;
 
 typedef struct HnswMetaPageData
@@ -312,6 +462,11 @@ typedef struct HnswMetaPageData
 	OffsetNumber entryOffno;
 	int16		entryLevel;
 	BlockNumber insertPage;
+	BlockNumber directoryBlkno; /* first bucket of partition directory */
+	uint32		directoryBuckets;	/* zero if not partitioned */
+	uint32		upperVersion;	/* incremented when elements are deleted */
+	uint32		upperInserts;	/* elements inserted into upper layers */
+	uint32		snapshotId;		/* zero if no valid snapshot */
 }			HnswMetaPageData;
 
 typedef HnswMetaPageData * HnswMetaPage;
@@ -325,6 +480,15 @@ typedef struct HnswPageOpaqueData
 
 typedef HnswPageOpaqueData * HnswPageOpaque;
 
+/* Entry point for a filter value in a partitioned index */
+typedef struct HnswDirectoryEntry
+{
+	int64		value;
+	BlockNumber blkno;
+	OffsetNumber offno;
+	int16		level;			/* -1 if partition is empty */
+}			HnswDirectoryEntry;
+
 typedef struct HnswElementTupleData
 {
 	uint8		type;
@@ -333,7 +497,7 @@ typedef struct HnswElementTupleData
 	uint8		version;
 	ItemPointerData heaptids[HNSW_HEAPTIDS];
 	ItemPointerData neighbortid;
-	uint16		unused;
+	uint16		quantization;	/* zero for indexes created before quantization */
 	Vector		data;
 }			HnswElementTupleData;
 
@@ -378,10 +542,28 @@ typedef struct HnswScanOpaqueData
 
 	/* Support functions */
 	HnswSupport support;
+
+	/* Instrumentation */
+	VectorScanStats stats;
+
+	/* Re-ranking */
+	VectorRerankState heapRerank;
 }			HnswScanOpaqueData;
 
 typedef HnswScanOpaqueData * HnswScanOpaque;
 
+typedef struct HnswInsertState
+{
+	const		HnswTypeInfo *typeInfo;
+	HnswSupport support;
+	int			m;
+	int			efConstruction;
+	bool		partitioned;
+
+	/* Reset after each row */
+	MemoryContext tmpCtx;
+}			HnswInsertState;
+
 typedef struct HnswVacuumState
 {
 	/* Info */
@@ -399,6 +581,13 @@ typedef struct HnswVacuumState
 
 	/* Variables */
 	struct tidhash_hash *deleted;
+	bool		partitioned;
+	struct partitionhash_hash *entryPoints;
+	struct partitionhash_hash *highestPoints;
+	Bitmapset  *deletedPages;
+	Bitmapset  *elementPages;
+	BlockNumber lastBlkno;
+	BlockNumber insertPage;
 	BufferAccessStrategy bas;
 	HnswNeighborTuple ntup;
 	HnswElementData highestPoint;
@@ -410,6 +599,9 @@ typedef struct HnswVacuumState
 /* Methods */
 int			HnswGetM(Relation index);
 int			HnswGetEfConstruction(Relation index);
+int			HnswGetQuantization(Relation index);
+bool		HnswGetPartitioned(Relation index);
+bool		HnswGetSnapshot(Relation index);
 FmgrInfo   *HnswOptionalProcInfo(Relation index, uint16 procnum);
 void		HnswInitSupport(HnswSupport * support, Relation index);
 Datum		HnswNormValue(const HnswTypeInfo * typeInfo, Oid collation, Datum value);
@@ -418,29 +610,54 @@ Buffer		HnswNewBuffer(Relation index, ForkNumber forkNum);
 void		HnswInitPage(Buffer buf, Page page);
 void		HnswInit(void);
 List	   *HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation index, HnswSupport * support, int m, bool inserting, HnswElement skipElement, visited_hash * v, pairingheap **discarded, bool initVisited, int64 *tuples);
-HnswElement HnswGetEntryPoint(Relation index);
+HnswElement HnswGetEntryPoint(Relation index, HnswFilterData * filter);
 void		HnswGetMetaPageInfo(Relation index, int *m, HnswElement * entryPoint);
+void		HnswGetScanMetaPageInfo(Relation index, int *m, uint32 *upperVersion, uint32 *upperInserts, bool *partitioned, uint32 *snapshotId);
+bool		HnswIsPartitioned(Relation index);
+uint32		HnswPartitionHash(int64 value);
+List	   *HnswGetPartitionEntryPoints(Relation index);
 void	   *HnswAlloc(HnswAllocator * allocator, Size size);
-HnswElement HnswInitElement(char *base, ItemPointer tid, int m, double ml, int maxLevel, HnswAllocator * alloc);
+HnswElement HnswInitElement(char *base, ItemPointer tid, int m, double ml, int maxLevel, Size valueSize, HnswAllocator * alloc);
+HnswElement HnswInitElementWithLevel(char *base, ItemPointer heaptid, int m, int level, Size valueSize, HnswAllocator * allocator);
 HnswElement HnswInitElementFromBlock(BlockNumber blkno, OffsetNumber offno);
 void		HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint, Relation index, HnswSupport * support, int m, int efConstruction, bool existing);
 HnswSearchCandidate *HnswEntryCandidate(char *base, HnswElement em, HnswQuery * q, Relation rel, HnswSupport * support, bool loadVec);
 void		HnswUpdateMetaPage(Relation index, int updateEntry, HnswElement entryPoint, BlockNumber insertPage, ForkNumber forkNum, bool building);
+void		HnswUpdateEntryPoint(Relation index, int updateEntry, HnswFilterData * filter, HnswElement entryPoint, ForkNumber forkNum, bool building);
+void		HnswUpdateUpperVersion(Relation index, bool deleted);
+void		HnswCreateDirectory(Relation index, List *entryPoints, ForkNumber forkNum);
 void		HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int m);
 void		HnswAddHeapTid(HnswElement element, ItemPointer heaptid);
 HnswNeighborArray *HnswInitNeighborArray(int lm, HnswAllocator * allocator);
 void		HnswInitNeighbors(char *base, HnswElement element, int m, HnswAllocator * alloc);
-bool		HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, ItemPointer heaptid, bool building);
+Size		HnswGetNeighborsSize(int level, int m);
+bool		HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, HnswFilterData * filter, ItemPointer heaptid, int m, int efConstruction, bool building);
 void		HnswUpdateNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e, int m, bool checkExisting, bool building);
-void		HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, bool loadHeaptids, bool loadVec);
+void		HnswUpdateGraphOnDisk(Relation index, HnswSupport * support, HnswElement element, int m, HnswElement entryPoint, bool building);
+void		HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, HnswSupport * support, bool loadHeaptids, bool loadVec);
 void		HnswLoadElement(HnswElement element, double *distance, HnswQuery * q, Relation index, HnswSupport * support, bool loadVec, double *maxDistance);
+double		HnswGetElementDistance(char *base, HnswElement a, HnswElement b, HnswSupport * support);
+double		HnswGetStoredDistance(Datum a, Pointer data, int quantization, HnswSupport * support);
+List	   *HnswSearchUpperCache(Relation index, HnswQuery * q, HnswElement entryPoint, HnswSupport * support, int m, uint32 upperVersion, uint32 upperInserts, int *lc);
+bool		HnswSearchSnapshot(Relation index, HnswQuery * q, HnswSupport * support, int m, uint32 snapshotId, List **w);
+void		HnswExportSnapshot(Relation index);
+void		HnswReleaseSnapshot(Relation index);
+void		HnswClearSnapshot(Relation index);
+void		HnswSnapshotInit(void);
+void		HnswQuantizeValue(Vector * vec, HnswQuantizedVector * result);
+Vector	   *HnswDequantizeValue(HnswQuantizedVector * vec);
+void		HnswSketchValue(Vector * vec, HnswBinarySketch * result);
 bool		HnswFormIndexValue(Datum *out, Datum *values, bool *isnull, const HnswTypeInfo * typeInfo, HnswSupport * support);
-void		HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element);
+int64		HnswGetFilterValue(HnswSupport * support, Datum value);
+void		HnswFormFilterValue(HnswFilterData * filter, Datum *values, bool *isnull, HnswSupport * support);
+Size		HnswGetElementTupleSize(char *base, HnswElement element, HnswSupport * support);
+void		HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element, HnswSupport * support);
 void		HnswUpdateConnection(char *base, HnswNeighborArray * neighbors, HnswElement newElement, float distance, int lm, int *updateIdx, Relation index, HnswSupport * support);
 bool		HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, Relation index, int m, int lm, int lc);
 void		HnswInitLockTranche(void);
 const		HnswTypeInfo *HnswGetTypeInfo(Relation index);
 PGDLLEXPORT void HnswParallelBuildMain(dsm_segment *seg, shm_toc *toc);
+PGDLLEXPORT void HnswParallelVacuumMain(dsm_segment *seg, shm_toc *toc);
 
 /* Index access methods */
 IndexBuildResult *hnswbuild(Relation heap, Relation index, IndexInfo *indexInfo);
@@ -468,6 +685,49 @@ HnswGetNeighbors(char *base, HnswElement element, int lc)
 	return HnswPtrAccess(base, neighborList[lc]);
 }
 
+/*
+ * Acquire a lock, adding the time spent waiting if waitTime is set
+ */
+static inline void
+HnswLockAcquire(LWLock *lock, LWLockMode mode, instr_time *waitTime)
+{
+	instr_time	start;
+	instr_time	end;
+
+	if (waitTime == NULL)
+	{
+		LWLockAcquire(lock, mode);
+		return;
+	}
+
+	/* Only read the clock when there is contention */
+	if (LWLockConditionalAcquire(lock, mode))
+		return;
+
+	INSTR_TIME_SET_CURRENT(start);
+	LWLockAcquire(lock, mode);
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_ACCUM_DIFF(*waitTime, end, start);
+}
+
+static inline bool
+HnswFilterEqual(HnswFilterData * a, HnswFilterData * b)
+{
+	if (a->isnull || b->isnull)
+		return a->isnull == b->isnull;
+
+	return a->value == b->value;
+}
+
+static inline bool
+HnswFilterMatches(HnswQuery * q, HnswElement element)
+{
+	if (!q->filtered)
+		return true;
+
+	return !element->filter.isnull && element->filter.value == q->filter.value;
+}
+
 /* Hash tables */
 typedef struct TidHashEntry
 {
@@ -482,6 +742,20 @@ typedef struct TidHashEntry
 #define SH_DECLARE
 #include "lib/simplehash.h"
 
+typedef struct ElementHashEntry
+{
+	ItemPointerData tid;
+	HnswElement element;
+	char		status;
+}			ElementHashEntry;
+
+#define SH_PREFIX elementhash
+#define SH_ELEMENT_TYPE ElementHashEntry
+#define SH_KEY_TYPE ItemPointerData
+#define SH_SCOPE extern
+#define SH_DECLARE
+#include "lib/simplehash.h"
+
 typedef struct PointerHashEntry
 {
 	uintptr_t	ptr;
@@ -495,6 +769,20 @@ typedef struct PointerHashEntry
 #define SH_DECLARE
 #include "lib/simplehash.h"
 
+typedef struct PartitionHashEntry
+{
+	int64		value;
+	HnswElement element;
+	char		status;
+}			PartitionHashEntry;
+
+#define SH_PREFIX partitionhash
+#define SH_ELEMENT_TYPE PartitionHashEntry
+#define SH_KEY_TYPE int64
+#define SH_SCOPE extern
+#define SH_DECLARE
+#include "lib/simplehash.h"
+
 typedef struct OffsetHashEntry
 {
 	Size		offset;
@@ -6,7 +6,7 @@
  * In this first phase, the graph is held completely in memory. When the graph
  * is fully built, or we run out of memory reserved for the build (determined
  * by maintenance_work_mem), we materialize the graph to disk (see
- * FlushPages()), and switch to the on-disk phase.
+ * FlushPages()), and switch to the segmented phase.
  *
  * In a parallel build, a large contiguous chunk of shared memory is allocated
  * to hold the graph. Each worker process has its own HnswBuildState struct in
@@ -18,18 +18,25 @@
  * "relative pointers", stored as an offset from 'hnswarea'.
  *
  * Each element is protected by an LWLock. It must be held when reading or
- * modifying the element's neighbors or 'heaptids'.
+ * modifying the element's neighbors or 'heaptids'. To avoid contention on
+ * the shared allocator, each process reserves an arena from the shared area
+ * and allocates its elements from it without taking any locks.
  *
  * In a non-parallel build, the graph is held in backend-private memory. All
  * the elements are allocated in a dedicated memory context, 'graphCtx', and
  * the pointers used in the graph are regular pointers.
  *
- * 2. On-disk phase
+ * 2. Segmented phase
  *
- * In the on-disk phase, the index is built by inserting each vector to the
- * index one by one, just like on INSERT. The only difference is that we don't
- * WAL-log the individual inserts. If the graph fit completely in memory and
- * was fully built in the in-memory phase, the on-disk phase is skipped.
+ * In the segmented phase, the remaining vectors are added to a new in-memory
+ * graph (a segment) in the same way. When the segment runs out of memory, or
+ * all vectors have been added, it is merged into the graph on disk (see
+ * MergeSegment()). Each element is inserted just like on INSERT, except that
+ * its neighbors from the segment (that are already on disk) are added as
+ * candidates, which allows for a smaller search on disk. We don't WAL-log the
+ * individual inserts. If the graph fit completely in memory and was fully
+ * built in the in-memory phase, the segmented phase is skipped. If a single
+ * element does not fit into memory, it is inserted on disk directly.
  *
  * After we have finished building the graph, we perform one more scan through
  * the index and write all the pages to the WAL.
@@ -51,8 +58,10 @@
 #include "optimizer/optimizer.h"
 #include "storage/bufmgr.h"
 #include "tcop/tcopprot.h"
+#include "utils/builtins.h"
 #include "utils/datum.h"
 #include "utils/memutils.h"
+#include "utils/rel.h"
 
 #if PG_VERSION_NUM >= 160000
 #include "varatt.h"
@@ -73,6 +82,9 @@
 #define PARALLEL_KEY_HNSW_AREA			UINT64CONST(0xA000000000000002)
 #define PARALLEL_KEY_QUERY_TEXT			UINT64CONST(0xA000000000000003)
 
+/* Max size of arenas reserved from the shared area */
+#define HNSW_MAX_ARENA_SIZE		(256 * 1024)
+
 /*
  * Create the metapage
  */
@@ -100,6 +112,24 @@ CreateMetaPage(HnswBuildState * buildstate)
 	metap->entryOffno = InvalidOffsetNumber;
 	metap->entryLevel = -1;
 	metap->insertPage = InvalidBlockNumber;
+	metap->directoryBlkno = InvalidBlockNumber;
+	metap->directoryBuckets = 0;
+	metap->upperVersion = 0;
+	metap->upperInserts = 0;
+	metap->snapshotId = 0;
+
+	/* Snapshot files are not WAL-logged, so each server exports its own */
+	if (HnswGetSnapshot(index) && forkNum == MAIN_FORKNUM && !RelationUsesLocalBuffers(index))
+	{
+		while (metap->snapshotId == 0)
+		{
+			if (!pg_strong_random(&metap->snapshotId, sizeof(uint32)))
+				ereport(ERROR,
+						(errcode(ERRCODE_INTERNAL_ERROR),
+						 errmsg("could not generate random snapshot id")));
+		}
+	}
+
 	((PageHeader) page)->pd_lower =
 		((char *) metap + sizeof(HnswMetaPageData)) - (char *) page;
 
@@ -171,7 +201,6 @@ CreateGraphPages(HnswBuildState * buildstate)
 		Size		etupSize;
 		Size		ntupSize;
 		Size		combinedSize;
-		Pointer		valuePtr = HnswPtrAccess(base, element->value);
 
 		/* Update iterator */
 		iter = element->next;
@@ -180,7 +209,7 @@ CreateGraphPages(HnswBuildState * buildstate)
 		MemSet(etup, 0, HNSW_TUPLE_ALLOC_SIZE);
 
 		/* Calculate sizes */
-		etupSize = HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(valuePtr));
+		etupSize = HnswGetElementTupleSize(base, element, &buildstate->support);
 		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, buildstate->m);
 		combinedSize = etupSize + ntupSize + sizeof(ItemIdData);
 
@@ -190,7 +219,7 @@ CreateGraphPages(HnswBuildState * buildstate)
 					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
 					 errmsg("index tuple too large")));
 
-		HnswSetElementTuple(base, etup, element);
+		HnswSetElementTuple(base, etup, element, &buildstate->support);
 
 		/* Keep element and neighbors on the same page if possible */
 		if (PageGetFreeSpace(page) < etupSize || (combinedSize <= maxSize && PageGetFreeSpace(page) < combinedSize))
@@ -288,6 +317,57 @@ WriteNeighborTuples(HnswBuildState * buildstate)
 	pfree(ntup);
 }
 
+/*
+ * Start a new segment
+ */
+static void
+ResetSegment(HnswBuildState * buildstate)
+{
+	HnswGraph  *graph = buildstate->graph;
+	char	   *base = buildstate->hnswarea;
+
+	HnswPtrStore(base, graph->head, (HnswElement) NULL);
+	HnswPtrStore(base, graph->entryPoint, (HnswElement) NULL);
+
+	/* Also invalidates arenas from the previous segment */
+	graph->segments++;
+	graph->memoryPeak = Max(graph->memoryPeak, graph->memoryUsed);
+	graph->memoryUsed = 0;
+	pg_atomic_write_u32(&graph->elementCount, 0);
+
+	if (buildstate->partitioned)
+		partitionhash_reset(buildstate->partitions);
+
+	if (base == NULL)
+		MemoryContextReset(buildstate->graphCtx);
+#if PG_VERSION_NUM < 140005
+	else
+	{
+		/* See HnswBeginParallel */
+		graph->memoryUsed += MAXALIGN(1);
+	}
+#endif
+}
+
+/*
+ * Create the directory with the entry point for each filter value
+ */
+static void
+CreateDirectory(HnswBuildState * buildstate)
+{
+	List	   *entryPoints = NIL;
+	partitionhash_iterator iter;
+	PartitionHashEntry *entry;
+
+	partitionhash_start_iterate(buildstate->partitions, &iter);
+	while ((entry = partitionhash_iterate(buildstate->partitions, &iter)) != NULL)
+		entryPoints = lappend(entryPoints, entry->element);
+
+	HnswCreateDirectory(buildstate->index, entryPoints, buildstate->forkNum);
+
+	list_free(entryPoints);
+}
+
 /*
  * Flush pages
  */
@@ -302,17 +382,241 @@ FlushPages(HnswBuildState * buildstate)
 	CreateGraphPages(buildstate);
 	WriteNeighborTuples(buildstate);
 
+	if (buildstate->partitioned)
+		CreateDirectory(buildstate);
+
 	buildstate->graph->flushed = true;
-	MemoryContextReset(buildstate->graphCtx);
+	ResetSegment(buildstate);
+}
+
+/*
+ * Get an element from the segment that is already on disk
+ */
+static HnswElement
+GetMergedElement(char *base, HnswElement element)
+{
+	HnswElement e = HnswInitElementFromBlock(element->blkno, element->offno);
+
+	e->level = element->level;
+	e->version = element->version;
+	e->heaptidsLength = element->heaptidsLength;
+	e->neighborPage = element->neighborPage;
+	e->neighborOffno = element->neighborOffno;
+	e->filter = element->filter;
+	HnswPtrPointer(e->value) = HnswPtrAccess(base, element->value);
+
+	return e;
+}
+
+/*
+ * Check if a neighbor array contains an element on disk
+ */
+static bool
+ContainsElement(HnswNeighborArray * neighbors, HnswElement element)
+{
+	for (int i = 0; i < neighbors->length; i++)
+	{
+		HnswElement e = HnswPtrPointer(neighbors->items[i].element);
+
+		if (e->blkno == element->blkno && e->offno == element->offno)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Merge an element from the segment into the graph on disk
+ */
+static void
+MergeElement(HnswBuildState * buildstate, HnswElement element)
+{
+	Relation	index = buildstate->index;
+	HnswSupport *support = &buildstate->support;
+	int			m = buildstate->m;
+	int			efConstruction = buildstate->efConstruction;
+	char	   *base = buildstate->hnswarea;
+	HnswNeighborArray *segmentNeighbors = HnswGetNeighbors(base, element, 0);
+	HnswElement entryPoint;
+	HnswElement e;
+	LOCKMODE	lockmode = ShareLock;
+
+	/* Copy the element to local memory */
+	e = HnswInitElementFromBlock(InvalidBlockNumber, InvalidOffsetNumber);
+	e->level = element->level;
+	e->deleted = 0;
+	e->version = element->version;
+	e->heaptidsLength = 0;
+	for (int i = 0; i < element->heaptidsLength; i++)
+		HnswAddHeapTid(e, &element->heaptids[i]);
+	HnswInitNeighbors(NULL, e, m, NULL);
+	e->filter = element->filter;
+	HnswPtrPointer(e->value) = HnswPtrAccess(base, element->value);
+
+	/* Search less when neighbors from the segment are already on disk */
+	for (int i = 0; i < segmentNeighbors->length; i++)
+	{
+		HnswElement neighborElement = HnswPtrAccess(base, segmentNeighbors->items[i].element);
+
+		if (BlockNumberIsValid(neighborElement->blkno))
+		{
+			efConstruction = Max(efConstruction / 2, HnswGetLayerM(m, 0));
+			break;
+		}
+	}
+
+	/* Same locking as inserts */
+	LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+	entryPoint = HnswGetEntryPoint(index, &e->filter);
+
+	/* Prevent concurrent inserts when likely updating entry point */
+	if (entryPoint == NULL || e->level > entryPoint->level)
+	{
+		UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+		lockmode = ExclusiveLock;
+		LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+		entryPoint = HnswGetEntryPoint(index, &e->filter);
+	}
+
+	/* Find neighbors on disk */
+	HnswFindElementNeighbors(NULL, e, entryPoint, index, support, m, efConstruction, false);
+
+	/* Add neighbors from the segment that are already on disk */
+	for (int lc = e->level; lc >= 0; lc--)
+	{
+		int			lm = HnswGetLayerM(m, lc);
+		HnswNeighborArray *neighbors = HnswGetNeighbors(NULL, e, lc);
+
+		segmentNeighbors = HnswGetNeighbors(base, element, lc);
+
+		for (int i = 0; i < segmentNeighbors->length; i++)
+		{
+			HnswCandidate *hc = &segmentNeighbors->items[i];
+			HnswElement neighborElement = HnswPtrAccess(base, hc->element);
+
+			if (!BlockNumberIsValid(neighborElement->blkno) || ContainsElement(neighbors, neighborElement))
+				continue;
+
+			HnswUpdateConnection(NULL, neighbors, GetMergedElement(base, neighborElement), hc->distance, lm, NULL, index, support);
+		}
+	}
+
+	/* Add to graph on disk */
+	HnswUpdateGraphOnDisk(index, support, e, m, entryPoint, true);
+
+	UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+	/* Record location for elements merged later (unless a duplicate) */
+	if (BlockNumberIsValid(e->blkno))
+	{
+		element->blkno = e->blkno;
+		element->offno = e->offno;
+		element->neighborPage = e->neighborPage;
+		element->neighborOffno = e->neighborOffno;
+		element->version = e->version;
+	}
+}
+
+/*
+ * Merge the segment into the graph on disk
+ */
+static void
+MergeSegment(HnswBuildState * buildstate)
+{
+	char	   *base = buildstate->hnswarea;
+	HnswElementPtr iter;
+	MemoryContext mergeCtx = AllocSetContextCreate(CurrentMemoryContext,
+												   "Hnsw merge context",
+												   ALLOCSET_DEFAULT_SIZES);
+	MemoryContext oldCtx = MemoryContextSwitchTo(mergeCtx);
+
+	/* Mark elements as not on disk */
+	iter = buildstate->graph->head;
+	while (!HnswPtrIsNull(base, iter))
+	{
+		HnswElement element = HnswPtrAccess(base, iter);
+
+		element->blkno = InvalidBlockNumber;
+		iter = element->next;
+	}
+
+	iter = buildstate->graph->head;
+	while (!HnswPtrIsNull(base, iter))
+	{
+		HnswElement element = HnswPtrAccess(base, iter);
+
+		/* Update iterator */
+		iter = element->next;
+
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		MergeElement(buildstate, element);
+
+		MemoryContextReset(mergeCtx);
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(mergeCtx);
+}
+
+/*
+ * Write the segment to disk
+ *
+ * If flushLock is passed, the caller holds it exclusively and has set
+ * graph->merging. The lock is released while merging so other processes can
+ * insert on disk instead of waiting.
+ */
+static void
+WriteSegment(HnswBuildState * buildstate, LWLock *flushLock)
+{
+	HnswGraph  *graph = buildstate->graph;
+	int			segments = graph->segments;
+	uint32		elements = pg_atomic_read_u32(&graph->elementCount);
+	Size		memoryUsed = graph->memoryUsed;
+	instr_time	start;
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	if (!graph->flushed)
+		FlushPages(buildstate);
+	else if (!HnswPtrIsNull(buildstate->hnswarea, graph->head))
+	{
+		/* No process inserts into the segment while merging is set */
+		if (flushLock != NULL)
+			LWLockRelease(flushLock);
+
+		MergeSegment(buildstate);
+
+		if (flushLock != NULL)
+			LWLockAcquire(flushLock, LW_EXCLUSIVE);
+
+		ResetSegment(buildstate);
+	}
+
+	if (buildstate->logging && graph->segments != segments)
+	{
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+
+		ereport(LOG,
+				(errmsg("hnsw build wrote segment %d with %u elements (%zu MB) in %.3f s after " INT64_FORMAT " tuples",
+						graph->segments, elements, memoryUsed / (1024 * 1024),
+						INSTR_TIME_GET_DOUBLE(duration), (int64) graph->indtuples)));
+	}
 }
 
 /*
  * Add a heap TID to an existing element
  */
 static bool
-AddDuplicateInMemory(HnswElement element, HnswElement dup)
+AddDuplicateInMemory(HnswElement element, HnswElement dup, HnswSupport * support)
 {
-	LWLockAcquire(&dup->lock, LW_EXCLUSIVE);
+	HnswLockAcquire(&dup->lock, LW_EXCLUSIVE, support->lockWait);
 
 	if (dup->heaptidsLength == HNSW_HEAPTIDS)
 	{
@@ -331,7 +635,7 @@ AddDuplicateInMemory(HnswElement element, HnswElement dup)
  * Find duplicate element
  */
 static bool
-FindDuplicateInMemory(char *base, HnswElement element)
+FindDuplicateInMemory(char *base, HnswElement element, HnswSupport * support)
 {
 	HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, 0);
 	Datum		value = HnswGetValue(base, element);
@@ -346,8 +650,12 @@ FindDuplicateInMemory(char *base, HnswElement element)
 		if (!datumIsEqual(value, neighborValue, false, -1))
 			return false;
 
+		/* Equal values with different filters need separate elements */
+		if (!HnswFilterEqual(&element->filter, &neighborElement->filter))
+			continue;
+
 		/* Check for space */
-		if (AddDuplicateInMemory(element, neighborElement))
+		if (AddDuplicateInMemory(element, neighborElement, support))
 			return true;
 	}
 
@@ -366,11 +674,26 @@ AddElementInMemory(char *base, HnswGraph * graph, HnswElement element)
 	SpinLockRelease(&graph->lock);
 }
 
+/*
+ * Check if a neighbor array contains an element in memory
+ */
+static bool
+ContainsElementInMemory(char *base, HnswNeighborArray * neighbors, HnswElement element)
+{
+	for (int i = 0; i < neighbors->length; i++)
+	{
+		if (HnswPtrAccess(base, neighbors->items[i].element) == element)
+			return true;
+	}
+
+	return false;
+}
+
 /*
  * Update neighbors
  */
 static void
-UpdateNeighborsInMemory(char *base, HnswSupport * support, HnswElement e, int m)
+UpdateNeighborsInMemory(char *base, HnswSupport * support, HnswElement e, int m, bool checkExisting)
 {
 	for (int lc = e->level; lc >= 0; lc--)
 	{
@@ -379,7 +702,7 @@ UpdateNeighborsInMemory(char *base, HnswSupport * support, HnswElement e, int m)
 		HnswNeighborArray *neighbors = palloc(neighborsSize);
 
 		/* Copy neighbors to local memory */
-		LWLockAcquire(&e->lock, LW_SHARED);
+		HnswLockAcquire(&e->lock, LW_SHARED, support->lockWait);
 		memcpy(neighbors, HnswGetNeighbors(base, e, lc), neighborsSize);
 		LWLockRelease(&e->lock);
 
@@ -387,17 +710,55 @@ UpdateNeighborsInMemory(char *base, HnswSupport * support, HnswElement e, int m)
 		{
 			HnswCandidate *hc = &neighbors->items[i];
 			HnswElement neighborElement = HnswPtrAccess(base, hc->element);
+			HnswNeighborArray *neighborNeighbors;
 
 			/* Keep scan-build happy on Mac x86-64 */
 			Assert(neighborElement);
 
-			LWLockAcquire(&neighborElement->lock, LW_EXCLUSIVE);
-			HnswUpdateConnection(base, HnswGetNeighbors(base, neighborElement, lc), e, hc->distance, lm, NULL, NULL, support);
+			HnswLockAcquire(&neighborElement->lock, LW_EXCLUSIVE, support->lockWait);
+			neighborNeighbors = HnswGetNeighbors(base, neighborElement, lc);
+			if (!checkExisting || !ContainsElementInMemory(base, neighborNeighbors, e))
+				HnswUpdateConnection(base, neighborNeighbors, e, hc->distance, lm, NULL, NULL, support);
 			LWLockRelease(&neighborElement->lock);
 		}
 	}
 }
 
+/*
+ * Get the entry point in memory
+ */
+static HnswElement
+GetEntryPointInMemory(HnswBuildState * buildstate, HnswElement element)
+{
+	PartitionHashEntry *entry;
+
+	if (!buildstate->partitioned)
+		return HnswPtrAccess(buildstate->hnswarea, buildstate->graph->entryPoint);
+
+	entry = partitionhash_lookup(buildstate->partitions, element->filter.value);
+
+	return entry != NULL ? entry->element : NULL;
+}
+
+/*
+ * Set the entry point in memory
+ */
+static void
+SetEntryPointInMemory(HnswBuildState * buildstate, HnswElement element)
+{
+	PartitionHashEntry *entry;
+	bool		found;
+
+	if (!buildstate->partitioned)
+	{
+		HnswPtrStore(buildstate->hnswarea, buildstate->graph->entryPoint, element);
+		return;
+	}
+
+	entry = partitionhash_insert(buildstate->partitions, element->filter.value, &found);
+	entry->element = element;
+}
+
 /*
  * Update graph in memory
  */
@@ -408,18 +769,18 @@ UpdateGraphInMemory(HnswSupport * support, HnswElement element, int m, HnswEleme
 	char	   *base = buildstate->hnswarea;
 
 	/* Look for duplicate */
-	if (FindDuplicateInMemory(base, element))
+	if (FindDuplicateInMemory(base, element, support))
 		return;
 
 	/* Add element */
 	AddElementInMemory(base, graph, element);
 
 	/* Update neighbors */
-	UpdateNeighborsInMemory(base, support, element, m);
+	UpdateNeighborsInMemory(base, support, element, m, false);
 
 	/* Update entry point if needed (already have lock) */
 	if (entryPoint == NULL || element->level > entryPoint->level)
-		HnswPtrStore(base, graph->entryPoint, element);
+		SetEntryPointInMemory(buildstate, element);
 }
 
 /*
@@ -436,14 +797,18 @@ InsertTupleInMemory(HnswBuildState * buildstate, HnswElement element)
 	int			efConstruction = buildstate->efConstruction;
 	int			m = buildstate->m;
 	char	   *base = buildstate->hnswarea;
+	instr_time *lockWait = buildstate->logging ? &buildstate->entryLockWait : NULL;
 
 	/* Wait if another process needs exclusive lock on entry lock */
-	LWLockAcquire(entryWaitLock, LW_EXCLUSIVE);
-	LWLockRelease(entryWaitLock);
+	if (pg_atomic_read_u32(&graph->entryWaiters) > 0)
+	{
+		HnswLockAcquire(entryWaitLock, LW_EXCLUSIVE, lockWait);
+		LWLockRelease(entryWaitLock);
+	}
 
 	/* Get entry point */
-	LWLockAcquire(entryLock, LW_SHARED);
-	entryPoint = HnswPtrAccess(base, graph->entryPoint);
+	HnswLockAcquire(entryLock, LW_SHARED, lockWait);
+	entryPoint = GetEntryPointInMemory(buildstate, element);
 
 	/* Prevent concurrent inserts when likely updating entry point */
 	if (entryPoint == NULL || element->level > entryPoint->level)
@@ -452,12 +817,14 @@ InsertTupleInMemory(HnswBuildState * buildstate, HnswElement element)
 		LWLockRelease(entryLock);
 
 		/* Tell other processes to wait and get exclusive lock */
-		LWLockAcquire(entryWaitLock, LW_EXCLUSIVE);
-		LWLockAcquire(entryLock, LW_EXCLUSIVE);
+		pg_atomic_fetch_add_u32(&graph->entryWaiters, 1);
+		HnswLockAcquire(entryWaitLock, LW_EXCLUSIVE, lockWait);
+		HnswLockAcquire(entryLock, LW_EXCLUSIVE, lockWait);
 		LWLockRelease(entryWaitLock);
+		pg_atomic_fetch_sub_u32(&graph->entryWaiters, 1);
 
 		/* Get latest entry point after lock is acquired */
-		entryPoint = HnswPtrAccess(base, graph->entryPoint);
+		entryPoint = GetEntryPointInMemory(buildstate, element);
 	}
 
 	/* Find neighbors for element */
@@ -470,6 +837,101 @@ InsertTupleInMemory(HnswBuildState * buildstate, HnswElement element)
 	LWLockRelease(entryLock);
 }
 
+/*
+ * Reserve memory for an element
+ */
+static bool
+ReserveMemory(HnswBuildState * buildstate, Size size)
+{
+	HnswGraph  *graph = buildstate->graph;
+
+	/* Serial builds allocate from a memory context */
+	if (buildstate->hnswarea == NULL)
+		return graph->memoryUsed < graph->memoryTotal;
+
+	/* The segment is being merged */
+	if (graph->merging)
+		return false;
+
+	/* Use the current arena if it has enough space */
+	if (buildstate->arenaSegment == graph->segments && size <= buildstate->arenaFree)
+		return true;
+
+	/*
+	 * Reserve a new arena from the shared memory area. The rest of the
+	 * current arena is wasted, which is fine since arenas are small relative
+	 * to the area.
+	 */
+	LWLockAcquire(&graph->allocatorLock, LW_EXCLUSIVE);
+
+	if (graph->memoryUsed >= graph->memoryTotal)
+	{
+		LWLockRelease(&graph->allocatorLock);
+		return false;
+	}
+
+	buildstate->arena = buildstate->hnswarea + graph->memoryUsed;
+	buildstate->arenaFree = Max(buildstate->arenaSize, size);
+	buildstate->arenaSegment = graph->segments;
+	graph->memoryUsed += buildstate->arenaFree;
+
+	LWLockRelease(&graph->allocatorLock);
+
+	return true;
+}
+
+/*
+ * Check if a value is equal to the value of an element from the source index
+ */
+static bool
+SourceValueEqual(HnswBuildState * buildstate, Datum value, HnswElement element)
+{
+	Datum		elementValue = HnswGetValue(buildstate->hnswarea, element);
+
+	/* Only the decoded value is known until the first heap TID is added */
+	if (buildstate->sourceQuantization == HNSW_QUANTIZATION_INT8 && element->heaptidsLength == 0)
+	{
+		Vector	   *vec = (Vector *) DatumGetPointer(value);
+		HnswQuantizedVector *qv = palloc(HNSW_QUANTIZED_VECTOR_SIZE(vec->dim));
+
+		HnswQuantizeValue(vec, qv);
+		value = PointerGetDatum(HnswDequantizeValue(qv));
+	}
+
+	return datumIsEqual(value, elementValue, false, -1);
+}
+
+/*
+ * Add a heap TID to an element from the source index if the row is unchanged
+ */
+static bool
+AddSourceHeapTid(HnswBuildState * buildstate, Datum value, HnswFilterData * filter, ItemPointer heaptid)
+{
+	ElementHashEntry *entry = elementhash_lookup(buildstate->sourceTids, *heaptid);
+	HnswElement element;
+
+	if (entry == NULL)
+		return false;
+
+	element = entry->element;
+
+	/* The heap TID may have been reused for a different row */
+	if (!HnswFilterEqual(filter, &element->filter) || !SourceValueEqual(buildstate, value, element))
+		return false;
+
+	/* Duplicates inserted during the scan can fill the element */
+	if (element->heaptidsLength == HNSW_HEAPTIDS)
+		return false;
+
+	/* Replace the decoded value */
+	if (element->heaptidsLength == 0)
+		memcpy(HnswPtrAccess(buildstate->hnswarea, element->value), DatumGetPointer(value), VARSIZE_ANY(DatumGetPointer(value)));
+
+	HnswAddHeapTid(element, heaptid);
+
+	return true;
+}
+
 /*
  * Insert tuple
  */
@@ -485,71 +947,94 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, Hn
 	LWLock	   *flushLock = &graph->flushLock;
 	char	   *base = buildstate->hnswarea;
 	Datum		value;
+	HnswFilterData filter;
 
 	/* Form index value */
 	if (!HnswFormIndexValue(&value, values, isnull, buildstate->typeInfo, support))
 		return false;
 
+	HnswFormFilterValue(&filter, values, isnull, support);
+
 	/* Get datum size */
 	valueSize = VARSIZE_ANY(DatumGetPointer(value));
 
-	/* Ensure graph not flushed when inserting */
-	LWLockAcquire(flushLock, LW_SHARED);
-
-	/* Are we in the on-disk phase? */
-	if (graph->flushed)
+	/* The source graph must stay in memory until dead elements are removed */
+	if (buildstate->sourceTids != NULL)
 	{
-		LWLockRelease(flushLock);
+		if (AddSourceHeapTid(buildstate, value, &filter, heaptid))
+			return true;
 
-		return HnswInsertTupleOnDisk(index, support, value, heaptid, true);
+		if (!ReserveMemory(buildstate, buildstate->maxElementSize + MAXALIGN(valueSize)))
+		{
+			buildstate->sourceFailed = true;
+			return false;
+		}
 	}
 
-	/*
-	 * In a parallel build, the HnswElement is allocated from the shared
-	 * memory area, so we need to coordinate with other processes.
-	 */
-	LWLockAcquire(&graph->allocatorLock, LW_EXCLUSIVE);
+	/* Ensure segment not written when inserting */
+	LWLockAcquire(flushLock, LW_SHARED);
 
 	/*
-	 * Check that we have enough memory available for the new element now that
-	 * we have the allocator lock, and flush pages if needed.
+	 * In a parallel build, the HnswElement is allocated from the shared
+	 * memory area. Check that we have enough memory available for the new
+	 * element (reserving a new arena if needed), and write the segment to
+	 * disk if not.
 	 */
-	if (graph->memoryUsed >= graph->memoryTotal)
+	while (!ReserveMemory(buildstate, buildstate->maxElementSize + MAXALIGN(valueSize)))
 	{
-		LWLockRelease(&graph->allocatorLock);
+		int			segments = graph->segments;
+		bool		onDisk;
+		bool		merging = false;
+
+		/*
+		 * Insert on disk while another process merges the segment (so other
+		 * processes can continue to make progress) or if the element does not
+		 * fit into an empty segment
+		 */
+		SpinLockAcquire(&graph->lock);
+		onDisk = graph->flushed && (graph->merging || HnswPtrIsNull(base, graph->head));
+		if (graph->flushed && !onDisk)
+			graph->merging = merging = true;
+		SpinLockRelease(&graph->lock);
 
 		LWLockRelease(flushLock);
+
+		if (onDisk)
+			return HnswInsertTupleOnDisk(index, support, value, &filter, heaptid, buildstate->m, buildstate->efConstruction, true);
+
 		LWLockAcquire(flushLock, LW_EXCLUSIVE);
 
-		if (!graph->flushed)
+		/* Check if another process already wrote the segment */
+		if (graph->segments == segments)
 		{
-			ereport(NOTICE,
-					(errmsg("hnsw graph no longer fits into maintenance_work_mem after " INT64_FORMAT " tuples", (int64) graph->indtuples),
-					 errdetail("Building will take significantly more time."),
-					 errhint("Increase maintenance_work_mem to speed up builds.")));
+			if (!graph->flushed)
+				ereport(NOTICE,
+						(errmsg("hnsw graph no longer fits into maintenance_work_mem after " INT64_FORMAT " tuples", (int64) graph->indtuples),
+						 errdetail("Building will continue in segments, which takes more time."),
+						 errhint("Increase maintenance_work_mem to speed up builds.")));
 
-			FlushPages(buildstate);
+			WriteSegment(buildstate, merging ? flushLock : NULL);
 		}
 
-		LWLockRelease(flushLock);
+		if (merging)
+		{
+			SpinLockAcquire(&graph->lock);
+			graph->merging = false;
+			SpinLockRelease(&graph->lock);
+		}
 
-		return HnswInsertTupleOnDisk(index, support, value, heaptid, true);
+		LWLockRelease(flushLock);
+		LWLockAcquire(flushLock, LW_SHARED);
 	}
 
 	/* Ok, we can proceed to allocate the element */
-	element = HnswInitElement(base, heaptid, buildstate->m, buildstate->ml, buildstate->maxLevel, allocator);
-	valuePtr = HnswAlloc(allocator, valueSize);
-
-	/*
-	 * We have now allocated the space needed for the element, so we don't
-	 * need the allocator lock anymore. Release it and initialize the rest of
-	 * the element.
-	 */
-	LWLockRelease(&graph->allocatorLock);
+	element = HnswInitElement(base, heaptid, buildstate->m, buildstate->ml, buildstate->maxLevel, valueSize, allocator);
+	element->ordinal = pg_atomic_fetch_add_u32(&graph->elementCount, 1);
+	element->filter = filter;
 
 	/* Copy the datum */
+	valuePtr = HnswPtrAccess(base, element->value);
 	memcpy(valuePtr, DatumGetPointer(value), valueSize);
-	HnswPtrStore(base, element->value, valuePtr);
 
 	/* Create a lock for the element */
 	LWLockInitialize(&element->lock, hnsw_lock_tranche_id);
@@ -563,6 +1048,51 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, Hn
 	return true;
 }
 
+/*
+ * Log insert progress for this process
+ */
+static void
+LogInsertProgress(HnswBuildState * buildstate)
+{
+	HnswGraph  *graph = buildstate->graph;
+	instr_time	duration;
+	double		seconds;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, buildstate->insertStart);
+	seconds = INSTR_TIME_GET_DOUBLE(duration);
+
+	ereport(LOG,
+			(errmsg("hnsw build %s inserted " INT64_FORMAT " tuples in %.3f s (%.0f tuples/s)",
+					IsParallelWorker() ? "worker" : "leader", buildstate->inserted, seconds,
+					seconds > 0 ? buildstate->inserted / seconds : 0),
+			 errdetail("distances: " INT64_FORMAT ", entry lock wait: %.3f s, element lock wait: %.3f s, memory used: %zu MB, segments written: %d",
+					   buildstate->stats.distances,
+					   INSTR_TIME_GET_DOUBLE(buildstate->entryLockWait),
+					   INSTR_TIME_GET_DOUBLE(buildstate->elementLockWait),
+					   graph->memoryUsed / (1024 * 1024), graph->segments)));
+}
+
+/*
+ * Log insert progress if hnsw.build_log_interval has elapsed
+ */
+static void
+MaybeLogInsertProgress(HnswBuildState * buildstate)
+{
+	instr_time	now;
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(now);
+	duration = now;
+	INSTR_TIME_SUBTRACT(duration, buildstate->lastLog);
+
+	if (INSTR_TIME_GET_DOUBLE(duration) < hnsw_build_log_interval)
+		return;
+
+	LogInsertProgress(buildstate);
+	buildstate->lastLog = now;
+}
+
 /*
  * Callback for table_index_build_scan
  */
@@ -578,6 +1108,14 @@ BuildCallback(Relation index, ItemPointer tid, Datum *values,
 	if (isnull[0])
 		return;
 
+	/* Partitioned indexes are only scanned with a filter value */
+	if (buildstate->partitioned && isnull[1])
+		return;
+
+	/* Skip the rest of the scan if the source graph cannot be used */
+	if (buildstate->sourceFailed)
+		return;
+
 	/* Use memory context */
 	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
 
@@ -588,6 +1126,12 @@ BuildCallback(Relation index, ItemPointer tid, Datum *values,
 		SpinLockAcquire(&graph->lock);
 		pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_DONE, ++graph->indtuples);
 		SpinLockRelease(&graph->lock);
+
+		if (buildstate->logging)
+		{
+			buildstate->inserted++;
+			MaybeLogInsertProgress(buildstate);
+		}
 	}
 
 	/* Reset memory context */
@@ -609,10 +1153,15 @@ InitGraph(HnswGraph * graph, char *base, Size memoryTotal)
 	graph->memoryUsed = 0;
 	graph->memoryTotal = memoryTotal;
 	graph->flushed = false;
+	graph->segments = 0;
+	graph->merging = false;
+	graph->memoryPeak = 0;
 	graph->indtuples = 0;
+	pg_atomic_init_u32(&graph->elementCount, 0);
 	SpinLockInit(&graph->lock);
 	LWLockInitialize(&graph->entryLock, hnsw_lock_tranche_id);
 	LWLockInitialize(&graph->entryWaitLock, hnsw_lock_tranche_id);
+	pg_atomic_init_u32(&graph->entryWaiters, 0);
 	LWLockInitialize(&graph->allocatorLock, hnsw_lock_tranche_id);
 	LWLockInitialize(&graph->flushLock, hnsw_lock_tranche_id);
 }
@@ -648,18 +1197,33 @@ static void *
 HnswSharedMemoryAlloc(Size size, void *state)
 {
 	HnswBuildState *buildstate = (HnswBuildState *) state;
-	void	   *chunk = buildstate->hnswarea + buildstate->graph->memoryUsed;
+	void	   *chunk = buildstate->arena;
 
-	buildstate->graph->memoryUsed += MAXALIGN(size);
+	/* Space was reserved by ReserveMemory */
+	Assert(MAXALIGN(size) <= buildstate->arenaFree);
+
+	buildstate->arena += MAXALIGN(size);
+	buildstate->arenaFree -= MAXALIGN(size);
 	return chunk;
 }
 
+/*
+ * Get the max memory needed for an element, excluding its value
+ */
+static Size
+GetMaxElementSize(int m, int maxLevel)
+{
+	return MAXALIGN(sizeof(HnswElementData)) + HnswGetNeighborsSize(maxLevel, m);
+}
+
 /*
  * Initialize the build state
  */
 static void
 InitBuildState(HnswBuildState * buildstate, Relation heap, Relation index, IndexInfo *indexInfo, ForkNumber forkNum)
 {
+	int			maxDimensions;
+
 	buildstate->heap = heap;
 	buildstate->index = index;
 	buildstate->indexInfo = indexInfo;
@@ -682,10 +1246,19 @@ InitBuildState(HnswBuildState * buildstate, Relation heap, Relation index, Index
 				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 				 errmsg("column does not have dimensions")));
 
-	if (buildstate->dimensions > buildstate->typeInfo->maxDimensions)
+	/* Quantized values use one byte per dimension */
+	maxDimensions = buildstate->typeInfo->maxDimensions;
+	if (HnswGetQuantization(index) == HNSW_QUANTIZATION_INT8)
+		maxDimensions = HNSW_MAX_QUANTIZED_DIM;
+
+	/* Sketches are stored in addition to values */
+	if (HnswGetQuantization(index) == HNSW_QUANTIZATION_BINARY)
+		maxDimensions = HNSW_MAX_BINARY_DIM;
+
+	if (buildstate->dimensions > maxDimensions)
 		ereport(ERROR,
 				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
-				 errmsg("column cannot have more than %d dimensions for hnsw index", buildstate->typeInfo->maxDimensions)));
+				 errmsg("column cannot have more than %d dimensions for hnsw index", maxDimensions)));
 
 	if (buildstate->efConstruction < 2 * buildstate->m)
 		ereport(ERROR,
@@ -695,13 +1268,46 @@ InitBuildState(HnswBuildState * buildstate, Relation heap, Relation index, Index
 	buildstate->reltuples = 0;
 	buildstate->indtuples = 0;
 
-	/* Get support functions */
-	HnswInitSupport(&buildstate->support, index);
+	/* Get support functions */
+	HnswInitSupport(&buildstate->support, index);
+
+	/* Instrumentation */
+	buildstate->logging = hnsw_build_log_interval > 0;
+	memset(&buildstate->stats, 0, sizeof(buildstate->stats));
+	buildstate->inserted = 0;
+	INSTR_TIME_SET_CURRENT(buildstate->insertStart);
+	buildstate->lastLog = buildstate->insertStart;
+	INSTR_TIME_SET_ZERO(buildstate->entryLockWait);
+	INSTR_TIME_SET_ZERO(buildstate->elementLockWait);
+	if (buildstate->logging)
+	{
+		buildstate->support.stats = &buildstate->stats;
+		buildstate->support.lockWait = &buildstate->elementLockWait;
+	}
+
+	buildstate->partitioned = HnswGetPartitioned(index);
+	buildstate->partitions = NULL;
+	if (buildstate->partitioned)
+	{
+		if (!OidIsValid(buildstate->support.filterType))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("partitioned hnsw index requires a filter column")));
+
+		buildstate->partitions = partitionhash_create(CurrentMemoryContext, 256, NULL);
+	}
+
+	/* Snapshot scans do not support filters */
+	if (HnswGetSnapshot(index) && OidIsValid(buildstate->support.filterType))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("snapshot is not supported for hnsw indexes with filter columns")));
 
 	InitGraph(&buildstate->graphData, NULL, (Size) maintenance_work_mem * 1024L);
 	buildstate->graph = &buildstate->graphData;
 	buildstate->ml = HnswGetMl(buildstate->m);
 	buildstate->maxLevel = HnswGetMaxLevel(buildstate->m);
+	buildstate->maxElementSize = GetMaxElementSize(buildstate->m, buildstate->maxLevel);
 
 	buildstate->graphCtx = GenerationContextCreate(CurrentMemoryContext,
 												   "Hnsw build graph context",
@@ -715,9 +1321,27 @@ InitBuildState(HnswBuildState * buildstate, Relation heap, Relation index, Index
 
 	InitAllocator(&buildstate->allocator, &HnswMemoryContextAlloc, buildstate);
 
+	buildstate->sourceTids = NULL;
+	buildstate->sourceQuantization = HNSW_QUANTIZATION_NONE;
+	buildstate->sourceFailed = false;
+	buildstate->sourceRepair = NULL;
+	buildstate->sourceCtx = NULL;
+
 	buildstate->hnswleader = NULL;
 	buildstate->hnswshared = NULL;
 	buildstate->hnswarea = NULL;
+
+	buildstate->arena = NULL;
+	buildstate->arenaFree = 0;
+	buildstate->arenaSize = 0;
+	buildstate->arenaSegment = 0;
+
+	/* Reuse visited array across searches */
+	buildstate->visited.stamps = NULL;
+	buildstate->visited.size = 0;
+	buildstate->visited.generation = 0;
+	buildstate->visited.ctx = CurrentMemoryContext;
+	buildstate->support.visited = &buildstate->visited;
 }
 
 /*
@@ -728,6 +1352,12 @@ FreeBuildState(HnswBuildState * buildstate)
 {
 	MemoryContextDelete(buildstate->graphCtx);
 	MemoryContextDelete(buildstate->tmpCtx);
+
+	if (buildstate->visited.stamps != NULL)
+		pfree(buildstate->visited.stamps);
+
+	if (buildstate->partitions != NULL)
+		partitionhash_destroy(buildstate->partitions);
 }
 
 /*
@@ -781,6 +1411,9 @@ HnswParallelScanAndInsert(Relation heapRel, Relation indexRel, HnswShared * hnsw
 	buildstate.graph = &hnswshared->graphData;
 	buildstate.hnswarea = hnswarea;
 	InitAllocator(&buildstate.allocator, &HnswSharedMemoryAlloc, &buildstate);
+
+	/* Keep arenas small relative to the area so little memory is wasted */
+	buildstate.arenaSize = MAXALIGN_DOWN(Min(HNSW_MAX_ARENA_SIZE, buildstate.graph->memoryTotal / 64));
 	scan = table_beginscan_parallel(heapRel,
 									ParallelTableScanFromHnswShared(hnswshared));
 	reltuples = table_index_build_scan(heapRel, indexRel, indexInfo,
@@ -794,6 +1427,9 @@ HnswParallelScanAndInsert(Relation heapRel, Relation indexRel, HnswShared * hnsw
 	SpinLockRelease(&hnswshared->mutex);
 
 	/* Log statistics */
+	if (buildstate.logging)
+		LogInsertProgress(&buildstate);
+
 	if (progress)
 		ereport(DEBUG1, (errmsg("leader processed " INT64_FORMAT " tuples", (int64) reltuples)));
 	else
@@ -1041,6 +1677,10 @@ ComputeParallelWorkers(Relation heap, Relation index)
 {
 	int			parallel_workers;
 
+	/* Entry points for partitions are only tracked in local memory */
+	if (HnswGetPartitioned(index))
+		return 0;
+
 	/* Make sure it's safe to use parallel workers */
 	parallel_workers = plan_create_index_workers(RelationGetRelid(heap), RelationGetRelid(index));
 	if (parallel_workers == 0)
@@ -1054,6 +1694,481 @@ ComputeParallelWorkers(Relation heap, Relation index)
 	return max_parallel_maintenance_workers;
 }
 
+/*
+ * Reset the graph in memory
+ */
+static void
+ResetGraph(HnswBuildState * buildstate)
+{
+	MemoryContextReset(buildstate->graphCtx);
+	InitGraph(&buildstate->graphData, NULL, buildstate->graphData.memoryTotal);
+
+	if (buildstate->partitions != NULL)
+		partitionhash_reset(buildstate->partitions);
+}
+
+/*
+ * Free the state for the source graph
+ */
+static void
+FreeSourceGraph(HnswBuildState * buildstate)
+{
+	if (buildstate->sourceCtx != NULL)
+		MemoryContextDelete(buildstate->sourceCtx);
+
+	buildstate->sourceCtx = NULL;
+	buildstate->sourceTids = NULL;
+	buildstate->sourceRepair = NULL;
+}
+
+/*
+ * Check if indexes have the same columns, operator classes, and graph settings
+ */
+static bool
+SameGraphDefinition(Relation index, Relation source)
+{
+	int			natts = IndexRelationGetNumberOfKeyAttributes(index);
+
+	if (IndexRelationGetNumberOfKeyAttributes(source) != natts)
+		return false;
+
+	for (int i = 0; i < natts; i++)
+	{
+		if (index->rd_index->indkey.values[i] != source->rd_index->indkey.values[i] ||
+			index->rd_opfamily[i] != source->rd_opfamily[i] ||
+			index->rd_indcollation[i] != source->rd_indcollation[i])
+			return false;
+	}
+
+	if (TupleDescAttr(index->rd_att, 0)->atttypmod != TupleDescAttr(source->rd_att, 0)->atttypmod)
+		return false;
+
+	if (!equal(RelationGetIndexExpressions(index), RelationGetIndexExpressions(source)))
+		return false;
+
+	return HnswGetM(index) == HnswGetM(source) && HnswGetPartitioned(index) == HnswGetPartitioned(source);
+}
+
+/*
+ * Open the index to reuse the graph from
+ */
+static Relation
+OpenSourceIndex(HnswBuildState * buildstate)
+{
+	Relation	index = buildstate->index;
+	Relation	source;
+	Oid			sourceOid;
+
+	sourceOid = DatumGetObjectId(DirectFunctionCall1(regclassin, CStringGetDatum(hnsw_build_source_index)));
+
+	if (sourceOid == RelationGetRelid(index))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot reuse the graph of the index being built"),
+				 errhint("Use REINDEX CONCURRENTLY to reuse the graph of an existing index.")));
+
+	source = index_open(sourceOid, AccessShareLock);
+
+	if (source->rd_rel->relam != index->rd_rel->relam)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw index", RelationGetRelationName(source))));
+
+	if (source->rd_index->indrelid != index->rd_index->indrelid)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("source index \"%s\" must be on the same table", RelationGetRelationName(source))));
+
+	if (!SameGraphDefinition(index, source))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("source index \"%s\" must have the same columns, operator classes, m, and partitioned settings", RelationGetRelationName(source))));
+
+	return source;
+}
+
+/*
+ * Load an element from the source index
+ */
+static void
+LoadSourceElement(HnswBuildState * buildstate, HnswSupport * sourceSupport, HnswElementTuple etup, ItemPointer indextid, elementhash_hash * indexTids, elementhash_hash * neighborTids)
+{
+	HnswGraph  *graph = buildstate->graph;
+	char	   *base = buildstate->hnswarea;
+	HnswElementData loaded;
+	HnswElement element;
+	Pointer		loadedValue;
+	Size		valueSize;
+	ItemPointerData neighbortid;
+	bool		found;
+
+	/* Decodes quantized values */
+	HnswPtrStore(base, loaded.value, (Pointer) NULL);
+	HnswLoadElementFromTuple(&loaded, etup, sourceSupport, true, true);
+	loadedValue = HnswPtrAccess(base, loaded.value);
+	valueSize = VARSIZE_ANY(loadedValue);
+
+	/* Heap TIDs are added back as rows are found */
+	element = HnswInitElementWithLevel(base, NULL, buildstate->m, loaded.level, valueSize, &buildstate->allocator);
+	element->ordinal = pg_atomic_fetch_add_u32(&graph->elementCount, 1);
+	element->version = loaded.version;
+	element->filter = loaded.filter;
+	memcpy(HnswPtrAccess(base, element->value), loadedValue, valueSize);
+	LWLockInitialize(&element->lock, hnsw_lock_tranche_id);
+
+	AddElementInMemory(base, graph, element);
+
+	for (int i = 0; i < loaded.heaptidsLength; i++)
+		elementhash_insert(buildstate->sourceTids, loaded.heaptids[i], &found)->element = element;
+
+	elementhash_insert(indexTids, *indextid, &found)->element = element;
+
+	ItemPointerSet(&neighbortid, loaded.neighborPage, loaded.neighborOffno);
+	elementhash_insert(neighborTids, neighbortid, &found)->element = element;
+}
+
+/*
+ * Load the neighbors of an element from the source index
+ */
+static void
+LoadSourceNeighbors(HnswBuildState * buildstate, HnswElement element, HnswNeighborTuple ntup, elementhash_hash * indexTids)
+{
+	char	   *base = buildstate->hnswarea;
+	int			m = buildstate->m;
+	bool		repair = false;
+
+	/* Repair later if the neighbor tuple has been replaced */
+	if (ntup->version != element->version || ntup->count != (element->level + 2) * m)
+		repair = true;
+	else
+	{
+		for (int lc = element->level; lc >= 0; lc--)
+		{
+			HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+			int			lm = HnswGetLayerM(m, lc);
+			int			start = (element->level - lc) * m;
+
+			for (int i = 0; i < lm; i++)
+			{
+				ItemPointer indextid = &ntup->indextids[start + i];
+				ElementHashEntry *entry;
+				HnswCandidate *hc;
+
+				if (!ItemPointerIsValid(indextid))
+					continue;
+
+				/* Deleted elements are not loaded */
+				entry = elementhash_lookup(indexTids, *indextid);
+				if (entry == NULL)
+				{
+					repair = true;
+					continue;
+				}
+
+				hc = &neighbors->items[neighbors->length++];
+				HnswPtrStore(base, hc->element, entry->element);
+				hc->distance = HnswGetElementDistance(base, element, entry->element, &buildstate->support);
+				hc->closer = false;
+			}
+		}
+	}
+
+	if (repair)
+	{
+		MemoryContext oldCtx = MemoryContextSwitchTo(buildstate->sourceCtx);
+
+		buildstate->sourceRepair = bms_add_member(buildstate->sourceRepair, element->ordinal);
+		MemoryContextSwitchTo(oldCtx);
+	}
+}
+
+/*
+ * Set the entry points to the highest elements in memory
+ */
+static void
+SetEntryPointsInMemory(HnswBuildState * buildstate)
+{
+	HnswGraph  *graph = buildstate->graph;
+	char	   *base = buildstate->hnswarea;
+	HnswElementPtr iter = graph->head;
+
+	HnswPtrStore(base, graph->entryPoint, (HnswElement) NULL);
+	if (buildstate->partitions != NULL)
+		partitionhash_reset(buildstate->partitions);
+
+	while (!HnswPtrIsNull(base, iter))
+	{
+		HnswElement element = HnswPtrAccess(base, iter);
+		HnswElement entryPoint = GetEntryPointInMemory(buildstate, element);
+
+		iter = element->next;
+
+		if (entryPoint == NULL || element->level > entryPoint->level)
+			SetEntryPointInMemory(buildstate, element);
+	}
+}
+
+/*
+ * Load the graph from the source index
+ *
+ * Elements are loaded without heap TIDs, which are added back during the heap
+ * scan for rows with the same value, so the index stays correct if rows were
+ * changed or heap TIDs were reused. The graph is not used if it does not fit
+ * into memory.
+ */
+static void
+LoadSourceGraph(HnswBuildState * buildstate)
+{
+	Relation	source = OpenSourceIndex(buildstate);
+	HnswGraph  *graph = buildstate->graph;
+	HnswSupport sourceSupport;
+	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	elementhash_hash *indexTids;
+	elementhash_hash *neighborTids;
+	BlockNumber blkno;
+	bool		fits = true;
+	MemoryContext oldCtx;
+
+	HnswInitSupport(&sourceSupport, source);
+
+	buildstate->sourceQuantization = HnswGetQuantization(source);
+	buildstate->sourceCtx = AllocSetContextCreate(CurrentMemoryContext,
+												  "Hnsw build source context",
+												  ALLOCSET_DEFAULT_SIZES);
+	buildstate->sourceTids = elementhash_create(buildstate->sourceCtx, 1024, NULL);
+	indexTids = elementhash_create(buildstate->sourceCtx, 1024, NULL);
+	neighborTids = elementhash_create(buildstate->sourceCtx, 1024, NULL);
+
+	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
+
+	/* Load elements */
+	blkno = HNSW_HEAD_BLKNO;
+	while (BlockNumberIsValid(blkno) && fits)
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBufferExtended(source, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+			ItemPointerData indextid;
+
+			/* Skip neighbor tuples and deleted elements */
+			if (!HnswIsElementTuple(etup) || etup->deleted || !ItemPointerIsValid(&etup->heaptids[0]))
+				continue;
+
+			ItemPointerSet(&indextid, blkno, offno);
+			LoadSourceElement(buildstate, &sourceSupport, etup, &indextid, indexTids, neighborTids);
+
+			if (graph->memoryUsed >= graph->memoryTotal)
+			{
+				fits = false;
+				break;
+			}
+		}
+
+		blkno = HnswPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+
+		MemoryContextReset(buildstate->tmpCtx);
+	}
+
+	/* Load neighbors */
+	blkno = fits ? HNSW_HEAD_BLKNO : InvalidBlockNumber;
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBufferExtended(source, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswNeighborTuple ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, offno));
+			ItemPointerData neighbortid;
+			ElementHashEntry *entry;
+
+			if (!HnswIsNeighborTuple(ntup))
+				continue;
+
+			ItemPointerSet(&neighbortid, blkno, offno);
+			entry = elementhash_lookup(neighborTids, neighbortid);
+			if (entry != NULL)
+				LoadSourceNeighbors(buildstate, entry->element, ntup, indexTids);
+		}
+
+		blkno = HnswPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+
+	FreeAccessStrategy(bas);
+	index_close(source, AccessShareLock);
+
+	elementhash_destroy(indexTids);
+	elementhash_destroy(neighborTids);
+
+	if (!fits)
+	{
+		ereport(NOTICE,
+				(errmsg("hnsw graph of \"%s\" does not fit into maintenance_work_mem", hnsw_build_source_index),
+				 errdetail("Building without reusing the graph."),
+				 errhint("Increase maintenance_work_mem to reuse the graph.")));
+
+		FreeSourceGraph(buildstate);
+		ResetGraph(buildstate);
+		return;
+	}
+
+	SetEntryPointsInMemory(buildstate);
+}
+
+/*
+ * Repair an element in memory whose neighbors were removed
+ */
+static void
+RepairElementInMemory(HnswBuildState * buildstate, HnswElement element)
+{
+	char	   *base = buildstate->hnswarea;
+	HnswSupport *support = &buildstate->support;
+	int			m = buildstate->m;
+	HnswElement entryPoint = GetEntryPointInMemory(buildstate, element);
+
+	/* Skip if element is entry point */
+	if (entryPoint == element)
+		return;
+
+	for (int lc = element->level; lc >= 0; lc--)
+	{
+		HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+
+		neighbors->length = 0;
+		neighbors->closerSet = false;
+	}
+
+	/* Find neighbors for element, skipping itself */
+	HnswFindElementNeighbors(base, element, entryPoint, NULL, support, m, buildstate->efConstruction, true);
+
+	UpdateNeighborsInMemory(base, support, element, m, true);
+}
+
+/*
+ * Remove elements from the source index whose rows were not found, and
+ * repair elements that lost neighbors
+ */
+static void
+FinishSourceGraph(HnswBuildState * buildstate)
+{
+	HnswGraph  *graph = buildstate->graph;
+	char	   *base = buildstate->hnswarea;
+	HnswElement prev = NULL;
+	HnswElementPtr iter;
+	int64		removed = 0;
+	int64		repaired = 0;
+	MemoryContext oldCtx;
+
+	/* Remove from element list */
+	iter = graph->head;
+	while (!HnswPtrIsNull(base, iter))
+	{
+		HnswElement element = HnswPtrAccess(base, iter);
+
+		iter = element->next;
+
+		if (element->heaptidsLength == 0)
+		{
+			if (prev == NULL)
+				graph->head = element->next;
+			else
+				prev->next = element->next;
+
+			removed++;
+		}
+		else
+			prev = element;
+	}
+
+	/* Remove from neighbors */
+	oldCtx = MemoryContextSwitchTo(buildstate->sourceCtx);
+	iter = graph->head;
+	while (!HnswPtrIsNull(base, iter))
+	{
+		HnswElement element = HnswPtrAccess(base, iter);
+
+		iter = element->next;
+
+		for (int lc = element->level; lc >= 0; lc--)
+		{
+			HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+			int			length = 0;
+
+			for (int i = 0; i < neighbors->length; i++)
+			{
+				HnswElement neighborElement = HnswPtrAccess(base, neighbors->items[i].element);
+
+				if (neighborElement->heaptidsLength != 0)
+					neighbors->items[length++] = neighbors->items[i];
+			}
+
+			if (length < neighbors->length)
+			{
+				neighbors->length = length;
+				neighbors->closerSet = false;
+				buildstate->sourceRepair = bms_add_member(buildstate->sourceRepair, element->ordinal);
+			}
+		}
+	}
+	MemoryContextSwitchTo(oldCtx);
+
+	/* Entry points may have been removed */
+	SetEntryPointsInMemory(buildstate);
+
+	/* Repair elements */
+	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
+	iter = graph->head;
+	while (!HnswPtrIsNull(base, iter))
+	{
+		HnswElement element = HnswPtrAccess(base, iter);
+
+		iter = element->next;
+
+		if (!bms_is_member(element->ordinal, buildstate->sourceRepair))
+			continue;
+
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		RepairElementInMemory(buildstate, element);
+		repaired++;
+
+		MemoryContextReset(buildstate->tmpCtx);
+	}
+	MemoryContextSwitchTo(oldCtx);
+
+	ereport(DEBUG1,
+			(errmsg("reused hnsw graph of \"%s\", removed " INT64_FORMAT " elements and repaired " INT64_FORMAT " elements",
+					hnsw_build_source_index, removed, repaired)));
+
+	FreeSourceGraph(buildstate);
+}
+
 /*
  * Build graph
  */
@@ -1064,8 +2179,12 @@ BuildGraph(HnswBuildState * buildstate)
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_HNSW_PHASE_LOAD);
 
-	/* Calculate parallel workers */
-	if (buildstate->heap != NULL)
+	/* Reuse the graph from an existing index if set */
+	if (buildstate->heap != NULL && hnsw_build_source_index != NULL && hnsw_build_source_index[0] != '\0')
+		LoadSourceGraph(buildstate);
+
+	/* Calculate parallel workers (the source graph is only in local memory) */
+	if (buildstate->heap != NULL && buildstate->sourceTids == NULL)
 		parallel_workers = ComputeParallelWorkers(buildstate->heap, buildstate->index);
 
 	/* Attempt to launch parallel worker scan when required */
@@ -1078,15 +2197,48 @@ BuildGraph(HnswBuildState * buildstate)
 		if (buildstate->hnswleader)
 			buildstate->reltuples = ParallelHeapScan(buildstate);
 		else
+		{
 			buildstate->reltuples = table_index_build_scan(buildstate->heap, buildstate->index, buildstate->indexInfo,
 														   true, true, BuildCallback, (void *) buildstate, NULL);
 
+			if (buildstate->sourceFailed)
+			{
+				ereport(NOTICE,
+						(errmsg("hnsw graph no longer fits into maintenance_work_mem after " INT64_FORMAT " tuples", (int64) buildstate->graph->indtuples),
+						 errdetail("Building without reusing the graph of \"%s\".", hnsw_build_source_index),
+						 errhint("Increase maintenance_work_mem to reuse the graph.")));
+
+				FreeSourceGraph(buildstate);
+				ResetGraph(buildstate);
+				buildstate->sourceFailed = false;
+
+				buildstate->reltuples = table_index_build_scan(buildstate->heap, buildstate->index, buildstate->indexInfo,
+															   true, true, BuildCallback, (void *) buildstate, NULL);
+			}
+			else if (buildstate->sourceTids != NULL)
+				FinishSourceGraph(buildstate);
+		}
+
 		buildstate->indtuples = buildstate->graph->indtuples;
+
+		/* Parallel participants log their own progress */
+		if (buildstate->logging && !buildstate->hnswleader)
+			LogInsertProgress(buildstate);
 	}
 
-	/* Flush pages */
-	if (!buildstate->graph->flushed)
-		FlushPages(buildstate);
+	/* Write the last segment */
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_HNSW_PHASE_WRITE);
+	WriteSegment(buildstate, NULL);
+
+	if (buildstate->logging)
+	{
+		HnswGraph  *graph = buildstate->graph;
+
+		ereport(LOG,
+				(errmsg("hnsw build used at most %zu MB of %zu MB for the graph in %d segments",
+						Max(graph->memoryPeak, graph->memoryUsed) / (1024 * 1024),
+						graph->memoryTotal / (1024 * 1024), graph->segments)));
+	}
 
 	/* End parallel build */
 	if (buildstate->hnswleader)
@@ -1125,6 +2277,9 @@ hnswbuild(Relation heap, Relation index, IndexInfo *indexInfo)
 
 	BuildIndex(heap, index, indexInfo, &buildstate, MAIN_FORKNUM);
 
+	/* Export after the graph is on disk */
+	HnswExportSnapshot(index);
+
 	result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
 	result->heap_tuples = buildstate.reltuples;
 	result->index_tuples = buildstate.indtuples;
@@ -0,0 +1,493 @@
+#include "postgres.h"
+
+#include "hnsw.h"
+#include "storage/bufmgr.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+/* Rebuild after inserts reach this fraction of the cached elements */
+#define HNSW_UPPER_CACHE_STALE_FRACTION 8
+
+typedef struct HnswUpperElement
+{
+	BlockNumber blkno;
+	OffsetNumber offno;
+	uint8		level;
+	uint16		quantization;
+	uint32		neighbors;		/* index of the first neighbor at level */
+	Pointer		value;
+}			HnswUpperElement;
+
+/*
+ * Upper layers of the graph, from the entry point level down to minLevel
+ *
+ * The cache is a single allocation in the relcache entry, so it is freed
+ * with rd_amcache when the relcache entry is invalidated
+ */
+typedef struct HnswUpperCache
+{
+	int			cacheSize;		/* hnsw.upper_cache_size when loaded */
+	BlockNumber entryBlkno;
+	OffsetNumber entryOffno;
+	int			m;
+	int			maxLevel;
+	int			minLevel;
+	uint32		upperVersion;
+	uint32		upperInserts;
+	uint32		maxInserts;
+	bool		valid;
+	uint32		generation;
+	int			length;
+	HnswUpperElement *elements;
+	int32	   *neighbors;		/* m per layer, -1 terminated if fewer */
+	uint32	   *visited;
+}			HnswUpperCache;
+
+/*
+ * Element while loading the cache
+ */
+typedef struct HnswUpperLoadElement
+{
+	HnswElement element;
+	uint16		quantization;
+	Pointer		value;
+	Size		valueSize;
+	ItemPointerData *indextids; /* upper layer neighbors */
+}			HnswUpperLoadElement;
+
+typedef struct HnswUpperLoadState
+{
+	Relation	index;
+	int			m;
+	elementhash_hash *elements;
+	HnswUpperLoadElement *items;
+	int			length;
+	int			maxLength;
+}			HnswUpperLoadState;
+
+/*
+ * Load an element and its upper layer neighbors
+ */
+static bool
+LoadUpperElement(HnswUpperLoadState * state, HnswUpperLoadElement * item, BlockNumber blkno, OffsetNumber offno)
+{
+	Relation	index = state->index;
+	int			m = state->m;
+	Buffer		buf;
+	Page		page;
+	HnswElementTuple etup;
+	HnswNeighborTuple ntup;
+	HnswElement element;
+	bool		valid;
+
+	buf = ReadBuffer(index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+
+	etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+	/* Deleted elements have no value */
+	if (!HnswIsElementTuple(etup) || etup->deleted)
+	{
+		UnlockReleaseBuffer(buf);
+		return false;
+	}
+
+	element = HnswInitElementFromBlock(blkno, offno);
+	element->level = etup->level;
+	element->version = etup->version;
+	element->neighborPage = ItemPointerGetBlockNumber(&etup->neighbortid);
+	element->neighborOffno = ItemPointerGetOffsetNumber(&etup->neighbortid);
+
+	item->element = element;
+	item->quantization = etup->quantization;
+	item->valueSize = VARSIZE_ANY(&etup->data);
+	item->value = palloc(item->valueSize);
+	memcpy(item->value, &etup->data, item->valueSize);
+	item->indextids = NULL;
+
+	UnlockReleaseBuffer(buf);
+
+	if (element->level == 0)
+		return true;
+
+	buf = ReadBuffer(index, element->neighborPage);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+
+	ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, element->neighborOffno));
+
+	/* Upper layers come first */
+	valid = ntup->version == element->version && ntup->count == (element->level + 2) * m;
+	if (valid)
+	{
+		item->indextids = palloc(element->level * m * sizeof(ItemPointerData));
+		memcpy(item->indextids, ntup->indextids, element->level * m * sizeof(ItemPointerData));
+	}
+
+	UnlockReleaseBuffer(buf);
+
+	return valid;
+}
+
+/*
+ * Add an element to the cache if not already added
+ */
+static void
+AddUpperElement(HnswUpperLoadState * state, ItemPointer indextid, Size *size)
+{
+	ElementHashEntry *entry;
+	HnswUpperLoadElement *item;
+	bool		found;
+
+	entry = elementhash_insert(state->elements, *indextid, &found);
+	if (found)
+		return;
+
+	entry->element = NULL;
+
+	if (state->length == state->maxLength)
+	{
+		state->maxLength *= 2;
+		state->items = repalloc(state->items, state->maxLength * sizeof(HnswUpperLoadElement));
+	}
+
+	item = &state->items[state->length];
+	if (!LoadUpperElement(state, item, ItemPointerGetBlockNumber(indextid), ItemPointerGetOffsetNumber(indextid)))
+		return;
+
+	item->element->ordinal = state->length++;
+	entry->element = item->element;
+
+	*size += sizeof(HnswUpperElement) + sizeof(uint32) + MAXALIGN(item->valueSize) + item->element->level * state->m * sizeof(int32);
+}
+
+/*
+ * Find all elements in a layer, starting from the elements in higher layers
+ */
+static void
+LoadUpperLayer(HnswUpperLoadState * state, int lc, Size *size, Size maxSize)
+{
+	int			m = state->m;
+
+	/* Elements are appended while iterating, which can move items */
+	for (int i = 0; i < state->length && *size <= maxSize; i++)
+	{
+		HnswElement element = state->items[i].element;
+		ItemPointerData *indextids = state->items[i].indextids;
+
+		if (element->level < lc || indextids == NULL)
+			continue;
+
+		for (int j = 0; j < m; j++)
+		{
+			ItemPointer indextid = &indextids[(element->level - lc) * m + j];
+
+			if (!ItemPointerIsValid(indextid))
+				break;
+
+			AddUpperElement(state, indextid, size);
+		}
+	}
+}
+
+/*
+ * Get the number of upper layer inserts before the cache is rebuilt
+ */
+static uint32
+GetMaxInserts(int length, int m, int minLevel)
+{
+	/* Only about 1 in m^(l - 1) upper layer inserts reach layer l */
+	double		maxInserts = (double) length / HNSW_UPPER_CACHE_STALE_FRACTION;
+
+	for (int lc = 1; lc < minLevel && maxInserts < PG_UINT32_MAX; lc++)
+		maxInserts *= m;
+
+	return (uint32) Max(Min(maxInserts, (double) PG_UINT32_MAX), 1);
+}
+
+/*
+ * Copy the loaded layers into a single allocation
+ */
+static HnswUpperCache *
+CopyUpperCache(HnswUpperLoadState * state, HnswElement entryPoint, int minLevel, int length)
+{
+	Relation	index = state->index;
+	int			m = state->m;
+	int			nneighbors = 0;
+	Size		valuesSize = 0;
+	Size		size;
+	HnswUpperCache *cache;
+	char	   *ptr;
+	char	   *values;
+
+	for (int i = 0; i < length; i++)
+	{
+		HnswUpperLoadElement *item = &state->items[i];
+
+		if (item->element->level >= minLevel)
+			nneighbors += (item->element->level - minLevel + 1) * m;
+		valuesSize += MAXALIGN(item->valueSize);
+	}
+
+	size = MAXALIGN(sizeof(HnswUpperCache)) + MAXALIGN(length * sizeof(HnswUpperElement)) + MAXALIGN(nneighbors * sizeof(int32)) + MAXALIGN(length * sizeof(uint32)) + valuesSize;
+
+	ptr = MemoryContextAllocExtended(index->rd_indexcxt, size, MCXT_ALLOC_HUGE);
+	cache = (HnswUpperCache *) ptr;
+	ptr += MAXALIGN(sizeof(HnswUpperCache));
+	cache->elements = (HnswUpperElement *) ptr;
+	ptr += MAXALIGN(length * sizeof(HnswUpperElement));
+	cache->neighbors = (int32 *) ptr;
+	ptr += MAXALIGN(nneighbors * sizeof(int32));
+	cache->visited = (uint32 *) ptr;
+	ptr += MAXALIGN(length * sizeof(uint32));
+	values = ptr;
+
+	cache->entryBlkno = entryPoint->blkno;
+	cache->entryOffno = entryPoint->offno;
+	cache->m = m;
+	cache->maxLevel = entryPoint->level;
+	cache->minLevel = minLevel;
+	cache->valid = true;
+	cache->generation = 0;
+	cache->length = length;
+	cache->maxInserts = GetMaxInserts(length, m, minLevel);
+	memset(cache->visited, 0, length * sizeof(uint32));
+
+	nneighbors = 0;
+	for (int i = 0; i < length; i++)
+	{
+		HnswUpperLoadElement *item = &state->items[i];
+		HnswElement element = item->element;
+		HnswUpperElement *ue = &cache->elements[i];
+
+		ue->blkno = element->blkno;
+		ue->offno = element->offno;
+		ue->level = element->level;
+		ue->quantization = item->quantization;
+		ue->neighbors = nneighbors;
+		ue->value = values;
+		memcpy(values, item->value, item->valueSize);
+		values += MAXALIGN(item->valueSize);
+
+		if (element->level < minLevel)
+			continue;
+
+		for (int lc = element->level; lc >= minLevel; lc--)
+		{
+			int32	   *neighbors = &cache->neighbors[nneighbors];
+			int			n = 0;
+
+			for (int j = 0; item->indextids != NULL && j < m; j++)
+			{
+				ItemPointer indextid = &item->indextids[(element->level - lc) * m + j];
+				ElementHashEntry *entry;
+
+				if (!ItemPointerIsValid(indextid))
+					break;
+
+				/* Skip deleted elements and elements not in the layer */
+				entry = elementhash_lookup(state->elements, *indextid);
+				if (entry == NULL || entry->element == NULL || entry->element->ordinal >= (uint32) length || entry->element->level < lc)
+					continue;
+
+				neighbors[n++] = entry->element->ordinal;
+			}
+
+			for (; n < m; n++)
+				neighbors[n] = -1;
+
+			nneighbors += m;
+		}
+	}
+
+	return cache;
+}
+
+/*
+ * Load the upper layers, or as many as fit into hnsw.upper_cache_size
+ */
+static HnswUpperCache *
+LoadUpperCache(Relation index, HnswElement entryPoint, int m)
+{
+	HnswUpperLoadState state;
+	HnswUpperCache *cache;
+	MemoryContext loadCtx;
+	MemoryContext oldCtx;
+	ItemPointerData entrytid;
+	Size		maxSize = (Size) hnsw_upper_cache_size * 1024;
+	Size		size = 0;
+	int			minLevel = entryPoint->level + 1;
+	int			length = 0;
+
+	loadCtx = AllocSetContextCreate(CurrentMemoryContext,
+									"Hnsw upper cache load context",
+									ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(loadCtx);
+
+	state.index = index;
+	state.m = m;
+	state.elements = elementhash_create(loadCtx, 256, NULL);
+	state.length = 0;
+	state.maxLength = 256;
+	state.items = palloc(state.maxLength * sizeof(HnswUpperLoadElement));
+
+	ItemPointerSet(&entrytid, entryPoint->blkno, entryPoint->offno);
+	AddUpperElement(&state, &entrytid, &size);
+
+	/* Add layers until the size is exceeded */
+	if (state.length > 0 && state.items[0].element->level == entryPoint->level)
+	{
+		for (int lc = entryPoint->level; lc >= 1; lc--)
+		{
+			LoadUpperLayer(&state, lc, &size, maxSize);
+
+			if (size > maxSize)
+				break;
+
+			minLevel = lc;
+			length = state.length;
+		}
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+
+	/* Keep an empty cache so loading is not retried until stale */
+	cache = CopyUpperCache(&state, entryPoint, minLevel, length);
+	cache->cacheSize = hnsw_upper_cache_size;
+
+	MemoryContextDelete(loadCtx);
+
+	return cache;
+}
+
+/*
+ * Get the cached upper layers, loading them if needed
+ */
+static HnswUpperCache *
+GetUpperCache(Relation index, HnswElement entryPoint, int m, uint32 upperVersion, uint32 upperInserts)
+{
+	HnswUpperCache *cache = (HnswUpperCache *) index->rd_amcache;
+
+	if (cache != NULL)
+	{
+		if (cache->valid &&
+			cache->cacheSize == hnsw_upper_cache_size &&
+			cache->entryBlkno == entryPoint->blkno &&
+			cache->entryOffno == entryPoint->offno &&
+			cache->maxLevel == entryPoint->level &&
+			cache->m == m &&
+			cache->upperVersion == upperVersion &&
+			upperInserts - cache->upperInserts < cache->maxInserts)
+			return cache;
+
+		index->rd_amcache = NULL;
+		pfree(cache);
+	}
+
+	cache = LoadUpperCache(index, entryPoint, m);
+	cache->upperVersion = upperVersion;
+	cache->upperInserts = upperInserts;
+
+	index->rd_amcache = cache;
+	return cache;
+}
+
+/*
+ * Search a cached layer with ef = 1
+ *
+ * Matches HnswSearchLayer, which only moves to closer elements when ef is 1
+ */
+static void
+SearchUpperLayer(HnswUpperCache * cache, HnswQuery * q, HnswSupport * support, int lc, int *current, double *distance)
+{
+	int			m = cache->m;
+	bool		moved = true;
+
+	if (++cache->generation == 0)
+	{
+		memset(cache->visited, 0, cache->length * sizeof(uint32));
+		cache->generation = 1;
+	}
+
+	cache->visited[*current] = cache->generation;
+
+	while (moved)
+	{
+		HnswUpperElement *ue = &cache->elements[*current];
+		int32	   *neighbors = &cache->neighbors[ue->neighbors + (ue->level - lc) * m];
+
+		moved = false;
+
+		for (int i = 0; i < m; i++)
+		{
+			int32		ordinal = neighbors[i];
+			HnswUpperElement *ne;
+			double		ndistance;
+
+			if (ordinal < 0)
+				break;
+
+			if (cache->visited[ordinal] == cache->generation)
+				continue;
+
+			cache->visited[ordinal] = cache->generation;
+
+			ne = &cache->elements[ordinal];
+			ndistance = HnswGetStoredDistance(q->value, ne->value, ne->quantization, support);
+
+			if (ndistance < *distance)
+			{
+				*current = ordinal;
+				*distance = ndistance;
+				moved = true;
+			}
+		}
+	}
+}
+
+/*
+ * Descend the cached upper layers
+ *
+ * Returns the entry points for layer lc, or NIL if the cache cannot be used
+ * (in which case lc is not changed)
+ */
+List *
+HnswSearchUpperCache(Relation index, HnswQuery * q, HnswElement entryPoint, HnswSupport * support, int m, uint32 upperVersion, uint32 upperInserts, int *lc)
+{
+	HnswUpperCache *cache;
+	HnswUpperElement *ue;
+	HnswSearchCandidate *sc;
+	HnswElement element;
+	char	   *base = NULL;
+	int			current = 0;
+	double		distance;
+
+	if (hnsw_upper_cache_size == 0 || entryPoint->level == 0 || DatumGetPointer(q->value) == NULL)
+		return NIL;
+
+	cache = GetUpperCache(index, entryPoint, m, upperVersion, upperInserts);
+	if (cache->length == 0)
+		return NIL;
+
+	ue = &cache->elements[current];
+	distance = HnswGetStoredDistance(q->value, ue->value, ue->quantization, support);
+
+	for (int l = cache->maxLevel; l >= cache->minLevel; l--)
+		SearchUpperLayer(cache, q, support, l, &current, &distance);
+
+	/* Load the closest element from disk, which also gets heap TIDs */
+	ue = &cache->elements[current];
+	element = HnswInitElementFromBlock(ue->blkno, ue->offno);
+	sc = HnswEntryCandidate(base, element, q, index, support, false);
+
+	/* Element was deleted or replaced since the cache was loaded */
+	if (element->deleted || element->level < cache->minLevel)
+	{
+		cache->valid = false;
+		return NIL;
+	}
+
+	*lc = cache->minLevel - 1;
+	return list_make1(sc);
+}
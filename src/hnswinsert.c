@@ -140,7 +140,7 @@ HnswInsertAppendPage(Relation index, Buffer *nbuf, Page *npage, GenericXLogState
  * Add to element and neighbor pages
  */
 static void
-AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, BlockNumber *updatedInsertPage, bool building)
+AddElementOnDisk(Relation index, HnswSupport * support, HnswElement e, int m, BlockNumber insertPage, BlockNumber *updatedInsertPage, bool building)
 {
 	Buffer		buf;
 	Page		page;
@@ -162,7 +162,7 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 	char	   *base = NULL;
 
 	/* Calculate sizes */
-	etupSize = HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(HnswPtrAccess(base, e->value)));
+	etupSize = HnswGetElementTupleSize(base, e, support);
 	ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(e->level, m);
 	combinedSize = etupSize + ntupSize + sizeof(ItemIdData);
 	maxSize = HNSW_MAX_SIZE;
@@ -170,7 +170,7 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 
 	/* Prepare element tuple */
 	etup = palloc0(etupSize);
-	HnswSetElementTuple(base, etup, e);
+	HnswSetElementTuple(base, etup, e, support);
 
 	/* Prepare neighbor tuple */
 	ntup = palloc0(ntupSize);
@@ -432,6 +432,8 @@ GetUpdateIndex(HnswElement element, HnswElement newElement, float distance, int
 		HnswQuery	q;
 
 		q.value = HnswGetValue(base, element);
+		q.sketch = NULL;
+		q.filtered = false;
 
 		LoadElementsForInsert(neighbors, &q, &idx, index, support);
 
@@ -466,32 +468,43 @@ ConnectionExists(HnswElement e, HnswNeighborTuple ntup, int startIdx, int lm)
 }
 
 /*
- * Update neighbor
+ * Neighbor update, applied after all update indexes are calculated
  */
-static void
-UpdateNeighborOnDisk(HnswElement element, HnswElement newElement, int idx, int m, int lm, int lc, Relation index, bool checkExisting, bool building)
+typedef struct HnswNeighborUpdate
+{
+	HnswElement element;
+	int			idx;
+	int			lm;
+	int			lc;
+	int			order;
+}			HnswNeighborUpdate;
+
+/*
+ * Compare neighbor updates by page
+ */
+static int
+CompareNeighborUpdates(const void *a, const void *b)
+{
+	const		HnswNeighborUpdate *ua = (const HnswNeighborUpdate *) a;
+	const		HnswNeighborUpdate *ub = (const HnswNeighborUpdate *) b;
+
+	if (ua->element->neighborPage != ub->element->neighborPage)
+		return ua->element->neighborPage < ub->element->neighborPage ? -1 : 1;
+
+	/* Keep the original order within a page */
+	return ua->order - ub->order;
+}
+
+/*
+ * Update neighbor on a locked page
+ */
+static bool
+UpdateNeighborOnPage(Page page, HnswElement element, HnswElement newElement, int idx, int m, int lm, int lc, bool checkExisting)
 {
-	Buffer		buf;
-	Page		page;
-	GenericXLogState *state;
 	HnswNeighborTuple ntup;
 	int			startIdx;
 	OffsetNumber offno = element->neighborOffno;
 
-	/* Register page */
-	buf = ReadBuffer(index, element->neighborPage);
-	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
-	if (building)
-	{
-		state = NULL;
-		page = BufferGetPage(buf);
-	}
-	else
-	{
-		state = GenericXLogStart(index);
-		page = GenericXLogRegisterBuffer(state, buf, 0);
-	}
-
 	/* Get tuple */
 	ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, offno));
 
@@ -524,8 +537,48 @@ UpdateNeighborOnDisk(HnswElement element, HnswElement newElement, int idx, int m
 
 		/* Update neighbor on the buffer */
 		ItemPointerSet(indextid, newElement->blkno, newElement->offno);
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Update neighbors on a page
+ */
+static void
+UpdateNeighborsOnPage(HnswNeighborUpdate * updates, int nupdates, HnswElement newElement, int m, Relation index, bool checkExisting, bool building)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	bool		updated = false;
+
+	/* Register page */
+	buf = ReadBuffer(index, updates[0].element->neighborPage);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	if (building)
+	{
+		state = NULL;
+		page = BufferGetPage(buf);
+	}
+	else
+	{
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+	}
 
-		/* Commit */
+	for (int i = 0; i < nupdates; i++)
+	{
+		HnswNeighborUpdate *update = &updates[i];
+
+		if (UpdateNeighborOnPage(page, update->element, newElement, update->idx, m, update->lm, update->lc, checkExisting))
+			updated = true;
+	}
+
+	/* Commit */
+	if (updated)
+	{
 		if (building)
 			MarkBufferDirty(buf);
 		else
@@ -539,19 +592,34 @@ UpdateNeighborOnDisk(HnswElement element, HnswElement newElement, int idx, int m
 
 /*
  * Update neighbors
+ *
+ * Update indexes are calculated for all neighbors first, so updates to
+ * neighbors on the same page share a single lock and WAL record
  */
 void
 HnswUpdateNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e, int m, bool checkExisting, bool building)
 {
 	char	   *base = NULL;
+	HnswNeighborUpdate *updates;
+	int			nupdates = 0;
+	int			maxUpdates = 0;
+	MemoryContext updateCtx;
+
+	for (int lc = e->level; lc >= 0; lc--)
+		maxUpdates += HnswGetNeighbors(base, e, lc)->length;
+
+	if (maxUpdates == 0)
+		return;
+
+	updates = palloc(maxUpdates * sizeof(HnswNeighborUpdate));
 
 	/* Use separate memory context to improve performance for larger vectors */
-	MemoryContext updateCtx = GenerationContextCreate(CurrentMemoryContext,
-													  "Hnsw insert update context",
+	updateCtx = GenerationContextCreate(CurrentMemoryContext,
+										"Hnsw insert update context",
 #if PG_VERSION_NUM >= 150000
-													  128 * 1024, 128 * 1024,
+										128 * 1024, 128 * 1024,
 #endif
-													  128 * 1024);
+										128 * 1024);
 
 	for (int lc = e->level; lc >= 0; lc--)
 	{
@@ -562,6 +630,7 @@ HnswUpdateNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e,
 		{
 			HnswCandidate *hc = &neighbors->items[i];
 			HnswElement neighborElement = HnswPtrAccess(base, hc->element);
+			HnswNeighborUpdate *update;
 			int			idx;
 
 			idx = GetUpdateIndex(neighborElement, e, hc->distance, m, lm, lc, index, support, updateCtx);
@@ -570,11 +639,35 @@ HnswUpdateNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e,
 			if (idx == -1)
 				continue;
 
-			UpdateNeighborOnDisk(neighborElement, e, idx, m, lm, lc, index, checkExisting, building);
+			update = &updates[nupdates];
+			update->element = neighborElement;
+			update->idx = idx;
+			update->lm = lm;
+			update->lc = lc;
+			update->order = nupdates;
+			nupdates++;
 		}
 	}
 
 	MemoryContextDelete(updateCtx);
+
+	/* Group updates by page */
+	if (nupdates > 1)
+		qsort(updates, nupdates, sizeof(HnswNeighborUpdate), CompareNeighborUpdates);
+
+	for (int i = 0; i < nupdates;)
+	{
+		BlockNumber blkno = updates[i].element->neighborPage;
+		int			j = i + 1;
+
+		while (j < nupdates && updates[j].element->neighborPage == blkno)
+			j++;
+
+		UpdateNeighborsOnPage(&updates[i], j - i, e, m, index, checkExisting, building);
+		i = j;
+	}
+
+	pfree(updates);
 }
 
 /*
@@ -653,6 +746,10 @@ FindDuplicateOnDisk(Relation index, HnswElement element, bool building)
 		if (!datumIsEqual(value, neighborValue, false, -1))
 			return false;
 
+		/* Equal values with different filters need separate elements */
+		if (!HnswFilterEqual(&element->filter, &neighborElement->filter))
+			continue;
+
 		if (AddDuplicateOnDisk(index, element, neighborElement, building))
 			return true;
 	}
@@ -663,17 +760,20 @@ FindDuplicateOnDisk(Relation index, HnswElement element, bool building)
 /*
  * Update graph on disk
  */
-static void
-UpdateGraphOnDisk(Relation index, HnswSupport * support, HnswElement element, int m, HnswElement entryPoint, bool building)
+void
+HnswUpdateGraphOnDisk(Relation index, HnswSupport * support, HnswElement element, int m, HnswElement entryPoint, bool building)
 {
 	BlockNumber newInsertPage = InvalidBlockNumber;
 
-	/* Look for duplicate */
-	if (FindDuplicateOnDisk(index, element, building))
+	/*
+	 * Look for duplicate. Elements merged from an in-memory segment can
+	 * already have multiple heap TIDs, which cannot be moved to a duplicate.
+	 */
+	if (element->heaptidsLength == 1 && FindDuplicateOnDisk(index, element, building))
 		return;
 
 	/* Add element */
-	AddElementOnDisk(index, element, m, GetInsertPage(index), &newInsertPage, building);
+	AddElementOnDisk(index, support, element, m, GetInsertPage(index), &newInsertPage, building);
 
 	/* Update insert page if needed */
 	if (BlockNumberIsValid(newInsertPage))
@@ -684,19 +784,19 @@ UpdateGraphOnDisk(Relation index, HnswSupport * support, HnswElement element, in
 
 	/* Update entry point if needed */
 	if (entryPoint == NULL || element->level > entryPoint->level)
-		HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, element, InvalidBlockNumber, MAIN_FORKNUM, building);
+		HnswUpdateEntryPoint(index, HNSW_UPDATE_ENTRY_GREATER, &element->filter, element, MAIN_FORKNUM, building);
+	else if (element->level > 0 && !building)
+		HnswUpdateUpperVersion(index, false);
 }
 
 /*
  * Insert a tuple into the index
  */
 bool
-HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, ItemPointer heaptid, bool building)
+HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, HnswFilterData * filter, ItemPointer heaptid, int m, int efConstruction, bool building)
 {
 	HnswElement entryPoint;
 	HnswElement element;
-	int			m;
-	int			efConstruction = HnswGetEfConstruction(index);
 	LOCKMODE	lockmode = ShareLock;
 	char	   *base = NULL;
 
@@ -707,12 +807,13 @@ HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, ItemPo
 	 */
 	LockPage(index, HNSW_UPDATE_LOCK, lockmode);
 
-	/* Get m and entry point */
-	HnswGetMetaPageInfo(index, &m, &entryPoint);
-
 	/* Create an element */
-	element = HnswInitElement(base, heaptid, m, HnswGetMl(m), HnswGetMaxLevel(m), NULL);
+	element = HnswInitElement(base, heaptid, m, HnswGetMl(m), HnswGetMaxLevel(m), 0, NULL);
 	HnswPtrStore(base, element->value, DatumGetPointer(value));
+	element->filter = *filter;
+
+	/* Get entry point (for the partition if partitioned) */
+	entryPoint = HnswGetEntryPoint(index, filter);
 
 	/* Prevent concurrent inserts when likely updating entry point */
 	if (entryPoint == NULL || element->level > entryPoint->level)
@@ -725,14 +826,14 @@ HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, ItemPo
 		LockPage(index, HNSW_UPDATE_LOCK, lockmode);
 
 		/* Get latest entry point after lock is acquired */
-		entryPoint = HnswGetEntryPoint(index);
+		entryPoint = HnswGetEntryPoint(index, filter);
 	}
 
 	/* Find neighbors for element */
 	HnswFindElementNeighbors(base, element, entryPoint, index, support, m, efConstruction, false);
 
 	/* Update graph on disk */
-	UpdateGraphOnDisk(index, support, element, m, entryPoint, building);
+	HnswUpdateGraphOnDisk(index, support, element, m, entryPoint, building);
 
 	/* Release lock */
 	UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
@@ -740,23 +841,64 @@ HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, ItemPo
 	return true;
 }
 
+/*
+ * Get the insert state for the statement
+ *
+ * Support functions and metapage info do not change after the index is
+ * built, so look them up once instead of for each row
+ */
+static HnswInsertState *
+GetInsertState(Relation index, IndexInfo *indexInfo)
+{
+	HnswInsertState *insertstate = (HnswInsertState *) indexInfo->ii_AmCache;
+	MemoryContext oldCtx;
+
+	if (insertstate != NULL)
+		return insertstate;
+
+	oldCtx = MemoryContextSwitchTo(indexInfo->ii_Context);
+
+	insertstate = palloc(sizeof(HnswInsertState));
+	insertstate->typeInfo = HnswGetTypeInfo(index);
+	HnswInitSupport(&insertstate->support, index);
+	HnswGetMetaPageInfo(index, &insertstate->m, NULL);
+	insertstate->efConstruction = HnswGetEfConstruction(index);
+	insertstate->partitioned = HnswIsPartitioned(index);
+
+	/* Scans cannot use the snapshot once the graph changes */
+	HnswClearSnapshot(index);
+
+	insertstate->tmpCtx = AllocSetContextCreate(indexInfo->ii_Context,
+												"Hnsw insert temporary context",
+												ALLOCSET_DEFAULT_SIZES);
+
+	MemoryContextSwitchTo(oldCtx);
+
+	indexInfo->ii_AmCache = insertstate;
+	return insertstate;
+}
+
 /*
  * Insert a tuple into the index
  */
 static void
-HnswInsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid)
+HnswInsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, HnswInsertState * insertstate)
 {
 	Datum		value;
-	const		HnswTypeInfo *typeInfo = HnswGetTypeInfo(index);
-	HnswSupport support;
-
-	HnswInitSupport(&support, index);
+	HnswFilterData filter;
+	HnswSupport *support = &insertstate->support;
 
 	/* Form index value */
-	if (!HnswFormIndexValue(&value, values, isnull, typeInfo, &support))
+	if (!HnswFormIndexValue(&value, values, isnull, insertstate->typeInfo, support))
+		return;
+
+	HnswFormFilterValue(&filter, values, isnull, support);
+
+	/* Partitioned indexes are only scanned with a filter value */
+	if (filter.isnull && insertstate->partitioned)
 		return;
 
-	HnswInsertTupleOnDisk(index, &support, value, heaptid, false);
+	HnswInsertTupleOnDisk(index, support, value, &filter, heaptid, insertstate->m, insertstate->efConstruction, false);
 }
 
 /*
@@ -771,25 +913,23 @@ hnswinsert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
 		   ,IndexInfo *indexInfo
 )
 {
+	HnswInsertState *insertstate;
 	MemoryContext oldCtx;
-	MemoryContext insertCtx;
 
 	/* Skip nulls */
 	if (isnull[0])
 		return false;
 
-	/* Create memory context */
-	insertCtx = AllocSetContextCreate(CurrentMemoryContext,
-									  "Hnsw insert temporary context",
-									  ALLOCSET_DEFAULT_SIZES);
-	oldCtx = MemoryContextSwitchTo(insertCtx);
+	/* Reuse state across rows of the statement */
+	insertstate = GetInsertState(index, indexInfo);
+	oldCtx = MemoryContextSwitchTo(insertstate->tmpCtx);
 
 	/* Insert tuple */
-	HnswInsertTuple(index, values, isnull, heap_tid);
+	HnswInsertTuple(index, values, isnull, heap_tid, insertstate);
 
-	/* Delete memory context */
+	/* Reset memory context */
 	MemoryContextSwitchTo(oldCtx);
-	MemoryContextDelete(insertCtx);
+	MemoryContextReset(insertstate->tmpCtx);
 
 	return false;
 }
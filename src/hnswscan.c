@@ -1,12 +1,182 @@
 #include "postgres.h"
 
+#include "access/genam.h"
+#include "access/htup_details.h"
 #include "access/relscan.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "catalog/index.h"
+#include "catalog/pg_class.h"
+#include "executor/executor.h"
+#include "funcapi.h"
 #include "hnsw.h"
+#include "miscadmin.h"
 #include "pgstat.h"
 #include "storage/bufmgr.h"
 #include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/float.h"
+#include "utils/format_type.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+/*
+ * Compare candidate distances for re-ranking, furthest first
+ */
+static int
+CompareRerankCandidates(const ListCell *a, const ListCell *b)
+{
+	HnswSearchCandidate *sca = lfirst(a);
+	HnswSearchCandidate *scb = lfirst(b);
+
+	if (sca->distance < scb->distance)
+		return 1;
+
+	if (sca->distance > scb->distance)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Get the exact distance for an element from the first visible heap tuple
+ */
+static bool
+GetExactDistance(IndexScanDesc scan, HnswElement element, Datum value, double *distance)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	PGFunction	normalize = so->support.normprocinfo != NULL ? so->typeInfo->normalize : NULL;
+
+	for (int i = 0; i < element->heaptidsLength; i++)
+	{
+		if (VectorRerankDistance(&so->heapRerank, scan, &element->heaptids[i], so->support.procinfo, so->support.collation, normalize, value, distance))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Get the exact distance for an element from its index tuple
+ */
+static bool
+GetIndexDistance(IndexScanDesc scan, HnswElement element, double *distance)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	Buffer		buf;
+	Page		page;
+	HnswElementTuple etup;
+	bool		found;
+
+	buf = ReadBuffer(scan->indexRelation, element->blkno);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+
+	etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, element->offno));
+
+	/* Element may have been replaced since it was loaded */
+	found = HnswIsElementTuple(etup) && !etup->deleted && etup->version == element->version;
+	if (found)
+		*distance = HnswGetStoredDistance(so->q.value, (Pointer) &etup->data, etup->quantization, &so->support);
+
+	UnlockReleaseBuffer(buf);
+
+	return found;
+}
+
+/*
+ * Re-rank candidates from sketches with exact distances
+ *
+ * Binary quantization keeps the original values in the index, so this reads
+ * the element tuples instead of the heap. Must be called with the scan lock.
+ */
+static List *
+RerankSketchItems(IndexScanDesc scan, List *w)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	char	   *base = NULL;
+	ListCell   *lc;
+
+	if (so->q.sketch == NULL || !hnsw_quantized_rerank || list_length(w) == 0)
+		return w;
+
+	/* Keep the estimated distance for elements that were replaced */
+	foreach(lc, w)
+	{
+		HnswSearchCandidate *sc = lfirst(lc);
+		HnswElement element = HnswPtrAccess(base, sc->element);
+		double		distance;
+
+		/* Skip elements that will not be returned */
+		if (element->heaptidsLength == 0 || !HnswFilterMatches(&so->q, element))
+			continue;
+
+		if (GetIndexDistance(scan, element, &distance))
+		{
+			sc->distance = distance;
+			so->stats.distances++;
+		}
+	}
+
+	/* Nearest is last */
+	list_sort(w, CompareRerankCandidates);
+
+	return w;
+}
+
+/*
+ * Re-rank candidates from quantized values with exact distances
+ */
+static List *
+RerankScanItems(IndexScanDesc scan, List *w)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	char	   *base = NULL;
+	ListCell   *lc;
+
+	if (so->support.quantization != HNSW_QUANTIZATION_INT8 || !hnsw_quantized_rerank)
+		return w;
+
+	if (DatumGetPointer(so->q.value) == NULL || list_length(w) == 0)
+		return w;
+
+	/* Set up heap access on first use, outside of tmpCtx since reset on rescan */
+	if (so->heapRerank.fetch == NULL)
+	{
+		MemoryContext oldCtx = MemoryContextSwitchTo(GetMemoryChunkContext(so));
+
+		VectorRerankBegin(&so->heapRerank, scan);
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	/* Keep the quantized distance for elements with no visible tuples */
+	foreach(lc, w)
+	{
+		HnswSearchCandidate *sc = lfirst(lc);
+		HnswElement element = HnswPtrAccess(base, sc->element);
+		double		distance;
+
+		/* Skip heap fetches for elements that will not be returned */
+		if (!HnswFilterMatches(&so->q, element))
+			continue;
+
+		if (GetExactDistance(scan, element, so->q.value, &distance))
+		{
+			sc->distance = distance;
+			so->stats.distances++;
+		}
+	}
+
+	ExecClearTuple(so->heapRerank.slot);
+
+	/* Nearest is last */
+	list_sort(w, CompareRerankCandidates);
+
+	return w;
+}
 
 /*
  * Algorithm 5 from paper
@@ -17,25 +187,57 @@ GetScanItems(IndexScanDesc scan, Datum value)
 	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
 	Relation	index = scan->indexRelation;
 	HnswSupport *support = &so->support;
-	List	   *ep;
+	List	   *ep = NIL;
 	List	   *w;
 	int			m;
+	uint32		upperVersion;
+	uint32		upperInserts;
+	bool		partitioned;
+	uint32		snapshotId;
 	HnswElement entryPoint;
 	char	   *base = NULL;
 	HnswQuery  *q = &so->q;
+	int			lc;
 
-	/* Get m and entry point */
-	HnswGetMetaPageInfo(index, &m, &entryPoint);
+	HnswGetScanMetaPageInfo(index, &m, &upperVersion, &upperInserts, &partitioned, &snapshotId);
 
 	q->value = value;
+	q->sketch = NULL;
 	so->m = m;
 
+	/* Traverse the snapshot if it still matches the graph */
+	if (snapshotId == 0)
+		HnswReleaseSnapshot(index);
+	else if (HnswGetSnapshot(index) && !q->filtered &&
+			 DatumGetPointer(value) != NULL && hnsw_iterative_scan == HNSW_ITERATIVE_SCAN_OFF &&
+			 HnswSearchSnapshot(index, q, support, m, snapshotId, &w))
+		return w;
+
+	/* Get entry point (for the partition if partitioned) */
+	entryPoint = HnswGetEntryPoint(index, q->filtered ? &q->filter : NULL);
+
+	/* Score elements with sketches and re-rank with the values */
+	if (support->quantization == HNSW_QUANTIZATION_BINARY && DatumGetPointer(value) != NULL)
+	{
+		Vector	   *vec = (Vector *) DatumGetPointer(value);
+
+		q->sketch = palloc(HNSW_BINARY_SKETCH_SIZE(vec->dim));
+		HnswSketchValue(vec, q->sketch);
+	}
+
 	if (entryPoint == NULL)
 		return NIL;
 
-	ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, support, false));
+	lc = entryPoint->level;
+
+	/* Partitions have separate upper layers */
+	if (!partitioned)
+		ep = HnswSearchUpperCache(index, q, entryPoint, support, m, upperVersion, upperInserts, &lc);
+
+	if (ep == NIL)
+		ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, support, false));
 
-	for (int lc = entryPoint->level; lc >= 1; lc--)
+	for (; lc >= 1; lc--)
 	{
 		w = HnswSearchLayer(base, q, ep, 1, lc, index, support, m, false, NULL, NULL, NULL, true, NULL);
 		ep = w;
@@ -102,6 +304,42 @@ GetScanValue(IndexScanDesc scan)
 	return value;
 }
 
+/*
+ * Get scan filter, returns false if no tuples can match
+ */
+static bool
+GetScanFilter(IndexScanDesc scan)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	HnswQuery  *q = &so->q;
+
+	q->filtered = false;
+
+	for (int i = 0; i < scan->numberOfKeys; i++)
+	{
+		ScanKey		key = &scan->keyData[i];
+		int64		value;
+
+		/* Equality with null is never true */
+		if (key->sk_flags & SK_ISNULL)
+			return false;
+
+		Assert(key->sk_attno == 2);
+
+		value = HnswGetFilterValue(&so->support, key->sk_argument);
+
+		/* Conflicting keys */
+		if (q->filtered && q->filter.value != value)
+			return false;
+
+		q->filtered = true;
+		q->filter.value = value;
+		q->filter.isnull = false;
+	}
+
+	return true;
+}
+
 #if defined(HNSW_MEMORY)
 /*
  * Show memory usage
@@ -109,7 +347,7 @@ GetScanValue(IndexScanDesc scan)
 static void
 ShowMemoryUsage(HnswScanOpaque so)
 {
-	elog(INFO, "memory: %zu KB, tuples: " INT64_FORMAT, MemoryContextMemAllocated(so->tmpCtx, false) / 1024, so->tuples);
+	elog(INFO, "memory: %zu KB, tuples: " INT64_FORMAT, MemoryContextMemAllocated(so->tmpCtx, true) / 1024, so->tuples);
 }
 #endif
 
@@ -127,10 +365,15 @@ hnswbeginscan(Relation index, int nkeys, int norderbys)
 
 	so = (HnswScanOpaque) palloc(sizeof(HnswScanOpaqueData));
 	so->typeInfo = HnswGetTypeInfo(index);
+	so->q.sketch = NULL;
 
 	/* Set support functions */
 	HnswInitSupport(&so->support, index);
 
+	/* Kept across rescans */
+	MemSet(&so->stats, 0, sizeof(VectorScanStats));
+	so->support.stats = &so->stats;
+
 	/*
 	 * Use a lower max allocation size than default to allow scanning more
 	 * tuples for iterative search before exceeding work_mem
@@ -144,6 +387,8 @@ hnswbeginscan(Relation index, int nkeys, int norderbys)
 	maxMemory = (double) work_mem * hnsw_scan_mem_multiplier * 1024.0 + 256;
 	so->maxMemory = Min(maxMemory, (double) SIZE_MAX);
 
+	so->heapRerank.fetch = NULL;
+
 	scan->opaque = so;
 
 	return scan;
@@ -165,6 +410,20 @@ hnswrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int no
 	so->previousDistance = -get_float8_infinity();
 	MemoryContextReset(so->tmpCtx);
 
+	/*
+	 * Candidates and elements have fixed sizes, so slabs avoid rounding up
+	 * to a power of two and reuse memory freed by iterative scans. They are
+	 * children of tmpCtx, so the reset deletes them.
+	 */
+	so->support.candidateCtx = SlabContextCreate(so->tmpCtx,
+												 "Hnsw scan candidate context",
+												 SLAB_DEFAULT_BLOCK_SIZE,
+												 sizeof(HnswSearchCandidate));
+	so->support.elementCtx = SlabContextCreate(so->tmpCtx,
+											   "Hnsw scan element context",
+											   SLAB_DEFAULT_BLOCK_SIZE,
+											   sizeof(HnswElementData));
+
 	if (keys && scan->numberOfKeys > 0)
 		memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
 
@@ -190,6 +449,7 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 	if (so->first)
 	{
 		Datum		value;
+		BufferUsage bufferUsage = pgBufferUsage;
 
 		/* Count index scan for stats */
 		pgstat_count_index_scan(scan->indexRelation);
@@ -197,6 +457,7 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 		if (scan->instrument)
 			scan->instrument->nsearches++;
 #endif
+		so->stats.scans++;
 
 		/* Safety check */
 		if (scan->orderByData == NULL)
@@ -210,16 +471,27 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 		/* Get scan value */
 		value = GetScanValue(scan);
 
-		/*
-		 * Get a shared lock. This allows vacuum to ensure no in-flight scans
-		 * before marking tuples as deleted.
-		 */
-		LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+		if (GetScanFilter(scan))
+		{
+			/*
+			 * Get a shared lock. This allows vacuum to ensure no in-flight
+			 * scans before marking tuples as deleted.
+			 */
+			LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+
+			so->w = GetScanItems(scan, value);
+			so->w = RerankSketchItems(scan, so->w);
+
+			/* Release shared lock */
+			UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
-		so->w = GetScanItems(scan, value);
+			/* Only count index buffers, not heap buffers for re-ranking */
+			VectorScanStatsAddBufferUsage(&so->stats, &bufferUsage);
 
-		/* Release shared lock */
-		UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+			so->w = RerankScanItems(scan, so->w);
+		}
+		else
+			so->w = NIL;
 
 		so->first = false;
 
@@ -245,7 +517,7 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 				break;
 
 			/* Reached max number of tuples or memory limit */
-			if (so->tuples >= hnsw_max_scan_tuples || MemoryContextMemAllocated(so->tmpCtx, false) > so->maxMemory)
+			if (so->tuples >= hnsw_max_scan_tuples || MemoryContextMemAllocated(so->tmpCtx, true) > so->maxMemory)
 			{
 				if (pairingheap_is_empty(so->discarded))
 					break;
@@ -255,6 +527,8 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 			}
 			else
 			{
+				BufferUsage bufferUsage = pgBufferUsage;
+
 				/*
 				 * Locking ensures when neighbors are read, the elements they
 				 * reference will not be deleted (and replaced) during the
@@ -267,9 +541,17 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 				LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
 				so->w = ResumeScanItems(scan);
+				so->w = RerankSketchItems(scan, so->w);
 
 				UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
+				/* Only count index buffers */
+				VectorScanStatsAddBufferUsage(&so->stats, &bufferUsage);
+
+				so->w = RerankScanItems(scan, so->w);
+
+				so->stats.resumes++;
+
 #if defined(HNSW_MEMORY)
 				ShowMemoryUsage(so);
 #endif
@@ -282,8 +564,8 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 		sc = llast(so->w);
 		element = HnswPtrAccess(base, sc->element);
 
-		/* Move to next element if no valid heap TIDs */
-		if (element->heaptidsLength == 0)
+		/* Move to next element if no valid heap TIDs or filtered out */
+		if (element->heaptidsLength == 0 || !HnswFilterMatches(&so->q, element))
 		{
 			so->w = list_delete_last(so->w);
 
@@ -327,8 +609,201 @@ hnswendscan(IndexScanDesc scan)
 {
 	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
 
+	/* Add to cumulative stats */
+	VectorScanStatsFlush(VECTOR_SCAN_STATS_HNSW, &so->stats);
+
+	/* Release heap access for re-ranking */
+	VectorRerankEnd(&so->heapRerank);
+
 	MemoryContextDelete(so->tmpCtx);
 
 	pfree(so);
 	scan->opaque = NULL;
 }
+
+/* Result of a batch search */
+typedef struct HnswBatchResult
+{
+	int32		query;
+	int32		rank;
+	ItemPointerData tid;
+}			HnswBatchResult;
+
+/*
+ * Search for the nearest visible rows of each query with a single scan
+ *
+ * Reusing the scan shares its setup, support functions, and heap access
+ * across queries, and each backend caches the upper layers, so only the
+ * search at layer 0 is repeated.
+ */
+static HnswBatchResult *
+SearchBatch(Relation index, Relation heap, ArrayType *queries, int k, int *nresults)
+{
+	Snapshot	snapshot = GetActiveSnapshot();
+	IndexScanDesc scan;
+	IndexFetchTableData *heapFetch;
+	TupleTableSlot *slot;
+	ScanKeyData orderby;
+	Datum	   *values;
+	bool	   *nulls;
+	int			nqueries;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	HnswBatchResult *results;
+	int			size = 64;
+	int			n = 0;
+
+	get_typlenbyvalalign(ARR_ELEMTYPE(queries), &typlen, &typbyval, &typalign);
+	deconstruct_array(queries, ARR_ELEMTYPE(queries), typlen, typbyval, typalign, &values, &nulls, &nqueries);
+
+	scan = hnswbeginscan(index, 0, 1);
+	scan->heapRelation = heap;
+	scan->xs_snapshot = snapshot;
+
+	heapFetch = table_index_fetch_begin(heap);
+	slot = table_slot_create(heap, NULL);
+	results = palloc(sizeof(HnswBatchResult) * size);
+
+	for (int i = 0; i < nqueries; i++)
+	{
+		int			rank = 0;
+
+		/* Null has no nearest neighbors */
+		if (nulls[i])
+			continue;
+
+		MemSet(&orderby, 0, sizeof(ScanKeyData));
+		orderby.sk_argument = PointerGetDatum(PG_DETOAST_DATUM(values[i]));
+		hnswrescan(scan, NULL, 0, &orderby, 1);
+
+		while (rank < k && hnswgettuple(scan, ForwardScanDirection))
+		{
+			bool		call_again = false;
+			bool		all_dead = false;
+
+			/* Skip tuples that are not visible, like the executor */
+			if (!table_index_fetch_tuple(heapFetch, &scan->xs_heaptid, snapshot, slot, &call_again, &all_dead))
+				continue;
+
+			if (n == size)
+			{
+				size *= 2;
+				results = repalloc_huge(results, sizeof(HnswBatchResult) * size);
+			}
+
+			results[n].query = i + 1;
+			results[n].rank = ++rank;
+			results[n].tid = slot->tts_tid;
+			n++;
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	ExecDropSingleTupleTableSlot(slot);
+	table_index_fetch_end(heapFetch);
+	hnswendscan(scan);
+	IndexScanEnd(scan);
+
+	*nresults = n;
+	return results;
+}
+
+/*
+ * Get the k nearest rows for each query vector
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(hnsw_search_batch);
+Datum
+hnsw_search_batch(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	HnswBatchResult *results;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		Oid			indexOid = PG_GETARG_OID(0);
+		ArrayType  *queries = PG_GETARG_ARRAYTYPE_P(1);
+		int32		k = PG_GETARG_INT32(2);
+		char	   *indexName;
+		Oid			heapOid;
+		MemoryContext oldCtx;
+		TupleDesc	tupdesc;
+		Relation	heap;
+		Relation	index;
+		AclResult	aclresult;
+		int			nresults;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldCtx = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		if (k < 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("k must be greater than zero")));
+
+		indexName = get_rel_name(indexOid);
+		if (indexName == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("index with OID %u does not exist", indexOid)));
+
+		if (get_rel_relkind(indexOid) != RELKIND_INDEX)
+			ereport(ERROR,
+					(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+					 errmsg("\"%s\" is not an hnsw index", indexName)));
+
+		/* Returns rows, so requires the same privilege as selecting them */
+		heapOid = IndexGetRelation(indexOid, false);
+		aclresult = pg_class_aclcheck(heapOid, GetUserId(), ACL_SELECT);
+		if (aclresult != ACLCHECK_OK)
+			aclcheck_error(aclresult, OBJECT_TABLE, get_rel_name(heapOid));
+
+		/* Lock the table before the index, like the executor */
+		heap = table_open(heapOid, AccessShareLock);
+		index = index_open(indexOid, AccessShareLock);
+
+		if (index->rd_indam->amgettuple != hnswgettuple)
+			ereport(ERROR,
+					(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+					 errmsg("\"%s\" is not an hnsw index", RelationGetRelationName(index))));
+
+		if (ARR_ELEMTYPE(queries) != index->rd_opcintype[0])
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+					 errmsg("queries must be an array of %s", format_type_be(index->rd_opcintype[0]))));
+
+		results = SearchBatch(index, heap, queries, k, &nresults);
+
+		index_close(index, AccessShareLock);
+		table_close(heap, AccessShareLock);
+
+		funcctx->user_fctx = results;
+		funcctx->max_calls = nresults;
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	results = (HnswBatchResult *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		HnswBatchResult *result = &results[funcctx->call_cntr];
+		Datum		values[3];
+		bool		nulls[3] = {0};
+
+		values[0] = Int32GetDatum(result->query);
+		values[1] = Int32GetDatum(result->rank);
+		values[2] = PointerGetDatum(&result->tid);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
@@ -0,0 +1,1607 @@
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include "access/generic_xlog.h"
+#include "access/table.h"
+#include "access/xact.h"
+#include "catalog/index.h"
+#include "catalog/objectaccess.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_database.h"
+#include "common/relpath.h"
+#include "hnsw.h"
+#include "lib/pairingheap.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/fd.h"
+#include "storage/lmgr.h"
+#include "storage/procarray.h"
+#include "utils/acl.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
+
+#define HNSW_SNAPSHOT_DIR		"pg_hnsw"
+#define HNSW_SNAPSHOT_MAGIC_NUMBER 0xA953A955
+#define HNSW_SNAPSHOT_VERSION	2
+
+/*
+ * Read-only copy of the graph that scans traverse without buffer access
+ *
+ * The file has the header, the elements, the neighbor slots (m for each
+ * upper layer and 2 * m for the ground layer, -1 if unused), the heap TIDs,
+ * and the values. Offsets are from the start of the file.
+ */
+typedef struct HnswSnapshotHeader
+{
+	uint32		magicNumber;
+	uint32		version;
+	uint32		snapshotId;
+	uint32		m;
+	uint32		length;
+	int32		entry;			/* -1 if empty */
+	Oid			spcOid;			/* tablespace of the index */
+	Oid			relNumber;		/* relfilenode of the index */
+	uint64		neighborsOffset;
+	uint64		heaptidsOffset;
+	uint64		valuesOffset;
+	uint64		size;
+}			HnswSnapshotHeader;
+
+typedef struct HnswSnapshotElement
+{
+	uint64		neighbors;		/* index of the first neighbor slot */
+	uint64		heaptids;		/* index of the first heap TID */
+	uint64		value;			/* offset of the value */
+	BlockNumber blkno;
+	uint32		valueSize;
+	OffsetNumber offno;
+	uint16		quantization;
+	uint8		level;
+	uint8		heaptidsLength;
+}			HnswSnapshotElement;
+
+#define SnapshotElements(header) ((HnswSnapshotElement *) ((char *) (header) + MAXALIGN(sizeof(HnswSnapshotHeader))))
+
+/*
+ * Mapped snapshot for an index, kept for the life of the backend
+ */
+typedef struct HnswSnapshotEntry
+{
+	Oid			indexOid;		/* hash key */
+	uint32		snapshotId;		/* zero if not tried */
+	char	   *base;			/* NULL if not available */
+	Size		size;
+	ino_t		fileIno;		/* zero if missing when last tried */
+	time_t		fileMtime;
+	uint32	   *visited;
+	uint32		generation;
+}			HnswSnapshotEntry;
+
+/*
+ * Element while exporting the snapshot
+ */
+typedef struct HnswSnapshotExportElement
+{
+	HnswSnapshotElement se;
+	uint8		version;
+	ItemPointerData neighbortid;
+}			HnswSnapshotExportElement;
+
+typedef struct HnswSnapshotExportState
+{
+	Relation	index;
+	int			m;
+	uint32		snapshotId;
+	HnswSnapshotExportElement *elements;
+	uint32		length;
+	uint32		maxLength;
+	ItemPointerData *heaptids;
+	uint64		heaptidsLength;
+	uint64		maxHeaptids;
+	BlockNumber nblocks;
+	uint32	   *blockStart;		/* first ordinal on each block */
+	uint16	   *blockCount;		/* number of ordinals on each block */
+	FILE	   *file;
+	uint64		position;
+}			HnswSnapshotExportState;
+
+typedef struct HnswSnapshotCandidate
+{
+	pairingheap_node c_node;
+	pairingheap_node w_node;
+	uint32		ordinal;
+	double		distance;
+}			HnswSnapshotCandidate;
+
+#define HnswGetSnapshotCandidate(membername, ptr) pairingheap_container(HnswSnapshotCandidate, membername, ptr)
+#define HnswGetSnapshotCandidateConst(membername, ptr) pairingheap_const_container(HnswSnapshotCandidate, membername, ptr)
+
+/*
+ * File to remove at the end of a transaction, like pending relation deletes
+ */
+typedef struct HnswPendingDelete
+{
+	char	   *path;			/* NULL for all files in database */
+	Oid			dbOid;
+	bool		atCommit;		/* remove at commit, otherwise at abort */
+	int			nestLevel;
+	struct HnswPendingDelete *next;
+}			HnswPendingDelete;
+
+static HTAB *snapshots = NULL;
+static HnswPendingDelete * pendingDeletes = NULL;
+static object_access_hook_type prev_object_access_hook = NULL;
+
+/*
+ * Get the path of the snapshot file for an index, relative to the data
+ * directory
+ */
+static void
+GetSnapshotPathById(Oid dbOid, Oid indexOid, char *path)
+{
+	snprintf(path, MAXPGPATH, HNSW_SNAPSHOT_DIR "/%u_%u.snapshot", dbOid, indexOid);
+}
+
+/*
+ * Get the path of the snapshot file, relative to the data directory
+ */
+static void
+GetSnapshotPath(Relation index, char *path)
+{
+	GetSnapshotPathById(MyDatabaseId, RelationGetRelid(index), path);
+}
+
+/*
+ * Remove a file, ignoring files that are already gone
+ */
+static void
+RemoveSnapshotFile(const char *path)
+{
+	if (unlink(path) != 0 && errno != ENOENT)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", path)));
+}
+
+/*
+ * Remove the snapshot files for a database
+ */
+static void
+RemoveDatabaseSnapshots(Oid dbOid)
+{
+	DIR		   *dir;
+	struct dirent *de;
+	char		prefix[32];
+
+	snprintf(prefix, sizeof(prefix), "%u_", dbOid);
+
+	dir = AllocateDir(HNSW_SNAPSHOT_DIR);
+	if (dir == NULL)
+		return;
+
+	while ((de = ReadDirExtended(dir, HNSW_SNAPSHOT_DIR, WARNING)) != NULL)
+	{
+		char		path[MAXPGPATH];
+
+		if (strncmp(de->d_name, prefix, strlen(prefix)) != 0)
+			continue;
+
+		snprintf(path, MAXPGPATH, HNSW_SNAPSHOT_DIR "/%s", de->d_name);
+		RemoveSnapshotFile(path);
+	}
+
+	FreeDir(dir);
+}
+
+/*
+ * Remove a file (or all files in a database if path is NULL) at the end of
+ * the current transaction
+ */
+static void
+RegisterPendingDelete(const char *path, Oid dbOid, bool atCommit)
+{
+	HnswPendingDelete *pending = MemoryContextAlloc(TopMemoryContext, sizeof(HnswPendingDelete));
+
+	pending->path = path != NULL ? MemoryContextStrdup(TopMemoryContext, path) : NULL;
+	pending->dbOid = dbOid;
+	pending->atCommit = atCommit;
+	pending->nestLevel = GetCurrentTransactionNestLevel();
+	pending->next = pendingDeletes;
+	pendingDeletes = pending;
+}
+
+/*
+ * Free a pending delete
+ */
+static void
+FreePendingDelete(HnswPendingDelete * pending)
+{
+	if (pending->path != NULL)
+		pfree(pending->path);
+	pfree(pending);
+}
+
+/*
+ * Stop removing a file at the end of the current transaction
+ */
+static void
+ForgetPendingDelete(const char *path)
+{
+	HnswPendingDelete **prev = &pendingDeletes;
+
+	while (*prev != NULL)
+	{
+		HnswPendingDelete *pending = *prev;
+
+		if (pending->path != NULL && strcmp(pending->path, path) == 0)
+		{
+			*prev = pending->next;
+			FreePendingDelete(pending);
+		}
+		else
+			prev = &pending->next;
+	}
+}
+
+/*
+ * Remove files for the current (sub)transaction and any children
+ */
+static void
+DoPendingDeletes(bool isCommit, int nestLevel)
+{
+	HnswPendingDelete **prev = &pendingDeletes;
+
+	while (*prev != NULL)
+	{
+		HnswPendingDelete *pending = *prev;
+
+		if (pending->nestLevel < nestLevel)
+		{
+			prev = &pending->next;
+			continue;
+		}
+
+		*prev = pending->next;
+
+		if (pending->atCommit == isCommit)
+		{
+			if (pending->path != NULL)
+				RemoveSnapshotFile(pending->path);
+			else
+				RemoveDatabaseSnapshots(pending->dbOid);
+		}
+
+		FreePendingDelete(pending);
+	}
+}
+
+/*
+ * Remove files at the end of a transaction
+ */
+static void
+SnapshotXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+			DoPendingDeletes(true, 0);
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			DoPendingDeletes(false, 0);
+			break;
+		case XACT_EVENT_PREPARE:
+			/* Files are left for the sweep since the outcome is unknown */
+			while (pendingDeletes != NULL)
+			{
+				HnswPendingDelete *pending = pendingDeletes;
+
+				pendingDeletes = pending->next;
+				FreePendingDelete(pending);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Remove files at the end of a subtransaction or pass them to the parent
+ */
+static void
+SnapshotSubXactCallback(SubXactEvent event, SubTransactionId mySubid, SubTransactionId parentSubid, void *arg)
+{
+	int			nestLevel = GetCurrentTransactionNestLevel();
+
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		DoPendingDeletes(false, nestLevel);
+	else if (event == SUBXACT_EVENT_COMMIT_SUB)
+	{
+		for (HnswPendingDelete * pending = pendingDeletes; pending != NULL; pending = pending->next)
+		{
+			if (pending->nestLevel >= nestLevel)
+				pending->nestLevel = nestLevel - 1;
+		}
+	}
+}
+
+/*
+ * Remove snapshot files for dropped indexes and databases once the drop
+ * commits
+ */
+static void
+SnapshotObjectAccess(ObjectAccessType access, Oid classId, Oid objectId, int subId, void *arg)
+{
+	if (prev_object_access_hook)
+		prev_object_access_hook(access, classId, objectId, subId, arg);
+
+	if (access != OAT_DROP)
+		return;
+
+	if (classId == RelationRelationId && subId == 0 && get_rel_relkind(objectId) == RELKIND_INDEX)
+	{
+		char		path[MAXPGPATH];
+		struct stat st;
+
+		/* Skip indexes without a snapshot */
+		GetSnapshotPathById(MyDatabaseId, objectId, path);
+		if (stat(path, &st) == 0)
+			RegisterPendingDelete(path, InvalidOid, true);
+	}
+	else if (classId == DatabaseRelationId)
+		RegisterPendingDelete(NULL, objectId, true);
+}
+
+/*
+ * Check if the main fork of a relation exists
+ *
+ * Dropped relations can keep an empty first segment until the next
+ * checkpoint, and hnsw indexes always have a metapage
+ */
+static bool
+RelationFileExists(Oid spcOid, Oid dbOid, Oid relNumber)
+{
+#if PG_VERSION_NUM >= 160000
+	RelFileLocator rlocator = {spcOid, dbOid, relNumber};
+#else
+	RelFileNode rlocator = {spcOid, dbOid, relNumber};
+#endif
+	struct stat st;
+#if PG_VERSION_NUM >= 180000
+	RelPathStr	path = relpathperm(rlocator, MAIN_FORKNUM);
+
+	return stat(path.str, &st) == 0 && st.st_size > 0;
+#else
+	char	   *path = relpathperm(rlocator, MAIN_FORKNUM);
+	bool		exists = stat(path, &st) == 0 && st.st_size > 0;
+
+	pfree(path);
+	return exists;
+#endif
+}
+
+/*
+ * Check if a snapshot file belongs to a relfilenode that still exists
+ */
+static bool
+SnapshotFileIsLive(const char *path, Oid dbOid)
+{
+	HnswSnapshotHeader header;
+	int			fd;
+	int			rc;
+
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+		return true;
+
+	rc = read(fd, &header, sizeof(HnswSnapshotHeader));
+	CloseTransientFile(fd);
+
+	if (rc != (int) sizeof(HnswSnapshotHeader) ||
+		header.magicNumber != HNSW_SNAPSHOT_MAGIC_NUMBER ||
+		header.version != HNSW_SNAPSHOT_VERSION)
+		return false;
+
+	return RelationFileExists(header.spcOid, dbOid, header.relNumber);
+}
+
+/*
+ * Remove files for indexes that no longer exist
+ *
+ * The object access hook does not run for drops replayed on a replica, or
+ * for files left behind by a crash, so each backend checks once before its
+ * first snapshot scan. Files are kept as long as the relfilenode they were
+ * exported from exists, which also covers builds that have not committed.
+ */
+static void
+SweepSnapshots(void)
+{
+	DIR		   *dir;
+	struct dirent *de;
+
+	dir = AllocateDir(HNSW_SNAPSHOT_DIR);
+	if (dir == NULL)
+		return;
+
+	while ((de = ReadDirExtended(dir, HNSW_SNAPSHOT_DIR, LOG)) != NULL)
+	{
+		char		path[MAXPGPATH];
+		Oid			dbOid;
+		Oid			indexOid;
+		int			pid;
+		char		suffix;
+
+		snprintf(path, MAXPGPATH, HNSW_SNAPSHOT_DIR "/%s", de->d_name);
+
+		/* Temporary files of exports that did not finish */
+		if (sscanf(de->d_name, "%u_%u.snapshot.tmp.%d%c", &dbOid, &indexOid, &pid, &suffix) == 3)
+		{
+			if (BackendPidGetProc(pid) == NULL)
+				RemoveSnapshotFile(path);
+		}
+		else if (sscanf(de->d_name, "%u_%u.snapshot%c", &dbOid, &indexOid, &suffix) == 2)
+		{
+			if (!SnapshotFileIsLive(path, dbOid))
+				RemoveSnapshotFile(path);
+		}
+	}
+
+	FreeDir(dir);
+}
+
+/*
+ * Get the snapshot id from the metapage
+ */
+static uint32
+GetSnapshotId(Relation index, int *m, BlockNumber *entryBlkno, OffsetNumber *entryOffno)
+{
+	Buffer		buf;
+	Page		page;
+	HnswMetaPage metap;
+	uint32		snapshotId;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = HnswPageGetMeta(page);
+
+	if (unlikely(metap->magicNumber != HNSW_MAGIC_NUMBER))
+		elog(ERROR, "hnsw index is not valid");
+
+	/* Indexes created before snapshots have zeros after the upper cache */
+	snapshotId = metap->snapshotId;
+
+	if (m != NULL)
+		*m = metap->m;
+
+	if (entryBlkno != NULL)
+		*entryBlkno = metap->entryBlkno;
+
+	if (entryOffno != NULL)
+		*entryOffno = metap->entryOffno;
+
+	UnlockReleaseBuffer(buf);
+
+	return snapshotId;
+}
+
+/*
+ * Get the ordinal of an exported element, or -1 if it was not exported
+ */
+static int32
+GetExportOrdinal(HnswSnapshotExportState * state, ItemPointer indextid)
+{
+	BlockNumber blkno = ItemPointerGetBlockNumber(indextid);
+	OffsetNumber offno = ItemPointerGetOffsetNumber(indextid);
+	uint32		lo;
+	uint32		hi;
+
+	if (blkno >= state->nblocks)
+		return -1;
+
+	/* Elements on a page are collected in offset order */
+	lo = state->blockStart[blkno];
+	hi = lo + state->blockCount[blkno];
+	while (lo < hi)
+	{
+		uint32		mid = lo + (hi - lo) / 2;
+		OffsetNumber midoffno = state->elements[mid].se.offno;
+
+		if (midoffno == offno)
+			return mid;
+
+		if (midoffno < offno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return -1;
+}
+
+/*
+ * Collect the elements that are not deleted, in page order
+ */
+static void
+CollectElements(HnswSnapshotExportState * state)
+{
+	Relation	index = state->index;
+	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	BlockNumber blkno = HNSW_HEAD_BLKNO;
+
+	state->nblocks = RelationGetNumberOfBlocks(index);
+	state->blockStart = palloc0(state->nblocks * sizeof(uint32));
+	state->blockCount = palloc0(state->nblocks * sizeof(uint16));
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		/* Elements on pages added since the start are not linked to */
+		if (blkno >= state->nblocks)
+			maxoffno = InvalidOffsetNumber;
+		else
+			state->blockStart[blkno] = state->length;
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+			HnswSnapshotExportElement *item;
+
+			if (!HnswIsElementTuple(etup) || etup->deleted)
+				continue;
+
+			if (state->length == state->maxLength)
+			{
+				state->maxLength *= 2;
+				state->elements = repalloc_huge(state->elements, state->maxLength * sizeof(HnswSnapshotExportElement));
+			}
+
+			item = &state->elements[state->length++];
+			item->se.blkno = blkno;
+			item->se.offno = offno;
+			item->se.level = etup->level;
+			item->se.quantization = etup->quantization;
+			item->se.valueSize = VARSIZE_ANY(&etup->data);
+			item->se.heaptids = state->heaptidsLength;
+			item->se.heaptidsLength = 0;
+			item->version = etup->version;
+			item->neighbortid = etup->neighbortid;
+
+			for (int i = 0; i < HNSW_HEAPTIDS; i++)
+			{
+				/* Can stop at first invalid */
+				if (!ItemPointerIsValid(&etup->heaptids[i]))
+					break;
+
+				if (state->heaptidsLength == state->maxHeaptids)
+				{
+					state->maxHeaptids *= 2;
+					state->heaptids = repalloc_huge(state->heaptids, state->maxHeaptids * sizeof(ItemPointerData));
+				}
+
+				state->heaptids[state->heaptidsLength++] = etup->heaptids[i];
+				item->se.heaptidsLength++;
+			}
+
+			state->blockCount[blkno]++;
+		}
+
+		blkno = HnswPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	FreeAccessStrategy(bas);
+}
+
+/*
+ * Write data to the snapshot file
+ */
+static bool
+WriteSnapshotData(HnswSnapshotExportState * state, const void *data, Size size)
+{
+	if (size > 0 && fwrite(data, 1, size, state->file) != size)
+		return false;
+
+	state->position += size;
+	return true;
+}
+
+/*
+ * Pad the snapshot file to an offset
+ */
+static bool
+WriteSnapshotPadding(HnswSnapshotExportState * state, uint64 offset)
+{
+	static const char zeros[MAXIMUM_ALIGNOF] = {0};
+
+	Assert(offset >= state->position && offset - state->position <= MAXIMUM_ALIGNOF);
+
+	return WriteSnapshotData(state, zeros, offset - state->position);
+}
+
+/*
+ * Write the neighbor slots for each element
+ *
+ * Neighbors that are deleted (or were not exported) are written as -1,
+ * as are all neighbors of an element whose neighbor tuple was replaced
+ */
+static bool
+WriteNeighbors(HnswSnapshotExportState * state)
+{
+	Relation	index = state->index;
+	int			m = state->m;
+	int32	   *slots = palloc((HnswGetMaxLevel(m) + 2) * m * sizeof(int32));
+
+	for (uint32 i = 0; i < state->length; i++)
+	{
+		HnswSnapshotExportElement *item = &state->elements[i];
+		int			count = (item->se.level + 2) * m;
+		Buffer		buf;
+		Page		page;
+		HnswNeighborTuple ntup;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(index, ItemPointerGetBlockNumber(&item->neighbortid));
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, ItemPointerGetOffsetNumber(&item->neighbortid)));
+
+		if (HnswIsNeighborTuple(ntup) && ntup->version == item->version && ntup->count == count)
+		{
+			for (int j = 0; j < count; j++)
+			{
+				if (ItemPointerIsValid(&ntup->indextids[j]))
+					slots[j] = GetExportOrdinal(state, &ntup->indextids[j]);
+				else
+					slots[j] = -1;
+			}
+		}
+		else
+		{
+			for (int j = 0; j < count; j++)
+				slots[j] = -1;
+		}
+
+		UnlockReleaseBuffer(buf);
+
+		if (!WriteSnapshotData(state, slots, count * sizeof(int32)))
+			return false;
+	}
+
+	pfree(slots);
+	return true;
+}
+
+/*
+ * Write the value for each element
+ *
+ * Returns false if an element was deleted or replaced since it was collected
+ */
+static bool
+WriteValues(HnswSnapshotExportState * state, bool *changed)
+{
+	Relation	index = state->index;
+	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	Buffer		buf = InvalidBuffer;
+	bool		result = true;
+
+	*changed = false;
+
+	for (uint32 i = 0; i < state->length; i++)
+	{
+		HnswSnapshotExportElement *item = &state->elements[i];
+		Page		page;
+		HnswElementTuple etup;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Elements on the same page are consecutive */
+		if (!BufferIsValid(buf) || BufferGetBlockNumber(buf) != item->se.blkno)
+		{
+			if (BufferIsValid(buf))
+				UnlockReleaseBuffer(buf);
+
+			buf = ReadBufferExtended(index, MAIN_FORKNUM, item->se.blkno, RBM_NORMAL, bas);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+		}
+
+		page = BufferGetPage(buf);
+		etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, item->se.offno));
+
+		if (!HnswIsElementTuple(etup) || etup->deleted || etup->version != item->version)
+		{
+			*changed = true;
+			result = false;
+			break;
+		}
+
+		if (!WriteSnapshotData(state, &etup->data, item->se.valueSize) ||
+			!WriteSnapshotPadding(state, MAXALIGN(state->position)))
+		{
+			result = false;
+			break;
+		}
+	}
+
+	if (BufferIsValid(buf))
+		UnlockReleaseBuffer(buf);
+
+	FreeAccessStrategy(bas);
+	return result;
+}
+
+/*
+ * Write the snapshot file
+ */
+static bool
+WriteSnapshot(HnswSnapshotExportState * state, BlockNumber entryBlkno, OffsetNumber entryOffno, bool *changed)
+{
+	HnswSnapshotHeader header;
+	uint64		slots = 0;
+	uint64		valuesSize = 0;
+	HnswSnapshotElement *elements;
+	ItemPointerData entrytid;
+
+	MemSet(&header, 0, sizeof(HnswSnapshotHeader));
+	header.magicNumber = HNSW_SNAPSHOT_MAGIC_NUMBER;
+	header.version = HNSW_SNAPSHOT_VERSION;
+	header.snapshotId = state->snapshotId;
+	header.m = state->m;
+	header.length = state->length;
+#if PG_VERSION_NUM >= 160000
+	header.spcOid = state->index->rd_locator.spcOid;
+	header.relNumber = state->index->rd_locator.relNumber;
+#else
+	header.spcOid = state->index->rd_node.spcNode;
+	header.relNumber = state->index->rd_node.relNode;
+#endif
+
+	/* Entry point was deleted or not reached if -1 */
+	header.entry = -1;
+	if (BlockNumberIsValid(entryBlkno))
+	{
+		ItemPointerSet(&entrytid, entryBlkno, entryOffno);
+		header.entry = GetExportOrdinal(state, &entrytid);
+	}
+
+	/* Assign offsets */
+	header.neighborsOffset = MAXALIGN(sizeof(HnswSnapshotHeader)) + MAXALIGN(state->length * sizeof(HnswSnapshotElement));
+	for (uint32 i = 0; i < state->length; i++)
+	{
+		state->elements[i].se.neighbors = slots;
+		slots += (state->elements[i].se.level + 2) * state->m;
+	}
+
+	header.heaptidsOffset = header.neighborsOffset + MAXALIGN(slots * sizeof(int32));
+	header.valuesOffset = header.heaptidsOffset + MAXALIGN(state->heaptidsLength * sizeof(ItemPointerData));
+	for (uint32 i = 0; i < state->length; i++)
+	{
+		state->elements[i].se.value = header.valuesOffset + valuesSize;
+		valuesSize += MAXALIGN(state->elements[i].se.valueSize);
+	}
+
+	header.size = header.valuesOffset + valuesSize;
+
+	/* Write header and elements */
+	if (!WriteSnapshotData(state, &header, sizeof(HnswSnapshotHeader)) ||
+		!WriteSnapshotPadding(state, MAXALIGN(state->position)))
+		return false;
+
+	elements = MemoryContextAllocHuge(CurrentMemoryContext, state->length * sizeof(HnswSnapshotElement));
+	for (uint32 i = 0; i < state->length; i++)
+		elements[i] = state->elements[i].se;
+
+	if (!WriteSnapshotData(state, elements, state->length * sizeof(HnswSnapshotElement)))
+		return false;
+
+	pfree(elements);
+
+	/* Write neighbors, heap TIDs, and values */
+	if (!WriteSnapshotPadding(state, header.neighborsOffset) ||
+		!WriteNeighbors(state) ||
+		!WriteSnapshotPadding(state, header.heaptidsOffset) ||
+		!WriteSnapshotData(state, state->heaptids, state->heaptidsLength * sizeof(ItemPointerData)) ||
+		!WriteSnapshotPadding(state, header.valuesOffset) ||
+		!WriteValues(state, changed))
+		return false;
+
+	Assert(state->position == header.size);
+	return true;
+}
+
+/*
+ * Check if the file was exported for a snapshot id
+ */
+static bool
+SnapshotFileMatches(const char *path, uint32 snapshotId)
+{
+	HnswSnapshotHeader header;
+	bool		result;
+	int			fd;
+
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+		return false;
+
+	result = read(fd, &header, sizeof(HnswSnapshotHeader)) == sizeof(HnswSnapshotHeader) &&
+		header.magicNumber == HNSW_SNAPSHOT_MAGIC_NUMBER &&
+		header.version == HNSW_SNAPSHOT_VERSION &&
+		header.snapshotId == snapshotId;
+
+	CloseTransientFile(fd);
+	return result;
+}
+
+/*
+ * Export the snapshot for an index
+ *
+ * Exports are serialized with a lock, and one that waited on another for the
+ * same snapshot id does not write the file again. The file is only renamed
+ * into place if the snapshot id did not change while it was written, so
+ * scans never map a file for a different graph. Failures are not errors
+ * since scans fall back to the index.
+ */
+static bool
+ExportSnapshot(Relation index, uint32 snapshotId)
+{
+	MemoryContext exportCtx = AllocSetContextCreate(CurrentMemoryContext,
+													"Hnsw snapshot export context",
+													ALLOCSET_DEFAULT_SIZES);
+	MemoryContext oldCtx = MemoryContextSwitchTo(exportCtx);
+	HnswSnapshotExportState state;
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH] = "";
+	Buffer		buf;
+	BlockNumber entryBlkno;
+	OffsetNumber entryOffno;
+	bool		changed = false;
+	bool		result = false;
+
+	LockPage(index, HNSW_SNAPSHOT_LOCK, ExclusiveLock);
+
+	if (GetSnapshotId(index, &state.m, &entryBlkno, &entryOffno) != snapshotId)
+		goto cleanup;
+
+	GetSnapshotPath(index, path);
+	if (SnapshotFileMatches(path, snapshotId))
+	{
+		result = true;
+		goto cleanup;
+	}
+
+	if (MakePGDirectory(HNSW_SNAPSHOT_DIR) < 0 && errno != EEXIST)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m", HNSW_SNAPSHOT_DIR)));
+		goto cleanup;
+	}
+
+	state.index = index;
+	state.snapshotId = snapshotId;
+	state.length = 0;
+	state.maxLength = 256;
+	state.elements = palloc(state.maxLength * sizeof(HnswSnapshotExportElement));
+	state.heaptidsLength = 0;
+	state.maxHeaptids = 256;
+	state.heaptids = palloc(state.maxHeaptids * sizeof(ItemPointerData));
+	state.position = 0;
+
+	CollectElements(&state);
+
+	snprintf(tmppath, MAXPGPATH, "%s.tmp.%d", path, MyProcPid);
+
+	/* Remove the temporary file if an error aborts the export */
+	RegisterPendingDelete(tmppath, InvalidOid, false);
+
+	state.file = AllocateFile(tmppath, PG_BINARY_W);
+	if (state.file == NULL)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+		goto cleanup;
+	}
+
+	if (!WriteSnapshot(&state, entryBlkno, entryOffno, &changed))
+	{
+		if (!changed)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not write file \"%s\": %m", tmppath)));
+
+		FreeFile(state.file);
+		unlink(tmppath);
+		goto cleanup;
+	}
+
+	/* Sync before locking so the rename below is quick */
+	if (fflush(state.file) != 0 || pg_fsync(fileno(state.file)) != 0)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", tmppath)));
+		FreeFile(state.file);
+		unlink(tmppath);
+		goto cleanup;
+	}
+
+	if (FreeFile(state.file) != 0)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", tmppath)));
+		unlink(tmppath);
+		goto cleanup;
+	}
+
+	/*
+	 * Discard if the index changed while writing. The snapshot id is the
+	 * generation of the file and is only cleared with an exclusive lock on
+	 * the metapage, so holding a share lock keeps a concurrent clear from
+	 * removing the file before it is renamed into place.
+	 */
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	if (HnswPageGetMeta(BufferGetPage(buf))->snapshotId == snapshotId)
+		result = durable_rename(tmppath, path, WARNING) == 0;
+	UnlockReleaseBuffer(buf);
+
+	if (!result)
+		unlink(tmppath);
+
+cleanup:
+	ForgetPendingDelete(tmppath);
+	UnlockPage(index, HNSW_SNAPSHOT_LOCK, ExclusiveLock);
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(exportCtx);
+
+	return result;
+}
+
+/*
+ * Unmap the snapshot for an entry
+ */
+static void
+UnmapSnapshot(HnswSnapshotEntry * entry)
+{
+	if (entry->base == NULL)
+		return;
+
+#ifndef WIN32
+	munmap(entry->base, entry->size);
+#else
+	pfree(entry->base);
+#endif
+	pfree(entry->visited);
+
+	entry->base = NULL;
+	entry->size = 0;
+	entry->visited = NULL;
+}
+
+/*
+ * Map the snapshot file for an entry
+ */
+static bool
+MapSnapshot(HnswSnapshotEntry * entry, const char *path, uint32 snapshotId, int m)
+{
+	HnswSnapshotHeader *header;
+	struct stat st;
+	char	   *base;
+	int			fd;
+
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(HnswSnapshotHeader))
+	{
+		CloseTransientFile(fd);
+		return false;
+	}
+
+#ifndef WIN32
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+	{
+		CloseTransientFile(fd);
+		return false;
+	}
+#else
+	/* Read into memory since files cannot be renamed while mapped */
+	base = MemoryContextAllocHuge(TopMemoryContext, st.st_size);
+	for (Size offset = 0; offset < (Size) st.st_size;)
+	{
+		int			rc = read(fd, base + offset, Min((Size) st.st_size - offset, 1024 * 1024));
+
+		if (rc <= 0)
+		{
+			pfree(base);
+			CloseTransientFile(fd);
+			return false;
+		}
+
+		offset += rc;
+	}
+#endif
+
+	CloseTransientFile(fd);
+
+	/* Reject files for a different graph or from a failed write */
+	header = (HnswSnapshotHeader *) base;
+	if (header->magicNumber != HNSW_SNAPSHOT_MAGIC_NUMBER ||
+		header->version != HNSW_SNAPSHOT_VERSION ||
+		header->snapshotId != snapshotId ||
+		header->m != (uint32) m ||
+		header->size != (uint64) st.st_size ||
+		header->entry >= (int32) header->length)
+	{
+#ifndef WIN32
+		munmap(base, st.st_size);
+#else
+		pfree(base);
+#endif
+		return false;
+	}
+
+	entry->base = base;
+	entry->size = st.st_size;
+	entry->visited = MemoryContextAllocExtended(TopMemoryContext, header->length * sizeof(uint32), MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+	entry->generation = 0;
+	return true;
+}
+
+/*
+ * Unmap and forget the snapshot for an index
+ */
+static void
+ReleaseSnapshot(Oid indexOid)
+{
+	HnswSnapshotEntry *entry;
+
+	if (snapshots == NULL)
+		return;
+
+	entry = hash_search(snapshots, &indexOid, HASH_FIND, NULL);
+	if (entry == NULL)
+		return;
+
+	UnmapSnapshot(entry);
+	hash_search(snapshots, &indexOid, HASH_REMOVE, NULL);
+}
+
+/*
+ * Release snapshots when indexes are dropped or rebuilt
+ *
+ * Entries are only used within HnswSearchSnapshot, which does not process
+ * invalidations, so they can be unmapped right away
+ */
+static void
+InvalidateSnapshots(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	HnswSnapshotEntry *entry;
+
+	if (snapshots == NULL)
+		return;
+
+	if (OidIsValid(relid))
+	{
+		ReleaseSnapshot(relid);
+		return;
+	}
+
+	hash_seq_init(&status, snapshots);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		UnmapSnapshot(entry);
+		hash_search(snapshots, &entry->indexOid, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Check if the file was replaced since it was last tried
+ */
+static bool
+SnapshotFileChanged(HnswSnapshotEntry * entry, const char *path)
+{
+	struct stat st;
+	ino_t		ino = 0;
+	time_t		mtime = 0;
+
+	if (stat(path, &st) == 0)
+	{
+		ino = st.st_ino;
+		mtime = st.st_mtime;
+	}
+
+	if (ino == entry->fileIno && mtime == entry->fileMtime)
+		return false;
+
+	entry->fileIno = ino;
+	entry->fileMtime = mtime;
+	return true;
+}
+
+/*
+ * Get the mapped snapshot for an index
+ *
+ * Scans do not export the file, so a scan never waits on a write of the
+ * whole graph. A missing or invalid file is only tried again once it is
+ * replaced, like by hnsw_export_snapshot.
+ */
+static HnswSnapshotEntry *
+GetSnapshot(Relation index, uint32 snapshotId, int m)
+{
+	Oid			indexOid = RelationGetRelid(index);
+	HnswSnapshotEntry *entry;
+	char		path[MAXPGPATH];
+	bool		found;
+
+	if (snapshots == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(HnswSnapshotEntry);
+		snapshots = hash_create("hnsw snapshots", 16, &ctl, HASH_ELEM | HASH_BLOBS);
+
+		/* Remove files left behind before the first scan */
+		SweepSnapshots();
+	}
+
+	entry = hash_search(snapshots, &indexOid, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->snapshotId = 0;
+		entry->base = NULL;
+		entry->size = 0;
+		entry->fileIno = 0;
+		entry->fileMtime = 0;
+		entry->visited = NULL;
+		entry->generation = 0;
+	}
+
+	if (entry->snapshotId == snapshotId && entry->base != NULL)
+		return entry;
+
+	GetSnapshotPath(index, path);
+	if (entry->snapshotId == snapshotId)
+	{
+		if (!SnapshotFileChanged(entry, path))
+			return NULL;
+	}
+	else
+	{
+		UnmapSnapshot(entry);
+		entry->snapshotId = snapshotId;
+		SnapshotFileChanged(entry, path);
+	}
+
+	if (!MapSnapshot(entry, path, snapshotId, m))
+		return NULL;
+
+	return entry;
+}
+
+/*
+ * Export the snapshot after a build
+ *
+ * The file is removed if the build aborts. The graph it was exported from
+ * is discarded, and for REINDEX, hnsw_export_snapshot exports the previous
+ * graph again.
+ */
+void
+HnswExportSnapshot(Relation index)
+{
+	uint32		snapshotId = GetSnapshotId(index, NULL, NULL, NULL);
+
+	if (snapshotId != 0 && ExportSnapshot(index, snapshotId))
+	{
+		char		path[MAXPGPATH];
+
+		GetSnapshotPath(index, path);
+		RegisterPendingDelete(path, InvalidOid, false);
+	}
+}
+
+/*
+ * Release the snapshot when scans can no longer use it
+ */
+void
+HnswReleaseSnapshot(Relation index)
+{
+	ReleaseSnapshot(RelationGetRelid(index));
+}
+
+/*
+ * Invalidate the snapshot before the index is changed
+ *
+ * Only the first change after a build updates the metapage
+ */
+void
+HnswClearSnapshot(Relation index)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	HnswMetaPage metap;
+	char		path[MAXPGPATH];
+
+	if (GetSnapshotId(index, NULL, NULL, NULL) == 0)
+		return;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	metap = HnswPageGetMeta(page);
+
+	metap->snapshotId = 0;
+
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+
+	/* File is no longer needed */
+	GetSnapshotPath(index, path);
+	RemoveSnapshotFile(path);
+	ReleaseSnapshot(RelationGetRelid(index));
+}
+
+/*
+ * Export the snapshot for an index if the file is missing, like on a replica
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(hnsw_export_snapshot);
+Datum
+hnsw_export_snapshot(PG_FUNCTION_ARGS)
+{
+	Oid			indexOid = PG_GETARG_OID(0);
+	char	   *indexName;
+	Relation	heap;
+	Relation	index;
+	uint32		snapshotId;
+	bool		result;
+
+	indexName = get_rel_name(indexOid);
+	if (indexName == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("index with OID %u does not exist", indexOid)));
+
+	if (get_rel_relkind(indexOid) != RELKIND_INDEX)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw index", indexName)));
+
+	/* Writes to the data directory, so requires the same privilege as REINDEX */
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, indexOid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(indexOid, GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER, OBJECT_INDEX, indexName);
+
+	/* Lock the table before the index, like scans */
+	heap = table_open(IndexGetRelation(indexOid, false), AccessShareLock);
+	index = index_open(indexOid, AccessShareLock);
+
+	if (index->rd_indam->amgettuple != hnswgettuple)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw index", RelationGetRelationName(index))));
+
+	if (!HnswGetSnapshot(index))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("snapshot is not enabled for index \"%s\"", RelationGetRelationName(index))));
+
+	/* Zero if the index changed after it was built */
+	snapshotId = GetSnapshotId(index, NULL, NULL, NULL);
+	result = snapshotId != 0 && ExportSnapshot(index, snapshotId);
+
+	index_close(index, AccessShareLock);
+	table_close(heap, AccessShareLock);
+
+	PG_RETURN_BOOL(result);
+}
+
+/*
+ * Register callbacks to remove snapshot files and mappings
+ */
+void
+HnswSnapshotInit(void)
+{
+	prev_object_access_hook = object_access_hook;
+	object_access_hook = SnapshotObjectAccess;
+
+	RegisterXactCallback(SnapshotXactCallback, NULL);
+	RegisterSubXactCallback(SnapshotSubXactCallback, NULL);
+	CacheRegisterRelcacheCallback(InvalidateSnapshots, (Datum) 0);
+}
+
+/*
+ * Compare candidate distances
+ */
+static int
+CompareNearestSnapshotCandidates(const pairingheap_node *a, const pairingheap_node *b, void *arg)
+{
+	if (HnswGetSnapshotCandidateConst(c_node, a)->distance < HnswGetSnapshotCandidateConst(c_node, b)->distance)
+		return 1;
+
+	if (HnswGetSnapshotCandidateConst(c_node, a)->distance > HnswGetSnapshotCandidateConst(c_node, b)->distance)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Compare candidate distances
+ */
+static int
+CompareFurthestSnapshotCandidates(const pairingheap_node *a, const pairingheap_node *b, void *arg)
+{
+	if (HnswGetSnapshotCandidateConst(w_node, a)->distance < HnswGetSnapshotCandidateConst(w_node, b)->distance)
+		return -1;
+
+	if (HnswGetSnapshotCandidateConst(w_node, a)->distance > HnswGetSnapshotCandidateConst(w_node, b)->distance)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Get the distance to a snapshot element
+ */
+static inline double
+GetSnapshotDistance(HnswSnapshotEntry * entry, HnswQuery * q, HnswSupport * support, uint32 ordinal)
+{
+	HnswSnapshotElement *se = &SnapshotElements(entry->base)[ordinal];
+
+	if (support->stats != NULL)
+		support->stats->distances++;
+
+	return HnswGetStoredDistance(q->value, entry->base + se->value, se->quantization, support);
+}
+
+/*
+ * Start a new traversal
+ */
+static inline void
+NextGeneration(HnswSnapshotEntry * entry)
+{
+	if (++entry->generation == 0)
+	{
+		memset(entry->visited, 0, ((HnswSnapshotHeader *) entry->base)->length * sizeof(uint32));
+		entry->generation = 1;
+	}
+}
+
+/*
+ * Search an upper layer with ef = 1
+ *
+ * Matches HnswSearchLayer, which only moves to closer elements when ef is 1
+ */
+static void
+SearchSnapshotUpperLayer(HnswSnapshotEntry * entry, HnswQuery * q, HnswSupport * support, int lc, uint32 *current, double *distance)
+{
+	HnswSnapshotHeader *header = (HnswSnapshotHeader *) entry->base;
+	HnswSnapshotElement *elements = SnapshotElements(header);
+	int32	   *slots = (int32 *) (entry->base + header->neighborsOffset);
+	int			m = header->m;
+	bool		moved = true;
+
+	NextGeneration(entry);
+	entry->visited[*current] = entry->generation;
+
+	while (moved)
+	{
+		HnswSnapshotElement *se = &elements[*current];
+		int32	   *neighbors = &slots[se->neighbors + (se->level - lc) * m];
+
+		moved = false;
+
+		if (support->stats != NULL)
+			support->stats->upperHops++;
+
+		for (int i = 0; i < m; i++)
+		{
+			int32		ordinal = neighbors[i];
+			double		ndistance;
+
+			if (ordinal < 0 || entry->visited[ordinal] == entry->generation)
+				continue;
+
+			entry->visited[ordinal] = entry->generation;
+
+			ndistance = GetSnapshotDistance(entry, q, support, ordinal);
+			if (ndistance < *distance)
+			{
+				*current = ordinal;
+				*distance = ndistance;
+				moved = true;
+			}
+		}
+	}
+}
+
+/*
+ * Search the ground layer
+ *
+ * Returns candidates with the furthest first, like HnswSearchLayer
+ */
+static List *
+SearchSnapshotGroundLayer(HnswSnapshotEntry * entry, HnswQuery * q, HnswSupport * support, uint32 current, double distance, int ef)
+{
+	HnswSnapshotHeader *header = (HnswSnapshotHeader *) entry->base;
+	HnswSnapshotElement *elements = SnapshotElements(header);
+	int32	   *slots = (int32 *) (entry->base + header->neighborsOffset);
+	int			lm = HnswGetLayerM(header->m, 0);
+	pairingheap *C = pairingheap_allocate(CompareNearestSnapshotCandidates, NULL);
+	pairingheap *W = pairingheap_allocate(CompareFurthestSnapshotCandidates, NULL);
+	HnswSnapshotCandidate *sc = palloc(sizeof(HnswSnapshotCandidate));
+	int			wlen = 1;
+	List	   *w = NIL;
+	int			stale = 0;
+
+	NextGeneration(entry);
+	entry->visited[current] = entry->generation;
+
+	sc->ordinal = current;
+	sc->distance = distance;
+	pairingheap_add(C, &sc->c_node);
+	pairingheap_add(W, &sc->w_node);
+
+	while (!pairingheap_is_empty(C))
+	{
+		HnswSnapshotCandidate *c = HnswGetSnapshotCandidate(c_node, pairingheap_remove_first(C));
+		HnswSnapshotCandidate *f = HnswGetSnapshotCandidate(w_node, pairingheap_first(W));
+		HnswSnapshotElement *se = &elements[c->ordinal];
+		int32	   *neighbors;
+		bool		improved = false;
+
+		if (c->distance > f->distance)
+			break;
+
+		neighbors = &slots[se->neighbors + se->level * header->m];
+
+		if (support->stats != NULL)
+			support->stats->layer0Hops++;
+
+		for (int i = 0; i < lm; i++)
+		{
+			int32		ordinal = neighbors[i];
+			double		edistance;
+
+			if (ordinal < 0 || entry->visited[ordinal] == entry->generation)
+				continue;
+
+			entry->visited[ordinal] = entry->generation;
+
+			f = HnswGetSnapshotCandidate(w_node, pairingheap_first(W));
+			edistance = GetSnapshotDistance(entry, q, support, ordinal);
+
+			if (edistance < f->distance || wlen < ef)
+			{
+				HnswSnapshotCandidate *e = palloc(sizeof(HnswSnapshotCandidate));
+
+				e->ordinal = ordinal;
+				e->distance = edistance;
+				pairingheap_add(C, &e->c_node);
+				pairingheap_add(W, &e->w_node);
+				wlen++;
+				improved = true;
+
+				/* No need to decrement wlen */
+				if (wlen > ef)
+					pairingheap_remove_first(W);
+			}
+		}
+
+		/* Same as HnswSearchLayer */
+		if (hnsw_search_patience > 0 && wlen >= ef)
+		{
+			if (improved)
+				stale = 0;
+			else if (++stale >= hnsw_search_patience)
+				break;
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	while (!pairingheap_is_empty(W))
+		w = lappend(w, HnswGetSnapshotCandidate(w_node, pairingheap_remove_first(W)));
+
+	return w;
+}
+
+/*
+ * Search the snapshot for an index
+ *
+ * Returns false if the snapshot is not available, in which case the caller
+ * searches the index
+ */
+bool
+HnswSearchSnapshot(Relation index, HnswQuery * q, HnswSupport * support, int m, uint32 snapshotId, List **w)
+{
+	HnswSnapshotEntry *entry;
+	HnswSnapshotHeader *header;
+	HnswSnapshotElement *elements;
+	ItemPointerData *heaptids;
+	List	   *candidates;
+	ListCell   *lc;
+	char	   *base = NULL;
+	uint32		current;
+	double		distance;
+
+	entry = GetSnapshot(index, snapshotId, m);
+	if (entry == NULL)
+		return false;
+
+	header = (HnswSnapshotHeader *) entry->base;
+	elements = SnapshotElements(header);
+	heaptids = (ItemPointerData *) (entry->base + header->heaptidsOffset);
+
+	*w = NIL;
+	if (header->entry < 0)
+		return true;
+
+	current = header->entry;
+	distance = GetSnapshotDistance(entry, q, support, current);
+
+	for (int l = elements[current].level; l >= 1; l--)
+		SearchSnapshotUpperLayer(entry, q, support, l, &current, &distance);
+
+	candidates = SearchSnapshotGroundLayer(entry, q, support, current, distance, hnsw_ef_search);
+
+	/* Scans only need the heap TIDs */
+	foreach(lc, candidates)
+	{
+		HnswSnapshotCandidate *c = lfirst(lc);
+		HnswSnapshotElement *se = &elements[c->ordinal];
+		HnswElement element = HnswInitElementFromBlock(se->blkno, se->offno);
+		HnswSearchCandidate *sc = palloc(sizeof(HnswSearchCandidate));
+
+		element->level = se->level;
+		element->deleted = false;
+		element->heaptidsLength = 0;
+		element->filter.value = 0;
+		element->filter.isnull = true;
+
+		for (int i = 0; i < se->heaptidsLength; i++)
+			HnswAddHeapTid(element, &heaptids[se->heaptids + i]);
+
+		HnswPtrStore(base, sc->element, element);
+		sc->distance = c->distance;
+		*w = lappend(*w, sc);
+	}
+
+	return true;
+}
@@ -1,24 +1,39 @@
 #include "postgres.h"
 
+#include <float.h>
 #include <math.h>
 
 #include "access/generic_xlog.h"
+#include "bitutils.h"
 #include "catalog/pg_type.h"
 #include "catalog/pg_type_d.h"
 #include "common/hashfn.h"
 #include "fmgr.h"
+#include "halfutils.h"
+#include "halfvec.h"
 #include "hnsw.h"
 #include "lib/pairingheap.h"
 #include "sparsevec.h"
 #include "storage/bufmgr.h"
+#include "storage/lmgr.h"
 #include "utils/datum.h"
 #include "utils/memdebug.h"
 #include "utils/rel.h"
+#include "utils/varbit.h"
+#include "vector.h"
+#include "vectorutils.h"
 
 #if PG_VERSION_NUM >= 160000
 #include "varatt.h"
 #endif
 
+/* Prefetch hint for reading */
+#if defined(__GNUC__) || defined(__clang__)
+#define HnswPrefetch(ptr) __builtin_prefetch(ptr, 0, 3)
+#else
+#define HnswPrefetch(ptr) ((void) (ptr))
+#endif
+
 #if PG_VERSION_NUM < 170000
 static inline uint64
 murmurhash64(uint64 data)
@@ -62,6 +77,17 @@ hash_tid(ItemPointerData tid)
 #define SH_DEFINE
 #include "lib/simplehash.h"
 
+/* Element hash table */
+#define SH_PREFIX		elementhash
+#define SH_ELEMENT_TYPE	ElementHashEntry
+#define SH_KEY_TYPE		ItemPointerData
+#define	SH_KEY			tid
+#define SH_HASH_KEY(tb, key)	hash_tid(key)
+#define SH_EQUAL(tb, a, b)		ItemPointerEquals(&a, &b)
+#define	SH_SCOPE		extern
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
 /* Pointer hash table */
 static uint32
 hash_pointer(uintptr_t ptr)
@@ -104,6 +130,17 @@ hash_offset(Size offset)
 #define SH_DEFINE
 #include "lib/simplehash.h"
 
+/* Partition hash table */
+#define SH_PREFIX		partitionhash
+#define SH_ELEMENT_TYPE	PartitionHashEntry
+#define SH_KEY_TYPE		int64
+#define	SH_KEY			value
+#define SH_HASH_KEY(tb, key)	HnswPartitionHash(key)
+#define SH_EQUAL(tb, a, b)		(a == b)
+#define	SH_SCOPE		extern
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
 /*
  * Get the max number of connections in an upper layer for each element in the index
  */
@@ -133,303 +170,1470 @@ HnswGetEfConstruction(Relation index)
 }
 
 /*
- * Get proc
+ * Get the storage for new element values
  */
-FmgrInfo *
-HnswOptionalProcInfo(Relation index, uint16 procnum)
+int
+HnswGetQuantization(Relation index)
 {
-	if (!OidIsValid(index_getprocid(index, 1, procnum)))
-		return NULL;
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
 
-	return index_getprocinfo(index, 1, procnum);
+	if (opts)
+		return opts->quantization;
+
+	return HNSW_QUANTIZATION_NONE;
 }
 
 /*
- * Init support functions
+ * Get whether to build a separate graph for each filter value
  */
-void
-HnswInitSupport(HnswSupport * support, Relation index)
+bool
+HnswGetPartitioned(Relation index)
 {
-	support->procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
-	support->collation = index->rd_indcollation[0];
-	support->normprocinfo = HnswOptionalProcInfo(index, HNSW_NORM_PROC);
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+
+	if (opts)
+		return opts->partitioned;
+
+	return false;
 }
 
 /*
- * Normalize value
+ * Get whether to export a read-only copy of the graph for scans
  */
-Datum
-HnswNormValue(const HnswTypeInfo * typeInfo, Oid collation, Datum value)
+bool
+HnswGetSnapshot(Relation index)
 {
-	return DirectFunctionCall1Coll(typeInfo->normalize, collation, value);
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+
+	if (opts)
+		return opts->snapshot;
+
+	return false;
 }
 
 /*
- * Check if non-zero norm
+ * Get proc
  */
-bool
-HnswCheckNorm(HnswSupport * support, Datum value)
+FmgrInfo *
+HnswOptionalProcInfo(Relation index, uint16 procnum)
 {
-	return DatumGetFloat8(FunctionCall1Coll(support->normprocinfo, support->collation, value)) > 0;
+	if (!OidIsValid(index_getprocid(index, 1, procnum)))
+		return NULL;
+
+	return index_getprocinfo(index, 1, procnum);
 }
 
+/* Distance functions for built-in operator classes */
+PGDLLEXPORT Datum vector_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_negative_inner_product(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum l1_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_negative_inner_product(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_l1_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hamming_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum jaccard_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum sparsevec_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum sparsevec_negative_inner_product(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum sparsevec_l1_distance(PG_FUNCTION_ARGS);
+
 /*
- * New buffer
+ * Native distance functions
+ *
+ * Values are never toasted (see HnswFormIndexValue and GetScanValue), so they
+ * can be used directly. Return false when dimensions differ so the caller
+ * falls back to fmgr, which reports the error.
  */
-Buffer
-HnswNewBuffer(Relation index, ForkNumber forkNum)
+static bool
+HnswVectorL2SquaredDistance(Datum a, Datum b, double *distance)
 {
-	Buffer		buf = ReadBufferExtended(index, forkNum, P_NEW, RBM_NORMAL, NULL);
+	Vector	   *va = (Vector *) DatumGetPointer(a);
+	Vector	   *vb = (Vector *) DatumGetPointer(b);
 
-	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
-	return buf;
+	if (va->dim != vb->dim)
+		return false;
+
+	*distance = (double) VectorL2SquaredDistance(va->dim, va->x, vb->x);
+	return true;
 }
 
-/*
- * Init page
- */
-void
-HnswInitPage(Buffer buf, Page page)
+static bool
+HnswVectorNegativeInnerProduct(Datum a, Datum b, double *distance)
 {
-	PageInit(page, BufferGetPageSize(buf), sizeof(HnswPageOpaqueData));
-	HnswPageGetOpaque(page)->nextblkno = InvalidBlockNumber;
-	HnswPageGetOpaque(page)->page_id = HNSW_PAGE_ID;
+	Vector	   *va = (Vector *) DatumGetPointer(a);
+	Vector	   *vb = (Vector *) DatumGetPointer(b);
+
+	if (va->dim != vb->dim)
+		return false;
+
+	*distance = (double) -VectorInnerProduct(va->dim, va->x, vb->x);
+	return true;
 }
 
-/*
- * Allocate a neighbor array
- */
-HnswNeighborArray *
-HnswInitNeighborArray(int lm, HnswAllocator * allocator)
+static bool
+HnswVectorDistances(Datum a, Datum *values, int n, double *distances, bool innerProduct)
 {
-	HnswNeighborArray *a = HnswAlloc(allocator, HNSW_NEIGHBOR_ARRAY_SIZE(lm));
+	Vector	   *va = (Vector *) DatumGetPointer(a);
+	float	   *bxs[HNSW_MAX_M * 2];
+	float		results[HNSW_MAX_M * 2];
 
-	a->length = 0;
-	a->closerSet = false;
-	return a;
+	if (n > lengthof(bxs))
+		return false;
+
+	for (int i = 0; i < n; i++)
+	{
+		Vector	   *vb = (Vector *) DatumGetPointer(values[i]);
+
+		if (va->dim != vb->dim)
+			return false;
+
+		bxs[i] = vb->x;
+	}
+
+	if (innerProduct)
+	{
+		VectorInnerProductBatch(va->dim, va->x, bxs, n, results);
+
+		for (int i = 0; i < n; i++)
+			distances[i] = (double) -results[i];
+	}
+	else
+	{
+		VectorL2SquaredDistanceBatch(va->dim, va->x, bxs, n, results);
+
+		for (int i = 0; i < n; i++)
+			distances[i] = (double) results[i];
+	}
+
+	return true;
 }
 
-/*
- * Allocate neighbors
- */
-void
-HnswInitNeighbors(char *base, HnswElement element, int m, HnswAllocator * allocator)
+static bool
+HnswVectorL2SquaredDistances(Datum a, Datum *values, int n, double *distances)
 {
-	int			level = element->level;
-	HnswNeighborArrayPtr *neighborList = (HnswNeighborArrayPtr *) HnswAlloc(allocator, sizeof(HnswNeighborArrayPtr) * (level + 1));
+	return HnswVectorDistances(a, values, n, distances, false);
+}
 
-	HnswPtrStore(base, element->neighbors, neighborList);
+static bool
+HnswVectorNegativeInnerProducts(Datum a, Datum *values, int n, double *distances)
+{
+	return HnswVectorDistances(a, values, n, distances, true);
+}
 
-	for (int lc = 0; lc <= level; lc++)
-		HnswPtrStore(base, neighborList[lc], HnswInitNeighborArray(HnswGetLayerM(m, lc), allocator));
+static bool
+HnswVectorL1Distance(Datum a, Datum b, double *distance)
+{
+	Vector	   *va = (Vector *) DatumGetPointer(a);
+	Vector	   *vb = (Vector *) DatumGetPointer(b);
+
+	if (va->dim != vb->dim)
+		return false;
+
+	*distance = (double) VectorL1Distance(va->dim, va->x, vb->x);
+	return true;
 }
 
-/*
- * Allocate memory from the allocator
- */
-void *
-HnswAlloc(HnswAllocator * allocator, Size size)
+static bool
+HnswHalfvecL2SquaredDistance(Datum a, Datum b, double *distance)
 {
-	if (allocator)
-		return (*(allocator)->alloc) (size, (allocator)->state);
+	HalfVector *va = (HalfVector *) DatumGetPointer(a);
+	HalfVector *vb = (HalfVector *) DatumGetPointer(b);
 
-	return palloc(size);
+	if (va->dim != vb->dim)
+		return false;
+
+	*distance = (double) HalfvecL2SquaredDistance(va->dim, va->x, vb->x);
+	return true;
+}
+
+static bool
+HnswHalfvecNegativeInnerProduct(Datum a, Datum b, double *distance)
+{
+	HalfVector *va = (HalfVector *) DatumGetPointer(a);
+	HalfVector *vb = (HalfVector *) DatumGetPointer(b);
+
+	if (va->dim != vb->dim)
+		return false;
+
+	*distance = (double) -HalfvecInnerProduct(va->dim, va->x, vb->x);
+	return true;
+}
+
+static bool
+HnswHalfvecL1Distance(Datum a, Datum b, double *distance)
+{
+	HalfVector *va = (HalfVector *) DatumGetPointer(a);
+	HalfVector *vb = (HalfVector *) DatumGetPointer(b);
+
+	if (va->dim != vb->dim)
+		return false;
+
+	*distance = (double) HalfvecL1Distance(va->dim, va->x, vb->x);
+	return true;
+}
+
+static bool
+HnswHammingDistance(Datum a, Datum b, double *distance)
+{
+	VarBit	   *va = (VarBit *) DatumGetPointer(a);
+	VarBit	   *vb = (VarBit *) DatumGetPointer(b);
+
+	if (VARBITLEN(va) != VARBITLEN(vb))
+		return false;
+
+	*distance = (double) BitHammingDistance(VARBITBYTES(va), VARBITS(va), VARBITS(vb), 0);
+	return true;
+}
+
+static bool
+HnswHammingDistances(Datum a, Datum *values, int n, double *distances)
+{
+	VarBit	   *va = (VarBit *) DatumGetPointer(a);
+	unsigned char *bxs[HNSW_MAX_M * 2];
+	uint64		counts[HNSW_MAX_M * 2];
+
+	if (n > lengthof(bxs))
+		return false;
+
+	for (int i = 0; i < n; i++)
+	{
+		VarBit	   *vb = (VarBit *) DatumGetPointer(values[i]);
+
+		if (VARBITLEN(va) != VARBITLEN(vb))
+			return false;
+
+		bxs[i] = VARBITS(vb);
+	}
+
+	BitHammingDistanceBatch(VARBITBYTES(va), VARBITS(va), bxs, n, counts);
+
+	for (int i = 0; i < n; i++)
+		distances[i] = (double) counts[i];
+
+	return true;
+}
+
+static bool
+HnswJaccardDistance(Datum a, Datum b, double *distance)
+{
+	VarBit	   *va = (VarBit *) DatumGetPointer(a);
+	VarBit	   *vb = (VarBit *) DatumGetPointer(b);
+
+	if (VARBITLEN(va) != VARBITLEN(vb))
+		return false;
+
+	*distance = BitJaccardDistance(VARBITBYTES(va), VARBITS(va), VARBITS(vb), 0, 0, 0);
+	return true;
+}
+
+static bool
+HnswJaccardDistances(Datum a, Datum *values, int n, double *distances)
+{
+	VarBit	   *va = (VarBit *) DatumGetPointer(a);
+	unsigned char *bxs[HNSW_MAX_M * 2];
+
+	if (n > lengthof(bxs))
+		return false;
+
+	for (int i = 0; i < n; i++)
+	{
+		VarBit	   *vb = (VarBit *) DatumGetPointer(values[i]);
+
+		if (VARBITLEN(va) != VARBITLEN(vb))
+			return false;
+
+		bxs[i] = VARBITS(vb);
+	}
+
+	BitJaccardDistanceBatch(VARBITBYTES(va), VARBITS(va), bxs, n, distances);
+	return true;
+}
+
+static bool
+HnswSparsevecL2SquaredDistance(Datum a, Datum b, double *distance)
+{
+	SparseVector *va = (SparseVector *) DatumGetPointer(a);
+	SparseVector *vb = (SparseVector *) DatumGetPointer(b);
+
+	if (va->dim != vb->dim)
+		return false;
+
+	*distance = (double) SparsevecL2SquaredDistance(va, vb);
+	return true;
+}
+
+static bool
+HnswSparsevecNegativeInnerProduct(Datum a, Datum b, double *distance)
+{
+	SparseVector *va = (SparseVector *) DatumGetPointer(a);
+	SparseVector *vb = (SparseVector *) DatumGetPointer(b);
+
+	if (va->dim != vb->dim)
+		return false;
+
+	*distance = (double) -SparsevecInnerProduct(va, vb);
+	return true;
+}
+
+static bool
+HnswSparsevecL1Distance(Datum a, Datum b, double *distance)
+{
+	SparseVector *va = (SparseVector *) DatumGetPointer(a);
+	SparseVector *vb = (SparseVector *) DatumGetPointer(b);
+
+	if (va->dim != vb->dim)
+		return false;
+
+	*distance = (double) SparsevecL1Distance(va, vb);
+	return true;
 }
 
 /*
- * Allocate an element
+ * Get the native distance function for a support function
  */
-HnswElement
-HnswInitElement(char *base, ItemPointer heaptid, int m, double ml, int maxLevel, HnswAllocator * allocator)
+static HnswDistanceFunc
+HnswNativeDistance(FmgrInfo *procinfo)
 {
-	HnswElement element = HnswAlloc(allocator, sizeof(HnswElementData));
+	static const struct
+	{
+		PGFunction	fmgr;
+		HnswDistanceFunc native;
+	}			functions[] =
+	{
+		{vector_l2_squared_distance, HnswVectorL2SquaredDistance},
+		{vector_negative_inner_product, HnswVectorNegativeInnerProduct},
+		{l1_distance, HnswVectorL1Distance},
+		{halfvec_l2_squared_distance, HnswHalfvecL2SquaredDistance},
+		{halfvec_negative_inner_product, HnswHalfvecNegativeInnerProduct},
+		{halfvec_l1_distance, HnswHalfvecL1Distance},
+		{hamming_distance, HnswHammingDistance},
+		{jaccard_distance, HnswJaccardDistance},
+		{sparsevec_l2_squared_distance, HnswSparsevecL2SquaredDistance},
+		{sparsevec_negative_inner_product, HnswSparsevecNegativeInnerProduct},
+		{sparsevec_l1_distance, HnswSparsevecL1Distance}
+	};
 
-	int			level = (int) (-log(RandomDouble()) * ml);
+	for (int i = 0; i < lengthof(functions); i++)
+	{
+		if (procinfo->fn_addr == functions[i].fmgr)
+			return functions[i].native;
+	}
 
-	/* Cap level */
-	if (level > maxLevel)
-		level = maxLevel;
+	/* Use fmgr for other operator classes */
+	return NULL;
+}
 
-	element->heaptidsLength = 0;
-	HnswAddHeapTid(element, heaptid);
+static bool
+HnswQuantizedL2SquaredDistance(Datum a, HnswQuantizedVector * b, double *distance)
+{
+	Vector	   *va = (Vector *) DatumGetPointer(a);
 
-	element->level = level;
-	element->deleted = 0;
-	/* Start at one to make it easier to find issues */
-	element->version = 1;
+	if (va->dim != b->dim)
+		return false;
+
+	*distance = (double) VectorQuantizedL2SquaredDistance(va->dim, va->x, b->offset, b->scale, b->x);
+	return true;
+}
+
+static bool
+HnswQuantizedNegativeInnerProduct(Datum a, HnswQuantizedVector * b, double *distance)
+{
+	Vector	   *va = (Vector *) DatumGetPointer(a);
+
+	if (va->dim != b->dim)
+		return false;
+
+	*distance = (double) -VectorQuantizedInnerProduct(va->dim, va->x, b->offset, b->scale, b->x);
+	return true;
+}
+
+static bool
+HnswQuantizedL1Distance(Datum a, HnswQuantizedVector * b, double *distance)
+{
+	Vector	   *va = (Vector *) DatumGetPointer(a);
+
+	if (va->dim != b->dim)
+		return false;
+
+	*distance = (double) VectorQuantizedL1Distance(va->dim, va->x, b->offset, b->scale, b->x);
+	return true;
+}
+
+/*
+ * Get the batch distance function for a support function
+ */
+static HnswBatchDistanceFunc
+HnswNativeBatchDistance(FmgrInfo *procinfo)
+{
+	if (procinfo->fn_addr == vector_l2_squared_distance)
+		return HnswVectorL2SquaredDistances;
+
+	if (procinfo->fn_addr == vector_negative_inner_product)
+		return HnswVectorNegativeInnerProducts;
+
+	if (procinfo->fn_addr == hamming_distance)
+		return HnswHammingDistances;
+
+	if (procinfo->fn_addr == jaccard_distance)
+		return HnswJaccardDistances;
+
+	return NULL;
+}
+
+/*
+ * Get the quantized distance function for a support function
+ */
+static HnswQuantizedDistanceFunc
+HnswNativeQuantizedDistance(FmgrInfo *procinfo)
+{
+	if (procinfo->fn_addr == vector_l2_squared_distance)
+		return HnswQuantizedL2SquaredDistance;
+
+	if (procinfo->fn_addr == vector_negative_inner_product)
+		return HnswQuantizedNegativeInnerProduct;
+
+	if (procinfo->fn_addr == l1_distance)
+		return HnswQuantizedL1Distance;
+
+	return NULL;
+}
+
+/*
+ * Estimate the inner product of two sketches after subtracting their means
+ *
+ * The fraction of differing signs approximates the angle between the
+ * centered vectors.
+ */
+static inline double
+HnswSketchCenteredInnerProduct(HnswBinarySketch * a, HnswBinarySketch * b)
+{
+	uint64		distance = BitHammingDistance((a->dim + 7) / 8, a->x, b->x, 0);
+
+	return (double) a->norm * b->norm * cos(M_PI * distance / a->dim);
+}
+
+static double
+HnswSketchL2SquaredDistance(HnswBinarySketch * a, HnswBinarySketch * b)
+{
+	double		meanDiff = (double) a->mean - b->mean;
+	double		distance;
+
+	distance = (double) a->norm * a->norm + (double) b->norm * b->norm - 2 * HnswSketchCenteredInnerProduct(a, b) + a->dim * meanDiff * meanDiff;
+
+	/* Estimate can be slightly negative */
+	return Max(distance, 0);
+}
+
+static double
+HnswSketchNegativeInnerProduct(HnswBinarySketch * a, HnswBinarySketch * b)
+{
+	return -(HnswSketchCenteredInnerProduct(a, b) + (double) a->dim * a->mean * b->mean);
+}
+
+/*
+ * Get the sketch distance function for a support function
+ */
+static HnswSketchDistanceFunc
+HnswNativeSketchDistance(FmgrInfo *procinfo)
+{
+	if (procinfo->fn_addr == vector_l2_squared_distance)
+		return HnswSketchL2SquaredDistance;
+
+	if (procinfo->fn_addr == vector_negative_inner_product)
+		return HnswSketchNegativeInnerProduct;
+
+	return NULL;
+}
+
+/*
+ * Init support functions
+ */
+void
+HnswInitSupport(HnswSupport * support, Relation index)
+{
+	int			nkeys = IndexRelationGetNumberOfKeyAttributes(index);
+
+	support->filterType = InvalidOid;
+	if (nkeys > 1)
+	{
+		Oid			type = TupleDescAttr(RelationGetDescr(index), 1)->atttypid;
+
+		if (nkeys > 2 || (type != INT2OID && type != INT4OID && type != INT8OID))
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("hnsw index can only have a single filter column of type smallint, integer, or bigint")));
+
+		support->filterType = type;
+	}
+
+	support->procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
+	support->collation = index->rd_indcollation[0];
+	support->normprocinfo = HnswOptionalProcInfo(index, HNSW_NORM_PROC);
+	support->distance = HnswNativeDistance(support->procinfo);
+	support->batchDistance = HnswNativeBatchDistance(support->procinfo);
+	support->quantization = HnswGetQuantization(index);
+	support->quantizedDistance = HnswNativeQuantizedDistance(support->procinfo);
+	support->sketchDistance = HnswNativeSketchDistance(support->procinfo);
+	support->visited = NULL;
+	support->candidateCtx = NULL;
+	support->elementCtx = NULL;
+	support->stats = NULL;
+	support->lockWait = NULL;
+
+	/* Values are quantized from floats */
+	if (support->quantization == HNSW_QUANTIZATION_INT8 && support->quantizedDistance == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("int8 quantization requires vector_l2_ops, vector_ip_ops, vector_cosine_ops, or vector_l1_ops")));
+
+	if (support->quantization == HNSW_QUANTIZATION_BINARY && support->sketchDistance == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("binary quantization requires vector_l2_ops, vector_ip_ops, or vector_cosine_ops")));
+}
+
+/*
+ * Normalize value
+ */
+Datum
+HnswNormValue(const HnswTypeInfo * typeInfo, Oid collation, Datum value)
+{
+	return DirectFunctionCall1Coll(typeInfo->normalize, collation, value);
+}
+
+/*
+ * Check if non-zero norm
+ */
+bool
+HnswCheckNorm(HnswSupport * support, Datum value)
+{
+	return DatumGetFloat8(FunctionCall1Coll(support->normprocinfo, support->collation, value)) > 0;
+}
+
+/*
+ * New buffer
+ */
+Buffer
+HnswNewBuffer(Relation index, ForkNumber forkNum)
+{
+	Buffer		buf = ReadBufferExtended(index, forkNum, P_NEW, RBM_NORMAL, NULL);
+
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	return buf;
+}
+
+/*
+ * Init page
+ */
+void
+HnswInitPage(Buffer buf, Page page)
+{
+	PageInit(page, BufferGetPageSize(buf), sizeof(HnswPageOpaqueData));
+	HnswPageGetOpaque(page)->nextblkno = InvalidBlockNumber;
+	HnswPageGetOpaque(page)->page_id = HNSW_PAGE_ID;
+}
+
+/*
+ * Allocate a neighbor array
+ */
+HnswNeighborArray *
+HnswInitNeighborArray(int lm, HnswAllocator * allocator)
+{
+	HnswNeighborArray *a = HnswAlloc(allocator, HNSW_NEIGHBOR_ARRAY_SIZE(lm));
+
+	a->length = 0;
+	a->closerSet = false;
+	return a;
+}
+
+/*
+ * Get the memory needed for the neighbors of an element
+ */
+Size
+HnswGetNeighborsSize(int level, int m)
+{
+	Size		size = MAXALIGN(sizeof(HnswNeighborArrayPtr) * (level + 1));
+
+	for (int lc = 0; lc <= level; lc++)
+		size += MAXALIGN(HNSW_NEIGHBOR_ARRAY_SIZE(HnswGetLayerM(m, lc)));
+
+	return size;
+}
+
+/*
+ * Set up neighbors in memory from HnswGetNeighborsSize
+ *
+ * The list and the arrays for each layer are contiguous, with layer 0 first
+ * since it is read the most
+ */
+static void
+HnswInitNeighborsInPlace(char *base, HnswElement element, int m, char *ptr)
+{
+	int			level = element->level;
+	HnswNeighborArrayPtr *neighborList = (HnswNeighborArrayPtr *) ptr;
+
+	HnswPtrStore(base, element->neighbors, neighborList);
+	ptr += MAXALIGN(sizeof(HnswNeighborArrayPtr) * (level + 1));
+
+	for (int lc = 0; lc <= level; lc++)
+	{
+		HnswNeighborArray *a = (HnswNeighborArray *) ptr;
+		int			lm = HnswGetLayerM(m, lc);
+
+		a->length = 0;
+		a->closerSet = false;
+		HnswPtrStore(base, neighborList[lc], a);
+		ptr += MAXALIGN(HNSW_NEIGHBOR_ARRAY_SIZE(lm));
+	}
+}
+
+/*
+ * Allocate neighbors
+ */
+void
+HnswInitNeighbors(char *base, HnswElement element, int m, HnswAllocator * allocator)
+{
+	char	   *ptr = HnswAlloc(allocator, HnswGetNeighborsSize(element->level, m));
+
+	HnswInitNeighborsInPlace(base, element, m, ptr);
+}
+
+/*
+ * Allocate memory from the allocator
+ */
+void *
+HnswAlloc(HnswAllocator * allocator, Size size)
+{
+	if (allocator)
+		return (*(allocator)->alloc) (size, (allocator)->state);
+
+	return palloc(size);
+}
+
+/*
+ * Allocate an element, with space for its value if valueSize is not zero
+ *
+ * The element, value and neighbors are allocated as a single chunk, so
+ * computing the distance to an element and reading its neighbors touches
+ * nearby memory, and in-memory builds avoid the overhead of separate chunks
+ */
+HnswElement
+HnswInitElement(char *base, ItemPointer heaptid, int m, double ml, int maxLevel, Size valueSize, HnswAllocator * allocator)
+{
+	int			level = (int) (-log(RandomDouble()) * ml);
+
+	/* Cap level */
+	if (level > maxLevel)
+		level = maxLevel;
+
+	return HnswInitElementWithLevel(base, heaptid, m, level, valueSize, allocator);
+}
+
+/*
+ * Allocate an element at a given level, with no heap TIDs if heaptid is NULL
+ */
+HnswElement
+HnswInitElementWithLevel(char *base, ItemPointer heaptid, int m, int level, Size valueSize, HnswAllocator * allocator)
+{
+	HnswElement element;
+	char	   *ptr;
+	Pointer		valuePtr;
+	Size		valueOffset = MAXALIGN(sizeof(HnswElementData));
+	Size		neighborsOffset = valueOffset + MAXALIGN(valueSize);
+
+	ptr = HnswAlloc(allocator, neighborsOffset + HnswGetNeighborsSize(level, m));
+	element = (HnswElement) ptr;
+
+	element->heaptidsLength = 0;
+	if (heaptid != NULL)
+		HnswAddHeapTid(element, heaptid);
+
+	element->level = level;
+	element->deleted = 0;
+	/* Start at one to make it easier to find issues */
+	element->version = 1;
+	element->ordinal = 0;
+	element->filter.value = 0;
+	element->filter.isnull = true;
+
+	HnswInitNeighborsInPlace(base, element, m, ptr + neighborsOffset);
+
+	valuePtr = valueSize > 0 ? ptr + valueOffset : NULL;
+	HnswPtrStore(base, element->value, valuePtr);
+
+	return element;
+}
+
+/*
+ * Add a heap TID to an element
+ */
+void
+HnswAddHeapTid(HnswElement element, ItemPointer heaptid)
+{
+	element->heaptids[element->heaptidsLength++] = *heaptid;
+}
+
+/*
+ * Allocate from a slab if set
+ */
+static inline void *
+HnswSlabAlloc(MemoryContext slab, Size size)
+{
+	if (slab != NULL)
+		return MemoryContextAlloc(slab, size);
+
+	return palloc(size);
+}
+
+/*
+ * Initialize an element from block and offset numbers
+ */
+static HnswElement
+InitElementFromBlock(HnswElement element, BlockNumber blkno, OffsetNumber offno)
+{
+	char	   *base = NULL;
+
+	element->blkno = blkno;
+	element->offno = offno;
+	HnswPtrStore(base, element->neighbors, (HnswNeighborArrayPtr *) NULL);
+	HnswPtrStore(base, element->value, (Pointer) NULL);
+	return element;
+}
+
+/*
+ * Allocate an element from block and offset numbers
+ */
+HnswElement
+HnswInitElementFromBlock(BlockNumber blkno, OffsetNumber offno)
+{
+	return InitElementFromBlock(palloc(sizeof(HnswElementData)), blkno, offno);
+}
+
+/*
+ * Get the metapage info
+ */
+void
+HnswGetMetaPageInfo(Relation index, int *m, HnswElement * entryPoint)
+{
+	Buffer		buf;
+	Page		page;
+	HnswMetaPage metap;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = HnswPageGetMeta(page);
+
+	if (unlikely(metap->magicNumber != HNSW_MAGIC_NUMBER))
+		elog(ERROR, "hnsw index is not valid");
+
+	if (m != NULL)
+		*m = metap->m;
+
+	if (entryPoint != NULL)
+	{
+		if (BlockNumberIsValid(metap->entryBlkno))
+		{
+			*entryPoint = HnswInitElementFromBlock(metap->entryBlkno, metap->entryOffno);
+			(*entryPoint)->level = metap->entryLevel;
+		}
+		else
+			*entryPoint = NULL;
+	}
+
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Get the metapage info for scans
+ */
+void
+HnswGetScanMetaPageInfo(Relation index, int *m, uint32 *upperVersion, uint32 *upperInserts, bool *partitioned, uint32 *snapshotId)
+{
+	Buffer		buf;
+	Page		page;
+	HnswMetaPage metap;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = HnswPageGetMeta(page);
+
+	if (unlikely(metap->magicNumber != HNSW_MAGIC_NUMBER))
+		elog(ERROR, "hnsw index is not valid");
+
+	*m = metap->m;
+
+	/* Indexes created before the upper cache have zeros after the directory */
+	*upperVersion = metap->upperVersion;
+	*upperInserts = metap->upperInserts;
+	*partitioned = metap->directoryBuckets > 0;
+
+	/* Indexes created before snapshots have zeros after the upper cache */
+	*snapshotId = metap->snapshotId;
+
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Get the directory info from the metapage
+ */
+static uint32
+HnswGetDirectoryInfo(Relation index, BlockNumber *directoryBlkno, HnswElement * entryPoint)
+{
+	Buffer		buf;
+	Page		page;
+	HnswMetaPage metap;
+	uint32		buckets;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = HnswPageGetMeta(page);
+
+	if (unlikely(metap->magicNumber != HNSW_MAGIC_NUMBER))
+		elog(ERROR, "hnsw index is not valid");
+
+	/* Indexes created before partitioning have zeros after the insert page */
+	buckets = metap->directoryBuckets;
+
+	if (directoryBlkno != NULL)
+		*directoryBlkno = metap->directoryBlkno;
+
+	if (entryPoint != NULL)
+	{
+		if (buckets == 0 && BlockNumberIsValid(metap->entryBlkno))
+		{
+			*entryPoint = HnswInitElementFromBlock(metap->entryBlkno, metap->entryOffno);
+			(*entryPoint)->level = metap->entryLevel;
+		}
+		else
+			*entryPoint = NULL;
+	}
+
+	UnlockReleaseBuffer(buf);
+
+	return buckets;
+}
+
+/*
+ * Check if the index has a separate graph for each filter value
+ */
+bool
+HnswIsPartitioned(Relation index)
+{
+	return HnswGetDirectoryInfo(index, NULL, NULL) > 0;
+}
+
+/*
+ * Hash a filter value
+ *
+ * Used to find the directory bucket, so must be stable
+ */
+uint32
+HnswPartitionHash(int64 value)
+{
+	return (uint32) murmurhash64((uint64) value);
+}
+
+/*
+ * Get the directory bucket for a filter value
+ */
+static inline BlockNumber
+HnswGetDirectoryBucket(BlockNumber directoryBlkno, uint32 buckets, int64 value)
+{
+	return directoryBlkno + HnswPartitionHash(value) % buckets;
+}
+
+/*
+ * Find a filter value on a directory page
+ */
+static HnswDirectoryEntry *
+HnswFindDirectoryEntry(Page page, int64 value)
+{
+	HnswDirectoryEntry *entries = HnswPageGetDirectory(page);
+	int			length = HnswPageGetDirectoryLength(page);
+
+	for (int i = 0; i < length; i++)
+	{
+		if (entries[i].value == value)
+			return &entries[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Get the entry point, or the entry point for the filter value if the index
+ * is partitioned
+ */
+HnswElement
+HnswGetEntryPoint(Relation index, HnswFilterData * filter)
+{
+	HnswElement entryPoint;
+	BlockNumber blkno;
+	uint32		buckets;
+
+	buckets = HnswGetDirectoryInfo(index, &blkno, &entryPoint);
+	if (buckets == 0)
+		return entryPoint;
+
+	if (filter == NULL || filter->isnull)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot scan partitioned hnsw index without an equality condition on the filter column")));
+
+	blkno = HnswGetDirectoryBucket(blkno, buckets, filter->value);
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf;
+		Page		page;
+		HnswDirectoryEntry *entry;
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+
+		entry = HnswFindDirectoryEntry(page, filter->value);
+		if (entry != NULL)
+		{
+			if (BlockNumberIsValid(entry->blkno))
+			{
+				entryPoint = HnswInitElementFromBlock(entry->blkno, entry->offno);
+				entryPoint->level = entry->level;
+			}
+
+			UnlockReleaseBuffer(buf);
+			break;
+		}
+
+		blkno = HnswPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	return entryPoint;
+}
+
+/*
+ * Get the entry points for all partitions
+ */
+List *
+HnswGetPartitionEntryPoints(Relation index)
+{
+	List	   *entryPoints = NIL;
+	BlockNumber directoryBlkno;
+	uint32		buckets;
+
+	buckets = HnswGetDirectoryInfo(index, &directoryBlkno, NULL);
+
+	for (uint32 i = 0; i < buckets; i++)
+	{
+		BlockNumber blkno = directoryBlkno + i;
+
+		while (BlockNumberIsValid(blkno))
+		{
+			Buffer		buf;
+			Page		page;
+			HnswDirectoryEntry *entries;
+			int			length;
+
+			buf = ReadBuffer(index, blkno);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+			page = BufferGetPage(buf);
+			entries = HnswPageGetDirectory(page);
+			length = HnswPageGetDirectoryLength(page);
+
+			for (int j = 0; j < length; j++)
+			{
+				HnswElement entryPoint;
+
+				if (!BlockNumberIsValid(entries[j].blkno))
+					continue;
+
+				entryPoint = HnswInitElementFromBlock(entries[j].blkno, entries[j].offno);
+				entryPoint->level = entries[j].level;
+				entryPoint->filter.value = entries[j].value;
+				entryPoint->filter.isnull = false;
+
+				entryPoints = lappend(entryPoints, entryPoint);
+			}
+
+			blkno = HnswPageGetOpaque(page)->nextblkno;
+
+			UnlockReleaseBuffer(buf);
+		}
+	}
+
+	return entryPoints;
+}
+
+/*
+ * Update the metapage info
+ */
+static void
+HnswUpdateMetaPageInfo(Page page, int updateEntry, HnswElement entryPoint, BlockNumber insertPage)
+{
+	HnswMetaPage metap = HnswPageGetMeta(page);
+
+	if (updateEntry)
+	{
+		if (entryPoint == NULL)
+		{
+			metap->entryBlkno = InvalidBlockNumber;
+			metap->entryOffno = InvalidOffsetNumber;
+			metap->entryLevel = -1;
+		}
+		else if (entryPoint->level > metap->entryLevel || updateEntry == HNSW_UPDATE_ENTRY_ALWAYS)
+		{
+			metap->entryBlkno = entryPoint->blkno;
+			metap->entryOffno = entryPoint->offno;
+			metap->entryLevel = entryPoint->level;
+		}
+	}
+
+	if (BlockNumberIsValid(insertPage))
+		metap->insertPage = insertPage;
+}
+
+/*
+ * Update the metapage
+ */
+void
+HnswUpdateMetaPage(Relation index, int updateEntry, HnswElement entryPoint, BlockNumber insertPage, ForkNumber forkNum, bool building)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+
+	buf = ReadBufferExtended(index, forkNum, HNSW_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	if (building)
+	{
+		state = NULL;
+		page = BufferGetPage(buf);
+	}
+	else
+	{
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+	}
+
+	HnswUpdateMetaPageInfo(page, updateEntry, entryPoint, insertPage);
+
+	if (building)
+		MarkBufferDirty(buf);
+	else
+		GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Record a change to the upper layers for backends that cache them
+ *
+ * Deleting elements invalidates the cache, while inserting elements only
+ * makes it stale, so the cache is loaded again after enough inserts
+ */
+void
+HnswUpdateUpperVersion(Relation index, bool deleted)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	HnswMetaPage metap;
+	uint16		lower;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	metap = HnswPageGetMeta(page);
+
+	if (deleted)
+		metap->upperVersion++;
+	else
+		metap->upperInserts++;
+
+	/* Extend for indexes created before the upper cache so changes are logged */
+	lower = ((char *) metap + sizeof(HnswMetaPageData)) - (char *) page;
+	if (((PageHeader) page)->pd_lower < lower)
+		((PageHeader) page)->pd_lower = lower;
+
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Set a directory entry
+ */
+static void
+HnswSetDirectoryEntry(HnswDirectoryEntry * entry, int updateEntry, HnswElement entryPoint)
+{
+	if (entryPoint == NULL)
+	{
+		entry->blkno = InvalidBlockNumber;
+		entry->offno = InvalidOffsetNumber;
+		entry->level = -1;
+	}
+	else if (entryPoint->level > entry->level || updateEntry == HNSW_UPDATE_ENTRY_ALWAYS)
+	{
+		entry->blkno = entryPoint->blkno;
+		entry->offno = entryPoint->offno;
+		entry->level = entryPoint->level;
+	}
+}
+
+/*
+ * Add a directory entry to a page with enough space
+ */
+static void
+HnswAddDirectoryEntry(Page page, int64 value, HnswElement entryPoint)
+{
+	HnswDirectoryEntry *entry = &HnswPageGetDirectory(page)[HnswPageGetDirectoryLength(page)];
+
+	entry->value = value;
+	entry->level = -1;
+	HnswSetDirectoryEntry(entry, HNSW_UPDATE_ENTRY_ALWAYS, entryPoint);
+
+	((PageHeader) page)->pd_lower = ((char *) (entry + 1)) - (char *) page;
+}
+
+/*
+ * Update the entry point, or the entry point for the filter value if the
+ * index is partitioned
+ *
+ * Partitioned indexes require an exclusive update lock, so there is at most
+ * one process changing the directory.
+ */
+void
+HnswUpdateEntryPoint(Relation index, int updateEntry, HnswFilterData * filter, HnswElement entryPoint, ForkNumber forkNum, bool building)
+{
+	BlockNumber blkno;
+	uint32		buckets;
+
+	buckets = HnswGetDirectoryInfo(index, &blkno, NULL);
+	if (buckets == 0)
+	{
+		HnswUpdateMetaPage(index, updateEntry, entryPoint, InvalidBlockNumber, forkNum, building);
+		return;
+	}
+
+	Assert(filter != NULL && !filter->isnull);
+
+	blkno = HnswGetDirectoryBucket(blkno, buckets, filter->value);
+
+	for (;;)
+	{
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *state;
+		HnswDirectoryEntry *entry;
+		BlockNumber nextblkno;
+		bool		updated = false;
+
+		buf = ReadBufferExtended(index, forkNum, blkno, RBM_NORMAL, NULL);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		if (building)
+		{
+			state = NULL;
+			page = BufferGetPage(buf);
+		}
+		else
+		{
+			state = GenericXLogStart(index);
+			page = GenericXLogRegisterBuffer(state, buf, 0);
+		}
+
+		entry = HnswFindDirectoryEntry(page, filter->value);
+		nextblkno = HnswPageGetOpaque(page)->nextblkno;
+
+		if (entry != NULL)
+		{
+			HnswSetDirectoryEntry(entry, updateEntry, entryPoint);
+			updated = true;
+		}
+		else if (!BlockNumberIsValid(nextblkno) && entryPoint != NULL)
+		{
+			/* Add to the last page of the bucket */
+			if (HnswPageGetDirectoryLength(page) < HNSW_DIRECTORY_MAX_ENTRIES)
+				HnswAddDirectoryEntry(page, filter->value, entryPoint);
+			else
+			{
+				Buffer		newbuf;
+				Page		newpage;
+
+				/* Add an overflow page */
+				LockRelationForExtension(index, ExclusiveLock);
+				newbuf = HnswNewBuffer(index, forkNum);
+				UnlockRelationForExtension(index, ExclusiveLock);
+
+				if (building)
+					newpage = BufferGetPage(newbuf);
+				else
+					newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
+
+				HnswInitPage(newbuf, newpage);
+				HnswAddDirectoryEntry(newpage, filter->value, entryPoint);
+
+				HnswPageGetOpaque(page)->nextblkno = BufferGetBlockNumber(newbuf);
+
+				/* Commit */
+				if (building)
+					MarkBufferDirty(newbuf);
+				else
+				{
+					GenericXLogFinish(state);
+					state = NULL;
+				}
+				UnlockReleaseBuffer(newbuf);
+			}
+
+			updated = true;
+		}
+
+		/* Commit */
+		if (building)
+		{
+			if (updated)
+				MarkBufferDirty(buf);
+		}
+		else if (state != NULL)
+		{
+			if (updated)
+				GenericXLogFinish(state);
+			else
+				GenericXLogAbort(state);
+		}
+		UnlockReleaseBuffer(buf);
+
+		if (updated || !BlockNumberIsValid(nextblkno))
+			return;
+
+		blkno = nextblkno;
+	}
+}
+
+/*
+ * Create the directory for a partitioned index during a build
+ */
+void
+HnswCreateDirectory(Relation index, List *entryPoints, ForkNumber forkNum)
+{
+	BlockNumber directoryBlkno = InvalidBlockNumber;
+	uint32		buckets;
+	Buffer		buf;
+	Page		page;
+	HnswMetaPage metap;
+	ListCell   *lc;
+
+	/* Keep buckets half full to leave room for new filter values */
+	buckets = Max(1, (2 * list_length(entryPoints) + HNSW_DIRECTORY_MAX_ENTRIES - 1) / HNSW_DIRECTORY_MAX_ENTRIES);
+
+	/* Buckets are contiguous, and no other process extends the relation */
+	for (uint32 i = 0; i < buckets; i++)
+	{
+		buf = HnswNewBuffer(index, forkNum);
+		page = BufferGetPage(buf);
+		HnswInitPage(buf, page);
+
+		if (i == 0)
+			directoryBlkno = BufferGetBlockNumber(buf);
+
+		Assert(BufferGetBlockNumber(buf) == directoryBlkno + i);
+
+		MarkBufferDirty(buf);
+		UnlockReleaseBuffer(buf);
+	}
+
+	/* Update metapage */
+	buf = ReadBufferExtended(index, forkNum, HNSW_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = BufferGetPage(buf);
+	metap = HnswPageGetMeta(page);
+	metap->directoryBlkno = directoryBlkno;
+	metap->directoryBuckets = buckets;
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+
+	/* Add entries */
+	foreach(lc, entryPoints)
+	{
+		HnswElement entryPoint = lfirst(lc);
+
+		HnswUpdateEntryPoint(index, HNSW_UPDATE_ENTRY_ALWAYS, &entryPoint->filter, entryPoint, forkNum, true);
+	}
+}
+
+/*
+ * Form index value
+ */
+bool
+HnswFormIndexValue(Datum *out, Datum *values, bool *isnull, const HnswTypeInfo * typeInfo, HnswSupport * support)
+{
+	/* Detoast once for all calls */
+	Datum		value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
+
+	/* Check value */
+	if (typeInfo->checkValue != NULL)
+		typeInfo->checkValue(DatumGetPointer(value));
+
+	/* Normalize if needed */
+	if (support->normprocinfo != NULL)
+	{
+		if (!HnswCheckNorm(support, value))
+			return false;
 
-	HnswInitNeighbors(base, element, m, allocator);
+		value = HnswNormValue(typeInfo, support->collation, value);
+	}
 
-	HnswPtrStore(base, element->value, (Pointer) NULL);
+	*out = value;
 
-	return element;
+	return true;
 }
 
 /*
- * Add a heap TID to an element
+ * Get the value of a filter column datum
  */
-void
-HnswAddHeapTid(HnswElement element, ItemPointer heaptid)
+int64
+HnswGetFilterValue(HnswSupport * support, Datum value)
 {
-	element->heaptids[element->heaptidsLength++] = *heaptid;
+	switch (support->filterType)
+	{
+		case INT2OID:
+			return DatumGetInt16(value);
+		case INT4OID:
+			return DatumGetInt32(value);
+		case INT8OID:
+			return DatumGetInt64(value);
+		default:
+			elog(ERROR, "unsupported filter type");
+	}
 }
 
 /*
- * Allocate an element from block and offset numbers
+ * Form filter value
  */
-HnswElement
-HnswInitElementFromBlock(BlockNumber blkno, OffsetNumber offno)
+void
+HnswFormFilterValue(HnswFilterData * filter, Datum *values, bool *isnull, HnswSupport * support)
 {
-	HnswElement element = palloc(sizeof(HnswElementData));
-	char	   *base = NULL;
-
-	element->blkno = blkno;
-	element->offno = offno;
-	HnswPtrStore(base, element->neighbors, (HnswNeighborArrayPtr *) NULL);
-	HnswPtrStore(base, element->value, (Pointer) NULL);
-	return element;
+	if (!OidIsValid(support->filterType) || isnull[1])
+	{
+		filter->value = 0;
+		filter->isnull = true;
+	}
+	else
+	{
+		filter->value = HnswGetFilterValue(support, values[1]);
+		filter->isnull = false;
+	}
 }
 
 /*
- * Get the metapage info
+ * Quantize a vector with its min and max
  */
 void
-HnswGetMetaPageInfo(Relation index, int *m, HnswElement * entryPoint)
+HnswQuantizeValue(Vector * vec, HnswQuantizedVector * result)
 {
-	Buffer		buf;
-	Page		page;
-	HnswMetaPage metap;
+	float		min = FLT_MAX;
+	float		max = -FLT_MAX;
+	float		scale;
 
-	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
-	LockBuffer(buf, BUFFER_LOCK_SHARE);
-	page = BufferGetPage(buf);
-	metap = HnswPageGetMeta(page);
+	for (int i = 0; i < vec->dim; i++)
+	{
+		if (vec->x[i] < min)
+			min = vec->x[i];
 
-	if (unlikely(metap->magicNumber != HNSW_MAGIC_NUMBER))
-		elog(ERROR, "hnsw index is not valid");
+		if (vec->x[i] > max)
+			max = vec->x[i];
+	}
 
-	if (m != NULL)
-		*m = metap->m;
+	scale = (max - min) / 255;
 
-	if (entryPoint != NULL)
+	SET_VARSIZE(result, HNSW_QUANTIZED_VECTOR_SIZE(vec->dim));
+	result->dim = vec->dim;
+	result->unused = 0;
+	result->offset = min;
+	result->scale = scale;
+
+	for (int i = 0; i < vec->dim; i++)
 	{
-		if (BlockNumberIsValid(metap->entryBlkno))
-		{
-			*entryPoint = HnswInitElementFromBlock(metap->entryBlkno, metap->entryOffno);
-			(*entryPoint)->level = metap->entryLevel;
-		}
-		else
-			*entryPoint = NULL;
-	}
+		/* All codes are zero when every element is the same */
+		float		code = scale > 0 ? rintf((vec->x[i] - min) / scale) : 0;
 
-	UnlockReleaseBuffer(buf);
+		result->x[i] = (uint8) Max(Min(code, 255), 0);
+	}
 }
 
 /*
- * Get the entry point
+ * Decode a quantized vector
  */
-HnswElement
-HnswGetEntryPoint(Relation index)
+Vector *
+HnswDequantizeValue(HnswQuantizedVector * vec)
 {
-	HnswElement entryPoint;
+	Vector	   *result = InitVector(vec->dim);
 
-	HnswGetMetaPageInfo(index, NULL, &entryPoint);
+	for (int i = 0; i < vec->dim; i++)
+		result->x[i] = vec->offset + vec->scale * vec->x[i];
 
-	return entryPoint;
+	return result;
 }
 
 /*
- * Update the metapage info
+ * Sketch a vector with the signs of its elements after subtracting the mean
  */
-static void
-HnswUpdateMetaPageInfo(Page page, int updateEntry, HnswElement entryPoint, BlockNumber insertPage)
+void
+HnswSketchValue(Vector * vec, HnswBinarySketch * result)
 {
-	HnswMetaPage metap = HnswPageGetMeta(page);
+	double		mean = 0;
+	double		norm = 0;
 
-	if (updateEntry)
-	{
-		if (entryPoint == NULL)
-		{
-			metap->entryBlkno = InvalidBlockNumber;
-			metap->entryOffno = InvalidOffsetNumber;
-			metap->entryLevel = -1;
-		}
-		else if (entryPoint->level > metap->entryLevel || updateEntry == HNSW_UPDATE_ENTRY_ALWAYS)
-		{
-			metap->entryBlkno = entryPoint->blkno;
-			metap->entryOffno = entryPoint->offno;
-			metap->entryLevel = entryPoint->level;
-		}
-	}
+	for (int i = 0; i < vec->dim; i++)
+		mean += vec->x[i];
 
-	if (BlockNumberIsValid(insertPage))
-		metap->insertPage = insertPage;
-}
+	mean /= vec->dim;
 
-/*
- * Update the metapage
- */
-void
-HnswUpdateMetaPage(Relation index, int updateEntry, HnswElement entryPoint, BlockNumber insertPage, ForkNumber forkNum, bool building)
-{
-	Buffer		buf;
-	Page		page;
-	GenericXLogState *state;
+	result->dim = vec->dim;
+	result->unused = 0;
+	result->mean = (float) mean;
+	MemSet(result->x, 0, (vec->dim + 7) / 8);
 
-	buf = ReadBufferExtended(index, forkNum, HNSW_METAPAGE_BLKNO, RBM_NORMAL, NULL);
-	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
-	if (building)
-	{
-		state = NULL;
-		page = BufferGetPage(buf);
-	}
-	else
+	for (int i = 0; i < vec->dim; i++)
 	{
-		state = GenericXLogStart(index);
-		page = GenericXLogRegisterBuffer(state, buf, 0);
-	}
+		double		diff = vec->x[i] - mean;
 
-	HnswUpdateMetaPageInfo(page, updateEntry, entryPoint, insertPage);
+		norm += diff * diff;
 
-	if (building)
-		MarkBufferDirty(buf);
-	else
-		GenericXLogFinish(state);
-	UnlockReleaseBuffer(buf);
+		if (diff > 0)
+			result->x[i / 8] |= 1 << (7 - (i % 8));
+	}
+
+	result->norm = (float) sqrt(norm);
 }
 
 /*
- * Form index value
+ * Get the size of an element tuple
  */
-bool
-HnswFormIndexValue(Datum *out, Datum *values, bool *isnull, const HnswTypeInfo * typeInfo, HnswSupport * support)
+Size
+HnswGetElementTupleSize(char *base, HnswElement element, HnswSupport * support)
 {
-	/* Detoast once for all calls */
-	Datum		value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
-
-	/* Check value */
-	if (typeInfo->checkValue != NULL)
-		typeInfo->checkValue(DatumGetPointer(value));
-
-	/* Normalize if needed */
-	if (support->normprocinfo != NULL)
-	{
-		if (!HnswCheckNorm(support, value))
-			return false;
+	Pointer		valuePtr = HnswPtrAccess(base, element->value);
+	Size		filterSize = OidIsValid(support->filterType) ? HNSW_FILTER_SIZE : 0;
 
-		value = HnswNormValue(typeInfo, support->collation, value);
-	}
+	if (support->quantization == HNSW_QUANTIZATION_INT8)
+		return HNSW_ELEMENT_TUPLE_SIZE(HNSW_QUANTIZED_VECTOR_SIZE(((Vector *) valuePtr)->dim)) + filterSize;
 
-	*out = value;
+	/* Binary quantization keeps the value for exact distances */
+	if (support->quantization == HNSW_QUANTIZATION_BINARY)
+		return HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(valuePtr)) + MAXALIGN(HNSW_BINARY_SKETCH_SIZE(((Vector *) valuePtr)->dim)) + filterSize;
 
-	return true;
+	return HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(valuePtr)) + filterSize;
 }
 
 /*
  * Set element tuple, except for neighbor info
  */
 void
-HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element)
+HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element, HnswSupport * support)
 {
 	Pointer		valuePtr = HnswPtrAccess(base, element->value);
 
@@ -444,7 +1648,18 @@ HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element)
 		else
 			ItemPointerSetInvalid(&etup->heaptids[i]);
 	}
-	memcpy(&etup->data, valuePtr, VARSIZE_ANY(valuePtr));
+
+	etup->quantization = support->quantization;
+	if (etup->quantization == HNSW_QUANTIZATION_INT8)
+		HnswQuantizeValue((Vector *) valuePtr, (HnswQuantizedVector *) &etup->data);
+	else
+		memcpy(&etup->data, valuePtr, VARSIZE_ANY(valuePtr));
+
+	if (etup->quantization == HNSW_QUANTIZATION_BINARY)
+		HnswSketchValue((Vector *) valuePtr, HnswElementTupleGetSketch(etup));
+
+	if (OidIsValid(support->filterType))
+		*HnswElementTupleGetFilter(etup) = element->filter;
 }
 
 /*
@@ -486,7 +1701,7 @@ HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int m)
  * Load an element from a tuple
  */
 void
-HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, bool loadHeaptids, bool loadVec)
+HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, HnswSupport * support, bool loadHeaptids, bool loadVec)
 {
 	element->level = etup->level;
 	element->deleted = etup->deleted;
@@ -507,10 +1722,25 @@ HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, bool loadHe
 		}
 	}
 
+	/* Value of deleted elements is zeroed, so filter cannot be located */
+	if (OidIsValid(support->filterType) && !etup->deleted)
+		element->filter = *HnswElementTupleGetFilter(etup);
+	else
+	{
+		element->filter.value = 0;
+		element->filter.isnull = true;
+	}
+
 	if (loadVec)
 	{
 		char	   *base = NULL;
-		Datum		value = datumCopy(PointerGetDatum(&etup->data), false, -1);
+		Datum		value;
+
+		/* Decode so callers always see the original type */
+		if (etup->quantization == HNSW_QUANTIZATION_INT8)
+			value = PointerGetDatum(HnswDequantizeValue((HnswQuantizedVector *) &etup->data));
+		else
+			value = datumCopy(PointerGetDatum(&etup->data), false, -1);
 
 		HnswPtrStore(base, element->value, DatumGetPointer(value));
 	}
@@ -522,9 +1752,61 @@ HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, bool loadHe
 static inline double
 HnswGetDistance(Datum a, Datum b, HnswSupport * support)
 {
+	double		distance;
+
+	if (support->distance != NULL && support->distance(a, b, &distance))
+		return distance;
+
 	return DatumGetFloat8(FunctionCall2Coll(support->procinfo, support->collation, a, b));
 }
 
+/*
+ * Calculate the distance between a value and a stored value
+ */
+static inline double
+GetStoredDistance(Datum a, Pointer data, int quantization, HnswSupport * support)
+{
+	if (quantization == HNSW_QUANTIZATION_INT8)
+	{
+		HnswQuantizedVector *qv = (HnswQuantizedVector *) data;
+		double		distance;
+
+		if (support->quantizedDistance != NULL && support->quantizedDistance(a, qv, &distance))
+			return distance;
+
+		return HnswGetDistance(a, PointerGetDatum(HnswDequantizeValue(qv)), support);
+	}
+
+	return HnswGetDistance(a, PointerGetDatum(data), support);
+}
+
+/*
+ * Calculate the distance between a value and a stored value
+ */
+double
+HnswGetStoredDistance(Datum a, Pointer data, int quantization, HnswSupport * support)
+{
+	return GetStoredDistance(a, data, quantization, support);
+}
+
+/*
+ * Calculate the distance between a value and an element tuple
+ */
+static inline double
+HnswGetTupleDistance(Datum a, HnswElementTuple etup, HnswSupport * support)
+{
+	return GetStoredDistance(a, (Pointer) &etup->data, etup->quantization, support);
+}
+
+/*
+ * Calculate the distance between two elements in memory
+ */
+double
+HnswGetElementDistance(char *base, HnswElement a, HnswElement b, HnswSupport * support)
+{
+	return HnswGetDistance(HnswGetValue(base, a), HnswGetValue(base, b), support);
+}
+
 /*
  * Load an element and optionally get its distance from q
  */
@@ -549,17 +1831,19 @@ HnswLoadElementImpl(BlockNumber blkno, OffsetNumber offno, double *distance, Hns
 	{
 		if (DatumGetPointer(q->value) == NULL)
 			*distance = 0;
+		else if (q->sketch != NULL && etup->quantization == HNSW_QUANTIZATION_BINARY && !etup->deleted && etup->data.dim == q->sketch->dim)
+			*distance = support->sketchDistance(q->sketch, HnswElementTupleGetSketch(etup));
 		else
-			*distance = HnswGetDistance(q->value, PointerGetDatum(&etup->data), support);
+			*distance = HnswGetTupleDistance(q->value, etup, support);
 	}
 
 	/* Load element */
 	if (distance == NULL || maxDistance == NULL || *distance < *maxDistance)
 	{
 		if (*element == NULL)
-			*element = HnswInitElementFromBlock(blkno, offno);
+			*element = InitElementFromBlock(HnswSlabAlloc(support->elementCtx, sizeof(HnswElementData)), blkno, offno);
 
-		HnswLoadElementFromTuple(*element, etup, true, loadVec);
+		HnswLoadElementFromTuple(*element, etup, support, true, loadVec);
 	}
 
 	UnlockReleaseBuffer(buf);
@@ -585,13 +1869,39 @@ GetElementDistance(char *base, HnswElement element, HnswQuery * q, HnswSupport *
 	return HnswGetDistance(q->value, value, support);
 }
 
+/*
+ * Calculate the distances between q and multiple values
+ *
+ * Uses a batched kernel when the type has one, and otherwise prefetches the
+ * values and computes the distances one at a time.
+ */
+static void
+HnswGetDistances(Datum q, Datum *values, int n, double *distances, HnswSupport * support)
+{
+	if (support->batchDistance != NULL && support->batchDistance(q, values, n, distances))
+		return;
+
+	/* Prefetch the start of each vector so loads overlap */
+	for (int i = 0; i < n; i++)
+		HnswPrefetch(DatumGetPointer(values[i]));
+
+	for (int i = 0; i < n; i++)
+	{
+		/* Prefetch ahead in case the vector spans multiple cache lines */
+		if (i + 1 < n)
+			HnswPrefetch(DatumGetPointer(values[i + 1]) + 64);
+
+		distances[i] = HnswGetDistance(q, values[i], support);
+	}
+}
+
 /*
  * Allocate a search candidate
  */
 static HnswSearchCandidate *
-HnswInitSearchCandidate(char *base, HnswElement element, double distance)
+HnswInitSearchCandidate(char *base, HnswElement element, double distance, HnswSupport * support)
 {
-	HnswSearchCandidate *sc = palloc(sizeof(HnswSearchCandidate));
+	HnswSearchCandidate *sc = HnswSlabAlloc(support->candidateCtx, sizeof(HnswSearchCandidate));
 
 	HnswPtrStore(base, sc->element, element);
 	sc->distance = distance;
@@ -612,7 +1922,10 @@ HnswEntryCandidate(char *base, HnswElement entryPoint, HnswQuery * q, Relation i
 	else
 		HnswLoadElement(entryPoint, &distance, q, index, support, loadVec, NULL);
 
-	return HnswInitSearchCandidate(base, entryPoint, distance);
+	if (support->stats != NULL)
+		support->stats->distances++;
+
+	return HnswInitSearchCandidate(base, entryPoint, distance, support);
 }
 
 /*
@@ -660,14 +1973,46 @@ CompareFurthestCandidates(const pairingheap_node *a, const pairingheap_node *b,
 	return 0;
 }
 
+/*
+ * Grow visited array to include an ordinal
+ */
+static void
+GrowVisitedArray(HnswVisitedArray * visited, uint32 ordinal)
+{
+	uint64		size = Max(visited->size, 1024);
+
+	while (size <= ordinal)
+		size *= 2;
+
+	if (visited->stamps == NULL)
+		visited->stamps = MemoryContextAllocExtended(visited->ctx, size * sizeof(uint32), MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+	else
+	{
+		visited->stamps = repalloc_huge(visited->stamps, size * sizeof(uint32));
+		memset(visited->stamps + visited->size, 0, (size - visited->size) * sizeof(uint32));
+	}
+
+	visited->size = size;
+}
+
 /*
  * Init visited
  */
 static inline void
-InitVisited(char *base, visited_hash * v, bool inMemory, int ef, int m)
+InitVisited(char *base, visited_hash * v, bool inMemory, int ef, int m, HnswVisitedArray * visited)
 {
 	if (!inMemory)
 		v->tids = tidhash_create(CurrentMemoryContext, ef * m * 2, NULL);
+	else if (visited != NULL)
+	{
+		/* Start a new generation instead of clearing */
+		if (++visited->generation == 0)
+		{
+			if (visited->stamps != NULL)
+				memset(visited->stamps, 0, (Size) visited->size * sizeof(uint32));
+			visited->generation = 1;
+		}
+	}
 	else if (base != NULL)
 		v->offsets = offsethash_create(CurrentMemoryContext, ef * m * 2, NULL);
 	else
@@ -678,7 +2023,7 @@ InitVisited(char *base, visited_hash * v, bool inMemory, int ef, int m)
  * Add to visited
  */
 static inline void
-AddToVisited(char *base, visited_hash * v, HnswElementPtr elementPtr, bool inMemory, bool *found)
+AddToVisited(char *base, visited_hash * v, HnswElementPtr elementPtr, bool inMemory, HnswVisitedArray * visited, bool *found)
 {
 	if (!inMemory)
 	{
@@ -688,6 +2033,17 @@ AddToVisited(char *base, visited_hash * v, HnswElementPtr elementPtr, bool inMem
 		ItemPointerSet(&indextid, element->blkno, element->offno);
 		tidhash_insert(v->tids, indextid, found);
 	}
+	else if (visited != NULL)
+	{
+		HnswElement element = HnswPtrAccess(base, elementPtr);
+		uint32		ordinal = element->ordinal;
+
+		if (ordinal >= visited->size)
+			GrowVisitedArray(visited, ordinal);
+
+		*found = visited->stamps[ordinal] == visited->generation;
+		visited->stamps[ordinal] = visited->generation;
+	}
 	else if (base != NULL)
 	{
 		HnswElement element = HnswPtrAccess(base, elementPtr);
@@ -724,13 +2080,13 @@ CountElement(HnswElement skipElement, HnswElement e)
  * Load unvisited neighbors from memory
  */
 static void
-HnswLoadUnvisitedFromMemory(char *base, HnswElement element, HnswUnvisited * unvisited, int *unvisitedLength, visited_hash * v, int lc, HnswNeighborArray * localNeighborhood, Size neighborhoodSize)
+HnswLoadUnvisitedFromMemory(char *base, HnswElement element, HnswUnvisited * unvisited, int *unvisitedLength, visited_hash * v, HnswVisitedArray * visited, int lc, HnswNeighborArray * localNeighborhood, Size neighborhoodSize, instr_time *lockWait)
 {
 	/* Get the neighborhood at layer lc */
 	HnswNeighborArray *neighborhood = HnswGetNeighbors(base, element, lc);
 
 	/* Copy neighborhood to local memory */
-	LWLockAcquire(&element->lock, LW_SHARED);
+	HnswLockAcquire(&element->lock, LW_SHARED, lockWait);
 	memcpy(localNeighborhood, neighborhood, neighborhoodSize);
 	LWLockRelease(&element->lock);
 
@@ -741,7 +2097,7 @@ HnswLoadUnvisitedFromMemory(char *base, HnswElement element, HnswUnvisited * unv
 		HnswCandidate *hc = &localNeighborhood->items[i];
 		bool		found;
 
-		AddToVisited(base, v, hc->element, true, &found);
+		AddToVisited(base, v, hc->element, true, visited, &found);
 
 		if (!found)
 			unvisited[(*unvisitedLength)++].element = HnswPtrAccess(base, hc->element);
@@ -809,6 +2165,32 @@ HnswLoadUnvisitedFromDisk(HnswElement element, HnswUnvisited * unvisited, int *u
 		if (!found)
 			unvisited[(*unvisitedLength)++].indextid = *indextid;
 	}
+
+	/*
+	 * Issue reads for all neighbor pages before loading any elements so they
+	 * overlap instead of stalling one at a time on cold caches
+	 */
+	if (*unvisitedLength < 2)
+		return;
+
+	for (int i = 0; i < *unvisitedLength; i++)
+	{
+		BlockNumber blkno = ItemPointerGetBlockNumber(&unvisited[i].indextid);
+		bool		seen = false;
+
+		/* Neighbors are often on the same page */
+		for (int j = 0; j < i; j++)
+		{
+			if (ItemPointerGetBlockNumber(&unvisited[j].indextid) == blkno)
+			{
+				seen = true;
+				break;
+			}
+		}
+
+		if (!seen)
+			PrefetchBuffer(index, MAIN_FORKNUM, blkno);
+	}
 }
 
 /*
@@ -828,7 +2210,17 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 	int			lm = HnswGetLayerM(m, lc);
 	HnswUnvisited *unvisited = palloc(lm * sizeof(HnswUnvisited));
 	int			unvisitedLength;
+	Datum	   *unvisitedValues = NULL;
+	double	   *unvisitedDistances = NULL;
 	bool		inMemory = index == NULL;
+	HnswVisitedArray *visited = inMemory ? support->visited : NULL;
+
+	/* Upper layers are only used for routing, so do not filter them */
+	bool		filtered = lc == 0 && q->filtered;
+
+	/* Only scans stop early, since inserts need the best neighbors */
+	int			patience = !inserting && lc == 0 ? hnsw_search_patience : 0;
+	int			stale = 0;
 
 	if (v == NULL)
 	{
@@ -838,7 +2230,7 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 
 	if (initVisited)
 	{
-		InitVisited(base, v, inMemory, ef, m);
+		InitVisited(base, v, inMemory, ef, m, visited);
 
 		if (discarded != NULL)
 			*discarded = pairingheap_allocate(CompareNearestDiscardedCandidates, NULL);
@@ -849,6 +2241,8 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 	{
 		neighborhoodSize = HNSW_NEIGHBOR_ARRAY_SIZE(lm);
 		localNeighborhood = palloc(neighborhoodSize);
+		unvisitedValues = palloc(lm * sizeof(Datum));
+		unvisitedDistances = palloc(lm * sizeof(double));
 	}
 
 	/* Add entry points to v, C, and W */
@@ -859,7 +2253,7 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 
 		if (initVisited)
 		{
-			AddToVisited(base, v, sc->element, inMemory, &found);
+			AddToVisited(base, v, sc->element, inMemory, visited, &found);
 
 			/* OK to count elements instead of tuples */
 			if (tuples != NULL)
@@ -874,7 +2268,7 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 		 * would be ideal to do this for inserts as well, but this could
 		 * affect insert performance.
 		 */
-		if (CountElement(skipElement, HnswPtrAccess(base, sc->element)))
+		if (CountElement(skipElement, HnswPtrAccess(base, sc->element)) && (!filtered || HnswFilterMatches(q, HnswPtrAccess(base, sc->element))))
 			wlen++;
 	}
 
@@ -883,14 +2277,27 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 		HnswSearchCandidate *c = HnswGetSearchCandidate(c_node, pairingheap_remove_first(C));
 		HnswSearchCandidate *f = HnswGetSearchCandidate(w_node, pairingheap_first(W));
 		HnswElement cElement;
+		bool		improved = false;
 
 		if (c->distance > f->distance)
 			break;
 
+		/* Bound the work for selective filters */
+		if (filtered && tuples != NULL && *tuples >= hnsw_max_scan_tuples)
+			break;
+
 		cElement = HnswPtrAccess(base, c->element);
 
 		if (inMemory)
-			HnswLoadUnvisitedFromMemory(base, cElement, unvisited, &unvisitedLength, v, lc, localNeighborhood, neighborhoodSize);
+		{
+			HnswLoadUnvisitedFromMemory(base, cElement, unvisited, &unvisitedLength, v, visited, lc, localNeighborhood, neighborhoodSize, support->lockWait);
+
+			/* Score all unvisited neighbors against q in one pass */
+			for (int i = 0; i < unvisitedLength; i++)
+				unvisitedValues[i] = HnswGetValue(base, unvisited[i].element);
+
+			HnswGetDistances(q->value, unvisitedValues, unvisitedLength, unvisitedDistances, support);
+		}
 		else
 			HnswLoadUnvisitedFromDisk(cElement, unvisited, &unvisitedLength, v, index, m, lm, lc);
 
@@ -898,6 +2305,16 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 		if (tuples != NULL)
 			(*tuples) += unvisitedLength;
 
+		if (support->stats != NULL)
+		{
+			if (lc == 0)
+				support->stats->layer0Hops++;
+			else
+				support->stats->upperHops++;
+
+			support->stats->distances += unvisitedLength;
+		}
+
 		for (int i = 0; i < unvisitedLength; i++)
 		{
 			HnswElement eElement;
@@ -910,7 +2327,7 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 			if (inMemory)
 			{
 				eElement = unvisited[i].element;
-				eDistance = GetElementDistance(base, eElement, q, support);
+				eDistance = unvisitedDistances[i];
 			}
 			else
 			{
@@ -931,8 +2348,11 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 				if (discarded != NULL)
 				{
 					/* Create a new candidate */
-					e = HnswInitSearchCandidate(base, eElement, eDistance);
+					e = HnswInitSearchCandidate(base, eElement, eDistance, support);
 					pairingheap_add(*discarded, &e->w_node);
+
+					if (support->stats != NULL)
+						support->stats->discarded++;
 				}
 
 				continue;
@@ -943,7 +2363,7 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 				continue;
 
 			/* Create a new candidate */
-			e = HnswInitSearchCandidate(base, eElement, eDistance);
+			e = HnswInitSearchCandidate(base, eElement, eDistance, support);
 			pairingheap_add(C, &e->c_node);
 			pairingheap_add(W, &e->w_node);
 
@@ -951,21 +2371,41 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 			 * Do not count elements being deleted towards ef when vacuuming.
 			 * It would be ideal to do this for inserts as well, but this
 			 * could affect insert performance.
+			 *
+			 * Elements that do not match the filter are still traversed, but
+			 * are not counted towards ef since they are never returned.
 			 */
-			if (CountElement(skipElement, eElement))
+			if (CountElement(skipElement, eElement) && (!filtered || HnswFilterMatches(q, eElement)))
 			{
 				wlen++;
 
+				/* Only results that can be returned reset patience */
+				improved = true;
+
 				/* No need to decrement wlen */
 				if (wlen > ef)
 				{
 					HnswSearchCandidate *d = HnswGetSearchCandidate(w_node, pairingheap_remove_first(W));
 
 					if (discarded != NULL)
+					{
 						pairingheap_add(*discarded, &d->w_node);
+
+						if (support->stats != NULL)
+							support->stats->discarded++;
+					}
 				}
 			}
 		}
+
+		/* Stop once W has not improved for patience expansions */
+		if (patience > 0 && wlen >= ef)
+		{
+			if (improved)
+				stale = 0;
+			else if (++stale >= patience)
+				break;
+		}
 	}
 
 	/* Add each element of W to w */
@@ -1044,6 +2484,9 @@ CheckElementCloser(char *base, HnswCandidate * e, List *r, HnswSupport * support
 		Datum		riValue = HnswGetValue(base, riElement);
 		float		distance = HnswGetDistance(eValue, riValue, support);
 
+		if (support->stats != NULL)
+			support->stats->distances++;
+
 		if (distance <= e->distance)
 			return false;
 	}
@@ -1251,6 +2694,26 @@ RemoveElements(char *base, List *w, HnswElement skipElement)
 	return w2;
 }
 
+/*
+ * Remove an element from candidates in memory
+ */
+static List *
+RemoveSelf(char *base, List *w, HnswElement skipElement)
+{
+	ListCell   *lc2;
+	List	   *w2 = NIL;
+
+	foreach(lc2, w)
+	{
+		HnswCandidate *hc = (HnswCandidate *) lfirst(lc2);
+
+		if (HnswPtrAccess(base, hc->element) != skipElement)
+			w2 = lappend(w2, hc);
+	}
+
+	return w2;
+}
+
 /*
  * Precompute hash
  */
@@ -1282,9 +2745,11 @@ HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint
 	bool		inMemory = index == NULL;
 
 	q.value = HnswGetValue(base, element);
+	q.sketch = NULL;
+	q.filtered = false;
 
-	/* Precompute hash */
-	if (inMemory)
+	/* Precompute hash (not needed with visited array) */
+	if (inMemory && support->visited == NULL)
 		PrecomputeHash(base, element);
 
 	/* No neighbors if no entry point */
@@ -1335,6 +2800,8 @@ HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint
 		/* but should be removed before selecting neighbors */
 		if (!inMemory)
 			lw = RemoveElements(base, lw, skipElement);
+		else if (skipElement != NULL)
+			lw = RemoveSelf(base, lw, skipElement);
 
 		/*
 		 * Candidates are sorted, but not deterministically. Could set
@@ -3,10 +3,15 @@
 #include <math.h>
 
 #include "access/generic_xlog.h"
+#include "access/parallel.h"
 #include "commands/vacuum.h"
 #include "hnsw.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "postmaster/autovacuum.h"
 #include "storage/bufmgr.h"
 #include "storage/lmgr.h"
+#include "tcop/tcopprot.h"
 #include "utils/memutils.h"
 
 #if PG_VERSION_NUM >= 160000
@@ -17,6 +22,35 @@
 #define vacuum_delay_point() vacuum_delay_point(false)
 #endif
 
+#if PG_VERSION_NUM >= 170000
+#define IsAutoVacuumWorkerProcess() AmAutoVacuumWorkerProcess()
+#endif
+
+#if PG_VERSION_NUM >= 140000
+#include "utils/backend_status.h"
+#else
+#include "pgstat.h"
+#endif
+
+#define PARALLEL_KEY_HNSW_VACUUM_SHARED	UINT64CONST(0xA000000000000001)
+#define PARALLEL_KEY_HNSW_VACUUM_AREA	UINT64CONST(0xA000000000000002)
+#define PARALLEL_KEY_QUERY_TEXT			UINT64CONST(0xA000000000000003)
+
+/* Minimum number of pages to repair for each parallel worker */
+#define HNSW_PARALLEL_VACUUM_MIN_PAGES	64
+
+typedef struct HnswVacuumShared
+{
+	/* Immutable state */
+	Oid			indexrelid;
+	BlockNumber nblocks;
+	Size		pagesSize;
+	int			deletedLength;
+
+	/* Coordination */
+	pg_atomic_uint32 nextBlkno;
+}			HnswVacuumShared;
+
 /*
  * Check if deleted list contains an index TID
  */
@@ -26,6 +60,36 @@ DeletedContains(tidhash_hash * deleted, ItemPointer indextid)
 	return tidhash_lookup(deleted, *indextid) != NULL;
 }
 
+/*
+ * Keep track of the highest non-entry point for a partition
+ */
+static void
+UpdatePartitionHighestPoint(HnswVacuumState * vacuumstate, HnswElementTuple etup, BlockNumber blkno, OffsetNumber offno)
+{
+	int64		value = HnswElementTupleGetFilter(etup)->value;
+	PartitionHashEntry *entry;
+	bool		found;
+
+	/* Skip entry point */
+	entry = partitionhash_lookup(vacuumstate->entryPoints, value);
+	if (entry != NULL && blkno == entry->element->blkno && offno == entry->element->offno)
+		return;
+
+	entry = partitionhash_insert(vacuumstate->highestPoints, value, &found);
+	if (!found)
+		entry->element = HnswInitElementFromBlock(blkno, offno);
+	else if (etup->level > entry->element->level)
+	{
+		entry->element->blkno = blkno;
+		entry->element->offno = offno;
+	}
+	else
+		return;
+
+	entry->element->level = etup->level;
+	entry->element->filter = *HnswElementTupleGetFilter(etup);
+}
+
 /*
  * Remove deleted heap TIDs
  *
@@ -38,7 +102,7 @@ RemoveHeapTids(HnswVacuumState * vacuumstate)
 	HnswElement highestPoint = &vacuumstate->highestPoint;
 	Relation	index = vacuumstate->index;
 	BufferAccessStrategy bas = vacuumstate->bas;
-	HnswElement entryPoint = HnswGetEntryPoint(vacuumstate->index);
+	HnswElement entryPoint = vacuumstate->partitioned ? NULL : HnswGetEntryPoint(vacuumstate->index, NULL);
 	IndexBulkDeleteResult *stats = vacuumstate->stats;
 
 	/* Store separately since highestPoint.level is uint8 */
@@ -117,7 +181,17 @@ RemoveHeapTids(HnswVacuumState * vacuumstate)
 
 				tidhash_insert(vacuumstate->deleted, ip, &found);
 				Assert(!found);
+
+				/* Set to first free page */
+				if (!BlockNumberIsValid(vacuumstate->insertPage))
+					vacuumstate->insertPage = blkno;
+
+				/* Keep track of where to mark as deleted */
+				if (!etup->deleted)
+					vacuumstate->deletedPages = bms_add_member(vacuumstate->deletedPages, blkno);
 			}
+			else if (vacuumstate->partitioned)
+				UpdatePartitionHighestPoint(vacuumstate, etup, blkno, offno);
 			else if (etup->level > highestLevel && !(entryPoint != NULL && blkno == entryPoint->blkno && offno == entryPoint->offno))
 			{
 				/* Keep track of highest non-entry point */
@@ -128,6 +202,8 @@ RemoveHeapTids(HnswVacuumState * vacuumstate)
 			}
 		}
 
+		vacuumstate->elementPages = bms_add_member(vacuumstate->elementPages, blkno);
+		vacuumstate->lastBlkno = blkno;
 		blkno = HnswPageGetOpaque(page)->nextblkno;
 
 		if (updated)
@@ -240,20 +316,17 @@ RepairGraphElement(HnswVacuumState * vacuumstate, HnswElement element, HnswEleme
 }
 
 /*
- * Repair graph entry point
+ * Repair the entry point, or the entry point for the filter value if the
+ * index is partitioned
  */
 static void
-RepairGraphEntryPoint(HnswVacuumState * vacuumstate)
+RepairEntryPoint(HnswVacuumState * vacuumstate, HnswElement highestPoint, HnswFilterData * filter)
 {
 	Relation	index = vacuumstate->index;
 	HnswSupport *support = &vacuumstate->support;
-	HnswElement highestPoint = &vacuumstate->highestPoint;
 	HnswElement entryPoint;
 	MemoryContext oldCtx = MemoryContextSwitchTo(vacuumstate->tmpCtx);
 
-	if (!BlockNumberIsValid(highestPoint->blkno))
-		highestPoint = NULL;
-
 	/*
 	 * Repair graph for highest non-entry point. Highest point may be outdated
 	 * due to inserts that happen during and after RemoveHeapTids.
@@ -268,7 +341,7 @@ RepairGraphEntryPoint(HnswVacuumState * vacuumstate)
 
 		/* Repair if needed */
 		if (NeedsUpdated(vacuumstate, highestPoint))
-			RepairGraphElement(vacuumstate, highestPoint, HnswGetEntryPoint(index));
+			RepairGraphElement(vacuumstate, highestPoint, HnswGetEntryPoint(index, filter));
 
 		/* Release lock */
 		UnlockPage(index, HNSW_UPDATE_LOCK, ShareLock);
@@ -278,7 +351,7 @@ RepairGraphEntryPoint(HnswVacuumState * vacuumstate)
 	LockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
 
 	/* Get latest entry point */
-	entryPoint = HnswGetEntryPoint(index);
+	entryPoint = HnswGetEntryPoint(index, filter);
 
 	if (entryPoint != NULL)
 	{
@@ -293,7 +366,7 @@ RepairGraphEntryPoint(HnswVacuumState * vacuumstate)
 			 * point is outdated and empty, the entry point will be empty
 			 * until an element is repaired.
 			 */
-			HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_ALWAYS, highestPoint, InvalidBlockNumber, MAIN_FORKNUM, false);
+			HnswUpdateEntryPoint(index, HNSW_UPDATE_ENTRY_ALWAYS, filter, highestPoint, MAIN_FORKNUM, false);
 		}
 		else
 		{
@@ -324,118 +397,387 @@ RepairGraphEntryPoint(HnswVacuumState * vacuumstate)
 }
 
 /*
- * Repair graph for all elements
+ * Repair graph entry point, or the entry point for each partition
  */
 static void
-RepairGraph(HnswVacuumState * vacuumstate)
+RepairGraphEntryPoint(HnswVacuumState * vacuumstate)
+{
+	HnswElement highestPoint = &vacuumstate->highestPoint;
+	partitionhash_iterator iter;
+	PartitionHashEntry *entry;
+
+	if (!vacuumstate->partitioned)
+	{
+		if (!BlockNumberIsValid(highestPoint->blkno))
+			highestPoint = NULL;
+
+		RepairEntryPoint(vacuumstate, highestPoint, NULL);
+		return;
+	}
+
+	/* Partitions added after the start of vacuum have no deleted elements */
+	partitionhash_start_iterate(vacuumstate->entryPoints, &iter);
+	while ((entry = partitionhash_iterate(vacuumstate->entryPoints, &iter)) != NULL)
+	{
+		PartitionHashEntry *highestEntry = partitionhash_lookup(vacuumstate->highestPoints, entry->value);
+
+		vacuum_delay_point();
+
+		RepairEntryPoint(vacuumstate, highestEntry != NULL ? highestEntry->element : NULL, &entry->element->filter);
+	}
+}
+
+/*
+ * Load elements on a page that are not being deleted
+ */
+static List *
+LoadElements(HnswVacuumState * vacuumstate, BlockNumber blkno)
+{
+	Buffer		buf;
+	Page		page;
+	OffsetNumber offno;
+	OffsetNumber maxoffno;
+	List	   *elements = NIL;
+
+	buf = ReadBufferExtended(vacuumstate->index, MAIN_FORKNUM, blkno, RBM_NORMAL, vacuumstate->bas);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	maxoffno = PageGetMaxOffsetNumber(page);
+
+	/* Load items into memory to minimize locking */
+	for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+	{
+		HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+		HnswElement element;
+
+		/* Skip neighbor tuples */
+		if (!HnswIsElementTuple(etup))
+			continue;
+
+		/* Skip updating neighbors if being deleted */
+		if (!ItemPointerIsValid(&etup->heaptids[0]))
+			continue;
+
+		/* Create an element */
+		element = HnswInitElementFromBlock(blkno, offno);
+		HnswLoadElementFromTuple(element, etup, &vacuumstate->support, false, true);
+
+		elements = lappend(elements, element);
+	}
+
+	UnlockReleaseBuffer(buf);
+
+	return elements;
+}
+
+/*
+ * Repair graph for elements with deleted neighbors
+ */
+static void
+RepairGraphElements(HnswVacuumState * vacuumstate, List *elements)
 {
 	Relation	index = vacuumstate->index;
-	BufferAccessStrategy bas = vacuumstate->bas;
-	BlockNumber blkno = HNSW_HEAD_BLKNO;
+	ListCell   *lc;
 
-	/*
-	 * Wait for inserts to complete. Inserts before this point may have
-	 * neighbors about to be deleted. Inserts after this point will not.
-	 */
-	LockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
-	UnlockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+	foreach(lc, elements)
+	{
+		HnswElement element = (HnswElement) lfirst(lc);
+		HnswElement entryPoint;
+		LOCKMODE	lockmode = ShareLock;
 
-	/* Repair entry point first */
-	RepairGraphEntryPoint(vacuumstate);
+		/* Check if any neighbors point to deleted values */
+		if (!NeedsUpdated(vacuumstate, element))
+			continue;
+
+		/* Get a shared lock */
+		LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+		/* Refresh entry point for each element */
+		entryPoint = HnswGetEntryPoint(index, &element->filter);
+
+		/* Prevent concurrent inserts when likely updating entry point */
+		if (entryPoint == NULL || element->level > entryPoint->level)
+		{
+			/* Release shared lock */
+			UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+			/* Get exclusive lock */
+			lockmode = ExclusiveLock;
+			LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+			/* Get latest entry point after lock is acquired */
+			entryPoint = HnswGetEntryPoint(index, &element->filter);
+		}
+
+		/* Repair connections */
+		RepairGraphElement(vacuumstate, element, entryPoint);
+
+		/*
+		 * Update metapage if needed. Should only happen if entry point was
+		 * replaced and highest point was outdated.
+		 */
+		if (entryPoint == NULL || element->level > entryPoint->level)
+			HnswUpdateEntryPoint(index, HNSW_UPDATE_ENTRY_GREATER, &element->filter, element, MAIN_FORKNUM, false);
+
+		/* Release lock */
+		UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+	}
+}
+
+/*
+ * Repair graph for elements on a page
+ */
+static void
+RepairGraphPage(HnswVacuumState * vacuumstate, BlockNumber blkno)
+{
+	MemoryContext oldCtx;
+
+	vacuum_delay_point();
+
+	oldCtx = MemoryContextSwitchTo(vacuumstate->tmpCtx);
+
+	RepairGraphElements(vacuumstate, LoadElements(vacuumstate, blkno));
+
+	/* Reset memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(vacuumstate->tmpCtx);
+}
+
+/*
+ * Get all element pages, including pages added after the first pass
+ */
+static Bitmapset *
+GetElementPages(HnswVacuumState * vacuumstate)
+{
+	Bitmapset  *pages = bms_copy(vacuumstate->elementPages);
+	BlockNumber blkno = vacuumstate->lastBlkno;
 
 	while (BlockNumberIsValid(blkno))
 	{
 		Buffer		buf;
 		Page		page;
-		OffsetNumber offno;
-		OffsetNumber maxoffno;
-		List	   *elements = NIL;
-		ListCell   *lc2;
-		MemoryContext oldCtx;
-
-		vacuum_delay_point();
-
-		oldCtx = MemoryContextSwitchTo(vacuumstate->tmpCtx);
 
-		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+		buf = ReadBufferExtended(vacuumstate->index, MAIN_FORKNUM, blkno, RBM_NORMAL, vacuumstate->bas);
 		LockBuffer(buf, BUFFER_LOCK_SHARE);
 		page = BufferGetPage(buf);
-		maxoffno = PageGetMaxOffsetNumber(page);
+		blkno = HnswPageGetOpaque(page)->nextblkno;
+		UnlockReleaseBuffer(buf);
 
-		/* Load items into memory to minimize locking */
-		for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
-		{
-			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
-			HnswElement element;
+		if (BlockNumberIsValid(blkno))
+			pages = bms_add_member(pages, blkno);
+	}
 
-			/* Skip neighbor tuples */
-			if (!HnswIsElementTuple(etup))
-				continue;
+	return pages;
+}
 
-			/* Skip updating neighbors if being deleted */
-			if (!ItemPointerIsValid(&etup->heaptids[0]))
-				continue;
+/*
+ * Repair pages claimed from the shared counter
+ */
+static void
+ParticipateInRepair(HnswVacuumState * vacuumstate, HnswVacuumShared * shared, Bitmapset *pages)
+{
+	for (;;)
+	{
+		BlockNumber blkno = pg_atomic_fetch_add_u32(&shared->nextBlkno, 1);
 
-			/* Create an element */
-			element = HnswInitElementFromBlock(blkno, offno);
-			HnswLoadElementFromTuple(element, etup, false, true);
+		if (blkno >= shared->nblocks)
+			break;
 
-			elements = lappend(elements, element);
-		}
+		if (!bms_is_member(blkno, pages))
+			continue;
 
-		blkno = HnswPageGetOpaque(page)->nextblkno;
+		RepairGraphPage(vacuumstate, blkno);
+	}
+}
 
-		UnlockReleaseBuffer(buf);
+/*
+ * Get the size of the set of pages in shared memory
+ */
+static Size
+PagesSize(const Bitmapset *pages)
+{
+	return offsetof(Bitmapset, words) + pages->nwords * sizeof(bitmapword);
+}
 
-		/* Update neighbor pages */
-		foreach(lc2, elements)
-		{
-			HnswElement element = (HnswElement) lfirst(lc2);
-			HnswElement entryPoint;
-			LOCKMODE	lockmode = ShareLock;
+/*
+ * Copy a set of index TIDs to an array
+ */
+static void
+CopyTids(tidhash_hash * tids, ItemPointer out)
+{
+	tidhash_iterator iter;
+	TidHashEntry *entry;
+	int			i = 0;
 
-			/* Check if any neighbors point to deleted values */
-			if (!NeedsUpdated(vacuumstate, element))
-				continue;
+	tidhash_start_iterate(tids, &iter);
+	while ((entry = tidhash_iterate(tids, &iter)) != NULL)
+		out[i++] = entry->tid;
+}
 
-			/* Get a shared lock */
-			LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+/*
+ * Add an array of index TIDs to a set
+ */
+static void
+AddTids(tidhash_hash * tids, ItemPointer items, int length)
+{
+	for (int i = 0; i < length; i++)
+	{
+		bool		found;
 
-			/* Refresh entry point for each element */
-			entryPoint = HnswGetEntryPoint(index);
+		tidhash_insert(tids, items[i], &found);
+	}
+}
 
-			/* Prevent concurrent inserts when likely updating entry point */
-			if (entryPoint == NULL || element->level > entryPoint->level)
-			{
-				/* Release shared lock */
-				UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+/*
+ * Repair graph with parallel workers, returns false if not able to
+ */
+static bool
+RepairGraphParallel(HnswVacuumState * vacuumstate, Bitmapset *pages, int request)
+{
+	ParallelContext *pcxt;
+	Size		estshared;
+	Size		estarea;
+	Size		pagesSize = MAXALIGN(PagesSize(pages));
+	Size		deletedSize = MAXALIGN(sizeof(ItemPointerData) * vacuumstate->deleted->members);
+	HnswVacuumShared *shared;
+	char	   *area;
+	int			querylen;
+
+	/* Enter parallel mode and create context */
+	EnterParallelMode();
+	Assert(request > 0);
+	pcxt = CreateParallelContext("vector", "HnswParallelVacuumMain", request);
+
+	/* Estimate size of workspaces */
+	estshared = MAXALIGN(sizeof(HnswVacuumShared));
+	shm_toc_estimate_chunk(&pcxt->estimator, estshared);
+	estarea = pagesSize + deletedSize;
+	shm_toc_estimate_chunk(&pcxt->estimator, estarea);
+	shm_toc_estimate_keys(&pcxt->estimator, 2);
+
+	/* Finally, estimate PARALLEL_KEY_QUERY_TEXT space */
+	if (debug_query_string)
+	{
+		querylen = strlen(debug_query_string);
+		shm_toc_estimate_chunk(&pcxt->estimator, querylen + 1);
+		shm_toc_estimate_keys(&pcxt->estimator, 1);
+	}
+	else
+		querylen = 0;			/* keep compiler quiet */
 
-				/* Get exclusive lock */
-				lockmode = ExclusiveLock;
-				LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+	/* Everyone's had a chance to ask for space, so now create the DSM */
+	InitializeParallelDSM(pcxt);
 
-				/* Get latest entry point after lock is acquired */
-				entryPoint = HnswGetEntryPoint(index);
-			}
+	/* If no DSM segment was available, back out (do serial repair) */
+	if (pcxt->seg == NULL)
+	{
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		return false;
+	}
 
-			/* Repair connections */
-			RepairGraphElement(vacuumstate, element, entryPoint);
+	shared = (HnswVacuumShared *) shm_toc_allocate(pcxt->toc, estshared);
+	/* Initialize immutable state */
+	shared->indexrelid = RelationGetRelid(vacuumstate->index);
+	shared->nblocks = (BlockNumber) bms_prev_member(pages, -1) + 1;
+	shared->pagesSize = pagesSize;
+	shared->deletedLength = vacuumstate->deleted->members;
+	/* Initialize coordination state */
+	pg_atomic_init_u32(&shared->nextBlkno, 0);
+
+	/* Copy pages and index TIDs */
+	area = shm_toc_allocate(pcxt->toc, estarea);
+	memcpy(area, pages, PagesSize(pages));
+	CopyTids(vacuumstate->deleted, (ItemPointer) (area + pagesSize));
+
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_VACUUM_SHARED, shared);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_VACUUM_AREA, area);
+
+	/* Store query string for workers */
+	if (debug_query_string)
+	{
+		char	   *sharedquery;
 
-			/*
-			 * Update metapage if needed. Should only happen if entry point
-			 * was replaced and highest point was outdated.
-			 */
-			if (entryPoint == NULL || element->level > entryPoint->level)
-				HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, element, InvalidBlockNumber, MAIN_FORKNUM, false);
+		sharedquery = (char *) shm_toc_allocate(pcxt->toc, querylen + 1);
+		memcpy(sharedquery, debug_query_string, querylen + 1);
+		shm_toc_insert(pcxt->toc, PARALLEL_KEY_QUERY_TEXT, sharedquery);
+	}
 
-			/* Release lock */
-			UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
-		}
+	LaunchParallelWorkers(pcxt);
+
+	/* Log participants */
+	ereport(DEBUG1, (errmsg("using %d parallel workers for hnsw vacuum", pcxt->nworkers_launched)));
+
+	/* Leader participates, and does all of the work if no workers launched */
+	ParticipateInRepair(vacuumstate, shared, pages);
+
+	/* Shutdown worker processes */
+	WaitForParallelWorkersToFinish(pcxt);
+
+	DestroyParallelContext(pcxt);
+	ExitParallelMode();
+
+	return true;
+}
+
+/*
+ * Compute parallel workers for repair
+ */
+static int
+ComputeParallelWorkers(HnswVacuumState * vacuumstate, int npages)
+{
+	/*
+	 * Parallel vacuum already processes indexes in workers, and autovacuum
+	 * never uses them
+	 */
+	if (IsInParallelMode() || IsAutoVacuumWorkerProcess())
+		return 0;
 
-		/* Reset memory context */
-		MemoryContextSwitchTo(oldCtx);
-		MemoryContextReset(vacuumstate->tmpCtx);
+	/* Workers cannot access temporary indexes */
+	if (RelationUsesLocalBuffers(vacuumstate->index))
+		return 0;
+
+	return Min(max_parallel_maintenance_workers, npages / HNSW_PARALLEL_VACUUM_MIN_PAGES);
+}
+
+/*
+ * Repair graph for all elements with deleted neighbors
+ */
+static void
+RepairGraph(HnswVacuumState * vacuumstate)
+{
+	Relation	index = vacuumstate->index;
+	Bitmapset  *pages;
+	int			parallelWorkers;
+
+	/*
+	 * Wait for inserts to complete. Inserts before this point may have
+	 * neighbors about to be deleted. Inserts after this point will not.
+	 */
+	LockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+	UnlockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+
+	/* Repair entry point first */
+	RepairGraphEntryPoint(vacuumstate);
+
+	/*
+	 * Check every element, since connections are not always added in both
+	 * directions. An element can point to a deleted element that does not
+	 * point back to it.
+	 */
+	pages = GetElementPages(vacuumstate);
+
+	/* Split pages across workers if there are enough */
+	parallelWorkers = ComputeParallelWorkers(vacuumstate, bms_num_members(pages));
+	if (parallelWorkers == 0 || !RepairGraphParallel(vacuumstate, pages, parallelWorkers))
+	{
+		int			i = -1;
+
+		while ((i = bms_next_member(pages, i)) >= 0)
+			RepairGraphPage(vacuumstate, (BlockNumber) i);
 	}
+
+	bms_free(pages);
 }
 
 /*
@@ -444,10 +786,9 @@ RepairGraph(HnswVacuumState * vacuumstate)
 static void
 MarkDeleted(HnswVacuumState * vacuumstate)
 {
-	BlockNumber blkno = HNSW_HEAD_BLKNO;
-	BlockNumber insertPage = InvalidBlockNumber;
 	Relation	index = vacuumstate->index;
 	BufferAccessStrategy bas = vacuumstate->bas;
+	int			i = -1;
 
 	/*
 	 * Wait for index scans to complete. Scans before this point may contain
@@ -457,8 +798,10 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 	LockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
 	UnlockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
 
-	while (BlockNumberIsValid(blkno))
+	/* Only pages with elements deleted by this vacuum need updated */
+	while ((i = bms_next_member(vacuumstate->deletedPages, i)) >= 0)
 	{
+		BlockNumber blkno = (BlockNumber) i;
 		Buffer		buf;
 		Page		page;
 		GenericXLogState *state;
@@ -497,13 +840,7 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 
 			/* Skip deleted tuples */
 			if (etup->deleted)
-			{
-				/* Set to first free page */
-				if (!BlockNumberIsValid(insertPage))
-					insertPage = blkno;
-
 				continue;
-			}
 
 			/* Skip live tuples */
 			if (ItemPointerIsValid(&etup->heaptids[0]))
@@ -553,33 +890,29 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 			if (nbuf != buf)
 				UnlockReleaseBuffer(nbuf);
 
-			/* Set to first free page */
-			if (!BlockNumberIsValid(insertPage))
-				insertPage = blkno;
-
 			/* Prepare new xlog */
 			state = GenericXLogStart(index);
 			page = GenericXLogRegisterBuffer(state, buf, 0);
 		}
 
-		blkno = HnswPageGetOpaque(page)->nextblkno;
-
 		GenericXLogAbort(state);
 		UnlockReleaseBuffer(buf);
 	}
 
 	/* Update insert page last, after everything has been marked as deleted */
-	HnswUpdateMetaPage(index, 0, NULL, insertPage, MAIN_FORKNUM, false);
+	HnswUpdateMetaPage(index, 0, NULL, vacuumstate->insertPage, MAIN_FORKNUM, false);
+
+	/* Cached upper layers may contain deleted elements */
+	if (!bms_is_empty(vacuumstate->deletedPages))
+		HnswUpdateUpperVersion(index, true);
 }
 
 /*
  * Initialize the vacuum state
  */
 static void
-InitVacuumState(HnswVacuumState * vacuumstate, IndexVacuumInfo *info, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state)
+InitVacuumState(HnswVacuumState * vacuumstate, Relation index, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state)
 {
-	Relation	index = info->index;
-
 	if (stats == NULL)
 		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
 
@@ -601,6 +934,35 @@ InitVacuumState(HnswVacuumState * vacuumstate, IndexVacuumInfo *info, IndexBulkD
 
 	/* Create hash table */
 	vacuumstate->deleted = tidhash_create(CurrentMemoryContext, 256, NULL);
+	vacuumstate->deletedPages = NULL;
+	vacuumstate->elementPages = NULL;
+	vacuumstate->lastBlkno = HNSW_HEAD_BLKNO;
+	vacuumstate->insertPage = InvalidBlockNumber;
+
+	/* Get entry points for partitions */
+	vacuumstate->partitioned = HnswIsPartitioned(index);
+	vacuumstate->entryPoints = NULL;
+	vacuumstate->highestPoints = NULL;
+	if (vacuumstate->partitioned)
+	{
+		List	   *entryPoints = HnswGetPartitionEntryPoints(index);
+		ListCell   *lc;
+
+		vacuumstate->entryPoints = partitionhash_create(CurrentMemoryContext, 256, NULL);
+		vacuumstate->highestPoints = partitionhash_create(CurrentMemoryContext, 256, NULL);
+
+		foreach(lc, entryPoints)
+		{
+			HnswElement entryPoint = lfirst(lc);
+			PartitionHashEntry *entry;
+			bool		found;
+
+			entry = partitionhash_insert(vacuumstate->entryPoints, entryPoint->filter.value, &found);
+			entry->element = entryPoint;
+		}
+
+		list_free(entryPoints);
+	}
 }
 
 /*
@@ -610,6 +972,13 @@ static void
 FreeVacuumState(HnswVacuumState * vacuumstate)
 {
 	tidhash_destroy(vacuumstate->deleted);
+	bms_free(vacuumstate->deletedPages);
+	bms_free(vacuumstate->elementPages);
+	if (vacuumstate->partitioned)
+	{
+		partitionhash_destroy(vacuumstate->entryPoints);
+		partitionhash_destroy(vacuumstate->highestPoints);
+	}
 	FreeAccessStrategy(vacuumstate->bas);
 	pfree(vacuumstate->ntup);
 	MemoryContextDelete(vacuumstate->tmpCtx);
@@ -624,7 +993,10 @@ hnswbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 {
 	HnswVacuumState vacuumstate;
 
-	InitVacuumState(&vacuumstate, info, stats, callback, callback_state);
+	InitVacuumState(&vacuumstate, info->index, stats, callback, callback_state);
+
+	/* Scans cannot use the snapshot once heap TIDs are removed */
+	HnswClearSnapshot(info->index);
 
 	/* Pass 1: Remove heap TIDs */
 	RemoveHeapTids(&vacuumstate);
@@ -660,3 +1032,43 @@ hnswvacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
 
 	return stats;
 }
+
+/*
+ * Repair graph within a launched parallel process
+ */
+void
+HnswParallelVacuumMain(dsm_segment *seg, shm_toc *toc)
+{
+	char	   *sharedquery;
+	HnswVacuumShared *shared;
+	char	   *area;
+	Bitmapset  *pages;
+	Relation	index;
+	HnswVacuumState vacuumstate;
+
+	/* Set debug_query_string for individual workers first */
+	sharedquery = shm_toc_lookup(toc, PARALLEL_KEY_QUERY_TEXT, true);
+	debug_query_string = sharedquery;
+
+	/* Report the query string from leader */
+	pgstat_report_activity(STATE_RUNNING, debug_query_string);
+
+	/* Look up shared state */
+	shared = shm_toc_lookup(toc, PARALLEL_KEY_HNSW_VACUUM_SHARED, false);
+	area = shm_toc_lookup(toc, PARALLEL_KEY_HNSW_VACUUM_AREA, false);
+	pages = (Bitmapset *) area;
+
+	/* Open index using lock mode known to be obtained by vacuum */
+	index = index_open(shared->indexrelid, RowExclusiveLock);
+
+	InitVacuumState(&vacuumstate, index, NULL, NULL, NULL);
+
+	/* Copy index TIDs from shared memory */
+	AddTids(vacuumstate.deleted, (ItemPointer) (area + shared->pagesSize), shared->deletedLength);
+
+	ParticipateInRepair(&vacuumstate, shared, pages);
+
+	FreeVacuumState(&vacuumstate);
+
+	index_close(index, RowExclusiveLock);
+}
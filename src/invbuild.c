@@ -0,0 +1,390 @@
+#include "postgres.h"
+
+#include <float.h>
+
+#include "access/tableam.h"
+#include "catalog/index.h"
+#include "catalog/pg_operator_d.h"
+#include "catalog/pg_type_d.h"
+#include "commands/progress.h"
+#include "inverted.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/memutils.h"
+
+#if PG_VERSION_NUM >= 140000
+#include "utils/backend_progress.h"
+#else
+#include "pgstat.h"
+#endif
+
+/*
+ * Callback for table_index_build_scan
+ */
+static void
+BuildCallback(Relation index, ItemPointer tid, Datum *values,
+			  bool *isnull, bool tupleIsAlive, void *state)
+{
+	InvertedBuildState *buildstate = (InvertedBuildState *) state;
+	TupleTableSlot *slot = buildstate->slot;
+	MemoryContext oldCtx;
+	SparseVector *vec;
+	float	   *x;
+	uint32		docid;
+
+	/* Skip nulls */
+	if (isnull[0])
+		return;
+
+	/* Use memory context since detoast can allocate */
+	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
+
+	vec = DatumGetSparseVector(values[0]);
+	x = SPARSEVEC_VALUES(vec);
+
+	/* Skip vectors without postings */
+	if (vec->nnz > 0)
+	{
+		if (buildstate->nextDocid == INVERTED_INVALID_DOCID)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("too many rows for inverted index \"%s\"", RelationGetRelationName(index))));
+
+		/* Document ids follow the scan order */
+		docid = buildstate->nextDocid++;
+
+		for (int i = 0; i < vec->nnz; i++)
+		{
+			/* Create a virtual tuple */
+			ExecClearTuple(slot);
+			slot->tts_values[0] = Int32GetDatum(vec->indices[i]);
+			slot->tts_isnull[0] = false;
+			slot->tts_values[1] = Int64GetDatum((int64) docid);
+			slot->tts_isnull[1] = false;
+			slot->tts_values[2] = Float4GetDatum(x[i]);
+			slot->tts_isnull[2] = false;
+			slot->tts_values[3] = PointerGetDatum(tid);
+			slot->tts_isnull[3] = false;
+			ExecStoreVirtualTuple(slot);
+
+			/*
+			 * Add tuple to sort
+			 *
+			 * tuplesort_puttupleslot comment: Input data is always copied;
+			 * the caller need not save it.
+			 */
+			tuplesort_puttupleslot(buildstate->sortstate, slot);
+		}
+
+		buildstate->npostings += vec->nnz;
+		buildstate->indtuples++;
+	}
+
+	/* Reset memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(buildstate->tmpCtx);
+}
+
+/*
+ * Initialize build sort state
+ */
+static Tuplesortstate *
+InitBuildSortState(TupleDesc tupdesc, int memory)
+{
+	AttrNumber	attNums[] = {1, 2};
+	Oid			sortOperators[] = {Int4LessOperator, Int8LessOperator};
+	Oid			sortCollations[] = {InvalidOid, InvalidOid};
+	bool		nullsFirstFlags[] = {false, false};
+
+	return tuplesort_begin_heap(tupdesc, 2, attNums, sortOperators, sortCollations, nullsFirstFlags, memory, NULL, false);
+}
+
+/*
+ * Initialize the build state
+ */
+static void
+InitBuildState(InvertedBuildState * buildstate, Relation heap, Relation index, IndexInfo *indexInfo)
+{
+	buildstate->heap = heap;
+	buildstate->index = index;
+	buildstate->indexInfo = indexInfo;
+
+	buildstate->reltuples = 0;
+	buildstate->indtuples = 0;
+	buildstate->npostings = 0;
+
+	buildstate->nextDocid = 0;
+	buildstate->termsLength = 0;
+	buildstate->termsSize = 1024;
+	buildstate->terms = palloc(buildstate->termsSize * sizeof(InvertedTermData));
+
+	/* Create tuple description for sorting */
+	buildstate->sortdesc = CreateTemplateTupleDesc(4);
+	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 1, "index", INT4OID, -1, 0);
+	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 2, "docid", INT8OID, -1, 0);
+	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 3, "value", FLOAT4OID, -1, 0);
+	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 4, "tid", TIDOID, -1, 0);
+
+	buildstate->slot = MakeSingleTupleTableSlot(buildstate->sortdesc, &TTSOpsVirtual);
+
+	buildstate->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+											   "Inverted build temporary context",
+											   ALLOCSET_DEFAULT_SIZES);
+}
+
+/*
+ * Free resources
+ */
+static void
+FreeBuildState(InvertedBuildState * buildstate)
+{
+	pfree(buildstate->terms);
+	MemoryContextDelete(buildstate->tmpCtx);
+}
+
+/*
+ * Create the metapage
+ */
+static void
+CreateMetaPage(Relation index, ForkNumber forkNum)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	InvertedMetaPage metap;
+
+	buf = InvertedNewBuffer(index, forkNum);
+	InvertedInitRegisterPage(index, &buf, &page, &state, INVERTED_META_PAGE);
+
+	/* Set metapage data */
+	metap = InvertedPageGetMeta(page);
+	metap->magicNumber = INVERTED_MAGIC_NUMBER;
+	metap->version = INVERTED_VERSION;
+	metap->nextDocid = 0;
+	metap->sortedTerms = 0;
+	metap->directoryStart = InvalidBlockNumber;
+	metap->directoryPages = 0;
+	metap->overflowStart = InvalidBlockNumber;
+	metap->overflowInsertPage = InvalidBlockNumber;
+	((PageHeader) page)->pd_lower =
+		((char *) metap + sizeof(InvertedMetaPageData)) - (char *) page;
+
+	InvertedCommitBuffer(buf, state);
+}
+
+/*
+ * Add a term to the build state
+ */
+static InvertedTerm
+AddTerm(InvertedBuildState * buildstate, int32 termIndex, BlockNumber startPage)
+{
+	InvertedTerm term;
+
+	if (buildstate->termsLength == buildstate->termsSize)
+	{
+		buildstate->termsSize *= 2;
+		buildstate->terms = repalloc_huge(buildstate->terms, buildstate->termsSize * sizeof(InvertedTermData));
+	}
+
+	term = &buildstate->terms[buildstate->termsLength++];
+	term->index = termIndex;
+	term->startPage = startPage;
+	term->insertPage = startPage;
+	term->maxValue = -FLT_MAX;
+	term->minValue = FLT_MAX;
+	return term;
+}
+
+/*
+ * Create posting pages from sorted postings
+ */
+static void
+CreatePostingPages(InvertedBuildState * buildstate, ForkNumber forkNum)
+{
+	Relation	index = buildstate->index;
+	TupleTableSlot *slot = MakeSingleTupleTableSlot(buildstate->sortdesc, &TTSOpsMinimalTuple);
+	InvertedTerm term = NULL;
+	Buffer		buf = InvalidBuffer;
+	Page		page = NULL;
+	GenericXLogState *state = NULL;
+	int64		inserted = 0;
+
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_INVERTED_PHASE_LOAD);
+
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_TOTAL, buildstate->npostings);
+
+	while (tuplesort_gettupleslot(buildstate->sortstate, true, false, slot, NULL))
+	{
+		InvertedPostingData posting;
+		int32		termIndex;
+		bool		isnull;
+
+		termIndex = DatumGetInt32(slot_getattr(slot, 1, &isnull));
+
+		/* Zero padding */
+		MemSet(&posting, 0, sizeof(InvertedPostingData));
+		posting.docid = (uint32) DatumGetInt64(slot_getattr(slot, 2, &isnull));
+		posting.value = DatumGetFloat4(slot_getattr(slot, 3, &isnull));
+		posting.heaptid = *((ItemPointer) DatumGetPointer(slot_getattr(slot, 4, &isnull)));
+
+		/* Start a new posting list */
+		if (term == NULL || term->index != termIndex)
+		{
+			if (term != NULL)
+			{
+				term->insertPage = BufferGetBlockNumber(buf);
+				InvertedCommitBuffer(buf, state);
+			}
+
+			/* Can take a while, so ensure we can interrupt */
+			/* Needs to be called when no buffer locks are held */
+			CHECK_FOR_INTERRUPTS();
+
+			buf = InvertedNewBuffer(index, forkNum);
+			InvertedInitRegisterPage(index, &buf, &page, &state, INVERTED_POSTING_PAGE);
+
+			term = AddTerm(buildstate, termIndex, BufferGetBlockNumber(buf));
+		}
+
+		/* Check for free space */
+		if (PageGetFreeSpace(page) < INVERTED_POSTING_SIZE)
+			InvertedAppendPage(index, &buf, &page, &state, forkNum);
+
+		/* Add the posting */
+		if (PageAddItem(page, (Item) &posting, sizeof(InvertedPostingData), InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+		InvertedUpdatePageBounds(page, posting.docid, posting.value);
+		term->maxValue = Max(term->maxValue, posting.value);
+		term->minValue = Min(term->minValue, posting.value);
+
+		pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_DONE, ++inserted);
+	}
+
+	if (term != NULL)
+	{
+		term->insertPage = BufferGetBlockNumber(buf);
+		InvertedCommitBuffer(buf, state);
+	}
+
+	ExecDropSingleTupleTableSlot(slot);
+}
+
+/*
+ * Create sorted directory pages and update the metapage
+ */
+static void
+CreateDirectoryPages(InvertedBuildState * buildstate, ForkNumber forkNum)
+{
+	Relation	index = buildstate->index;
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	InvertedMetaPage metap;
+	BlockNumber directoryStart = InvalidBlockNumber;
+	BlockNumber directoryPages = 0;
+
+	if (buildstate->termsLength > 0)
+	{
+		/* Pages are contiguous since nothing else extends the index */
+		buf = InvertedNewBuffer(index, forkNum);
+		InvertedInitRegisterPage(index, &buf, &page, &state, INVERTED_DIRECTORY_PAGE);
+		directoryStart = BufferGetBlockNumber(buf);
+		directoryPages = 1;
+
+		for (int i = 0; i < buildstate->termsLength; i++)
+		{
+			/* Check for free space */
+			if (PageGetFreeSpace(page) < INVERTED_TERM_SIZE)
+			{
+				InvertedAppendPage(index, &buf, &page, &state, forkNum);
+				directoryPages++;
+			}
+
+			if (PageAddItem(page, (Item) &buildstate->terms[i], sizeof(InvertedTermData), InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+				elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+		}
+
+		Assert(BufferGetBlockNumber(buf) == directoryStart + directoryPages - 1);
+
+		InvertedCommitBuffer(buf, state);
+	}
+
+	/* Update metapage */
+	buf = ReadBufferExtended(index, forkNum, INVERTED_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	metap = InvertedPageGetMeta(page);
+	metap->nextDocid = buildstate->nextDocid;
+	metap->sortedTerms = buildstate->termsLength;
+	metap->directoryStart = directoryStart;
+	metap->directoryPages = directoryPages;
+	InvertedCommitBuffer(buf, state);
+}
+
+/*
+ * Build the index
+ */
+static void
+BuildIndex(Relation heap, Relation index, IndexInfo *indexInfo,
+		   InvertedBuildState * buildstate, ForkNumber forkNum)
+{
+	InitBuildState(buildstate, heap, index, indexInfo);
+
+	CreateMetaPage(index, forkNum);
+
+	buildstate->sortstate = InitBuildSortState(buildstate->sortdesc, maintenance_work_mem);
+
+	/* Add postings to sort */
+	if (heap != NULL)
+	{
+		pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_INVERTED_PHASE_SCAN);
+
+		buildstate->reltuples = table_index_build_scan(heap, index, indexInfo,
+													   true, true, BuildCallback, (void *) buildstate, NULL);
+	}
+
+	tuplesort_performsort(buildstate->sortstate);
+
+	CreatePostingPages(buildstate, forkNum);
+	CreateDirectoryPages(buildstate, forkNum);
+
+	tuplesort_end(buildstate->sortstate);
+
+	/* Write WAL for initialization fork since GenericXLog functions do not */
+	if (forkNum == INIT_FORKNUM)
+		log_newpage_range(index, forkNum, 0, RelationGetNumberOfBlocksInFork(index, forkNum), true);
+
+	FreeBuildState(buildstate);
+}
+
+/*
+ * Build the index for a logged table
+ */
+IndexBuildResult *
+invertedbuild(Relation heap, Relation index, IndexInfo *indexInfo)
+{
+	IndexBuildResult *result;
+	InvertedBuildState buildstate;
+
+	BuildIndex(heap, index, indexInfo, &buildstate, MAIN_FORKNUM);
+
+	result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
+	result->heap_tuples = buildstate.reltuples;
+	result->index_tuples = buildstate.indtuples;
+
+	return result;
+}
+
+/*
+ * Build the index for an unlogged table
+ */
+void
+invertedbuildempty(Relation index)
+{
+	IndexInfo  *indexInfo = BuildIndexInfo(index);
+	InvertedBuildState buildstate;
+
+	BuildIndex(NULL, index, indexInfo, &buildstate, INIT_FORKNUM);
+}
@@ -0,0 +1,233 @@
+#include "postgres.h"
+
+#include "access/amapi.h"
+#include "access/reloptions.h"
+#include "commands/progress.h"
+#include "commands/vacuum.h"
+#include "inverted.h"
+#include "utils/float.h"
+#include "utils/guc.h"
+#include "utils/selfuncs.h"
+
+#if PG_VERSION_NUM < 150000
+#define MarkGUCPrefixReserved(x) EmitWarningsOnPlaceholders(x)
+#endif
+
+int			inverted_top_k;
+static relopt_kind inverted_relopt_kind;
+
+/*
+ * Initialize index options and variables
+ */
+void
+InvertedInit(void)
+{
+	inverted_relopt_kind = add_reloption_kind();
+
+	DefineCustomIntVariable("inverted.top_k", "Sets the number of results for scans",
+							"Valid range is 1..1000.", &inverted_top_k,
+							INVERTED_DEFAULT_TOP_K, 1, INVERTED_MAX_TOP_K, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	MarkGUCPrefixReserved("inverted");
+}
+
+/*
+ * Get the name of index build phase
+ */
+static char *
+invertedbuildphasename(int64 phasenum)
+{
+	switch (phasenum)
+	{
+		case PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE:
+			return "initializing";
+		case PROGRESS_INVERTED_PHASE_SCAN:
+			return "scanning table";
+		case PROGRESS_INVERTED_PHASE_LOAD:
+			return "loading postings";
+		default:
+			return NULL;
+	}
+}
+
+/*
+ * Get the number of query terms if the query is a constant
+ */
+static int
+GetQueryTerms(IndexPath *path)
+{
+	Expr	   *clause = linitial(path->indexorderbys);
+	Node	   *arg;
+
+	if (!IsA(clause, OpExpr) || list_length(((OpExpr *) clause)->args) != 2)
+		return INVERTED_DEFAULT_QUERY_TERMS;
+
+	arg = lsecond(((OpExpr *) clause)->args);
+	if (!IsA(arg, Const) || ((Const *) arg)->constisnull)
+		return INVERTED_DEFAULT_QUERY_TERMS;
+
+	return DatumGetSparseVector(((Const *) arg)->constvalue)->nnz;
+}
+
+/*
+ * Estimate the cost of an index scan
+ */
+static void
+invertedcostestimate(PlannerInfo *root, IndexPath *path, double loop_count,
+					 Cost *indexStartupCost, Cost *indexTotalCost,
+					 Selectivity *indexSelectivity, double *indexCorrelation,
+					 double *indexPages)
+{
+	GenericCosts costs;
+	InvertedMetaPageData meta;
+	double		ratio;
+	Relation	index;
+
+	/* Never use index without order */
+	if (path->indexorderbys == NIL)
+	{
+		*indexStartupCost = get_float8_infinity();
+		*indexTotalCost = get_float8_infinity();
+		*indexSelectivity = 0;
+		*indexCorrelation = 0;
+		*indexPages = 0;
+#if PG_VERSION_NUM >= 180000
+		/* See "On disable_cost" thread on pgsql-hackers */
+		path->path.disabled_nodes = 2;
+#endif
+		return;
+	}
+
+	MemSet(&costs, 0, sizeof(costs));
+
+	genericcostestimate(root, path, loop_count, &costs);
+
+	index = index_open(path->indexinfo->indexoid, NoLock);
+	InvertedGetMetaPageInfo(index, &meta);
+	index_close(index, NoLock);
+
+	/* Scans only read the posting lists of the query terms */
+	if (meta.sortedTerms > 0)
+	{
+		ratio = ((double) GetQueryTerms(path)) / meta.sortedTerms;
+		if (ratio > 1)
+			ratio = 1;
+	}
+	else
+		ratio = 1;
+
+	/* All results are found before returning the first row */
+	costs.indexStartupCost = costs.indexTotalCost * ratio;
+	costs.indexTotalCost = costs.indexStartupCost;
+
+	*indexStartupCost = costs.indexStartupCost;
+	*indexTotalCost = costs.indexTotalCost;
+	*indexSelectivity = costs.indexSelectivity;
+	*indexCorrelation = costs.indexCorrelation;
+	*indexPages = costs.numIndexPages;
+}
+
+/*
+ * Parse and validate the reloptions
+ */
+static bytea *
+invertedoptions(Datum reloptions, bool validate)
+{
+	return (bytea *) build_reloptions(reloptions, validate,
+									  inverted_relopt_kind,
+									  sizeof(InvertedOptions),
+									  NULL, 0);
+}
+
+/*
+ * Validate catalog entries for the specified operator class
+ */
+static bool
+invertedvalidate(Oid opclassoid)
+{
+	return true;
+}
+
+/*
+ * Define index handler
+ *
+ * See https://www.postgresql.org/docs/current/index-api.html
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(invertedhandler);
+Datum
+invertedhandler(PG_FUNCTION_ARGS)
+{
+	IndexAmRoutine *amroutine = makeNode(IndexAmRoutine);
+
+	amroutine->amstrategies = 0;
+	amroutine->amsupport = 0;
+	amroutine->amoptsprocnum = 0;
+	amroutine->amcanorder = false;
+	amroutine->amcanorderbyop = true;
+#if PG_VERSION_NUM >= 180000
+	amroutine->amcanhash = false;
+	amroutine->amconsistentequality = false;
+	amroutine->amconsistentordering = false;
+#endif
+	amroutine->amcanbackward = false;	/* can change direction mid-scan */
+	amroutine->amcanunique = false;
+	amroutine->amcanmulticol = false;
+	amroutine->amoptionalkey = true;
+	amroutine->amsearcharray = false;
+	amroutine->amsearchnulls = false;
+	amroutine->amstorage = false;
+	amroutine->amclusterable = false;
+	amroutine->ampredlocks = false;
+	amroutine->amcanparallel = false;
+#if PG_VERSION_NUM >= 170000
+	amroutine->amcanbuildparallel = false;
+#endif
+	amroutine->amcaninclude = false;
+	amroutine->amusemaintenanceworkmem = false; /* not used during VACUUM */
+#if PG_VERSION_NUM >= 160000
+	amroutine->amsummarizing = false;
+#endif
+	amroutine->amparallelvacuumoptions = VACUUM_OPTION_PARALLEL_BULKDEL;
+	amroutine->amkeytype = InvalidOid;
+
+	/* Interface functions */
+	amroutine->ambuild = invertedbuild;
+	amroutine->ambuildempty = invertedbuildempty;
+	amroutine->aminsert = invertedinsert;
+#if PG_VERSION_NUM >= 170000
+	amroutine->aminsertcleanup = NULL;
+#endif
+	amroutine->ambulkdelete = invertedbulkdelete;
+	amroutine->amvacuumcleanup = invertedvacuumcleanup;
+	amroutine->amcanreturn = NULL;
+	amroutine->amcostestimate = invertedcostestimate;
+#if PG_VERSION_NUM >= 180000
+	amroutine->amgettreeheight = NULL;
+#endif
+	amroutine->amoptions = invertedoptions;
+	amroutine->amproperty = NULL;
+	amroutine->ambuildphasename = invertedbuildphasename;
+	amroutine->amvalidate = invertedvalidate;
+#if PG_VERSION_NUM >= 140000
+	amroutine->amadjustmembers = NULL;
+#endif
+	amroutine->ambeginscan = invertedbeginscan;
+	amroutine->amrescan = invertedrescan;
+	amroutine->amgettuple = invertedgettuple;
+	amroutine->amgetbitmap = NULL;
+	amroutine->amendscan = invertedendscan;
+	amroutine->ammarkpos = NULL;
+	amroutine->amrestrpos = NULL;
+
+	/* Interface functions to support parallel index scans */
+	amroutine->amestimateparallelscan = NULL;
+	amroutine->aminitparallelscan = NULL;
+	amroutine->amparallelrescan = NULL;
+
+#if PG_VERSION_NUM >= 180000
+	amroutine->amtranslatestrategy = NULL;
+	amroutine->amtranslatecmptype = NULL;
+#endif
+
+	PG_RETURN_POINTER(amroutine);
+}
@@ -0,0 +1,210 @@
+#ifndef INVERTED_H
+#define INVERTED_H
+
+#include "postgres.h"
+
+#include "access/genam.h"
+#include "access/generic_xlog.h"
+#include "nodes/execnodes.h"
+#include "sparsevec.h"
+#include "utils/tuplesort.h"
+#include "vector.h"
+
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
+
+#define INVERTED_VERSION	1
+#define INVERTED_MAGIC_NUMBER 0x1A7E4ED
+#define INVERTED_PAGE_ID	0xFF8A
+
+/* Preserved page numbers */
+#define INVERTED_METAPAGE_BLKNO	0
+
+/* Must correspond to page numbers since page lock is used */
+#define INVERTED_INSERT_LOCK	0
+
+/* Page types */
+#define INVERTED_META_PAGE		0
+#define INVERTED_DIRECTORY_PAGE	1
+#define INVERTED_POSTING_PAGE	2
+
+/* Inverted parameters */
+#define INVERTED_DEFAULT_TOP_K	40
+#define INVERTED_MAX_TOP_K		1000
+
+/* Used when query terms are not known when planning */
+#define INVERTED_DEFAULT_QUERY_TERMS	100
+
+/* Build phases */
+/* PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE is 1 */
+#define PROGRESS_INVERTED_PHASE_SCAN	2
+#define PROGRESS_INVERTED_PHASE_LOAD	3
+
+#define INVERTED_INVALID_DOCID	PG_UINT32_MAX
+
+#define INVERTED_POSTING_SIZE	MAXALIGN(sizeof(InvertedPostingData))
+#define INVERTED_TERM_SIZE		MAXALIGN(sizeof(InvertedTermData))
+#define INVERTED_MAX_POSTINGS_PER_PAGE	((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(InvertedPageOpaqueData))) / (INVERTED_POSTING_SIZE + sizeof(ItemIdData)))
+
+#define InvertedPageGetOpaque(page)	((InvertedPageOpaque) PageGetSpecialPointer(page))
+#define InvertedPageGetMeta(page)	((InvertedMetaPageData *) PageGetContents(page))
+
+/* Variables */
+extern int	inverted_top_k;
+
+/* Inverted index options */
+typedef struct InvertedOptions
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+}			InvertedOptions;
+
+typedef struct InvertedMetaPageData
+{
+	uint32		magicNumber;
+	uint32		version;
+	uint32		nextDocid;
+	uint32		sortedTerms;	/* terms in directory pages from build */
+	BlockNumber directoryStart; /* sorted and contiguous */
+	BlockNumber directoryPages;
+	BlockNumber overflowStart;	/* terms added after build */
+	BlockNumber overflowInsertPage;
+}			InvertedMetaPageData;
+
+typedef InvertedMetaPageData * InvertedMetaPage;
+
+typedef struct InvertedPageOpaqueData
+{
+	BlockNumber nextblkno;
+	uint32		lastDocid;		/* upper bound for posting pages */
+	float		maxValue;		/* for block-max pruning */
+	float		minValue;
+	uint16		type;
+	uint16		page_id;		/* for identification of inverted indexes */
+}			InvertedPageOpaqueData;
+
+typedef InvertedPageOpaqueData * InvertedPageOpaque;
+
+/* Directory entry for a dimension */
+typedef struct InvertedTermData
+{
+	int32		index;
+	BlockNumber startPage;
+	BlockNumber insertPage;
+	float		maxValue;
+	float		minValue;
+}			InvertedTermData;
+
+typedef InvertedTermData * InvertedTerm;
+
+/* Postings are ordered by document id within a term */
+typedef struct InvertedPostingData
+{
+	uint32		docid;
+	float		value;
+	ItemPointerData heaptid;
+}			InvertedPostingData;
+
+typedef InvertedPostingData * InvertedPosting;
+
+typedef struct InvertedTermLocation
+{
+	BlockNumber blkno;			/* invalid if not found */
+	OffsetNumber offno;
+	InvertedTermData term;
+}			InvertedTermLocation;
+
+typedef struct InvertedBuildState
+{
+	/* Info */
+	Relation	heap;
+	Relation	index;
+	IndexInfo  *indexInfo;
+
+	/* Statistics */
+	double		indtuples;
+	double		reltuples;
+	int64		npostings;
+
+	/* Variables */
+	uint32		nextDocid;
+	InvertedTermData *terms;
+	int			termsLength;
+	int			termsSize;
+
+	/* Sorting */
+	Tuplesortstate *sortstate;
+	TupleDesc	sortdesc;
+	TupleTableSlot *slot;
+
+	/* Memory */
+	MemoryContext tmpCtx;
+}			InvertedBuildState;
+
+typedef struct InvertedScanCursor
+{
+	float		query;			/* query value for the term */
+	double		maxScore;		/* upper bound for the term */
+	double		blockMaxScore;	/* upper bound for the current page */
+	uint32		docid;			/* current document id */
+	uint32		lastDocid;
+	BlockNumber nextblkno;
+	int			pos;
+	int			npostings;
+	InvertedPostingData *postings;
+}			InvertedScanCursor;
+
+typedef struct InvertedScanItem
+{
+	ItemPointerData heaptid;
+	double		distance;
+}			InvertedScanItem;
+
+typedef struct InvertedScanOpaqueData
+{
+	int			topK;
+	bool		first;
+	MemoryContext tmpCtx;
+	BufferAccessStrategy bas;
+
+	/* Cursors */
+	InvertedScanCursor *cursors;
+	InvertedScanCursor **sorted;
+	int			ncursors;
+
+	/* Bounded max-heap of results */
+	InvertedScanItem *items;
+	int			itemsLength;
+	int			itemsIndex;
+}			InvertedScanOpaqueData;
+
+typedef InvertedScanOpaqueData * InvertedScanOpaque;
+
+/* Methods */
+void		InvertedInit(void);
+void		InvertedGetMetaPageInfo(Relation index, InvertedMetaPageData * meta);
+void		InvertedFindTerms(Relation index, InvertedMetaPageData * meta, int nterms, const int32 *indices, InvertedTermLocation * locations);
+Buffer		InvertedNewBuffer(Relation index, ForkNumber forkNum);
+void		InvertedInitPage(Buffer buf, Page page, uint16 type);
+void		InvertedInitRegisterPage(Relation index, Buffer *buf, Page *page, GenericXLogState **state, uint16 type);
+void		InvertedCommitBuffer(Buffer buf, GenericXLogState *state);
+void		InvertedAppendPage(Relation index, Buffer *buf, Page *page, GenericXLogState **state, ForkNumber forkNum);
+void		InvertedUpdatePageBounds(Page page, uint32 docid, float value);
+
+/* Index access methods */
+IndexBuildResult *invertedbuild(Relation heap, Relation index, IndexInfo *indexInfo);
+void		invertedbuildempty(Relation index);
+bool		invertedinsert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, Relation heap, IndexUniqueCheck checkUnique
+#if PG_VERSION_NUM >= 140000
+						   ,bool indexUnchanged
+#endif
+						   ,IndexInfo *indexInfo
+);
+IndexBulkDeleteResult *invertedbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state);
+IndexBulkDeleteResult *invertedvacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats);
+IndexScanDesc invertedbeginscan(Relation index, int nkeys, int norderbys);
+void		invertedrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys);
+bool		invertedgettuple(IndexScanDesc scan, ScanDirection dir);
+void		invertedendscan(IndexScanDesc scan);
+
+#endif
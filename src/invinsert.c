@@ -0,0 +1,297 @@
+#include "postgres.h"
+
+#include "access/generic_xlog.h"
+#include "inverted.h"
+#include "storage/bufmgr.h"
+#include "storage/lmgr.h"
+#include "utils/memutils.h"
+
+/*
+ * Get the next document id
+ */
+static uint32
+GetNextDocid(Relation index, InvertedMetaPageData * meta)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	InvertedMetaPage metap;
+	uint32		docid;
+
+	buf = ReadBuffer(index, INVERTED_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	metap = InvertedPageGetMeta(page);
+
+	if (unlikely(metap->magicNumber != INVERTED_MAGIC_NUMBER))
+		elog(ERROR, "inverted index is not valid");
+
+	/* Document ids are not reused */
+	if (metap->nextDocid == INVERTED_INVALID_DOCID)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many rows for inverted index \"%s\"", RelationGetRelationName(index)),
+				 errhint("REINDEX the index.")));
+
+	docid = metap->nextDocid++;
+	memcpy(meta, metap, sizeof(InvertedMetaPageData));
+
+	InvertedCommitBuffer(buf, state);
+
+	return docid;
+}
+
+/*
+ * Get a new page
+ */
+static Buffer
+GetNewPage(Relation index, GenericXLogState *state, Page *page, uint16 type)
+{
+	Buffer		buf;
+
+	LockRelationForExtension(index, ExclusiveLock);
+	buf = InvertedNewBuffer(index, MAIN_FORKNUM);
+	UnlockRelationForExtension(index, ExclusiveLock);
+
+	*page = GenericXLogRegisterBuffer(state, buf, GENERIC_XLOG_FULL_IMAGE);
+	InvertedInitPage(buf, *page, type);
+	return buf;
+}
+
+/*
+ * Add a posting to the page
+ */
+static void
+AddPostingToPage(Relation index, Page page, InvertedPosting posting)
+{
+	if (PageAddItem(page, (Item) posting, sizeof(InvertedPostingData), InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+	InvertedUpdatePageBounds(page, posting->docid, posting->value);
+}
+
+/*
+ * Update the insert page and bounds of a term
+ */
+static void
+UpdateTerm(Relation index, InvertedTermLocation * location, BlockNumber insertPage, float value)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	InvertedTerm term;
+
+	buf = ReadBuffer(index, location->blkno);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	term = (InvertedTerm) PageGetItem(page, PageGetItemId(page, location->offno));
+
+	term->insertPage = insertPage;
+	term->maxValue = Max(term->maxValue, value);
+	term->minValue = Min(term->minValue, value);
+
+	InvertedCommitBuffer(buf, state);
+}
+
+/*
+ * Append a posting to an existing term
+ */
+static void
+AppendPosting(Relation index, InvertedTermLocation * location, InvertedPosting posting)
+{
+	InvertedTerm term = &location->term;
+	BlockNumber insertPage = term->insertPage;
+	bool		updateTerm = posting->value > term->maxValue || posting->value < term->minValue;
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+
+	/* Always append to the last page to keep postings ordered */
+	buf = ReadBuffer(index, insertPage);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+
+	if (PageGetFreeSpace(page) < INVERTED_POSTING_SIZE)
+	{
+		Page		newpage;
+		Buffer		newbuf = GetNewPage(index, state, &newpage, INVERTED_POSTING_PAGE);
+
+		/* Update previous buffer */
+		InvertedPageGetOpaque(page)->nextblkno = BufferGetBlockNumber(newbuf);
+
+		/* Commit */
+		GenericXLogFinish(state);
+
+		/* Unlock previous buffer */
+		UnlockReleaseBuffer(buf);
+
+		/* Prepare new buffer */
+		state = GenericXLogStart(index);
+		buf = newbuf;
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+
+		insertPage = BufferGetBlockNumber(buf);
+		updateTerm = true;
+	}
+
+	AddPostingToPage(index, page, posting);
+
+	InvertedCommitBuffer(buf, state);
+
+	if (updateTerm)
+		UpdateTerm(index, location, insertPage, posting->value);
+}
+
+/*
+ * Create a term that is not in the index
+ */
+static void
+CreateTerm(Relation index, int32 termIndex, InvertedPosting posting)
+{
+	InvertedTermData term;
+	Buffer		buf;
+	Page		page;
+	Buffer		metabuf;
+	Page		metapage;
+	Buffer		newbuf = InvalidBuffer;
+	GenericXLogState *state;
+	InvertedMetaPage metap;
+
+	/* Create posting list */
+	state = GenericXLogStart(index);
+	buf = GetNewPage(index, state, &page, INVERTED_POSTING_PAGE);
+	AddPostingToPage(index, page, posting);
+
+	term.index = termIndex;
+	term.startPage = BufferGetBlockNumber(buf);
+	term.insertPage = term.startPage;
+	term.maxValue = posting->value;
+	term.minValue = posting->value;
+
+	InvertedCommitBuffer(buf, state);
+
+	/* Add to terms added after build */
+	metabuf = ReadBuffer(index, INVERTED_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	metapage = GenericXLogRegisterBuffer(state, metabuf, 0);
+	metap = InvertedPageGetMeta(metapage);
+
+	if (BlockNumberIsValid(metap->overflowInsertPage))
+	{
+		buf = ReadBuffer(index, metap->overflowInsertPage);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+
+		if (PageGetFreeSpace(page) < INVERTED_TERM_SIZE)
+		{
+			Page		newpage;
+
+			newbuf = GetNewPage(index, state, &newpage, INVERTED_DIRECTORY_PAGE);
+			InvertedPageGetOpaque(page)->nextblkno = BufferGetBlockNumber(newbuf);
+			metap->overflowInsertPage = BufferGetBlockNumber(newbuf);
+			page = newpage;
+		}
+	}
+	else
+	{
+		buf = GetNewPage(index, state, &page, INVERTED_DIRECTORY_PAGE);
+		metap->overflowStart = BufferGetBlockNumber(buf);
+		metap->overflowInsertPage = metap->overflowStart;
+	}
+
+	if (PageAddItem(page, (Item) &term, sizeof(InvertedTermData), InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+	GenericXLogFinish(state);
+
+	UnlockReleaseBuffer(buf);
+	if (BufferIsValid(newbuf))
+		UnlockReleaseBuffer(newbuf);
+	UnlockReleaseBuffer(metabuf);
+}
+
+/*
+ * Insert a tuple into the index
+ */
+static void
+InsertTuple(Relation index, Datum *values, ItemPointer heap_tid)
+{
+	SparseVector *vec;
+	float	   *x;
+	InvertedMetaPageData meta;
+	InvertedTermLocation *locations;
+	uint32		docid;
+
+	/* Detoast once for all calls */
+	vec = DatumGetSparseVector(values[0]);
+	x = SPARSEVEC_VALUES(vec);
+
+	/* Skip vectors without postings */
+	if (vec->nnz == 0)
+		return;
+
+	/* Serialize inserts so postings stay ordered by document id */
+	LockPage(index, INVERTED_INSERT_LOCK, ExclusiveLock);
+
+	docid = GetNextDocid(index, &meta);
+
+	locations = palloc(vec->nnz * sizeof(InvertedTermLocation));
+	InvertedFindTerms(index, &meta, vec->nnz, vec->indices, locations);
+
+	for (int i = 0; i < vec->nnz; i++)
+	{
+		InvertedPostingData posting;
+
+		/* Zero padding */
+		MemSet(&posting, 0, sizeof(InvertedPostingData));
+		posting.docid = docid;
+		posting.value = x[i];
+		posting.heaptid = *heap_tid;
+
+		if (BlockNumberIsValid(locations[i].blkno))
+			AppendPosting(index, &locations[i], &posting);
+		else
+			CreateTerm(index, vec->indices[i], &posting);
+	}
+
+	UnlockPage(index, INVERTED_INSERT_LOCK, ExclusiveLock);
+}
+
+/*
+ * Insert a tuple into the index
+ */
+bool
+invertedinsert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
+			   Relation heap, IndexUniqueCheck checkUnique
+#if PG_VERSION_NUM >= 140000
+			   ,bool indexUnchanged
+#endif
+			   ,IndexInfo *indexInfo
+)
+{
+	MemoryContext oldCtx;
+	MemoryContext insertCtx;
+
+	/* Skip nulls */
+	if (isnull[0])
+		return false;
+
+	/* Use memory context since detoast can allocate */
+	insertCtx = AllocSetContextCreate(CurrentMemoryContext,
+									  "Inverted insert temporary context",
+									  ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(insertCtx);
+
+	/* Insert tuple */
+	InsertTuple(index, values, heap_tid);
+
+	/* Delete memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(insertCtx);
+
+	return false;
+}
@@ -0,0 +1,473 @@
+#include "postgres.h"
+
+#include "access/relscan.h"
+#include "inverted.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/bufmgr.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+/*
+ * Get the upper bound of a term contribution from its bounds
+ *
+ * Documents without the term contribute zero, so the bound is never negative
+ */
+static inline double
+GetMaxScore(float query, float maxValue, float minValue)
+{
+	double		score = query > 0 ? (double) query * maxValue : (double) query * minValue;
+
+	return Max(score, 0);
+}
+
+/*
+ * Load the first posting page with a document id at or after the target
+ */
+static void
+CursorLoadPage(IndexScanDesc scan, InvertedScanCursor * cursor, uint32 target)
+{
+	InvertedScanOpaque so = (InvertedScanOpaque) scan->opaque;
+
+	while (BlockNumberIsValid(cursor->nextblkno))
+	{
+		Buffer		buf;
+		Page		page;
+		InvertedPageOpaque opaque;
+		OffsetNumber maxoffno;
+
+		buf = ReadBufferExtended(scan->indexRelation, MAIN_FORKNUM, cursor->nextblkno, RBM_NORMAL, so->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		opaque = InvertedPageGetOpaque(page);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		cursor->nextblkno = opaque->nextblkno;
+
+		/* Skip pages without the target and pages emptied by vacuum */
+		if (opaque->lastDocid < target || maxoffno == InvalidOffsetNumber)
+		{
+			UnlockReleaseBuffer(buf);
+			continue;
+		}
+
+		/* Copy postings so the page is not pinned while scoring */
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+			cursor->postings[offno - FirstOffsetNumber] = *((InvertedPosting) PageGetItem(page, PageGetItemId(page, offno)));
+
+		cursor->npostings = maxoffno;
+		cursor->pos = 0;
+		cursor->lastDocid = opaque->lastDocid;
+		cursor->blockMaxScore = GetMaxScore(cursor->query, opaque->maxValue, opaque->minValue);
+
+		UnlockReleaseBuffer(buf);
+
+		/* Postings may be deleted after the copy of the last document id */
+		if (cursor->postings[cursor->npostings - 1].docid >= target)
+			return;
+	}
+
+	cursor->npostings = 0;
+	cursor->docid = INVERTED_INVALID_DOCID;
+}
+
+/*
+ * Move the cursor to the first posting with a document id at or after the
+ * target
+ */
+static void
+CursorSeek(IndexScanDesc scan, InvertedScanCursor * cursor, uint32 target)
+{
+	int			lo;
+	int			hi;
+
+	if (cursor->docid >= target)
+		return;
+
+	if (cursor->npostings == 0 || cursor->postings[cursor->npostings - 1].docid < target)
+	{
+		CursorLoadPage(scan, cursor, target);
+		if (cursor->docid == INVERTED_INVALID_DOCID)
+			return;
+	}
+
+	/* Binary search the current page */
+	lo = cursor->pos;
+	hi = cursor->npostings - 1;
+	while (lo < hi)
+	{
+		int			mid = lo + (hi - lo) / 2;
+
+		if (cursor->postings[mid].docid < target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	cursor->pos = lo;
+	cursor->docid = cursor->postings[lo].docid;
+}
+
+/*
+ * Add an item to the bounded max-heap, keeping the closest items
+ */
+static void
+AddScanItem(InvertedScanOpaque so, double distance, ItemPointer heaptid)
+{
+	InvertedScanItem *items = so->items;
+	int			i;
+
+	if (so->itemsLength == so->topK)
+	{
+		int			length = so->itemsLength;
+
+		/* Skip if not closer than the furthest item */
+		if (distance >= items[0].distance)
+			return;
+
+		/* Replace furthest item and sift down */
+		i = 0;
+		for (;;)
+		{
+			int			child = 2 * i + 1;
+
+			if (child >= length)
+				break;
+
+			if (child + 1 < length && items[child + 1].distance > items[child].distance)
+				child++;
+
+			if (items[child].distance <= distance)
+				break;
+
+			items[i] = items[child];
+			i = child;
+		}
+	}
+	else
+	{
+		/* Add item and sift up */
+		i = so->itemsLength++;
+		while (i > 0)
+		{
+			int			parent = (i - 1) / 2;
+
+			if (items[parent].distance >= distance)
+				break;
+
+			items[i] = items[parent];
+			i = parent;
+		}
+	}
+
+	items[i].distance = distance;
+	items[i].heaptid = *heaptid;
+}
+
+/*
+ * Compare item distances
+ */
+static int
+CompareScanItems(const void *a, const void *b)
+{
+	if (((const InvertedScanItem *) a)->distance > ((const InvertedScanItem *) b)->distance)
+		return 1;
+
+	if (((const InvertedScanItem *) a)->distance < ((const InvertedScanItem *) b)->distance)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Sort cursors by document id, with exhausted cursors last
+ *
+ * Cursors are nearly sorted after each step, so use insertion sort
+ */
+static void
+SortCursors(InvertedScanOpaque so)
+{
+	InvertedScanCursor **sorted = so->sorted;
+
+	for (int i = 1; i < so->ncursors; i++)
+	{
+		InvertedScanCursor *cursor = sorted[i];
+		int			j = i - 1;
+
+		while (j >= 0 && sorted[j]->docid > cursor->docid)
+		{
+			sorted[j + 1] = sorted[j];
+			j--;
+		}
+		sorted[j + 1] = cursor;
+	}
+}
+
+/*
+ * Create a cursor for each query term in the index
+ */
+static void
+InitCursors(IndexScanDesc scan, SparseVector * query)
+{
+	InvertedScanOpaque so = (InvertedScanOpaque) scan->opaque;
+	float	   *x = SPARSEVEC_VALUES(query);
+	InvertedMetaPageData meta;
+	InvertedTermLocation *locations;
+
+	InvertedGetMetaPageInfo(scan->indexRelation, &meta);
+
+	locations = palloc(query->nnz * sizeof(InvertedTermLocation));
+	InvertedFindTerms(scan->indexRelation, &meta, query->nnz, query->indices, locations);
+
+	so->cursors = palloc(query->nnz * sizeof(InvertedScanCursor));
+	so->sorted = palloc(query->nnz * sizeof(InvertedScanCursor *));
+	so->ncursors = 0;
+
+	for (int i = 0; i < query->nnz; i++)
+	{
+		InvertedScanCursor *cursor;
+
+		/* Skip terms without postings */
+		if (!BlockNumberIsValid(locations[i].blkno))
+			continue;
+
+		cursor = &so->cursors[so->ncursors];
+		cursor->query = x[i];
+		cursor->maxScore = GetMaxScore(x[i], locations[i].term.maxValue, locations[i].term.minValue);
+		cursor->docid = 0;
+		cursor->nextblkno = locations[i].term.startPage;
+		cursor->npostings = 0;
+		cursor->postings = palloc(INVERTED_MAX_POSTINGS_PER_PAGE * sizeof(InvertedPostingData));
+
+		/* Position on the first posting */
+		CursorLoadPage(scan, cursor, 0);
+		if (cursor->docid != INVERTED_INVALID_DOCID)
+			cursor->docid = cursor->postings[0].docid;
+
+		so->sorted[so->ncursors++] = cursor;
+	}
+
+	pfree(locations);
+}
+
+/*
+ * Get items with Block-Max WAND
+ *
+ * Postings are traversed document-at-a-time. A document is only scored when
+ * the upper bounds of its terms (first for the whole list, then for the
+ * current pages) could place it in the top results, and cursors skip over the
+ * remaining documents.
+ */
+static void
+GetScanItems(IndexScanDesc scan, SparseVector * query)
+{
+	InvertedScanOpaque so = (InvertedScanOpaque) scan->opaque;
+	InvertedScanCursor **sorted;
+
+	InitCursors(scan, query);
+	sorted = so->sorted;
+
+	for (;;)
+	{
+		bool		full = so->itemsLength == so->topK;
+		double		threshold = full ? -so->items[0].distance : 0;
+		double		upperBound = 0;
+		int			pivot = -1;
+		uint32		pivotDocid;
+
+		CHECK_FOR_INTERRUPTS();
+
+		SortCursors(so);
+
+		/* Find the first document that could be in the top results */
+		for (int i = 0; i < so->ncursors && sorted[i]->docid != INVERTED_INVALID_DOCID; i++)
+		{
+			upperBound += sorted[i]->maxScore;
+			if (!full || upperBound > threshold)
+			{
+				pivot = i;
+				break;
+			}
+		}
+
+		if (pivot == -1)
+			break;
+
+		pivotDocid = sorted[pivot]->docid;
+		while (pivot + 1 < so->ncursors && sorted[pivot + 1]->docid == pivotDocid)
+			pivot++;
+
+		if (sorted[0]->docid == pivotDocid)
+		{
+			double		blockUpperBound = 0;
+			uint32		next;
+
+			for (int i = 0; i <= pivot; i++)
+				blockUpperBound += sorted[i]->blockMaxScore;
+
+			if (!full || blockUpperBound > threshold)
+			{
+				double		score = 0;
+
+				for (int i = 0; i <= pivot; i++)
+					score += (double) sorted[i]->query * sorted[i]->postings[sorted[i]->pos].value;
+
+				/* Distance is negative inner product */
+				AddScanItem(so, -score, &sorted[0]->postings[sorted[0]->pos].heaptid);
+
+				next = pivotDocid + 1;
+			}
+			else
+			{
+				/* Skip to the end of the shallowest page or the next term */
+				next = INVERTED_INVALID_DOCID;
+				for (int i = 0; i <= pivot; i++)
+					next = Min(next, sorted[i]->lastDocid + 1);
+
+				if (pivot + 1 < so->ncursors)
+					next = Min(next, sorted[pivot + 1]->docid);
+			}
+
+			for (int i = 0; i <= pivot; i++)
+				CursorSeek(scan, sorted[i], next);
+		}
+		else
+		{
+			/* Earlier documents cannot be in the top results */
+			for (int i = 0; i < pivot && sorted[i]->docid < pivotDocid; i++)
+				CursorSeek(scan, sorted[i], pivotDocid);
+		}
+	}
+
+	qsort(so->items, so->itemsLength, sizeof(InvertedScanItem), CompareScanItems);
+}
+
+/*
+ * Prepare for an index scan
+ */
+IndexScanDesc
+invertedbeginscan(Relation index, int nkeys, int norderbys)
+{
+	IndexScanDesc scan;
+	InvertedScanOpaque so;
+
+	scan = RelationGetIndexScan(index, nkeys, norderbys);
+
+	so = (InvertedScanOpaque) palloc(sizeof(InvertedScanOpaqueData));
+	so->topK = inverted_top_k;
+	so->first = true;
+	so->cursors = NULL;
+	so->sorted = NULL;
+	so->ncursors = 0;
+	so->items = palloc(so->topK * sizeof(InvertedScanItem));
+	so->itemsLength = 0;
+	so->itemsIndex = 0;
+
+	/* Cursors and postings are freed when the scan restarts */
+	so->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+									   "Inverted scan temporary context",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	/*
+	 * Reuse same set of shared buffers for scan
+	 *
+	 * See postgres/src/backend/storage/buffer/README for description
+	 */
+	so->bas = GetAccessStrategy(BAS_BULKREAD);
+
+	scan->opaque = so;
+
+	return scan;
+}
+
+/*
+ * Start or restart an index scan
+ */
+void
+invertedrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys)
+{
+	InvertedScanOpaque so = (InvertedScanOpaque) scan->opaque;
+
+	so->first = true;
+	so->itemsLength = 0;
+	so->itemsIndex = 0;
+
+	if (keys && scan->numberOfKeys > 0)
+		memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
+
+	if (orderbys && scan->numberOfOrderBys > 0)
+		memmove(scan->orderByData, orderbys, scan->numberOfOrderBys * sizeof(ScanKeyData));
+}
+
+/*
+ * Fetch the next tuple in the given scan
+ */
+bool
+invertedgettuple(IndexScanDesc scan, ScanDirection dir)
+{
+	InvertedScanOpaque so = (InvertedScanOpaque) scan->opaque;
+
+	/*
+	 * Index can be used to scan backward, but Postgres doesn't support
+	 * backward scan on operators
+	 */
+	Assert(ScanDirectionIsForward(dir));
+
+	if (so->first)
+	{
+		MemoryContext oldCtx;
+
+		/* Count index scan for stats */
+		pgstat_count_index_scan(scan->indexRelation);
+#if PG_VERSION_NUM >= 180000
+		if (scan->instrument)
+			scan->instrument->nsearches++;
+#endif
+
+		/* Safety check */
+		if (scan->orderByData == NULL)
+			elog(ERROR, "cannot scan inverted index without order");
+
+		/* Requires MVCC-compliant snapshot as not able to pin during sorting */
+		/* https://www.postgresql.org/docs/current/index-locking.html */
+		if (!IsMVCCSnapshot(scan->xs_snapshot))
+			elog(ERROR, "non-MVCC snapshots are not supported with inverted");
+
+		so->first = false;
+
+		/* No rows share a nonzero index with a null query */
+		if (scan->orderByData->sk_flags & SK_ISNULL)
+			return false;
+
+		MemoryContextReset(so->tmpCtx);
+		oldCtx = MemoryContextSwitchTo(so->tmpCtx);
+
+		GetScanItems(scan, DatumGetSparseVector(scan->orderByData->sk_argument));
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	if (so->itemsIndex == so->itemsLength)
+		return false;
+
+	scan->xs_heaptid = so->items[so->itemsIndex++].heaptid;
+	scan->xs_recheck = false;
+	scan->xs_recheckorderby = false;
+	return true;
+}
+
+/*
+ * End a scan and release resources
+ */
+void
+invertedendscan(IndexScanDesc scan)
+{
+	InvertedScanOpaque so = (InvertedScanOpaque) scan->opaque;
+
+	FreeAccessStrategy(so->bas);
+	MemoryContextDelete(so->tmpCtx);
+
+	pfree(so->items);
+	pfree(so);
+	scan->opaque = NULL;
+}
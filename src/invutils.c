@@ -0,0 +1,250 @@
+#include "postgres.h"
+
+#include <float.h>
+
+#include "access/generic_xlog.h"
+#include "inverted.h"
+#include "storage/bufmgr.h"
+
+/*
+ * New buffer
+ */
+Buffer
+InvertedNewBuffer(Relation index, ForkNumber forkNum)
+{
+	Buffer		buf = ReadBufferExtended(index, forkNum, P_NEW, RBM_NORMAL, NULL);
+
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	return buf;
+}
+
+/*
+ * Init page
+ */
+void
+InvertedInitPage(Buffer buf, Page page, uint16 type)
+{
+	InvertedPageOpaque opaque;
+
+	PageInit(page, BufferGetPageSize(buf), sizeof(InvertedPageOpaqueData));
+	opaque = InvertedPageGetOpaque(page);
+	opaque->nextblkno = InvalidBlockNumber;
+	opaque->lastDocid = 0;
+	opaque->maxValue = -FLT_MAX;
+	opaque->minValue = FLT_MAX;
+	opaque->type = type;
+	opaque->page_id = INVERTED_PAGE_ID;
+}
+
+/*
+ * Init and register page
+ */
+void
+InvertedInitRegisterPage(Relation index, Buffer *buf, Page *page, GenericXLogState **state, uint16 type)
+{
+	*state = GenericXLogStart(index);
+	*page = GenericXLogRegisterBuffer(*state, *buf, GENERIC_XLOG_FULL_IMAGE);
+	InvertedInitPage(*buf, *page, type);
+}
+
+/*
+ * Commit buffer
+ */
+void
+InvertedCommitBuffer(Buffer buf, GenericXLogState *state)
+{
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Add a new page of the same type
+ *
+ * The order is very important!!
+ */
+void
+InvertedAppendPage(Relation index, Buffer *buf, Page *page, GenericXLogState **state, ForkNumber forkNum)
+{
+	/* Get new buffer */
+	Buffer		newbuf = InvertedNewBuffer(index, forkNum);
+	Page		newpage = GenericXLogRegisterBuffer(*state, newbuf, GENERIC_XLOG_FULL_IMAGE);
+
+	/* Update the previous buffer */
+	InvertedPageGetOpaque(*page)->nextblkno = BufferGetBlockNumber(newbuf);
+
+	/* Init new page */
+	InvertedInitPage(newbuf, newpage, InvertedPageGetOpaque(*page)->type);
+
+	/* Commit */
+	GenericXLogFinish(*state);
+
+	/* Unlock */
+	UnlockReleaseBuffer(*buf);
+
+	*state = GenericXLogStart(index);
+	*page = GenericXLogRegisterBuffer(*state, newbuf, GENERIC_XLOG_FULL_IMAGE);
+	*buf = newbuf;
+}
+
+/*
+ * Update the bounds of a posting page after adding a posting
+ */
+void
+InvertedUpdatePageBounds(Page page, uint32 docid, float value)
+{
+	InvertedPageOpaque opaque = InvertedPageGetOpaque(page);
+
+	opaque->lastDocid = Max(opaque->lastDocid, docid);
+	opaque->maxValue = Max(opaque->maxValue, value);
+	opaque->minValue = Min(opaque->minValue, value);
+}
+
+/*
+ * Get the metapage info
+ */
+void
+InvertedGetMetaPageInfo(Relation index, InvertedMetaPageData * meta)
+{
+	Buffer		buf;
+	Page		page;
+	InvertedMetaPage metap;
+
+	buf = ReadBuffer(index, INVERTED_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = InvertedPageGetMeta(page);
+
+	if (unlikely(metap->magicNumber != INVERTED_MAGIC_NUMBER))
+		elog(ERROR, "inverted index is not valid");
+
+	memcpy(meta, metap, sizeof(InvertedMetaPageData));
+
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Find a term in the sorted directory pages
+ */
+static void
+FindSortedTerm(Relation index, InvertedMetaPageData * meta, int32 termIndex, BlockNumber *lo, InvertedTermLocation * location)
+{
+	BlockNumber hi = meta->directoryPages;
+
+	/* Binary search pages, which are never empty */
+	while (*lo < hi)
+	{
+		BlockNumber mid = *lo + (hi - *lo) / 2;
+		BlockNumber blkno = meta->directoryStart + mid;
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+		InvertedTerm first;
+		InvertedTerm last;
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		first = (InvertedTerm) PageGetItem(page, PageGetItemId(page, FirstOffsetNumber));
+		last = (InvertedTerm) PageGetItem(page, PageGetItemId(page, maxoffno));
+
+		if (termIndex < first->index)
+			hi = mid;
+		else if (termIndex > last->index)
+			*lo = mid + 1;
+		else
+		{
+			OffsetNumber olo = FirstOffsetNumber;
+			OffsetNumber ohi = maxoffno + 1;
+
+			/* Binary search items */
+			while (olo < ohi)
+			{
+				OffsetNumber omid = olo + (ohi - olo) / 2;
+				InvertedTerm term = (InvertedTerm) PageGetItem(page, PageGetItemId(page, omid));
+
+				if (term->index < termIndex)
+					olo = omid + 1;
+				else
+					ohi = omid;
+			}
+
+			if (olo <= maxoffno)
+			{
+				InvertedTerm term = (InvertedTerm) PageGetItem(page, PageGetItemId(page, olo));
+
+				if (term->index == termIndex)
+				{
+					location->blkno = blkno;
+					location->offno = olo;
+					location->term = *term;
+				}
+			}
+
+			/* Later terms are on this page or after */
+			*lo = mid;
+			UnlockReleaseBuffer(buf);
+			return;
+		}
+
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Find the directory entries for sorted term indices
+ */
+void
+InvertedFindTerms(Relation index, InvertedMetaPageData * meta, int nterms, const int32 *indices, InvertedTermLocation * locations)
+{
+	BlockNumber lo = 0;
+	BlockNumber nextblkno = meta->overflowStart;
+
+	for (int i = 0; i < nterms; i++)
+	{
+		locations[i].blkno = InvalidBlockNumber;
+		FindSortedTerm(index, meta, indices[i], &lo, &locations[i]);
+	}
+
+	/* Check terms added after the index was built */
+	while (BlockNumberIsValid(nextblkno))
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		buf = ReadBuffer(index, nextblkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			InvertedTerm term = (InvertedTerm) PageGetItem(page, PageGetItemId(page, offno));
+			int			tlo = 0;
+			int			thi = nterms;
+
+			while (tlo < thi)
+			{
+				int			tmid = tlo + (thi - tlo) / 2;
+
+				if (indices[tmid] < term->index)
+					tlo = tmid + 1;
+				else
+					thi = tmid;
+			}
+
+			if (tlo < nterms && indices[tlo] == term->index)
+			{
+				locations[tlo].blkno = nextblkno;
+				locations[tlo].offno = offno;
+				locations[tlo].term = *term;
+			}
+		}
+
+		nextblkno = InvertedPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+}
@@ -0,0 +1,136 @@
+#include "postgres.h"
+
+#include <float.h>
+
+#include "access/generic_xlog.h"
+#include "commands/vacuum.h"
+#include "inverted.h"
+#include "storage/bufmgr.h"
+
+#if PG_VERSION_NUM >= 180000
+#define vacuum_delay_point() vacuum_delay_point(false)
+#endif
+
+/*
+ * Bulk delete tuples from the index
+ */
+IndexBulkDeleteResult *
+invertedbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+				   IndexBulkDeleteCallback callback, void *callback_state)
+{
+	Relation	index = info->index;
+	BlockNumber nblocks = RelationGetNumberOfBlocks(index);
+	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+
+	if (stats == NULL)
+		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+
+	/* Pages added after this are only for new tuples */
+	for (BlockNumber blkno = INVERTED_METAPAGE_BLKNO + 1; blkno < nblocks; blkno++)
+	{
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *state;
+		InvertedPageOpaque opaque;
+		OffsetNumber offno;
+		OffsetNumber maxoffno;
+		OffsetNumber deletable[MaxOffsetNumber];
+		int			ndeletable;
+
+		vacuum_delay_point();
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+
+		/*
+		 * ambulkdelete cannot delete entries from pages that are pinned by
+		 * other backends
+		 *
+		 * https://www.postgresql.org/docs/current/index-locking.html
+		 */
+		LockBufferForCleanup(buf);
+
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+		opaque = InvertedPageGetOpaque(page);
+
+		if (opaque->type != INVERTED_POSTING_PAGE)
+		{
+			GenericXLogAbort(state);
+			UnlockReleaseBuffer(buf);
+			continue;
+		}
+
+		maxoffno = PageGetMaxOffsetNumber(page);
+		ndeletable = 0;
+
+		/* Find deleted postings */
+		for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			InvertedPosting posting = (InvertedPosting) PageGetItem(page, PageGetItemId(page, offno));
+
+			if (callback(&posting->heaptid, callback_state))
+			{
+				deletable[ndeletable++] = offno;
+				stats->tuples_removed++;
+			}
+		}
+
+		if (ndeletable > 0)
+		{
+			/* Delete postings */
+			PageIndexMultiDelete(page, deletable, ndeletable);
+
+			/*
+			 * Tighten the bounds for block-max pruning. The last document id
+			 * stays since it is only an upper bound, and the insert page and
+			 * term bounds are not changed so postings stay ordered.
+			 */
+			opaque->maxValue = -FLT_MAX;
+			opaque->minValue = FLT_MAX;
+
+			maxoffno = PageGetMaxOffsetNumber(page);
+			for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+			{
+				InvertedPosting posting = (InvertedPosting) PageGetItem(page, PageGetItemId(page, offno));
+
+				opaque->maxValue = Max(opaque->maxValue, posting->value);
+				opaque->minValue = Min(opaque->minValue, posting->value);
+			}
+
+			GenericXLogFinish(state);
+		}
+		else
+			GenericXLogAbort(state);
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	FreeAccessStrategy(bas);
+
+	return stats;
+}
+
+/*
+ * Clean up after a VACUUM operation
+ */
+IndexBulkDeleteResult *
+invertedvacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
+{
+	Relation	rel = info->index;
+
+	if (info->analyze_only)
+		return stats;
+
+	/* stats is NULL if ambulkdelete not called */
+	/* OK to return NULL if index not changed */
+	if (stats == NULL)
+		return NULL;
+
+	stats->num_pages = RelationGetNumberOfBlocks(rel);
+
+	/* Postings are per term, so use the heap count like GIN */
+	stats->num_index_tuples = Max(info->num_heap_tuples, 0);
+	stats->estimated_count = info->estimated_count;
+
+	return stats;
+}
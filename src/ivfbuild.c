@@ -39,6 +39,7 @@
 #define PARALLEL_KEY_TUPLESORT			UINT64CONST(0xA000000000000002)
 #define PARALLEL_KEY_IVFFLAT_CENTERS	UINT64CONST(0xA000000000000003)
 #define PARALLEL_KEY_QUERY_TEXT			UINT64CONST(0xA000000000000004)
+#define PARALLEL_KEY_IVFFLAT_CODEBOOK	UINT64CONST(0xA000000000000005)
 
 /*
  * Add sample
@@ -174,12 +175,24 @@ AddTupleToSort(ItemPointer tid, Datum *values, IvfflatBuildState * buildstate)
 		}
 	}
 
-#ifdef IVFFLAT_KMEANS_DEBUG
 	buildstate->inertia += minDistance;
+
+#ifdef IVFFLAT_KMEANS_DEBUG
 	buildstate->listSums[closestCenter] += minDistance;
 	buildstate->listCounts[closestCenter]++;
 #endif
 
+	/* Store codes instead of the value for product quantization */
+	if (buildstate->codebook != NULL)
+	{
+		int			subvectors = buildstate->subvectors;
+		bytea	   *codes = palloc(VARHDRSZ + subvectors);
+
+		SET_VARSIZE(codes, VARHDRSZ + subvectors);
+		IvfflatPqEncode(buildstate->codebook, buildstate->dimensions, subvectors, DatumGetVector(value), (uint8 *) VARDATA(codes));
+		value = PointerGetDatum(codes);
+	}
+
 	/* Create a virtual tuple */
 	ExecClearTuple(slot);
 	slot->tts_values[0] = Int32GetDatum(closestCenter);
@@ -201,6 +214,42 @@ AddTupleToSort(ItemPointer tid, Datum *values, IvfflatBuildState * buildstate)
 	buildstate->indtuples++;
 }
 
+/*
+ * Log assign progress for this process
+ */
+static void
+LogAssignProgress(IvfflatBuildState * buildstate)
+{
+	instr_time	duration;
+	double		seconds;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, buildstate->assignStart);
+	seconds = INSTR_TIME_GET_DOUBLE(duration);
+
+	ereport(LOG,
+			(errmsg("ivfflat build %s assigned %.0f tuples in %.3f s (%.0f tuples/s)",
+					IsParallelWorker() ? "worker" : "leader", buildstate->indtuples, seconds,
+					seconds > 0 ? buildstate->indtuples / seconds : 0)));
+}
+
+/*
+ * Log sort method and space used
+ */
+static void
+LogSortStats(Tuplesortstate *sortstate)
+{
+	TuplesortInstrumentation stats;
+
+	tuplesort_get_stats(sortstate, &stats);
+
+	ereport(LOG,
+			(errmsg("ivfflat build sort method: %s, %s space used: " INT64_FORMAT " kB",
+					tuplesort_method_name(stats.sortMethod),
+					tuplesort_space_type_name(stats.spaceType),
+					(int64) stats.spaceUsed)));
+}
+
 /*
  * Callback for table_index_build_scan
  */
@@ -224,13 +273,16 @@ BuildCallback(Relation index, ItemPointer tid, Datum *values,
 	/* Reset memory context */
 	MemoryContextSwitchTo(oldCtx);
 	MemoryContextReset(buildstate->tmpCtx);
+
+	if (IvfflatBuildLogDue(&buildstate->lastLog))
+		LogAssignProgress(buildstate);
 }
 
 /*
  * Get index tuple from sort state
  */
 static inline void
-GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot, IndexTuple *itup, int *list)
+GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot, int subvectors, bool packed, IndexTuple *itup, int *list)
 {
 	if (tuplesort_gettupleslot(sortstate, true, false, slot, NULL))
 	{
@@ -238,10 +290,18 @@ GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot,
 		bool		isnull;
 
 		*list = DatumGetInt32(slot_getattr(slot, 1, &isnull));
+
+		/* Packed entries are read from the slot instead */
+		if (packed)
+			return;
+
 		value = slot_getattr(slot, 3, &isnull);
 
 		/* Form the index tuple */
-		*itup = index_form_tuple(tupdesc, &value, &isnull);
+		if (subvectors > 0)
+			*itup = IvfflatPqFormTuple((uint8 *) VARDATA_ANY(DatumGetPointer(value)), subvectors);
+		else
+			*itup = index_form_tuple(tupdesc, &value, &isnull);
 		(*itup)->t_tid = *((ItemPointer) DatumGetPointer(slot_getattr(slot, 2, &isnull)));
 	}
 	else
@@ -265,7 +325,7 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_TOTAL, buildstate->indtuples);
 
-	GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list);
+	GetNextTuple(buildstate->sortstate, tupdesc, slot, buildstate->subvectors, buildstate->packed, &itup, &list);
 
 	for (int i = 0; i < buildstate->centers->length; i++)
 	{
@@ -281,27 +341,49 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 
 		buf = IvfflatNewBuffer(index, forkNum);
 		IvfflatInitRegisterPage(index, &buf, &page, &state);
+		if (buildstate->packed)
+			IvfflatPackedInitPage(page);
 
 		startPage = BufferGetBlockNumber(buf);
 
 		/* Get all tuples for list */
 		while (list == i)
 		{
-			/* Check for free space */
-			Size		itemsz = MAXALIGN(IndexTupleSize(itup));
+			if (buildstate->packed)
+			{
+				bool		isnull;
+				ItemPointer heaptid = (ItemPointer) DatumGetPointer(slot_getattr(slot, 2, &isnull));
+				Datum		value = slot_getattr(slot, 3, &isnull);
+				Vector	   *vec = DatumGetVector(value);
+
+				/* Appended pages are packed as well */
+				if (!IvfflatPackedHasSpace(page, vec->dim))
+					IvfflatAppendPage(index, &buf, &page, &state, forkNum);
+
+				IvfflatPackedAddEntry(page, heaptid, vec);
 
-			if (PageGetFreeSpace(page) < itemsz)
-				IvfflatAppendPage(index, &buf, &page, &state, forkNum);
+				/* Free if detoasted from a short header */
+				if ((Pointer) vec != DatumGetPointer(value))
+					pfree(vec);
+			}
+			else
+			{
+				/* Check for free space */
+				Size		itemsz = MAXALIGN(IndexTupleSize(itup));
 
-			/* Add the item */
-			if (PageAddItem(page, (Item) itup, itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
-				elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+				if (PageGetFreeSpace(page) < itemsz)
+					IvfflatAppendPage(index, &buf, &page, &state, forkNum);
 
-			pfree(itup);
+				/* Add the item */
+				if (PageAddItem(page, (Item) itup, itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+					elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+				pfree(itup);
+			}
 
 			pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_DONE, ++inserted);
 
-			GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list);
+			GetNextTuple(buildstate->sortstate, tupdesc, slot, buildstate->subvectors, buildstate->packed, &itup, &list);
 		}
 
 		insertPage = BufferGetBlockNumber(buf);
@@ -327,6 +409,7 @@ InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, In
 
 	buildstate->lists = IvfflatGetLists(index);
 	buildstate->dimensions = TupleDescAttr(index->rd_att, 0)->atttypmod;
+	buildstate->subvectors = 0;
 
 	/* Disallow varbit since require fixed dimensions */
 	if (TupleDescAttr(index->rd_att, 0)->atttypid == VARBITOID)
@@ -345,6 +428,9 @@ InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, In
 				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
 				 errmsg("column cannot have more than %d dimensions for ivfflat index", buildstate->typeInfo->maxDimensions)));
 
+	buildstate->subvectors = IvfflatGetSubvectors(index, buildstate->dimensions);
+	buildstate->packed = IvfflatGetPacked(index);
+
 	buildstate->reltuples = 0;
 	buildstate->indtuples = 0;
 
@@ -364,24 +450,36 @@ InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, In
 	buildstate->sortdesc = CreateTemplateTupleDesc(3);
 	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 1, "list", INT4OID, -1, 0);
 	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 2, "tid", TIDOID, -1, 0);
-	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 3, "vector", TupleDescAttr(buildstate->tupdesc, 0)->atttypid, -1, 0);
+	if (buildstate->subvectors > 0)
+		TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 3, "codes", BYTEAOID, -1, 0);
+	else
+		TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 3, "vector", TupleDescAttr(buildstate->tupdesc, 0)->atttypid, -1, 0);
 
 	buildstate->slot = MakeSingleTupleTableSlot(buildstate->sortdesc, &TTSOpsVirtual);
 
 	buildstate->centers = VectorArrayInit(buildstate->lists, buildstate->dimensions, buildstate->typeInfo->itemSize(buildstate->dimensions));
 	buildstate->listInfo = palloc(sizeof(ListInfo) * buildstate->lists);
 
+	if (buildstate->subvectors > 0)
+		buildstate->codebook = palloc(sizeof(float) * IVFFLAT_PQ_CENTROIDS * buildstate->dimensions);
+	else
+		buildstate->codebook = NULL;
+
 	buildstate->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
 											   "Ivfflat build temporary context",
 											   ALLOCSET_DEFAULT_SIZES);
 
-#ifdef IVFFLAT_KMEANS_DEBUG
 	buildstate->inertia = 0;
+
+#ifdef IVFFLAT_KMEANS_DEBUG
 	buildstate->listSums = palloc0(sizeof(double) * buildstate->lists);
 	buildstate->listCounts = palloc0(sizeof(int) * buildstate->lists);
 #endif
 
 	buildstate->ivfleader = NULL;
+
+	INSTR_TIME_SET_CURRENT(buildstate->assignStart);
+	buildstate->lastLog = buildstate->assignStart;
 }
 
 /*
@@ -393,6 +491,9 @@ FreeBuildState(IvfflatBuildState * buildstate)
 	VectorArrayFree(buildstate->centers);
 	pfree(buildstate->listInfo);
 
+	if (buildstate->codebook != NULL)
+		pfree(buildstate->codebook);
+
 #ifdef IVFFLAT_KMEANS_DEBUG
 	pfree(buildstate->listSums);
 	pfree(buildstate->listCounts);
@@ -408,6 +509,7 @@ static void
 ComputeCenters(IvfflatBuildState * buildstate)
 {
 	int			numSamples;
+	int			parallel_workers = 0;
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_IVFFLAT_PHASE_KMEANS);
 
@@ -437,8 +539,16 @@ ComputeCenters(IvfflatBuildState * buildstate)
 		}
 	}
 
+	/* Calculate parallel workers */
+	if (buildstate->heap != NULL)
+		parallel_workers = plan_create_index_workers(RelationGetRelid(buildstate->heap), RelationGetRelid(buildstate->index));
+
 	/* Calculate centers */
-	IvfflatBench("k-means", IvfflatKmeans(buildstate->index, buildstate->samples, buildstate->centers, buildstate->typeInfo));
+	IvfflatBench("k-means", IvfflatKmeans(buildstate->index, buildstate->samples, buildstate->centers, buildstate->typeInfo, parallel_workers, buildstate->indexInfo->ii_Concurrent));
+
+	/* Train codebook on the same samples */
+	if (buildstate->codebook != NULL)
+		IvfflatBench("pq training", IvfflatPqTrain(buildstate->samples, buildstate->subvectors, buildstate->codebook));
 
 	/* Free samples before we allocate more memory */
 	VectorArrayFree(buildstate->samples);
@@ -448,7 +558,7 @@ ComputeCenters(IvfflatBuildState * buildstate)
  * Create the metapage
  */
 static void
-CreateMetaPage(Relation index, int dimensions, int lists, ForkNumber forkNum)
+CreateMetaPage(Relation index, int dimensions, int lists, int subvectors, ForkNumber forkNum)
 {
 	Buffer		buf;
 	Page		page;
@@ -464,6 +574,8 @@ CreateMetaPage(Relation index, int dimensions, int lists, ForkNumber forkNum)
 	metap->version = IVFFLAT_VERSION;
 	metap->dimensions = dimensions;
 	metap->lists = lists;
+	metap->subvectors = subvectors;
+	metap->codebookPage = InvalidBlockNumber;
 	((PageHeader) page)->pd_lower =
 		((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page;
 
@@ -597,9 +709,7 @@ ParallelHeapScan(IvfflatBuildState * buildstate)
 		{
 			buildstate->indtuples = ivfshared->indtuples;
 			reltuples = ivfshared->reltuples;
-#ifdef IVFFLAT_KMEANS_DEBUG
 			buildstate->inertia = ivfshared->inertia;
-#endif
 			SpinLockRelease(&ivfshared->mutex);
 			break;
 		}
@@ -618,7 +728,7 @@ ParallelHeapScan(IvfflatBuildState * buildstate)
  * Perform a worker's portion of a parallel sort
  */
 static void
-IvfflatParallelScanAndSort(IvfflatSpool * ivfspool, IvfflatShared * ivfshared, Sharedsort *sharedsort, char *ivfcenters, int sortmem, bool progress)
+IvfflatParallelScanAndSort(IvfflatSpool * ivfspool, IvfflatShared * ivfshared, Sharedsort *sharedsort, char *ivfcenters, char *ivfcodebook, int sortmem, bool progress)
 {
 	SortCoordinate coordinate;
 	IvfflatBuildState buildstate;
@@ -638,6 +748,8 @@ IvfflatParallelScanAndSort(IvfflatSpool * ivfspool, IvfflatShared * ivfshared, S
 	InitBuildState(&buildstate, ivfspool->heap, ivfspool->index, indexInfo);
 	memcpy(buildstate.centers->items, ivfcenters, buildstate.centers->itemsize * buildstate.centers->maxlen);
 	buildstate.centers->length = buildstate.centers->maxlen;
+	if (buildstate.codebook != NULL)
+		memcpy(buildstate.codebook, ivfcodebook, sizeof(float) * IVFFLAT_PQ_CENTROIDS * buildstate.dimensions);
 	ivfspool->sortstate = InitBuildSortState(buildstate.sortdesc, sortmem, coordinate);
 	buildstate.sortstate = ivfspool->sortstate;
 	scan = table_beginscan_parallel(ivfspool->heap,
@@ -654,12 +766,16 @@ IvfflatParallelScanAndSort(IvfflatSpool * ivfspool, IvfflatShared * ivfshared, S
 	ivfshared->nparticipantsdone++;
 	ivfshared->reltuples += reltuples;
 	ivfshared->indtuples += buildstate.indtuples;
-#ifdef IVFFLAT_KMEANS_DEBUG
 	ivfshared->inertia += buildstate.inertia;
-#endif
 	SpinLockRelease(&ivfshared->mutex);
 
 	/* Log statistics */
+	if (ivfflat_build_log_interval > 0)
+	{
+		LogAssignProgress(&buildstate);
+		LogSortStats(ivfspool->sortstate);
+	}
+
 	if (progress)
 		ereport(DEBUG1, (errmsg("leader processed " INT64_FORMAT " tuples", (int64) reltuples)));
 	else
@@ -685,6 +801,7 @@ IvfflatParallelBuildMain(dsm_segment *seg, shm_toc *toc)
 	IvfflatShared *ivfshared;
 	Sharedsort *sharedsort;
 	char	   *ivfcenters;
+	char	   *ivfcodebook;
 	Relation	heapRel;
 	Relation	indexRel;
 	LOCKMODE	heapLockmode;
@@ -727,10 +844,11 @@ IvfflatParallelBuildMain(dsm_segment *seg, shm_toc *toc)
 	tuplesort_attach_shared(sharedsort, seg);
 
 	ivfcenters = shm_toc_lookup(toc, PARALLEL_KEY_IVFFLAT_CENTERS, false);
+	ivfcodebook = shm_toc_lookup(toc, PARALLEL_KEY_IVFFLAT_CODEBOOK, true);
 
 	/* Perform sorting */
 	sortmem = maintenance_work_mem / ivfshared->scantuplesortstates;
-	IvfflatParallelScanAndSort(ivfspool, ivfshared, sharedsort, ivfcenters, sortmem, false);
+	IvfflatParallelScanAndSort(ivfspool, ivfshared, sharedsort, ivfcenters, ivfcodebook, sortmem, false);
 
 	/* Close relations within worker */
 	index_close(indexRel, indexLockmode);
@@ -781,7 +899,7 @@ IvfflatLeaderParticipateAsWorker(IvfflatBuildState * buildstate)
 	sortmem = maintenance_work_mem / ivfleader->nparticipanttuplesorts;
 	IvfflatParallelScanAndSort(leaderworker, ivfleader->ivfshared,
 							   ivfleader->sharedsort, ivfleader->ivfcenters,
-							   sortmem, true);
+							   ivfleader->ivfcodebook, sortmem, true);
 }
 
 /*
@@ -796,9 +914,11 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	Size		estivfshared;
 	Size		estsort;
 	Size		estcenters;
+	Size		estcodebook;
 	IvfflatShared *ivfshared;
 	Sharedsort *sharedsort;
 	char	   *ivfcenters;
+	char	   *ivfcodebook = NULL;
 	IvfflatLeader *ivfleader = (IvfflatLeader *) palloc0(sizeof(IvfflatLeader));
 	bool		leaderparticipates = true;
 	int			querylen;
@@ -829,6 +949,14 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	shm_toc_estimate_chunk(&pcxt->estimator, estcenters);
 	shm_toc_estimate_keys(&pcxt->estimator, 3);
 
+	/* Estimate PARALLEL_KEY_IVFFLAT_CODEBOOK space */
+	estcodebook = buildstate->codebook != NULL ? sizeof(float) * IVFFLAT_PQ_CENTROIDS * buildstate->dimensions : 0;
+	if (estcodebook > 0)
+	{
+		shm_toc_estimate_chunk(&pcxt->estimator, estcodebook);
+		shm_toc_estimate_keys(&pcxt->estimator, 1);
+	}
+
 	/* Finally, estimate PARALLEL_KEY_QUERY_TEXT space */
 	if (debug_query_string)
 	{
@@ -865,9 +993,7 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	ivfshared->nparticipantsdone = 0;
 	ivfshared->reltuples = 0;
 	ivfshared->indtuples = 0;
-#ifdef IVFFLAT_KMEANS_DEBUG
 	ivfshared->inertia = 0;
-#endif
 	table_parallelscan_initialize(buildstate->heap,
 								  ParallelTableScanFromIvfflatShared(ivfshared),
 								  snapshot);
@@ -884,6 +1010,13 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	shm_toc_insert(pcxt->toc, PARALLEL_KEY_TUPLESORT, sharedsort);
 	shm_toc_insert(pcxt->toc, PARALLEL_KEY_IVFFLAT_CENTERS, ivfcenters);
 
+	if (estcodebook > 0)
+	{
+		ivfcodebook = shm_toc_allocate(pcxt->toc, estcodebook);
+		memcpy(ivfcodebook, buildstate->codebook, estcodebook);
+		shm_toc_insert(pcxt->toc, PARALLEL_KEY_IVFFLAT_CODEBOOK, ivfcodebook);
+	}
+
 	/* Store query string for workers */
 	if (debug_query_string)
 	{
@@ -904,6 +1037,7 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	ivfleader->sharedsort = sharedsort;
 	ivfleader->snapshot = snapshot;
 	ivfleader->ivfcenters = ivfcenters;
+	ivfleader->ivfcodebook = ivfcodebook;
 
 	/* If no workers were successfully launched, back out (do serial build) */
 	if (pcxt->nworkers_launched == 0)
@@ -960,12 +1094,24 @@ AssignTuples(IvfflatBuildState * buildstate)
 	/* Add tuples to sort */
 	if (buildstate->heap != NULL)
 	{
+		INSTR_TIME_SET_CURRENT(buildstate->assignStart);
+		buildstate->lastLog = buildstate->assignStart;
+
 		if (buildstate->ivfleader)
 			buildstate->reltuples = ParallelHeapScan(buildstate);
 		else
 			buildstate->reltuples = table_index_build_scan(buildstate->heap, buildstate->index, buildstate->indexInfo,
 														   true, true, BuildCallback, (void *) buildstate, NULL);
 
+		/* Parallel participants log their own progress */
+		if (ivfflat_build_log_interval > 0 && !buildstate->ivfleader)
+			LogAssignProgress(buildstate);
+
+		if (ivfflat_build_log_interval > 0)
+			ereport(LOG,
+					(errmsg("ivfflat build assigned %.0f tuples to %d lists with inertia %.3e",
+							buildstate->indtuples, buildstate->centers->length, buildstate->inertia)));
+
 #ifdef IVFFLAT_KMEANS_DEBUG
 		PrintKmeansMetrics(buildstate);
 #endif
@@ -982,8 +1128,12 @@ CreateEntryPages(IvfflatBuildState * buildstate, ForkNumber forkNum)
 	IvfflatBench("assign tuples", AssignTuples(buildstate));
 
 	/* Sort */
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_IVFFLAT_PHASE_SORT);
 	IvfflatBench("sort tuples", tuplesort_performsort(buildstate->sortstate));
 
+	if (ivfflat_build_log_interval > 0)
+		LogSortStats(buildstate->sortstate);
+
 	/* Load */
 	IvfflatBench("load tuples", InsertTuples(buildstate->index, buildstate, forkNum));
 
@@ -1007,8 +1157,10 @@ BuildIndex(Relation heap, Relation index, IndexInfo *indexInfo,
 	ComputeCenters(buildstate);
 
 	/* Create pages */
-	CreateMetaPage(index, buildstate->dimensions, buildstate->lists, forkNum);
+	CreateMetaPage(index, buildstate->dimensions, buildstate->lists, buildstate->subvectors, forkNum);
 	CreateListPages(index, buildstate->centers, buildstate->lists, forkNum, &buildstate->listInfo);
+	if (buildstate->codebook != NULL)
+		IvfflatPqCreateCodebookPages(index, buildstate->codebook, buildstate->dimensions, forkNum);
 	CreateEntryPages(buildstate, forkNum);
 
 	/* Write WAL for initialization fork since GenericXLog functions do not */
@@ -19,6 +19,10 @@
 int			ivfflat_probes;
 int			ivfflat_iterative_scan;
 int			ivfflat_max_probes;
+int			ivfflat_pq_rerank;
+int			ivfflat_max_results;
+int			ivfflat_build_log_interval;
+double		ivfflat_probe_ratio;
 static relopt_kind ivfflat_relopt_kind;
 
 static const struct config_enum_entry ivfflat_iterative_scan_options[] = {
@@ -27,6 +31,12 @@ static const struct config_enum_entry ivfflat_iterative_scan_options[] = {
 	{NULL, 0, false}
 };
 
+static relopt_enum_elt_def ivfflat_quantizer_options[] = {
+	{"flat", IVFFLAT_QUANTIZER_FLAT},
+	{"pq", IVFFLAT_QUANTIZER_PQ},
+	{(const char *) NULL}
+};
+
 /*
  * Initialize index options and variables
  */
@@ -36,6 +46,14 @@ IvfflatInit(void)
 	ivfflat_relopt_kind = add_reloption_kind();
 	add_int_reloption(ivfflat_relopt_kind, "lists", "Number of inverted lists",
 					  IVFFLAT_DEFAULT_LISTS, IVFFLAT_MIN_LISTS, IVFFLAT_MAX_LISTS, AccessExclusiveLock);
+	add_enum_reloption(ivfflat_relopt_kind, "quantizer", "Storage for list entries",
+					   ivfflat_quantizer_options, IVFFLAT_QUANTIZER_FLAT,
+					   "Valid values are \"flat\" and \"pq\".", AccessExclusiveLock);
+	/* Zero chooses based on dimensions */
+	add_int_reloption(ivfflat_relopt_kind, "subvectors", "Number of subvectors for product quantization",
+					  0, 0, IVFFLAT_MAX_SUBVECTORS, AccessExclusiveLock);
+	add_bool_reloption(ivfflat_relopt_kind, "packed", "Packs vectors on entry pages",
+					   false, AccessExclusiveLock);
 
 	DefineCustomIntVariable("ivfflat.probes", "Sets the number of probes",
 							"Valid range is 1..lists.", &ivfflat_probes,
@@ -50,6 +68,24 @@ IvfflatInit(void)
 							NULL, &ivfflat_max_probes,
 							IVFFLAT_MAX_LISTS, IVFFLAT_MIN_LISTS, IVFFLAT_MAX_LISTS, PGC_USERSET, 0, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("ivfflat.pq_rerank", "Sets the number of candidates to re-rank with exact distances for product quantization",
+							"Zero disables re-ranking.", &ivfflat_pq_rerank,
+							IVFFLAT_DEFAULT_PQ_RERANK, 0, IVFFLAT_MAX_PQ_RERANK, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("ivfflat.max_results", "Sets the max number of results for non-iterative scans",
+							"Zero disables the limit.", &ivfflat_max_results,
+							0, 0, IVFFLAT_MAX_MAX_RESULTS, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	/* Needs max_results to know the furthest result */
+	DefineCustomRealVariable("ivfflat.probe_ratio", "Stops probing lists farther than this multiple of the distance to the furthest result",
+							 "Zero disables stopping early.", &ivfflat_probe_ratio,
+							 0, 0, 1000, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	/* Writes to the server log, so same context as log_min_duration_statement */
+	DefineCustomIntVariable("ivfflat.build_log_interval", "Sets the interval to log build progress",
+							"Zero disables logging.", &ivfflat_build_log_interval,
+							0, 0, INT_MAX, PGC_SUSET, GUC_UNIT_S, NULL, NULL, NULL);
+
 	MarkGUCPrefixReserved("ivfflat");
 }
 
@@ -67,6 +103,8 @@ ivfflatbuildphasename(int64 phasenum)
 			return "performing k-means";
 		case PROGRESS_IVFFLAT_PHASE_ASSIGN:
 			return "assigning tuples";
+		case PROGRESS_IVFFLAT_PHASE_SORT:
+			return "sorting tuples";
 		case PROGRESS_IVFFLAT_PHASE_LOAD:
 			return "loading tuples";
 		default:
@@ -153,6 +191,9 @@ ivfflatoptions(Datum reloptions, bool validate)
 {
 	static const relopt_parse_elt tab[] = {
 		{"lists", RELOPT_TYPE_INT, offsetof(IvfflatOptions, lists)},
+		{"quantizer", RELOPT_TYPE_ENUM, offsetof(IvfflatOptions, quantizer)},
+		{"subvectors", RELOPT_TYPE_INT, offsetof(IvfflatOptions, subvectors)},
+		{"packed", RELOPT_TYPE_BOOL, offsetof(IvfflatOptions, packed)},
 	};
 
 	return (bytea *) build_reloptions(reloptions, validate,
@@ -200,7 +241,7 @@ ivfflathandler(PG_FUNCTION_ARGS)
 	amroutine->amstorage = false;
 	amroutine->amclusterable = false;
 	amroutine->ampredlocks = false;
-	amroutine->amcanparallel = false;
+	amroutine->amcanparallel = true;
 #if PG_VERSION_NUM >= 170000
 	amroutine->amcanbuildparallel = true;
 #endif
@@ -242,9 +283,9 @@ ivfflathandler(PG_FUNCTION_ARGS)
 	amroutine->amrestrpos = NULL;
 
 	/* Interface functions to support parallel index scans */
-	amroutine->amestimateparallelscan = NULL;
-	amroutine->aminitparallelscan = NULL;
-	amroutine->amparallelrescan = NULL;
+	amroutine->amestimateparallelscan = ivfflatestimateparallelscan;
+	amroutine->aminitparallelscan = ivfflatinitparallelscan;
+	amroutine->amparallelrescan = ivfflatparallelrescan;
 
 #if PG_VERSION_NUM >= 180000
 	amroutine->amtranslatestrategy = NULL;
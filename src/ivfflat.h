@@ -9,6 +9,9 @@
 #include "lib/pairingheap.h"
 #include "nodes/execnodes.h"
 #include "port.h"				/* for random() */
+#include "port/atomics.h"
+#include "rerank.h"
+#include "scanstats.h"
 #include "utils/sampling.h"
 #include "utils/tuplesort.h"
 #include "vector.h"
@@ -21,9 +24,7 @@
 #include "common/pg_prng.h"
 #endif
 
-#ifdef IVFFLAT_BENCH
 #include "portability/instr_time.h"
-#endif
 
 #define IVFFLAT_MAX_DIM 2000
 
@@ -47,32 +48,61 @@
 #define IVFFLAT_MIN_LISTS		1
 #define IVFFLAT_MAX_LISTS		32768
 #define IVFFLAT_DEFAULT_PROBES	1
+#define IVFFLAT_DEFAULT_PQ_RERANK	0
+#define IVFFLAT_MAX_PQ_RERANK	20000
+#define IVFFLAT_MAX_MAX_RESULTS	1000000
+
+/* Product quantization parameters */
+#define IVFFLAT_PQ_CENTROIDS	256
+#define IVFFLAT_MAX_SUBVECTORS	IVFFLAT_MAX_DIM
 
 /* Build phases */
 /* PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE is 1 */
 #define PROGRESS_IVFFLAT_PHASE_KMEANS	2
 #define PROGRESS_IVFFLAT_PHASE_ASSIGN	3
-#define PROGRESS_IVFFLAT_PHASE_LOAD		4
+#define PROGRESS_IVFFLAT_PHASE_SORT		4
+#define PROGRESS_IVFFLAT_PHASE_LOAD		5
 
 #define IVFFLAT_LIST_SIZE(size)	(offsetof(IvfflatListData, center) + size)
+#define IVFFLAT_PQ_TUPLE_SIZE(subvectors)	MAXALIGN(sizeof(IndexTupleData) + (subvectors))
+
+#define IvfflatPqTupleGetCodes(itup)	((uint8 *) (itup) + sizeof(IndexTupleData))
 
 #define IvfflatPageGetOpaque(page)	((IvfflatPageOpaque) PageGetSpecialPointer(page))
 #define IvfflatPageGetMeta(page)	((IvfflatMetaPageData *) PageGetContents(page))
 
+/* Page flags */
+#define IVFFLAT_PACKED	(1 << 0)
+
+#define IvfflatPageIsPacked(page)	((IvfflatPageGetOpaque(page)->flags & IVFFLAT_PACKED) != 0)
+
+#define IVFFLAT_PACKED_ENTRY_SIZE(dimensions)	(sizeof(ItemPointerData) + (dimensions) * sizeof(float))
+#define IVFFLAT_MAX_PACKED_ENTRIES	((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(IvfflatPageOpaqueData))) / IVFFLAT_PACKED_ENTRY_SIZE(1))
+
+/* Build steps are timed with IVFFLAT_BENCH or ivfflat.build_log_interval */
 #ifdef IVFFLAT_BENCH
+#define IVFFLAT_BENCH_ENABLED true
+#define IVFFLAT_BENCH_ELEVEL INFO
+#else
+#define IVFFLAT_BENCH_ENABLED (ivfflat_build_log_interval > 0)
+#define IVFFLAT_BENCH_ELEVEL LOG
+#endif
+
 #define IvfflatBench(name, code) \
 	do { \
-		instr_time	start; \
-		instr_time	duration; \
-		INSTR_TIME_SET_CURRENT(start); \
-		(code); \
-		INSTR_TIME_SET_CURRENT(duration); \
-		INSTR_TIME_SUBTRACT(duration, start); \
-		elog(INFO, "%s: %.3f ms", name, INSTR_TIME_GET_MILLISEC(duration)); \
+		if (IVFFLAT_BENCH_ENABLED) \
+		{ \
+			instr_time	start; \
+			instr_time	duration; \
+			INSTR_TIME_SET_CURRENT(start); \
+			(code); \
+			INSTR_TIME_SET_CURRENT(duration); \
+			INSTR_TIME_SUBTRACT(duration, start); \
+			elog(IVFFLAT_BENCH_ELEVEL, "ivfflat %s: %.3f ms", name, INSTR_TIME_GET_MILLISEC(duration)); \
+		} \
+		else \
+			(code); \
 	} while (0)
-#else
-#define IvfflatBench(name, code) (code)
-#endif
 
 #if PG_VERSION_NUM >= 150000
 #define RandomDouble() pg_prng_double(&pg_global_prng_state)
@@ -88,6 +118,10 @@
 extern int	ivfflat_probes;
 extern int	ivfflat_iterative_scan;
 extern int	ivfflat_max_probes;
+extern int	ivfflat_pq_rerank;
+extern int	ivfflat_max_results;
+extern int	ivfflat_build_log_interval;
+extern double ivfflat_probe_ratio;
 
 typedef enum IvfflatIterativeScanMode
 {
@@ -95,6 +129,12 @@ typedef enum IvfflatIterativeScanMode
 	IVFFLAT_ITERATIVE_SCAN_RELAXED
 }			IvfflatIterativeScanMode;
 
+typedef enum IvfflatQuantizer
+{
+	IVFFLAT_QUANTIZER_FLAT,
+	IVFFLAT_QUANTIZER_PQ
+}			IvfflatQuantizer;
+
 typedef struct VectorArrayData
 {
 	int			length;
@@ -117,6 +157,9 @@ typedef struct IvfflatOptions
 {
 	int32		vl_len_;		/* varlena header (do not touch directly!) */
 	int			lists;			/* number of lists */
+	int			quantizer;		/* storage for list entries */
+	int			subvectors;		/* number of subvectors for pq */
+	bool		packed;			/* pack vectors on entry pages */
 }			IvfflatOptions;
 
 typedef struct IvfflatSpool
@@ -144,10 +187,7 @@ typedef struct IvfflatShared
 	int			nparticipantsdone;
 	double		reltuples;
 	double		indtuples;
-
-#ifdef IVFFLAT_KMEANS_DEBUG
 	double		inertia;
-#endif
 }			IvfflatShared;
 
 #define ParallelTableScanFromIvfflatShared(shared) \
@@ -161,6 +201,7 @@ typedef struct IvfflatLeader
 	Sharedsort *sharedsort;
 	Snapshot	snapshot;
 	char	   *ivfcenters;
+	char	   *ivfcodebook;
 }			IvfflatLeader;
 
 typedef struct IvfflatTypeInfo
@@ -184,6 +225,8 @@ typedef struct IvfflatBuildState
 	/* Settings */
 	int			dimensions;
 	int			lists;
+	int			subvectors;
+	bool		packed;
 
 	/* Statistics */
 	double		indtuples;
@@ -199,9 +242,12 @@ typedef struct IvfflatBuildState
 	VectorArray samples;
 	VectorArray centers;
 	ListInfo   *listInfo;
+	float	   *codebook;
 
-#ifdef IVFFLAT_KMEANS_DEBUG
+	/* Sum of distances to the closest center */
 	double		inertia;
+
+#ifdef IVFFLAT_KMEANS_DEBUG
 	double	   *listSums;
 	int		   *listCounts;
 #endif
@@ -221,6 +267,10 @@ typedef struct IvfflatBuildState
 
 	/* Parallel builds */
 	IvfflatLeader *ivfleader;
+
+	/* Instrumentation for ivfflat.build_log_interval */
+	instr_time	assignStart;
+	instr_time	lastLog;
 }			IvfflatBuildState;
 
 typedef struct IvfflatMetaPageData
@@ -229,6 +279,8 @@ typedef struct IvfflatMetaPageData
 	uint32		version;
 	uint16		dimensions;
 	uint16		lists;
+	uint16		subvectors;		/* zero unless product quantization */
+	BlockNumber codebookPage;
 }			IvfflatMetaPageData;
 
 typedef IvfflatMetaPageData * IvfflatMetaPage;
@@ -236,7 +288,7 @@ typedef IvfflatMetaPageData * IvfflatMetaPage;
 typedef struct IvfflatPageOpaqueData
 {
 	BlockNumber nextblkno;
-	uint16		unused;
+	uint16		flags;
 	uint16		page_id;		/* for identification of IVFFlat indexes */
 }			IvfflatPageOpaqueData;
 
@@ -258,6 +310,20 @@ typedef struct IvfflatScanList
 	double		distance;
 }			IvfflatScanList;
 
+typedef struct IvfflatScanItem
+{
+	ItemPointerData heaptid;
+	double		distance;
+}			IvfflatScanItem;
+
+typedef struct IvfflatParallelScanData
+{
+	/* Next list to claim from the closest lists */
+	pg_atomic_uint32 nextList;
+}			IvfflatParallelScanData;
+
+typedef IvfflatParallelScanData * IvfflatParallelScan;
+
 typedef struct IvfflatScanOpaqueData
 {
 	const		IvfflatTypeInfo *typeInfo;
@@ -275,17 +341,46 @@ typedef struct IvfflatScanOpaqueData
 	TupleTableSlot *mslot;
 	BufferAccessStrategy bas;
 
+	/* Bounded max-heap used instead of sorting */
+	int			maxResults;
+	double		probeRatio;		/* zero unless probing stops early */
+	IvfflatScanItem *items;
+	int			itemsLength;
+	int			itemsSize;
+	int			itemsIndex;
+
 	/* Support functions */
 	FmgrInfo   *procinfo;
 	FmgrInfo   *normprocinfo;
 	Oid			collation;
 	Datum		(*distfunc) (FmgrInfo *flinfo, Oid collation, Datum arg1, Datum arg2);
+	bool		hammingBatch;	/* score each page in one call */
 
 	/* Lists */
 	pairingheap *listQueue;
 	BlockNumber *listPages;
+	double	   *listDistances;
 	int			listIndex;
 	IvfflatScanList *lists;
+
+	/* Product quantization */
+	int			subvectors;
+	const float *codebook;
+	float	   *pqTable;
+	bool		pqInnerProduct;
+
+	/* Packed entry pages */
+	bool		packedInnerProduct;
+
+	/* Re-ranking */
+	int			rerank;
+	IvfflatScanItem *rerankItems;
+	int			rerankLength;
+	int			rerankIndex;
+	VectorRerankState heapRerank;
+
+	/* Instrumentation */
+	VectorScanStats stats;
 }			IvfflatScanOpaqueData;
 
 typedef IvfflatScanOpaqueData * IvfflatScanOpaque;
@@ -306,15 +401,58 @@ VectorArraySet(VectorArray arr, int offset, Pointer val)
 	memcpy(VectorArrayGet(arr, offset), val, VARSIZE_ANY(val));
 }
 
+/*
+ * Packed entry pages store heap TIDs up from the page header and vectors
+ * down from the special space, so pd_lower and pd_upper bound the free space
+ * like on other pages
+ */
+
+static inline int
+IvfflatPackedGetCount(Page page)
+{
+	return (((PageHeader) page)->pd_lower - MAXALIGN(SizeOfPageHeaderData)) / sizeof(ItemPointerData);
+}
+
+static inline ItemPointer
+IvfflatPackedGetTid(Page page, int i)
+{
+	return (ItemPointer) PageGetContents(page) + i;
+}
+
+static inline float *
+IvfflatPackedGetVector(Page page, int i, int dimensions)
+{
+	return (float *) (((char *) page + ((PageHeader) page)->pd_special) - (Size) (i + 1) * dimensions * sizeof(float));
+}
+
+static inline bool
+IvfflatPackedHasSpace(Page page, int dimensions)
+{
+	return (Size) (((PageHeader) page)->pd_upper - ((PageHeader) page)->pd_lower) >= IVFFLAT_PACKED_ENTRY_SIZE(dimensions);
+}
+
 /* Methods */
 VectorArray VectorArrayInit(int maxlen, int dimensions, Size itemsize);
 void		VectorArrayFree(VectorArray arr);
-void		IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo);
+void		IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, int parallelWorkers, bool isconcurrent);
 FmgrInfo   *IvfflatOptionalProcInfo(Relation index, uint16 procnum);
 Datum		IvfflatNormValue(const IvfflatTypeInfo * typeInfo, Oid collation, Datum value);
 bool		IvfflatCheckNorm(FmgrInfo *procinfo, Oid collation, Datum value);
+bool		IvfflatBuildLogDue(instr_time *lastLog);
 int			IvfflatGetLists(Relation index);
 void		IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions);
+void		IvfflatGetPqMetaPageInfo(Relation index, int *subvectors, BlockNumber *codebookPage);
+int			IvfflatGetSubvectors(Relation index, int dimensions);
+bool		IvfflatGetPacked(Relation index);
+void		IvfflatPackedInitPage(Page page);
+void		IvfflatPackedAddEntry(Page page, ItemPointer heaptid, Vector * vec);
+bool		IvfflatPqUsesInnerProduct(FmgrInfo *procinfo);
+void		IvfflatPqTrain(VectorArray samples, int subvectors, float *codebook);
+void		IvfflatPqEncode(const float *codebook, int dimensions, int subvectors, Vector * vec, uint8 *codes);
+IndexTuple	IvfflatPqFormTuple(const uint8 *codes, int subvectors);
+void		IvfflatPqComputeTable(const float *codebook, int dimensions, int subvectors, Vector * query, bool innerProduct, float *table);
+void		IvfflatPqCreateCodebookPages(Relation index, const float *codebook, int dimensions, ForkNumber forkNum);
+const float *IvfflatPqGetCodebook(Relation index, int *subvectors);
 void		IvfflatUpdateList(Relation index, ListInfo listInfo, BlockNumber insertPage, BlockNumber originalInsertPage, BlockNumber startPage, ForkNumber forkNum);
 void		IvfflatCommitBuffer(Buffer buf, GenericXLogState *state);
 void		IvfflatAppendPage(Relation index, Buffer *buf, Page *page, GenericXLogState **state, ForkNumber forkNum);
@@ -324,6 +462,7 @@ void		IvfflatInitRegisterPage(Relation index, Buffer *buf, Page *page, GenericXL
 void		IvfflatInit(void);
 const		IvfflatTypeInfo *IvfflatGetTypeInfo(Relation index);
 PGDLLEXPORT void IvfflatParallelBuildMain(dsm_segment *seg, shm_toc *toc);
+PGDLLEXPORT void IvfflatParallelKmeansMain(dsm_segment *seg, shm_toc *toc);
 
 /* Index access methods */
 IndexBuildResult *ivfflatbuild(Relation heap, Relation index, IndexInfo *indexInfo);
@@ -340,5 +479,14 @@ IndexScanDesc ivfflatbeginscan(Relation index, int nkeys, int norderbys);
 void		ivfflatrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys);
 bool		ivfflatgettuple(IndexScanDesc scan, ScanDirection dir);
 void		ivfflatendscan(IndexScanDesc scan);
+#if PG_VERSION_NUM >= 180000
+Size		ivfflatestimateparallelscan(Relation indexRelation, int nkeys, int norderbys);
+#elif PG_VERSION_NUM >= 170000
+Size		ivfflatestimateparallelscan(int nkeys, int norderbys);
+#else
+Size		ivfflatestimateparallelscan(void);
+#endif
+void		ivfflatinitparallelscan(void *target);
+void		ivfflatparallelrescan(IndexScanDesc scan);
 
 #endif
@@ -78,6 +78,9 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
 	BlockNumber insertPage = InvalidBlockNumber;
 	ListInfo	listInfo;
 	BlockNumber originalInsertPage;
+	const float *codebook;
+	int			subvectors;
+	bool		packed;
 
 	/* Detoast once for all calls */
 	value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
@@ -103,7 +106,16 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
 	originalInsertPage = insertPage;
 
 	/* Form tuple */
-	itup = index_form_tuple(RelationGetDescr(index), &value, isnull);
+	codebook = IvfflatPqGetCodebook(index, &subvectors);
+	if (codebook != NULL)
+	{
+		uint8	   *codes = palloc(subvectors);
+
+		IvfflatPqEncode(codebook, TupleDescAttr(index->rd_att, 0)->atttypmod, subvectors, DatumGetVector(value), codes);
+		itup = IvfflatPqFormTuple(codes, subvectors);
+	}
+	else
+		itup = index_form_tuple(RelationGetDescr(index), &value, isnull);
 	itup->t_tid = *heap_tid;
 
 	/* Get tuple size */
@@ -119,7 +131,10 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
 		state = GenericXLogStart(index);
 		page = GenericXLogRegisterBuffer(state, buf, 0);
 
-		if (PageGetFreeSpace(page) >= itemsz)
+		/* Pages of a list are either all packed or not */
+		packed = IvfflatPageIsPacked(page);
+
+		if (packed ? IvfflatPackedHasSpace(page, DatumGetVector(value)->dim) : PageGetFreeSpace(page) >= itemsz)
 			break;
 
 		insertPage = IvfflatPageGetOpaque(page)->nextblkno;
@@ -143,6 +158,8 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
 			/* Init new page */
 			newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
 			IvfflatInitPage(newbuf, newpage);
+			if (packed)
+				IvfflatPackedInitPage(newpage);
 
 			/* Update insert page */
 			insertPage = BufferGetBlockNumber(newbuf);
@@ -165,7 +182,9 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
 	}
 
 	/* Add to next offset */
-	if (PageAddItem(page, (Item) itup, itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+	if (packed)
+		IvfflatPackedAddEntry(page, heap_tid, DatumGetVector(value));
+	else if (PageAddItem(page, (Item) itup, itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
 		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
 
 	IvfflatCommitBuffer(buf, state);
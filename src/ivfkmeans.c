@@ -3,11 +3,14 @@
 #include <float.h>
 #include <math.h>
 
+#include "access/parallel.h"
 #include "bitvec.h"
 #include "halfutils.h"
 #include "halfvec.h"
 #include "ivfflat.h"
 #include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/barrier.h"
 #include "utils/builtins.h"
 #include "utils/datum.h"
 #include "utils/memutils.h"
@@ -17,23 +20,372 @@
 #include "varatt.h"
 #endif
 
+#if PG_VERSION_NUM >= 140000
+#include "utils/wait_event.h"
+#else
+#include "pgstat.h"
+#endif
+
+#define PARALLEL_KEY_KMEANS_SHARED		UINT64CONST(0xA000000000000006)
+#define PARALLEL_KEY_KMEANS_AREA		UINT64CONST(0xA000000000000007)
+
+/* Number of samples (or centers) claimed at a time by a participant */
+#define KMEANS_SAMPLE_CHUNK_SIZE	1024
+#define KMEANS_CENTER_CHUNK_SIZE	16
+
+/* Mini-batch k-means */
+#define KMEANS_MINIBATCH_SIZE		4096
+#define KMEANS_MINIBATCH_EPOCHS		2
+#define KMEANS_MINIBATCH_MIN_ITERATIONS	10
+
+/*
+ * Steps of Elkan's algorithm that are independent for each sample (or
+ * center) and can be split across parallel workers
+ */
+typedef enum KmeansTask
+{
+	KMEANS_TASK_DONE,
+	KMEANS_TASK_INIT_DISTANCES,
+	KMEANS_TASK_INIT_ASSIGN,
+	KMEANS_TASK_CENTER_DISTANCES,
+	KMEANS_TASK_ASSIGN,
+	KMEANS_TASK_UPDATE_BOUNDS
+}			KmeansTask;
+
+typedef struct KmeansShared
+{
+	/* Immutable state */
+	Oid			indexrelid;
+	bool		isconcurrent;
+	int			numSamples;
+	int			numCenters;
+	int			dimensions;
+	Size		itemsize;
+
+	/* Coordination */
+	Barrier		barrier;
+	pg_atomic_uint32 nextChunk;
+	pg_atomic_uint32 changes;
+
+	/* Set by leader before each task */
+	KmeansTask	task;
+	int			center;
+	bool		rjreset;
+}			KmeansShared;
+
+typedef struct KmeansState
+{
+	FmgrInfo   *procinfo;
+	Oid			collation;
+	int			numSamples;
+	int			numCenters;
+	VectorArray samples;
+	VectorArray centers;
+	float	   *lowerBound;
+	float	   *upperBound;
+	int		   *closestCenters;
+	float	   *weight;
+	float	   *halfcdist;
+	float	   *s;
+	float	   *newcdist;
+
+	/* Parallel k-means */
+	ParallelContext *pcxt;
+	KmeansShared *shared;
+}			KmeansState;
+
+/*
+ * Compute distances to a new center for kmeans++
+ */
+static void
+InitDistances(KmeansState * state, int center, int64 start, int64 end)
+{
+	int			numCenters = state->numCenters;
+	Datum		centerVec = PointerGetDatum(VectorArrayGet(state->centers, center));
+
+	for (int64 j = start; j < end; j++)
+	{
+		Datum		vec = PointerGetDatum(VectorArrayGet(state->samples, j));
+		double		distance;
+
+		/* Only need to compute distance for new center */
+		/* TODO Use triangle inequality to reduce distance calculations */
+		distance = DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, vec, centerVec));
+
+		/* Set lower bound */
+		state->lowerBound[j * numCenters + center] = distance;
+
+		/* Use distance squared for weighted probability distribution */
+		distance *= distance;
+
+		if (distance < state->weight[j])
+			state->weight[j] = distance;
+	}
+}
+
+/*
+ * Assign each x to its closest initial center c(x) = argmin d(x,c)
+ */
+static void
+InitAssign(KmeansState * state, int64 start, int64 end)
+{
+	int			numCenters = state->numCenters;
+
+	for (int64 j = start; j < end; j++)
+	{
+		float		minDistance = FLT_MAX;
+		int			closestCenter = 0;
+
+		/* Find closest center */
+		for (int64 k = 0; k < numCenters; k++)
+		{
+			/* TODO Use Lemma 1 in k-means++ initialization */
+			float		distance = state->lowerBound[j * numCenters + k];
+
+			if (distance < minDistance)
+			{
+				minDistance = distance;
+				closestCenter = k;
+			}
+		}
+
+		state->upperBound[j] = minDistance;
+		state->closestCenters[j] = closestCenter;
+	}
+}
+
+/*
+ * Step 1: For all centers, compute distance
+ */
+static void
+CenterDistances(KmeansState * state, int64 start, int64 end)
+{
+	int			numCenters = state->numCenters;
+	float	   *halfcdist = state->halfcdist;
+
+	for (int64 j = start; j < end; j++)
+	{
+		Datum		vec = PointerGetDatum(VectorArrayGet(state->centers, j));
+
+		for (int64 k = j + 1; k < numCenters; k++)
+		{
+			float		distance = 0.5 * DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, vec, PointerGetDatum(VectorArrayGet(state->centers, k))));
+
+			halfcdist[j * numCenters + k] = distance;
+			halfcdist[k * numCenters + j] = distance;
+		}
+	}
+}
+
+/*
+ * Steps 2 and 3: Reassign samples
+ */
+static int
+AssignSamples(KmeansState * state, bool rjreset, int64 start, int64 end)
+{
+	int			numCenters = state->numCenters;
+	float	   *lowerBound = state->lowerBound;
+	float	   *upperBound = state->upperBound;
+	int		   *closestCenters = state->closestCenters;
+	float	   *halfcdist = state->halfcdist;
+	int			changes = 0;
+
+	for (int64 j = start; j < end; j++)
+	{
+		bool		rj;
+
+		/* Step 2: Identify all points x such that u(x) <= s(c(x)) */
+		if (upperBound[j] <= state->s[closestCenters[j]])
+			continue;
+
+		rj = rjreset;
+
+		for (int64 k = 0; k < numCenters; k++)
+		{
+			Datum		vec;
+			float		dxcx;
+
+			/* Step 3: For all remaining points x and centers c */
+			if (k == closestCenters[j])
+				continue;
+
+			if (upperBound[j] <= lowerBound[j * numCenters + k])
+				continue;
+
+			if (upperBound[j] <= halfcdist[closestCenters[j] * numCenters + k])
+				continue;
+
+			vec = PointerGetDatum(VectorArrayGet(state->samples, j));
+
+			/* Step 3a */
+			if (rj)
+			{
+				dxcx = DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, vec, PointerGetDatum(VectorArrayGet(state->centers, closestCenters[j]))));
+
+				/* d(x,c(x)) computed, which is a form of d(x,c) */
+				lowerBound[j * numCenters + closestCenters[j]] = dxcx;
+				upperBound[j] = dxcx;
+
+				rj = false;
+			}
+			else
+				dxcx = upperBound[j];
+
+			/* Step 3b */
+			if (dxcx > lowerBound[j * numCenters + k] || dxcx > halfcdist[closestCenters[j] * numCenters + k])
+			{
+				float		dxc = DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, vec, PointerGetDatum(VectorArrayGet(state->centers, k))));
+
+				/* d(x,c) calculated */
+				lowerBound[j * numCenters + k] = dxc;
+
+				if (dxc < dxcx)
+				{
+					closestCenters[j] = k;
+
+					/* c(x) changed */
+					upperBound[j] = dxc;
+
+					changes++;
+				}
+			}
+		}
+	}
+
+	return changes;
+}
+
+/*
+ * Steps 5 and 6: Update bounds
+ */
+static void
+UpdateBounds(KmeansState * state, int64 start, int64 end)
+{
+	int			numCenters = state->numCenters;
+	float	   *newcdist = state->newcdist;
+
+	for (int64 j = start; j < end; j++)
+	{
+		for (int64 k = 0; k < numCenters; k++)
+		{
+			float		distance = state->lowerBound[j * numCenters + k] - newcdist[k];
+
+			if (distance < 0)
+				distance = 0;
+
+			state->lowerBound[j * numCenters + k] = distance;
+		}
+
+		/* We reset r(x) before Step 3 in the next iteration */
+		state->upperBound[j] += newcdist[state->closestCenters[j]];
+	}
+}
+
+/*
+ * Perform a task for a range of samples (or centers)
+ */
+static int
+PerformTask(KmeansState * state, KmeansTask task, int center, bool rjreset, int64 start, int64 end)
+{
+	switch (task)
+	{
+		case KMEANS_TASK_INIT_DISTANCES:
+			InitDistances(state, center, start, end);
+			break;
+		case KMEANS_TASK_INIT_ASSIGN:
+			InitAssign(state, start, end);
+			break;
+		case KMEANS_TASK_CENTER_DISTANCES:
+			CenterDistances(state, start, end);
+			break;
+		case KMEANS_TASK_ASSIGN:
+			return AssignSamples(state, rjreset, start, end);
+		case KMEANS_TASK_UPDATE_BOUNDS:
+			UpdateBounds(state, start, end);
+			break;
+		case KMEANS_TASK_DONE:
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * Participate in the current task until all chunks are claimed
+ */
+static void
+ParticipateInTask(KmeansState * state)
+{
+	KmeansShared *shared = state->shared;
+	KmeansTask	task = shared->task;
+	int64		count = task == KMEANS_TASK_CENTER_DISTANCES ? state->numCenters : state->numSamples;
+	int64		chunkSize = task == KMEANS_TASK_CENTER_DISTANCES ? KMEANS_CENTER_CHUNK_SIZE : KMEANS_SAMPLE_CHUNK_SIZE;
+
+	for (;;)
+	{
+		int64		start = (int64) pg_atomic_fetch_add_u32(&shared->nextChunk, 1) * chunkSize;
+		int			changes;
+
+		if (start >= count)
+			break;
+
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		changes = PerformTask(state, task, shared->center, shared->rjreset, start, Min(start + chunkSize, count));
+
+		if (changes > 0)
+			pg_atomic_fetch_add_u32(&shared->changes, changes);
+	}
+}
+
+/*
+ * Run a task across all participants (or just the current process)
+ */
+static int
+RunTask(KmeansState * state, KmeansTask task, int center, bool rjreset)
+{
+	KmeansShared *shared = state->shared;
+
+	if (shared == NULL)
+	{
+		int64		count = task == KMEANS_TASK_CENTER_DISTANCES ? state->numCenters : state->numSamples;
+
+		return PerformTask(state, task, center, rjreset, 0, count);
+	}
+
+	/* Set up task while workers wait */
+	shared->task = task;
+	shared->center = center;
+	shared->rjreset = rjreset;
+	pg_atomic_write_u32(&shared->nextChunk, 0);
+	pg_atomic_write_u32(&shared->changes, 0);
+
+	/* Start task */
+	BarrierArriveAndWait(&shared->barrier, WAIT_EVENT_PARALLEL_CREATE_INDEX_SCAN);
+
+	ParticipateInTask(state);
+
+	/* Wait for task to finish */
+	BarrierArriveAndWait(&shared->barrier, WAIT_EVENT_PARALLEL_CREATE_INDEX_SCAN);
+
+	return pg_atomic_read_u32(&shared->changes);
+}
+
 /*
  * Initialize with kmeans++
  *
  * https://theory.stanford.edu/~sergei/papers/kMeansPP-soda.pdf
  */
 static void
-InitCenters(Relation index, VectorArray samples, VectorArray centers, float *lowerBound)
+InitCenters(KmeansState * state)
 {
-	FmgrInfo   *procinfo;
-	Oid			collation;
+	VectorArray samples = state->samples;
+	VectorArray centers = state->centers;
+	float	   *weight = state->weight;
+	int			numCenters = state->numCenters;
+	int			numSamples = state->numSamples;
 	int64		j;
-	float	   *weight = palloc(samples->length * sizeof(float));
-	int			numCenters = centers->maxlen;
-	int			numSamples = samples->length;
-
-	procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
-	collation = index->rd_indcollation[0];
 
 	/* Choose an initial center uniformly at random */
 	VectorArraySet(centers, 0, VectorArrayGet(samples, RandomInt() % samples->length));
@@ -49,33 +401,17 @@ InitCenters(Relation index, VectorArray samples, VectorArray centers, float *low
 
 		CHECK_FOR_INTERRUPTS();
 
-		sum = 0.0;
-
-		for (j = 0; j < numSamples; j++)
-		{
-			Datum		vec = PointerGetDatum(VectorArrayGet(samples, j));
-			double		distance;
-
-			/* Only need to compute distance for new center */
-			/* TODO Use triangle inequality to reduce distance calculations */
-			distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, i))));
-
-			/* Set lower bound */
-			lowerBound[j * numCenters + i] = distance;
-
-			/* Use distance squared for weighted probability distribution */
-			distance *= distance;
-
-			if (distance < weight[j])
-				weight[j] = distance;
-
-			sum += weight[j];
-		}
+		/* Set lower bounds and weights for new center */
+		RunTask(state, KMEANS_TASK_INIT_DISTANCES, i, false);
 
 		/* Only compute lower bound on last iteration */
 		if (i + 1 == numCenters)
 			break;
 
+		sum = 0.0;
+		for (j = 0; j < numSamples; j++)
+			sum += weight[j];
+
 		/* Choose new center using weighted probability distribution. */
 		choice = sum * RandomDouble();
 		for (j = 0; j < numSamples - 1; j++)
@@ -88,8 +424,6 @@ InitCenters(Relation index, VectorArray samples, VectorArray centers, float *low
 		VectorArraySet(centers, i + 1, VectorArrayGet(samples, j));
 		centers->length++;
 	}
-
-	pfree(weight);
 }
 
 /*
@@ -251,32 +585,340 @@ ComputeNewCenters(VectorArray samples, float *agg, VectorArray newCenters, int *
 		NormCenters(typeInfo, collation, newCenters);
 }
 
+/*
+ * Assign shared arrays and return their total size
+ */
+static Size
+SetSharedArrays(KmeansState * state, char *area, Size itemsize)
+{
+	int64		numSamples = state->numSamples;
+	int64		numCenters = state->numCenters;
+	Size		samplesOffset = 0;
+	Size		centersOffset = samplesOffset + MAXALIGN(numSamples * itemsize);
+	Size		lowerBoundOffset = centersOffset + MAXALIGN(numCenters * itemsize);
+	Size		upperBoundOffset = lowerBoundOffset + MAXALIGN(sizeof(float) * numSamples * numCenters);
+	Size		closestCentersOffset = upperBoundOffset + MAXALIGN(sizeof(float) * numSamples);
+	Size		weightOffset = closestCentersOffset + MAXALIGN(sizeof(int) * numSamples);
+	Size		halfcdistOffset = weightOffset + MAXALIGN(sizeof(float) * numSamples);
+	Size		sOffset = halfcdistOffset + MAXALIGN(sizeof(float) * numCenters * numCenters);
+	Size		newcdistOffset = sOffset + MAXALIGN(sizeof(float) * numCenters);
+	Size		totalSize = newcdistOffset + MAXALIGN(sizeof(float) * numCenters);
+
+	if (area != NULL)
+	{
+		state->samples->items = area + samplesOffset;
+		state->centers->items = area + centersOffset;
+		state->lowerBound = (float *) (area + lowerBoundOffset);
+		state->upperBound = (float *) (area + upperBoundOffset);
+		state->closestCenters = (int *) (area + closestCentersOffset);
+		state->weight = (float *) (area + weightOffset);
+		state->halfcdist = (float *) (area + halfcdistOffset);
+		state->s = (float *) (area + sOffset);
+		state->newcdist = (float *) (area + newcdistOffset);
+	}
+
+	return totalSize;
+}
+
+/*
+ * Create a vector array header for shared items
+ */
+static VectorArray
+SharedVectorArray(int length, int dimensions, Size itemsize)
+{
+	VectorArray arr = palloc0(sizeof(VectorArrayData));
+
+	arr->length = length;
+	arr->maxlen = length;
+	arr->dim = dimensions;
+	arr->itemsize = itemsize;
+	return arr;
+}
+
+/*
+ * Begin parallel k-means
+ *
+ * The workers started by IvfflatBeginParallel only exist after the centers
+ * are known, so k-means uses its own short-lived parallel context
+ */
+static void
+KmeansBeginParallel(KmeansState * state, Relation index, bool isconcurrent, int request)
+{
+	ParallelContext *pcxt;
+	VectorArray samples = state->samples;
+	VectorArray centers = state->centers;
+	Size		estshared;
+	Size		estarea;
+	KmeansShared *shared;
+	char	   *area;
+
+	/* Enter parallel mode and create context */
+	EnterParallelMode();
+	Assert(request > 0);
+	pcxt = CreateParallelContext("vector", "IvfflatParallelKmeansMain", request);
+
+	/* Estimate size of workspaces */
+	estshared = MAXALIGN(sizeof(KmeansShared));
+	shm_toc_estimate_chunk(&pcxt->estimator, estshared);
+	estarea = SetSharedArrays(state, NULL, samples->itemsize);
+	shm_toc_estimate_chunk(&pcxt->estimator, estarea);
+	shm_toc_estimate_keys(&pcxt->estimator, 2);
+
+	/* Everyone's had a chance to ask for space, so now create the DSM */
+	InitializeParallelDSM(pcxt);
+
+	/* If no DSM segment was available, back out (do serial k-means) */
+	if (pcxt->seg == NULL)
+	{
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		return;
+	}
+
+	shared = (KmeansShared *) shm_toc_allocate(pcxt->toc, estshared);
+	/* Initialize immutable state */
+	shared->indexrelid = RelationGetRelid(index);
+	shared->isconcurrent = isconcurrent;
+	shared->numSamples = state->numSamples;
+	shared->numCenters = state->numCenters;
+	shared->dimensions = samples->dim;
+	shared->itemsize = samples->itemsize;
+	/* Initialize coordination state */
+	BarrierInit(&shared->barrier, 0);
+	pg_atomic_init_u32(&shared->nextChunk, 0);
+	pg_atomic_init_u32(&shared->changes, 0);
+	shared->task = KMEANS_TASK_DONE;
+	shared->center = 0;
+	shared->rjreset = false;
+
+	/* Copy samples and place everything else in shared memory */
+	area = shm_toc_allocate(pcxt->toc, estarea);
+	state->samples = SharedVectorArray(samples->length, samples->dim, samples->itemsize);
+	state->centers = SharedVectorArray(0, centers->dim, centers->itemsize);
+	state->centers->maxlen = centers->maxlen;
+	SetSharedArrays(state, area, samples->itemsize);
+	memcpy(state->samples->items, samples->items, (Size) samples->length * samples->itemsize);
+
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_KMEANS_SHARED, shared);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_KMEANS_AREA, area);
+
+	/* Attach before launching so workers cannot run ahead of the leader */
+	BarrierAttach(&shared->barrier);
+
+	LaunchParallelWorkers(pcxt);
+
+	/* If no workers were successfully launched, back out (do serial k-means) */
+	if (pcxt->nworkers_launched == 0)
+	{
+		BarrierDetach(&shared->barrier);
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+
+		state->samples = samples;
+		state->centers = centers;
+		return;
+	}
+
+	/* Log participants */
+	ereport(DEBUG1, (errmsg("using %d parallel workers for k-means", pcxt->nworkers_launched)));
+
+	state->pcxt = pcxt;
+	state->shared = shared;
+}
+
+/*
+ * End parallel k-means
+ */
+static void
+KmeansEndParallel(KmeansState * state, VectorArray centers)
+{
+	/* Tell workers to exit */
+	state->shared->task = KMEANS_TASK_DONE;
+	BarrierArriveAndDetach(&state->shared->barrier);
+
+	/* Shutdown worker processes */
+	WaitForParallelWorkersToFinish(state->pcxt);
+
+	/* Copy centers out of shared memory before it goes away */
+	memcpy(centers->items, state->centers->items, (Size) state->centers->length * centers->itemsize);
+	centers->length = state->centers->length;
+
+	DestroyParallelContext(state->pcxt);
+	ExitParallelMode();
+
+	state->pcxt = NULL;
+	state->shared = NULL;
+}
+
+/*
+ * Use mini-batch k-means when the bounds for Elkan do not fit into memory
+ *
+ * Each iteration assigns a random batch of samples to the nearest center
+ * and moves those centers towards them with a per-center learning rate.
+ * This needs memory proportional to the number of samples and centers
+ * rather than their product.
+ *
+ * https://www.eecs.tufts.edu/~dsculley/papers/fastkmeans.pdf
+ */
+static void
+MiniBatchKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo)
+{
+	FmgrInfo   *procinfo;
+	FmgrInfo   *normprocinfo;
+	Oid			collation;
+	int			dimensions = centers->dim;
+	int			numCenters = centers->maxlen;
+	int			numSamples = samples->length;
+	int			batchSize = Min(KMEANS_MINIBATCH_SIZE, numSamples);
+	int			iterations = Max(KMEANS_MINIBATCH_MIN_ITERATIONS, (int64) KMEANS_MINIBATCH_EPOCHS * numSamples / batchSize);
+	float	   *agg;
+	int64	   *centerCounts;
+	int		   *batch;
+	int		   *closestCenters;
+	float	   *x;
+	instr_time	lastLog;
+
+	/* Calculate allocation sizes */
+	Size		samplesSize = VECTOR_ARRAY_SIZE(samples->maxlen, samples->itemsize);
+	Size		centersSize = VECTOR_ARRAY_SIZE(centers->maxlen, centers->itemsize);
+	Size		aggSize = sizeof(float) * (int64) numCenters * dimensions;
+	Size		centerCountsSize = sizeof(int64) * numCenters;
+	Size		batchArraySize = sizeof(int) * batchSize;
+	Size		closestCentersSize = sizeof(int) * batchSize;
+	Size		xSize = sizeof(float) * dimensions;
+
+	/* Calculate total size */
+	Size		totalSize = samplesSize + centersSize + aggSize + centerCountsSize + batchArraySize + closestCentersSize + xSize;
+
+	/* Check memory requirements */
+	/* Add one to error message to ceil */
+	if (totalSize > (Size) maintenance_work_mem * 1024L)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("memory required is %zu MB, maintenance_work_mem is %d MB",
+						totalSize / (1024 * 1024) + 1, maintenance_work_mem / 1024)));
+
+	/* Set support functions */
+	procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
+	normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
+	collation = index->rd_indcollation[0];
+
+	/* Allocate space */
+	agg = palloc0(aggSize);
+	centerCounts = palloc0(centerCountsSize);
+	batch = palloc(batchArraySize);
+	closestCenters = palloc(closestCentersSize);
+	x = palloc(xSize);
+
+#ifdef IVFFLAT_MEMORY
+	ShowMemoryUsage(MemoryContextGetParent(CurrentMemoryContext), totalSize);
+#endif
+
+	if (ivfflat_build_log_interval > 0)
+		ereport(LOG,
+				(errmsg("ivfflat mini-batch k-means using %zu MB for %d samples and %d centers",
+						totalSize / (1024 * 1024), numSamples, numCenters)));
+
+	INSTR_TIME_SET_CURRENT(lastLog);
+
+	/* Pick initial centers uniformly at random */
+	for (int j = 0; j < numCenters; j++)
+	{
+		Pointer		sample = VectorArrayGet(samples, RandomInt() % numSamples);
+
+		VectorArraySet(centers, j, sample);
+		typeInfo->sumCenter(sample, agg + ((int64) j * dimensions));
+	}
+	centers->length = numCenters;
+
+	if (normprocinfo != NULL)
+		NormCenters(typeInfo, collation, centers);
+
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		/* Assign batch to current centers */
+		for (int i = 0; i < batchSize; i++)
+		{
+			Datum		vec;
+			float		minDistance = FLT_MAX;
+			int			closestCenter = 0;
+
+			batch[i] = RandomInt() % numSamples;
+			vec = PointerGetDatum(VectorArrayGet(samples, batch[i]));
+
+			for (int k = 0; k < numCenters; k++)
+			{
+				float		distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, k))));
+
+				if (distance < minDistance)
+				{
+					minDistance = distance;
+					closestCenter = k;
+				}
+			}
+
+			closestCenters[i] = closestCenter;
+		}
+
+		/* Move centers towards their samples */
+		for (int i = 0; i < batchSize; i++)
+		{
+			int			c = closestCenters[i];
+			float	   *center = agg + ((int64) c * dimensions);
+			float		eta;
+
+			for (int k = 0; k < dimensions; k++)
+				x[k] = 0.0;
+
+			typeInfo->sumCenter(VectorArrayGet(samples, batch[i]), x);
+
+			centerCounts[c]++;
+			eta = 1.0 / centerCounts[c];
+
+			for (int k = 0; k < dimensions; k++)
+				center[k] += eta * (x[k] - center[k]);
+		}
+
+		/* Set new centers */
+		UpdateCenters(agg, centers, typeInfo);
+
+		/* Normalize if needed */
+		if (normprocinfo != NULL)
+			NormCenters(typeInfo, collation, centers);
+
+		if (IvfflatBuildLogDue(&lastLog))
+			ereport(LOG,
+					(errmsg("ivfflat mini-batch k-means finished iteration %d of %d", iteration + 1, iterations)));
+	}
+}
+
 /*
  * Use Elkan for performance. This requires distance function to satisfy triangle inequality.
  *
  * We use L2 distance for L2 (not L2 squared like index scan)
  * and angular distance for inner product and cosine distance
  *
+ * Steps that are independent for each sample are split across parallel
+ * workers when requested. Everything else runs in the leader, so the
+ * result does not depend on the number of workers.
+ *
  * https://www.aaai.org/Papers/ICML/2003/ICML03-022.pdf
  */
 static void
-ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo)
+ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, int parallelWorkers, bool isconcurrent)
 {
-	FmgrInfo   *procinfo;
 	FmgrInfo   *normprocinfo;
-	Oid			collation;
+	KmeansState state;
 	int			dimensions = centers->dim;
 	int			numCenters = centers->maxlen;
 	int			numSamples = samples->length;
 	VectorArray newCenters;
 	float	   *agg;
 	int		   *centerCounts;
-	int		   *closestCenters;
-	float	   *lowerBound;
-	float	   *upperBound;
-	float	   *s;
-	float	   *halfcdist;
-	float	   *newcdist;
+	instr_time	lastLog;
 
 	/* Calculate allocation sizes */
 	Size		samplesSize = VECTOR_ARRAY_SIZE(samples->maxlen, samples->itemsize);
@@ -294,33 +936,53 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 	/* Calculate total size */
 	Size		totalSize = samplesSize + centersSize + newCentersSize + aggSize + centerCountsSize + closestCentersSize + lowerBoundSize + upperBoundSize + sSize + halfcdistSize + newcdistSize;
 
-	/* Check memory requirements */
-	/* Add one to error message to ceil */
+	/* Fall back to mini-batch if bounds do not fit into memory */
 	if (totalSize > (Size) maintenance_work_mem * 1024L)
-		ereport(ERROR,
-				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
-				 errmsg("memory required is %zu MB, maintenance_work_mem is %d MB",
-						totalSize / (1024 * 1024) + 1, maintenance_work_mem / 1024)));
+	{
+		ereport(NOTICE,
+				(errmsg("ivfflat k-means bounds do not fit into maintenance_work_mem"),
+				 errdetail("Using mini-batch k-means, which may reduce recall."),
+				 errhint("Increase maintenance_work_mem to at least %zu MB to use full k-means.",
+						 totalSize / (1024 * 1024) + 1)));
+
+		MiniBatchKmeans(index, samples, centers, typeInfo);
+		return;
+	}
 
 	/* Ensure indexing does not overflow */
 	if (numCenters * numCenters > INT_MAX)
 		elog(ERROR, "Indexing overflow detected. Please report a bug.");
 
 	/* Set support functions */
-	procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
+	state.procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
+	state.collation = index->rd_indcollation[0];
 	normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
-	collation = index->rd_indcollation[0];
+
+	state.numSamples = numSamples;
+	state.numCenters = numCenters;
+	state.samples = samples;
+	state.centers = centers;
+	state.pcxt = NULL;
+	state.shared = NULL;
+
+	/* Attempt to launch parallel workers when requested */
+	if (parallelWorkers > 0)
+		KmeansBeginParallel(&state, index, isconcurrent, parallelWorkers);
 
 	/* Allocate space */
 	/* Use float instead of double to save memory */
 	agg = palloc(aggSize);
 	centerCounts = palloc(centerCountsSize);
-	closestCenters = palloc(closestCentersSize);
-	lowerBound = palloc_extended(lowerBoundSize, MCXT_ALLOC_HUGE);
-	upperBound = palloc(upperBoundSize);
-	s = palloc(sSize);
-	halfcdist = palloc_extended(halfcdistSize, MCXT_ALLOC_HUGE);
-	newcdist = palloc(newcdistSize);
+	if (state.shared == NULL)
+	{
+		state.closestCenters = palloc(closestCentersSize);
+		state.lowerBound = palloc_extended(lowerBoundSize, MCXT_ALLOC_HUGE);
+		state.upperBound = palloc(upperBoundSize);
+		state.weight = palloc(upperBoundSize);
+		state.s = palloc(sSize);
+		state.halfcdist = palloc_extended(halfcdistSize, MCXT_ALLOC_HUGE);
+		state.newcdist = palloc(newcdistSize);
+	}
 
 	/* Initialize new centers */
 	newCenters = VectorArrayInit(numCenters, dimensions, centers->itemsize);
@@ -330,54 +992,31 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 	ShowMemoryUsage(MemoryContextGetParent(CurrentMemoryContext), totalSize);
 #endif
 
-	/* Pick initial centers */
-	InitCenters(index, samples, centers, lowerBound);
+	if (ivfflat_build_log_interval > 0)
+		ereport(LOG,
+				(errmsg("ivfflat k-means using %zu MB for %d samples and %d centers with %d workers",
+						totalSize / (1024 * 1024), numSamples, numCenters,
+						state.pcxt != NULL ? state.pcxt->nworkers_launched : 0)));
 
-	/* Assign each x to its closest initial center c(x) = argmin d(x,c) */
-	for (int64 j = 0; j < numSamples; j++)
-	{
-		float		minDistance = FLT_MAX;
-		int			closestCenter = 0;
+	INSTR_TIME_SET_CURRENT(lastLog);
 
-		/* Find closest center */
-		for (int64 k = 0; k < numCenters; k++)
-		{
-			/* TODO Use Lemma 1 in k-means++ initialization */
-			float		distance = lowerBound[j * numCenters + k];
-
-			if (distance < minDistance)
-			{
-				minDistance = distance;
-				closestCenter = k;
-			}
-		}
+	/* Pick initial centers */
+	InitCenters(&state);
 
-		upperBound[j] = minDistance;
-		closestCenters[j] = closestCenter;
-	}
+	/* Assign each x to its closest initial center c(x) = argmin d(x,c) */
+	RunTask(&state, KMEANS_TASK_INIT_ASSIGN, 0, false);
 
 	/* Give 500 iterations to converge */
 	for (int iteration = 0; iteration < 500; iteration++)
 	{
-		int			changes = 0;
-		bool		rjreset;
+		int			changes;
+		float	   *halfcdist = state.halfcdist;
 
 		/* Can take a while, so ensure we can interrupt */
 		CHECK_FOR_INTERRUPTS();
 
 		/* Step 1: For all centers, compute distance */
-		for (int64 j = 0; j < numCenters; j++)
-		{
-			Datum		vec = PointerGetDatum(VectorArrayGet(centers, j));
-
-			for (int64 k = j + 1; k < numCenters; k++)
-			{
-				float		distance = 0.5 * DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, k))));
-
-				halfcdist[j * numCenters + k] = distance;
-				halfcdist[k * numCenters + j] = distance;
-			}
-		}
+		RunTask(&state, KMEANS_TASK_CENTER_DISTANCES, 0, false);
 
 		/* For all centers c, compute s(c) */
 		for (int64 j = 0; j < numCenters; j++)
@@ -396,105 +1035,41 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 					minDistance = distance;
 			}
 
-			s[j] = minDistance;
+			state.s[j] = minDistance;
 		}
 
-		rjreset = iteration != 0;
-
-		for (int64 j = 0; j < numSamples; j++)
-		{
-			bool		rj;
-
-			/* Step 2: Identify all points x such that u(x) <= s(c(x)) */
-			if (upperBound[j] <= s[closestCenters[j]])
-				continue;
-
-			rj = rjreset;
-
-			for (int64 k = 0; k < numCenters; k++)
-			{
-				Datum		vec;
-				float		dxcx;
-
-				/* Step 3: For all remaining points x and centers c */
-				if (k == closestCenters[j])
-					continue;
-
-				if (upperBound[j] <= lowerBound[j * numCenters + k])
-					continue;
-
-				if (upperBound[j] <= halfcdist[closestCenters[j] * numCenters + k])
-					continue;
-
-				vec = PointerGetDatum(VectorArrayGet(samples, j));
-
-				/* Step 3a */
-				if (rj)
-				{
-					dxcx = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, closestCenters[j]))));
-
-					/* d(x,c(x)) computed, which is a form of d(x,c) */
-					lowerBound[j * numCenters + closestCenters[j]] = dxcx;
-					upperBound[j] = dxcx;
-
-					rj = false;
-				}
-				else
-					dxcx = upperBound[j];
-
-				/* Step 3b */
-				if (dxcx > lowerBound[j * numCenters + k] || dxcx > halfcdist[closestCenters[j] * numCenters + k])
-				{
-					float		dxc = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, k))));
-
-					/* d(x,c) calculated */
-					lowerBound[j * numCenters + k] = dxc;
-
-					if (dxc < dxcx)
-					{
-						closestCenters[j] = k;
-
-						/* c(x) changed */
-						upperBound[j] = dxc;
-
-						changes++;
-					}
-				}
-			}
-		}
+		/* Steps 2 and 3 */
+		changes = RunTask(&state, KMEANS_TASK_ASSIGN, 0, iteration != 0);
 
 		/* Step 4: For each center c, let m(c) be mean of all points assigned */
-		ComputeNewCenters(samples, agg, newCenters, centerCounts, closestCenters, normprocinfo, collation, typeInfo);
+		ComputeNewCenters(state.samples, agg, newCenters, centerCounts, state.closestCenters, normprocinfo, state.collation, typeInfo);
 
 		/* Step 5 */
 		for (int j = 0; j < numCenters; j++)
-			newcdist[j] = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, PointerGetDatum(VectorArrayGet(centers, j)), PointerGetDatum(VectorArrayGet(newCenters, j))));
+			state.newcdist[j] = DatumGetFloat8(FunctionCall2Coll(state.procinfo, state.collation, PointerGetDatum(VectorArrayGet(state.centers, j)), PointerGetDatum(VectorArrayGet(newCenters, j))));
 
-		for (int64 j = 0; j < numSamples; j++)
-		{
-			for (int64 k = 0; k < numCenters; k++)
-			{
-				float		distance = lowerBound[j * numCenters + k] - newcdist[k];
-
-				if (distance < 0)
-					distance = 0;
-
-				lowerBound[j * numCenters + k] = distance;
-			}
-		}
-
-		/* Step 6 */
-		/* We reset r(x) before Step 3 in the next iteration */
-		for (int j = 0; j < numSamples; j++)
-			upperBound[j] += newcdist[closestCenters[j]];
+		/* Steps 5 and 6 */
+		RunTask(&state, KMEANS_TASK_UPDATE_BOUNDS, 0, false);
 
 		/* Step 7 */
 		for (int j = 0; j < numCenters; j++)
-			VectorArraySet(centers, j, VectorArrayGet(newCenters, j));
+			VectorArraySet(state.centers, j, VectorArrayGet(newCenters, j));
 
 		if (changes == 0 && iteration != 0)
+		{
+			if (ivfflat_build_log_interval > 0)
+				ereport(LOG, (errmsg("ivfflat k-means converged after %d iterations", iteration + 1)));
 			break;
+		}
+
+		if (IvfflatBuildLogDue(&lastLog))
+			ereport(LOG,
+					(errmsg("ivfflat k-means finished iteration %d with %d of %d samples reassigned",
+							iteration + 1, changes, numSamples)));
 	}
+
+	if (state.shared != NULL)
+		KmeansEndParallel(&state, centers);
 }
 
 /*
@@ -559,12 +1134,13 @@ CheckCenters(Relation index, VectorArray centers, const IvfflatTypeInfo * typeIn
 	CheckNorms(centers, index);
 }
 
+
 /*
  * Perform naive k-means centering
  * We use spherical k-means for inner product and cosine
  */
 void
-IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo)
+IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, int parallelWorkers, bool isconcurrent)
 {
 	MemoryContext kmeansCtx = AllocSetContextCreate(CurrentMemoryContext,
 													"Ivfflat kmeans temporary context",
@@ -574,10 +1150,70 @@ IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const Iv
 	if (samples->length == 0)
 		RandomCenters(index, centers, typeInfo);
 	else
-		ElkanKmeans(index, samples, centers, typeInfo);
+		ElkanKmeans(index, samples, centers, typeInfo, parallelWorkers, isconcurrent);
 
 	CheckCenters(index, centers, typeInfo);
 
 	MemoryContextSwitchTo(oldCtx);
 	MemoryContextDelete(kmeansCtx);
 }
+
+/*
+ * Perform k-means work within a launched parallel process
+ */
+void
+IvfflatParallelKmeansMain(dsm_segment *seg, shm_toc *toc)
+{
+	KmeansShared *shared;
+	char	   *area;
+	Relation	index;
+	LOCKMODE	indexLockmode;
+	KmeansState state;
+	bool		inTask;
+
+	/* Look up shared state */
+	shared = shm_toc_lookup(toc, PARALLEL_KEY_KMEANS_SHARED, false);
+	area = shm_toc_lookup(toc, PARALLEL_KEY_KMEANS_AREA, false);
+
+	/* Open index using lock mode known to be obtained by index.c */
+	if (!shared->isconcurrent)
+		indexLockmode = AccessExclusiveLock;
+	else
+		indexLockmode = RowExclusiveLock;
+
+	index = index_open(shared->indexrelid, indexLockmode);
+
+	/* Set up state */
+	state.procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
+	state.collation = index->rd_indcollation[0];
+	state.numSamples = shared->numSamples;
+	state.numCenters = shared->numCenters;
+	state.samples = SharedVectorArray(shared->numSamples, shared->dimensions, shared->itemsize);
+	state.centers = SharedVectorArray(shared->numCenters, shared->dimensions, shared->itemsize);
+	SetSharedArrays(&state, area, shared->itemsize);
+	state.pcxt = NULL;
+	state.shared = shared;
+
+	/* Join a task already in progress */
+	inTask = BarrierAttach(&shared->barrier) % 2 == 1;
+
+	for (;;)
+	{
+		/* Wait for leader to start next task */
+		if (!inTask)
+			BarrierArriveAndWait(&shared->barrier, WAIT_EVENT_PARALLEL_CREATE_INDEX_SCAN);
+		inTask = false;
+
+		if (shared->task == KMEANS_TASK_DONE)
+			break;
+
+		ParticipateInTask(&state);
+
+		/* Wait for task to finish */
+		BarrierArriveAndWait(&shared->barrier, WAIT_EVENT_PARALLEL_CREATE_INDEX_SCAN);
+	}
+
+	BarrierDetach(&shared->barrier);
+
+	index_close(index, indexLockmode);
+}
@@ -0,0 +1,399 @@
+#include "postgres.h"
+
+#include <float.h>
+
+#include "access/generic_xlog.h"
+#include "ivfflat.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "vector.h"
+#include "vectorutils.h"
+
+/* Give 25 iterations to converge like most PQ implementations */
+#define IVFFLAT_PQ_ITERATIONS 25
+
+/* More samples have little effect on codebook quality */
+#define IVFFLAT_PQ_MAX_SAMPLES (IVFFLAT_PQ_CENTROIDS * 64)
+
+/* Floats that fit in a single item on a codebook page */
+#define IVFFLAT_CODEBOOK_PAGE_FLOATS (MAXALIGN_DOWN(BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(IvfflatPageOpaqueData)) - sizeof(ItemIdData)) / sizeof(float))
+
+PGDLLEXPORT Datum vector_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_negative_inner_product(PG_FUNCTION_ARGS);
+
+typedef struct IvfflatPqCache
+{
+	int			dimensions;
+	int			subvectors;
+	float		codebook[FLEXIBLE_ARRAY_MEMBER];
+}			IvfflatPqCache;
+
+/*
+ * Get the number of subvectors for a new index, or zero for no quantization
+ */
+int
+IvfflatGetSubvectors(Relation index, int dimensions)
+{
+	IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+	FmgrInfo   *procinfo;
+	int			subvectors;
+
+	if (!opts || opts->quantizer != IVFFLAT_QUANTIZER_PQ)
+		return 0;
+
+	/* Codes are computed with float kernels */
+	procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
+	if (procinfo->fn_addr != vector_l2_squared_distance && procinfo->fn_addr != vector_negative_inner_product)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("product quantization requires vector_l2_ops, vector_ip_ops, or vector_cosine_ops")));
+
+	subvectors = opts->subvectors;
+
+	/* Default to 8 dimensions per subvector when possible */
+	if (subvectors == 0)
+	{
+		subvectors = Max(dimensions / 8, 1);
+		while (dimensions % subvectors != 0)
+			subvectors--;
+	}
+
+	if (subvectors > dimensions)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("subvectors cannot be greater than dimensions")));
+
+	if (dimensions % subvectors != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("dimensions must be divisible by subvectors")));
+
+	return subvectors;
+}
+
+/*
+ * Check if scores use inner product instead of L2 squared distance
+ */
+bool
+IvfflatPqUsesInnerProduct(FmgrInfo *procinfo)
+{
+	return procinfo->fn_addr == vector_negative_inner_product;
+}
+
+/*
+ * Find the closest centroid in a subspace
+ */
+static inline int
+ClosestCentroid(const float *centroids, int dsub, float *x)
+{
+	float		minDistance = FLT_MAX;
+	int			closest = 0;
+
+	for (int k = 0; k < IVFFLAT_PQ_CENTROIDS; k++)
+	{
+		float		distance = VectorL2SquaredDistance(dsub, x, (float *) centroids + (int64) k * dsub);
+
+		if (distance < minDistance)
+		{
+			minDistance = distance;
+			closest = k;
+		}
+	}
+
+	return closest;
+}
+
+/*
+ * Train the codebook for a single subspace with Lloyd's algorithm
+ *
+ * Codebooks are trained with L2 distance for all metrics, which is standard
+ * for inner product as well
+ */
+static void
+TrainSubspace(VectorArray samples, int numSamples, int offset, int dsub, float *centroids, int *assignments, float *sums, int *counts)
+{
+	/* Initialize with random samples */
+	for (int k = 0; k < IVFFLAT_PQ_CENTROIDS; k++)
+	{
+		Vector	   *vec = (Vector *) VectorArrayGet(samples, RandomInt() % numSamples);
+
+		memcpy(centroids + (int64) k * dsub, vec->x + offset, dsub * sizeof(float));
+	}
+
+	for (int j = 0; j < numSamples; j++)
+		assignments[j] = -1;
+
+	for (int iteration = 0; iteration < IVFFLAT_PQ_ITERATIONS; iteration++)
+	{
+		int			changes = 0;
+
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		/* Assign samples */
+		for (int j = 0; j < numSamples; j++)
+		{
+			Vector	   *vec = (Vector *) VectorArrayGet(samples, j);
+			int			closest = ClosestCentroid(centroids, dsub, vec->x + offset);
+
+			if (closest != assignments[j])
+			{
+				assignments[j] = closest;
+				changes++;
+			}
+		}
+
+		if (changes == 0)
+			break;
+
+		/* Update centroids */
+		memset(sums, 0, sizeof(float) * IVFFLAT_PQ_CENTROIDS * dsub);
+		memset(counts, 0, sizeof(int) * IVFFLAT_PQ_CENTROIDS);
+
+		for (int j = 0; j < numSamples; j++)
+		{
+			Vector	   *vec = (Vector *) VectorArrayGet(samples, j);
+			float	   *x = sums + (int64) assignments[j] * dsub;
+
+			for (int d = 0; d < dsub; d++)
+				x[d] += vec->x[offset + d];
+
+			counts[assignments[j]]++;
+		}
+
+		for (int k = 0; k < IVFFLAT_PQ_CENTROIDS; k++)
+		{
+			float	   *c = centroids + (int64) k * dsub;
+
+			if (counts[k] > 0)
+			{
+				for (int d = 0; d < dsub; d++)
+					c[d] = sums[(int64) k * dsub + d] / counts[k];
+			}
+			else
+			{
+				/* Move empty centroids to a random sample */
+				Vector	   *vec = (Vector *) VectorArrayGet(samples, RandomInt() % numSamples);
+
+				memcpy(c, vec->x + offset, dsub * sizeof(float));
+			}
+		}
+	}
+}
+
+/*
+ * Train the codebook
+ *
+ * The codebook is stored as subvectors * IVFFLAT_PQ_CENTROIDS * (dimensions
+ * / subvectors) floats, which is IVFFLAT_PQ_CENTROIDS * dimensions in total
+ */
+void
+IvfflatPqTrain(VectorArray samples, int subvectors, float *codebook)
+{
+	int			dimensions = samples->dim;
+	int			dsub = dimensions / subvectors;
+	int			numSamples = Min(samples->length, IVFFLAT_PQ_MAX_SAMPLES);
+	MemoryContext pqCtx = AllocSetContextCreate(CurrentMemoryContext,
+												"Ivfflat pq temporary context",
+												ALLOCSET_DEFAULT_SIZES);
+	MemoryContext oldCtx = MemoryContextSwitchTo(pqCtx);
+
+	/* Quick approach if we have no data */
+	if (numSamples == 0)
+	{
+		for (int64 i = 0; i < (int64) IVFFLAT_PQ_CENTROIDS * dimensions; i++)
+			codebook[i] = (float) RandomDouble();
+	}
+	else
+	{
+		int		   *assignments = palloc(sizeof(int) * numSamples);
+		float	   *sums = palloc(sizeof(float) * IVFFLAT_PQ_CENTROIDS * dsub);
+		int		   *counts = palloc(sizeof(int) * IVFFLAT_PQ_CENTROIDS);
+
+		for (int m = 0; m < subvectors; m++)
+		{
+			float	   *centroids = codebook + (int64) m * IVFFLAT_PQ_CENTROIDS * dsub;
+
+			TrainSubspace(samples, numSamples, m * dsub, dsub, centroids, assignments, sums, counts);
+		}
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(pqCtx);
+}
+
+/*
+ * Encode a vector
+ */
+void
+IvfflatPqEncode(const float *codebook, int dimensions, int subvectors, Vector * vec, uint8 *codes)
+{
+	int			dsub = dimensions / subvectors;
+
+	for (int m = 0; m < subvectors; m++)
+	{
+		const float *centroids = codebook + (int64) m * IVFFLAT_PQ_CENTROIDS * dsub;
+
+		codes[m] = (uint8) ClosestCentroid(centroids, dsub, vec->x + m * dsub);
+	}
+}
+
+/*
+ * Form an index tuple with codes instead of the value
+ */
+IndexTuple
+IvfflatPqFormTuple(const uint8 *codes, int subvectors)
+{
+	Size		size = IVFFLAT_PQ_TUPLE_SIZE(subvectors);
+	IndexTuple	itup = palloc0(size);
+
+	itup->t_info = size;
+	memcpy(IvfflatPqTupleGetCodes(itup), codes, subvectors);
+
+	return itup;
+}
+
+/*
+ * Compute the lookup table for asymmetric distance computation
+ *
+ * table[m * IVFFLAT_PQ_CENTROIDS + k] is the score of centroid k in subspace
+ * m, so the score for a tuple is the sum over its codes
+ */
+void
+IvfflatPqComputeTable(const float *codebook, int dimensions, int subvectors, Vector * query, bool innerProduct, float *table)
+{
+	int			dsub = dimensions / subvectors;
+
+	for (int m = 0; m < subvectors; m++)
+	{
+		float	   *x = query->x + m * dsub;
+
+		for (int k = 0; k < IVFFLAT_PQ_CENTROIDS; k++)
+		{
+			float	   *c = (float *) codebook + ((int64) m * IVFFLAT_PQ_CENTROIDS + k) * dsub;
+
+			if (innerProduct)
+				table[m * IVFFLAT_PQ_CENTROIDS + k] = -VectorInnerProduct(dsub, x, c);
+			else
+				table[m * IVFFLAT_PQ_CENTROIDS + k] = VectorL2SquaredDistance(dsub, x, c);
+		}
+	}
+}
+
+/*
+ * Create codebook pages and store their location in the metapage
+ */
+void
+IvfflatPqCreateCodebookPages(Relation index, const float *codebook, int dimensions, ForkNumber forkNum)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	BlockNumber startPage;
+	int64		total = (int64) IVFFLAT_PQ_CENTROIDS * dimensions;
+	IvfflatMetaPage metap;
+
+	buf = IvfflatNewBuffer(index, forkNum);
+	IvfflatInitRegisterPage(index, &buf, &page, &state);
+	startPage = BufferGetBlockNumber(buf);
+
+	for (int64 i = 0; i < total; i += IVFFLAT_CODEBOOK_PAGE_FLOATS)
+	{
+		Size		itemsz = MAXALIGN(Min(total - i, IVFFLAT_CODEBOOK_PAGE_FLOATS) * sizeof(float));
+
+		/* One item per page */
+		if (i > 0)
+			IvfflatAppendPage(index, &buf, &page, &state, forkNum);
+
+		if (PageAddItem(page, (Item) (codebook + i), itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+	}
+
+	IvfflatCommitBuffer(buf, state);
+
+	/* Update metapage */
+	buf = ReadBufferExtended(index, forkNum, IVFFLAT_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	metap = IvfflatPageGetMeta(page);
+	metap->codebookPage = startPage;
+	IvfflatCommitBuffer(buf, state);
+}
+
+/*
+ * Read the codebook from disk
+ */
+static void
+ReadCodebook(Relation index, BlockNumber blkno, float *codebook, int dimensions)
+{
+	int64		total = (int64) IVFFLAT_PQ_CENTROIDS * dimensions;
+	int64		i = 0;
+
+	while (BlockNumberIsValid(blkno) && i < total)
+	{
+		Buffer		buf;
+		Page		page;
+		int64		count = Min(total - i, IVFFLAT_CODEBOOK_PAGE_FLOATS);
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+
+		memcpy(codebook + i, PageGetItem(page, PageGetItemId(page, FirstOffsetNumber)), count * sizeof(float));
+		i += count;
+
+		blkno = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	if (i != total)
+		elog(ERROR, "ivfflat codebook is not valid");
+}
+
+/*
+ * Get the codebook, or NULL if no quantization
+ *
+ * The codebook is cached in the relcache entry since every insert needs it
+ */
+const float *
+IvfflatPqGetCodebook(Relation index, int *subvectors)
+{
+	IvfflatPqCache *cache = (IvfflatPqCache *) index->rd_amcache;
+
+	if (cache == NULL)
+	{
+		int			dimensions;
+		int			m;
+		BlockNumber codebookPage;
+
+		IvfflatGetMetaPageInfo(index, NULL, &dimensions);
+		IvfflatGetPqMetaPageInfo(index, &m, &codebookPage);
+
+		cache = MemoryContextAlloc(index->rd_indexcxt, offsetof(IvfflatPqCache, codebook) + (m == 0 ? 0 : sizeof(float) * IVFFLAT_PQ_CENTROIDS * dimensions));
+		cache->dimensions = dimensions;
+		cache->subvectors = m;
+
+		if (m != 0)
+		{
+			PG_TRY();
+			{
+				ReadCodebook(index, codebookPage, cache->codebook, dimensions);
+			}
+			PG_CATCH();
+			{
+				pfree(cache);
+				PG_RE_THROW();
+			}
+			PG_END_TRY();
+		}
+
+		index->rd_amcache = cache;
+	}
+
+	*subvectors = cache->subvectors;
+	return cache->subvectors == 0 ? NULL : cache->codebook;
+}
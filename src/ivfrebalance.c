@@ -0,0 +1,1057 @@
+#include "postgres.h"
+
+#include <float.h>
+
+#include "access/generic_xlog.h"
+#include "access/htup_details.h"
+#include "access/table.h"
+#include "catalog/index.h"
+#include "catalog/pg_class.h"
+#include "funcapi.h"
+#include "ivfflat.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+/* Only two centers are needed to split a list */
+#define IVFFLAT_REBALANCE_SAMPLES	1000
+
+typedef struct RebalanceList
+{
+	ListInfo	listInfo;
+	BlockNumber startPage;
+	BlockNumber insertPage;
+	BlockNumber tailPage;
+	int64		count;
+	bool		split;
+	bool		merged;			/* merged into another list */
+	Pointer		center;
+}			RebalanceList;
+
+/* New entry pages for one half of a split */
+typedef struct RebalanceChain
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	BlockNumber startPage;
+	BlockNumber insertPage;
+}			RebalanceChain;
+
+/* Old entry page and the number of entries copied from it */
+typedef struct RebalanceCopied
+{
+	BlockNumber blkno;
+	int			count;
+}			RebalanceCopied;
+
+typedef struct RebalanceSplit
+{
+	int			list;
+	VectorArray centers;
+	RebalanceChain chains[2];
+	RebalanceCopied *copied;
+	int			numCopied;
+	int			maxCopied;
+}			RebalanceSplit;
+
+typedef struct RebalanceMerge
+{
+	int			from;
+	int			into;
+}			RebalanceMerge;
+
+typedef struct RebalanceState
+{
+	Relation	index;
+	const		IvfflatTypeInfo *typeInfo;
+	FmgrInfo   *procinfo;
+	FmgrInfo   *kmeansnormprocinfo;
+	Oid			collation;
+	int			dimensions;
+	Size		listSize;
+	BufferAccessStrategy bas;
+	MemoryContext tmpCtx;
+
+	/* Lists */
+	RebalanceList *lists;
+	int			numLists;
+	int			maxLists;
+	BlockNumber lastListPage;
+
+	/* Packed entries are copied here to have a datum */
+	Vector	   *vec;
+}			RebalanceState;
+
+/*
+ * Get the number of entries on an entry page
+ */
+static int
+GetEntryCount(Page page)
+{
+	if (IvfflatPageIsPacked(page))
+		return IvfflatPackedGetCount(page);
+
+	return PageGetMaxOffsetNumber(page);
+}
+
+/*
+ * Get an entry from an entry page
+ *
+ * itup is set to NULL for packed pages
+ */
+static Datum
+GetEntry(RebalanceState * rs, Page page, int i, ItemPointer *heaptid, IndexTuple *itup)
+{
+	if (IvfflatPageIsPacked(page))
+	{
+		memcpy(rs->vec->x, IvfflatPackedGetVector(page, i, rs->dimensions), rs->dimensions * sizeof(float));
+		*heaptid = IvfflatPackedGetTid(page, i);
+		*itup = NULL;
+		return PointerGetDatum(rs->vec);
+	}
+	else
+	{
+		bool		isnull;
+
+		*itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, i + FirstOffsetNumber));
+		*heaptid = &(*itup)->t_tid;
+		return index_getattr(*itup, 1, RelationGetDescr(rs->index), &isnull);
+	}
+}
+
+/*
+ * Read the lists and count their entries
+ */
+static void
+ReadLists(RebalanceState * rs)
+{
+	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
+	Size		itemsize = MAXALIGN(rs->typeInfo->itemSize(rs->dimensions));
+
+	rs->listSize = MAXALIGN(IVFFLAT_LIST_SIZE(itemsize));
+
+	while (BlockNumberIsValid(nextblkno))
+	{
+		Buffer		cbuf;
+		Page		cpage;
+		OffsetNumber maxoffno;
+
+		cbuf = ReadBuffer(rs->index, nextblkno);
+		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		cpage = BufferGetPage(cbuf);
+		maxoffno = PageGetMaxOffsetNumber(cpage);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			IvfflatList list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, offno));
+			RebalanceList *rlist;
+
+			if (rs->numLists == rs->maxLists)
+			{
+				rs->maxLists *= 2;
+				rs->lists = repalloc(rs->lists, rs->maxLists * sizeof(RebalanceList));
+			}
+
+			rlist = &rs->lists[rs->numLists++];
+			rlist->listInfo.blkno = nextblkno;
+			rlist->listInfo.offno = offno;
+			rlist->startPage = list->startPage;
+			rlist->insertPage = list->insertPage;
+			rlist->tailPage = list->startPage;
+			rlist->count = 0;
+			rlist->split = false;
+			rlist->merged = false;
+			rlist->center = palloc(itemsize);
+			memcpy(rlist->center, &list->center, VARSIZE_ANY(&list->center));
+		}
+
+		rs->lastListPage = nextblkno;
+		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+
+		UnlockReleaseBuffer(cbuf);
+	}
+
+	/* Count entries */
+	for (int i = 0; i < rs->numLists; i++)
+	{
+		BlockNumber searchPage = rs->lists[i].startPage;
+
+		while (BlockNumberIsValid(searchPage))
+		{
+			Buffer		buf;
+			Page		page;
+
+			CHECK_FOR_INTERRUPTS();
+
+			buf = ReadBufferExtended(rs->index, MAIN_FORKNUM, searchPage, RBM_NORMAL, rs->bas);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+			page = BufferGetPage(buf);
+
+			rs->lists[i].count += GetEntryCount(page);
+			rs->lists[i].tailPage = searchPage;
+			searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+			UnlockReleaseBuffer(buf);
+		}
+	}
+}
+
+/*
+ * Get the closest of two centers
+ */
+static int
+ClosestCenter(RebalanceState * rs, VectorArray centers, Datum value)
+{
+	double		distance0 = DatumGetFloat8(FunctionCall2Coll(rs->procinfo, rs->collation, value, PointerGetDatum(VectorArrayGet(centers, 0))));
+	double		distance1 = DatumGetFloat8(FunctionCall2Coll(rs->procinfo, rs->collation, value, PointerGetDatum(VectorArrayGet(centers, 1))));
+
+	return distance1 < distance0 ? 1 : 0;
+}
+
+/*
+ * Sample entries of a list with selection sampling
+ */
+static VectorArray
+SampleList(RebalanceState * rs, RebalanceList * list)
+{
+	int64		remaining = list->count;
+	int			needed = Min(list->count, IVFFLAT_REBALANCE_SAMPLES);
+	VectorArray samples = VectorArrayInit(needed, rs->dimensions, rs->typeInfo->itemSize(rs->dimensions));
+	BlockNumber searchPage = list->startPage;
+
+	while (BlockNumberIsValid(searchPage) && needed > 0)
+	{
+		Buffer		buf;
+		Page		page;
+		int			count;
+		MemoryContext oldCtx;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBufferExtended(rs->index, MAIN_FORKNUM, searchPage, RBM_NORMAL, rs->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		count = GetEntryCount(page);
+
+		oldCtx = MemoryContextSwitchTo(rs->tmpCtx);
+
+		for (int i = 0; i < count && needed > 0; i++)
+		{
+			ItemPointer heaptid;
+			IndexTuple	itup;
+			Datum		value;
+
+			if (remaining-- * RandomDouble() >= needed)
+				continue;
+
+			needed--;
+			value = GetEntry(rs, page, i, &heaptid, &itup);
+
+			/* Spherical distance function expects unit vectors */
+			if (rs->kmeansnormprocinfo != NULL)
+			{
+				if (!IvfflatCheckNorm(rs->kmeansnormprocinfo, rs->collation, value))
+					continue;
+
+				value = IvfflatNormValue(rs->typeInfo, rs->collation, value);
+			}
+
+			VectorArraySet(samples, samples->length, DatumGetPointer(value));
+			samples->length++;
+		}
+
+		MemoryContextSwitchTo(oldCtx);
+		MemoryContextReset(rs->tmpCtx);
+
+		searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	return samples;
+}
+
+/*
+ * Start new entry pages
+ */
+static void
+ChainInit(RebalanceState * rs, RebalanceChain * chain, bool packed)
+{
+	/* Inserts can extend the index at the same time */
+	LockRelationForExtension(rs->index, ExclusiveLock);
+	chain->buf = IvfflatNewBuffer(rs->index, MAIN_FORKNUM);
+	UnlockRelationForExtension(rs->index, ExclusiveLock);
+
+	IvfflatInitRegisterPage(rs->index, &chain->buf, &chain->page, &chain->state);
+	if (packed)
+		IvfflatPackedInitPage(chain->page);
+
+	chain->startPage = BufferGetBlockNumber(chain->buf);
+}
+
+/*
+ * Continue new entry pages after they were finished
+ */
+static void
+ChainResume(RebalanceState * rs, RebalanceChain * chain)
+{
+	chain->buf = ReadBuffer(rs->index, chain->insertPage);
+	LockBuffer(chain->buf, BUFFER_LOCK_EXCLUSIVE);
+	chain->state = GenericXLogStart(rs->index);
+	chain->page = GenericXLogRegisterBuffer(chain->state, chain->buf, 0);
+}
+
+/*
+ * Add a page to new entry pages
+ */
+static void
+ChainAppendPage(RebalanceState * rs, RebalanceChain * chain)
+{
+	LockRelationForExtension(rs->index, ExclusiveLock);
+	IvfflatAppendPage(rs->index, &chain->buf, &chain->page, &chain->state, MAIN_FORKNUM);
+	UnlockRelationForExtension(rs->index, ExclusiveLock);
+}
+
+/*
+ * Add an entry to new entry pages
+ */
+static void
+ChainAdd(RebalanceState * rs, RebalanceChain * chain, ItemPointer heaptid, IndexTuple itup, Datum value)
+{
+	if (itup == NULL)
+	{
+		Vector	   *vec = DatumGetVector(value);
+
+		if (!IvfflatPackedHasSpace(chain->page, vec->dim))
+			ChainAppendPage(rs, chain);
+
+		IvfflatPackedAddEntry(chain->page, heaptid, vec);
+	}
+	else
+	{
+		Size		itemsz = MAXALIGN(IndexTupleSize(itup));
+
+		if (PageGetFreeSpace(chain->page) < itemsz)
+			ChainAppendPage(rs, chain);
+
+		if (PageAddItem(chain->page, (Item) itup, itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(rs->index));
+	}
+}
+
+/*
+ * Finish new entry pages
+ */
+static void
+ChainFinish(RebalanceChain * chain)
+{
+	chain->insertPage = BufferGetBlockNumber(chain->buf);
+	IvfflatCommitBuffer(chain->buf, chain->state);
+}
+
+/*
+ * Copy entries of an old entry page to the new entry pages, starting at an
+ * entry
+ */
+static void
+CopyEntries(RebalanceState * rs, RebalanceSplit * split, Page page, int start, int count)
+{
+	for (int i = start; i < count; i++)
+	{
+		ItemPointer heaptid;
+		IndexTuple	itup;
+		Datum		value = GetEntry(rs, page, i, &heaptid, &itup);
+		MemoryContext oldCtx;
+		int			closest;
+
+		/* Distance functions can detoast */
+		oldCtx = MemoryContextSwitchTo(rs->tmpCtx);
+		closest = ClosestCenter(rs, split->centers, value);
+		MemoryContextSwitchTo(oldCtx);
+
+		ChainAdd(rs, &split->chains[closest], heaptid, itup, value);
+	}
+
+	MemoryContextReset(rs->tmpCtx);
+}
+
+/*
+ * Split a list with 2-means and write each half to new entry pages
+ *
+ * The new pages are not reachable until the lists are switched, so
+ * concurrent scans are not affected. Inserts can add entries to the old
+ * pages at the same time, so the number of entries copied from each page is
+ * kept to copy the rest when switching.
+ */
+static bool
+SplitList(RebalanceState * rs, int listIndex, RebalanceSplit * split)
+{
+	RebalanceList *list = &rs->lists[listIndex];
+	VectorArray samples;
+	VectorArray centers;
+	int			sampleCounts[2] = {0};
+	BlockNumber searchPage = list->startPage;
+	bool		packed;
+	Buffer		buf;
+
+	samples = SampleList(rs, list);
+	if (samples->length < 2)
+	{
+		VectorArrayFree(samples);
+		return false;
+	}
+
+	centers = VectorArrayInit(2, rs->dimensions, rs->typeInfo->itemSize(rs->dimensions));
+	IvfflatKmeans(rs->index, samples, centers, rs->typeInfo, 0, false);
+
+	/* Skip lists that cannot be separated, like ones with the same vector */
+	for (int i = 0; i < samples->length; i++)
+		sampleCounts[ClosestCenter(rs, centers, PointerGetDatum(VectorArrayGet(samples, i)))]++;
+
+	VectorArrayFree(samples);
+
+	if (sampleCounts[0] == 0 || sampleCounts[1] == 0)
+	{
+		VectorArrayFree(centers);
+		return false;
+	}
+
+	/* Pages of a list are either all packed or not */
+	buf = ReadBufferExtended(rs->index, MAIN_FORKNUM, searchPage, RBM_NORMAL, rs->bas);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	packed = IvfflatPageIsPacked(BufferGetPage(buf));
+	UnlockReleaseBuffer(buf);
+
+	split->list = listIndex;
+	split->centers = centers;
+	split->numCopied = 0;
+	split->maxCopied = 16;
+	split->copied = palloc(split->maxCopied * sizeof(RebalanceCopied));
+	ChainInit(rs, &split->chains[0], packed);
+	ChainInit(rs, &split->chains[1], packed);
+
+	/* Assign each entry to the closest center */
+	while (BlockNumberIsValid(searchPage))
+	{
+		Page		page;
+		int			count;
+
+		buf = ReadBufferExtended(rs->index, MAIN_FORKNUM, searchPage, RBM_NORMAL, rs->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		count = GetEntryCount(page);
+
+		CopyEntries(rs, split, page, 0, count);
+
+		if (split->numCopied == split->maxCopied)
+		{
+			split->maxCopied *= 2;
+			split->copied = repalloc(split->copied, split->maxCopied * sizeof(RebalanceCopied));
+		}
+
+		split->copied[split->numCopied].blkno = searchPage;
+		split->copied[split->numCopied].count = count;
+		split->numCopied++;
+
+		searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	ChainFinish(&split->chains[0]);
+	ChainFinish(&split->chains[1]);
+
+	return true;
+}
+
+/*
+ * Copy entries that inserts added to the old entry pages of a split list
+ * after they were copied
+ *
+ * Inserts only add entries after the existing ones on a page and only add
+ * pages at the end of a list, and are blocked by the relation lock.
+ */
+static void
+CopyNewEntries(RebalanceState * rs, RebalanceSplit * split)
+{
+	BlockNumber searchPage = rs->lists[split->list].startPage;
+	int			n = 0;
+
+	ChainResume(rs, &split->chains[0]);
+	ChainResume(rs, &split->chains[1]);
+
+	while (BlockNumberIsValid(searchPage))
+	{
+		Buffer		buf;
+		Page		page;
+		int			start = 0;
+
+		buf = ReadBufferExtended(rs->index, MAIN_FORKNUM, searchPage, RBM_NORMAL, rs->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+
+		if (n < split->numCopied)
+		{
+			Assert(split->copied[n].blkno == searchPage);
+			start = split->copied[n].count;
+			n++;
+		}
+
+		CopyEntries(rs, split, page, start, GetEntryCount(page));
+
+		searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	ChainFinish(&split->chains[0]);
+	ChainFinish(&split->chains[1]);
+}
+
+/*
+ * Get the last entry page of a list, which inserts may have added after the
+ * lists were read
+ */
+static BlockNumber
+GetTailPage(RebalanceState * rs, BlockNumber blkno)
+{
+	for (;;)
+	{
+		Buffer		buf;
+		BlockNumber nextblkno;
+
+		buf = ReadBufferExtended(rs->index, MAIN_FORKNUM, blkno, RBM_NORMAL, rs->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		nextblkno = IvfflatPageGetOpaque(BufferGetPage(buf))->nextblkno;
+		UnlockReleaseBuffer(buf);
+
+		if (!BlockNumberIsValid(nextblkno))
+			return blkno;
+
+		blkno = nextblkno;
+	}
+}
+
+/*
+ * Set the center to the weighted mean of the centers of two lists
+ */
+static void
+MergeCenters(RebalanceState * rs, RebalanceList * into, RebalanceList * from)
+{
+	int			dimensions = rs->dimensions;
+	float	   *x = palloc0(dimensions * sizeof(float));
+	float	   *y = palloc0(dimensions * sizeof(float));
+	double		weight = into->count + from->count > 0 ? (double) into->count / (into->count + from->count) : 0.5;
+	Pointer		center = palloc(VARSIZE_ANY(into->center));
+	MemoryContext oldCtx;
+
+	rs->typeInfo->sumCenter(into->center, x);
+	rs->typeInfo->sumCenter(from->center, y);
+
+	for (int i = 0; i < dimensions; i++)
+		x[i] = weight * x[i] + (1 - weight) * y[i];
+
+	rs->typeInfo->updateCenter(center, dimensions, x);
+
+	oldCtx = MemoryContextSwitchTo(rs->tmpCtx);
+
+	/* Keep the existing center if the mean cannot be normalized */
+	if (rs->kmeansnormprocinfo == NULL)
+		memcpy(into->center, center, VARSIZE_ANY(center));
+	else if (IvfflatCheckNorm(rs->kmeansnormprocinfo, rs->collation, PointerGetDatum(center)))
+	{
+		Pointer		normCenter = DatumGetPointer(IvfflatNormValue(rs->typeInfo, rs->collation, PointerGetDatum(center)));
+
+		memcpy(into->center, normCenter, VARSIZE_ANY(normCenter));
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(rs->tmpCtx);
+
+	pfree(x);
+	pfree(y);
+	pfree(center);
+}
+
+/*
+ * Find the closest list that an underfull list can be merged into
+ */
+static int
+FindMergeList(RebalanceState * rs, int from, double maxCount)
+{
+	RebalanceList *list = &rs->lists[from];
+	double		minDistance = DBL_MAX;
+	int			closest = -1;
+
+	for (int i = 0; i < rs->numLists; i++)
+	{
+		RebalanceList *other = &rs->lists[i];
+		double		distance;
+
+		if (i == from || other->split || other->merged || other->count + list->count > maxCount)
+			continue;
+
+		distance = DatumGetFloat8(FunctionCall2Coll(rs->procinfo, rs->collation, PointerGetDatum(list->center), PointerGetDatum(other->center)));
+		if (distance < minDistance)
+		{
+			minDistance = distance;
+			closest = i;
+		}
+	}
+
+	return closest;
+}
+
+/*
+ * Register a buffer for a generic WAL record
+ */
+static Page
+RegisterBuffer(Relation index, GenericXLogState *state, BlockNumber blkno, Buffer *buf)
+{
+	*buf = ReadBuffer(index, blkno);
+	LockBuffer(*buf, BUFFER_LOCK_EXCLUSIVE);
+	return GenericXLogRegisterBuffer(state, *buf, 0);
+}
+
+/*
+ * Set the pages and center of a list item
+ */
+static void
+SetList(IvfflatList list, BlockNumber startPage, BlockNumber insertPage, Pointer center)
+{
+	list->startPage = startPage;
+	list->insertPage = insertPage;
+	memcpy(&list->center, center, VARSIZE_ANY(center));
+}
+
+/*
+ * Merge a list by linking its entry pages after another list
+ *
+ * Links the pages, updates the other list, and removes the list in a single
+ * WAL record, so entries are never missing or reachable twice.
+ */
+static void
+MergeList(RebalanceState * rs, int from, int into)
+{
+	RebalanceList *fromList = &rs->lists[from];
+	RebalanceList *intoList = &rs->lists[into];
+	GenericXLogState *state;
+	Buffer		bufs[4];
+	int			nbufs = 0;
+	Page		tailpage;
+	Page		intopage;
+	Page		frompage;
+	Page		metapage;
+	IvfflatList list;
+
+	intoList->tailPage = GetTailPage(rs, intoList->tailPage);
+
+	state = GenericXLogStart(rs->index);
+
+	tailpage = RegisterBuffer(rs->index, state, intoList->tailPage, &bufs[nbufs++]);
+	IvfflatPageGetOpaque(tailpage)->nextblkno = fromList->startPage;
+
+	/* Keep the insert page, which is before the new pages */
+	intopage = RegisterBuffer(rs->index, state, intoList->listInfo.blkno, &bufs[nbufs++]);
+	list = (IvfflatList) PageGetItem(intopage, PageGetItemId(intopage, intoList->listInfo.offno));
+	memcpy(&list->center, intoList->center, VARSIZE_ANY(intoList->center));
+
+	if (fromList->listInfo.blkno == intoList->listInfo.blkno)
+		frompage = intopage;
+	else
+		frompage = RegisterBuffer(rs->index, state, fromList->listInfo.blkno, &bufs[nbufs++]);
+	PageIndexTupleDelete(frompage, fromList->listInfo.offno);
+
+	metapage = RegisterBuffer(rs->index, state, IVFFLAT_METAPAGE_BLKNO, &bufs[nbufs++]);
+	IvfflatPageGetMeta(metapage)->lists--;
+
+	GenericXLogFinish(state);
+
+	for (int i = 0; i < nbufs; i++)
+		UnlockReleaseBuffer(bufs[i]);
+
+	intoList->tailPage = GetTailPage(rs, fromList->tailPage);
+
+	/* Later items on the page moved to earlier offsets */
+	for (int i = 0; i < rs->numLists; i++)
+	{
+		ListInfo   *listInfo = &rs->lists[i].listInfo;
+
+		if (listInfo->blkno == fromList->listInfo.blkno && listInfo->offno > fromList->listInfo.offno)
+			listInfo->offno--;
+	}
+}
+
+/*
+ * Get a list page with space for another list
+ */
+static BlockNumber
+GetListSpace(RebalanceState * rs, BlockNumber blkno)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	bool		hasSpace;
+
+	/* Try the page of the split list, then the last list page */
+	for (int i = 0; i < 2; i++)
+	{
+		buf = ReadBuffer(rs->index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		hasSpace = PageGetFreeSpace(BufferGetPage(buf)) >= rs->listSize;
+		UnlockReleaseBuffer(buf);
+
+		if (hasSpace)
+			return blkno;
+
+		blkno = rs->lastListPage;
+	}
+
+	/* Add an empty list page */
+	buf = ReadBuffer(rs->index, rs->lastListPage);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(rs->index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	IvfflatAppendPage(rs->index, &buf, &page, &state, MAIN_FORKNUM);
+
+	rs->lastListPage = BufferGetBlockNumber(buf);
+
+	IvfflatCommitBuffer(buf, state);
+
+	return rs->lastListPage;
+}
+
+/*
+ * Empty the old entry pages of a split list and add them before the new
+ * ones, so the space is reused by inserts
+ *
+ * Each page is emptied and linked to the list in the same WAL record, so a
+ * page is never unreachable once it is empty. Interrupts are held so the
+ * pages are not leaked by a cancel. Inserts are blocked by the relation
+ * lock.
+ */
+static void
+ReuseEntryPages(RebalanceState * rs, RebalanceList * list, BlockNumber startPage)
+{
+	BlockNumber searchPage = startPage;
+
+	HOLD_INTERRUPTS();
+
+	while (BlockNumberIsValid(searchPage))
+	{
+		Buffer		bufs[2];
+		Page		page;
+		GenericXLogState *state;
+		IvfflatList item;
+		BlockNumber nextblkno;
+		bool		packed;
+
+		bufs[0] = ReadBufferExtended(rs->index, MAIN_FORKNUM, searchPage, RBM_NORMAL, rs->bas);
+		LockBuffer(bufs[0], BUFFER_LOCK_EXCLUSIVE);
+		state = GenericXLogStart(rs->index);
+		page = GenericXLogRegisterBuffer(state, bufs[0], GENERIC_XLOG_FULL_IMAGE);
+
+		nextblkno = IvfflatPageGetOpaque(page)->nextblkno;
+		packed = IvfflatPageIsPacked(page);
+
+		IvfflatInitPage(bufs[0], page);
+		if (packed)
+			IvfflatPackedInitPage(page);
+		IvfflatPageGetOpaque(page)->nextblkno = list->startPage;
+
+		page = RegisterBuffer(rs->index, state, list->listInfo.blkno, &bufs[1]);
+		item = (IvfflatList) PageGetItem(page, PageGetItemId(page, list->listInfo.offno));
+		item->startPage = searchPage;
+		item->insertPage = searchPage;
+
+		GenericXLogFinish(state);
+
+		UnlockReleaseBuffer(bufs[0]);
+		UnlockReleaseBuffer(bufs[1]);
+
+		list->startPage = searchPage;
+		list->insertPage = searchPage;
+
+		searchPage = nextblkno;
+	}
+
+	RESUME_INTERRUPTS();
+}
+
+/*
+ * Switch a split list to the new entry pages
+ *
+ * Copies entries inserted since the split first. Updates the list and adds
+ * the new list in a single WAL record, so entries are never missing or
+ * reachable twice.
+ */
+static void
+SwitchSplit(RebalanceState * rs, RebalanceSplit * split)
+{
+	RebalanceList *list = &rs->lists[split->list];
+	BlockNumber oldStartPage = list->startPage;
+	BlockNumber newListPage = GetListSpace(rs, list->listInfo.blkno);
+	GenericXLogState *state;
+	Buffer		bufs[3];
+	int			nbufs = 0;
+	Page		page;
+	Page		newpage;
+	Page		metapage;
+	IvfflatList newList = palloc0(rs->listSize);
+
+	CopyNewEntries(rs, split);
+
+	state = GenericXLogStart(rs->index);
+
+	page = RegisterBuffer(rs->index, state, list->listInfo.blkno, &bufs[nbufs++]);
+	SetList((IvfflatList) PageGetItem(page, PageGetItemId(page, list->listInfo.offno)),
+			split->chains[0].startPage, split->chains[0].insertPage, VectorArrayGet(split->centers, 0));
+
+	if (newListPage == list->listInfo.blkno)
+		newpage = page;
+	else
+		newpage = RegisterBuffer(rs->index, state, newListPage, &bufs[nbufs++]);
+
+	SetList(newList, split->chains[1].startPage, split->chains[1].insertPage, VectorArrayGet(split->centers, 1));
+	if (PageAddItem(newpage, (Item) newList, rs->listSize, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(rs->index));
+
+	metapage = RegisterBuffer(rs->index, state, IVFFLAT_METAPAGE_BLKNO, &bufs[nbufs++]);
+	IvfflatPageGetMeta(metapage)->lists++;
+
+	GenericXLogFinish(state);
+
+	for (int i = 0; i < nbufs; i++)
+		UnlockReleaseBuffer(bufs[i]);
+
+	pfree(newList);
+
+	list->startPage = split->chains[0].startPage;
+	list->insertPage = split->chains[0].insertPage;
+
+	ReuseEntryPages(rs, list, oldStartPage);
+}
+
+/*
+ * Compare lists by the number of entries
+ */
+static int
+CompareListCounts(const void *a, const void *b, void *arg)
+{
+	RebalanceList *lists = (RebalanceList *) arg;
+	int64		countA = lists[*((const int *) a)].count;
+	int64		countB = lists[*((const int *) b)].count;
+
+	if (countA < countB)
+		return -1;
+
+	if (countA > countB)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Split oversized lists and merge underfull ones
+ */
+static void
+RebalanceIndex(RebalanceState * rs, double splitRatio, double mergeRatio, int *splits, int *merges)
+{
+	RebalanceSplit *splitList;
+	RebalanceMerge *mergeList;
+	int			nsplits = 0;
+	int			nmerges = 0;
+	int64		total = 0;
+	double		mean;
+	int			numLists;
+	int		   *order;
+
+	ReadLists(rs);
+
+	for (int i = 0; i < rs->numLists; i++)
+		total += rs->lists[i].count;
+
+	*splits = 0;
+	*merges = 0;
+
+	if (total == 0)
+		return;
+
+	mean = (double) total / rs->numLists;
+	numLists = rs->numLists;
+
+	splitList = palloc(rs->numLists * sizeof(RebalanceSplit));
+	mergeList = palloc(rs->numLists * sizeof(RebalanceMerge));
+
+	/* Sort lists by the number of entries */
+	order = palloc(rs->numLists * sizeof(int));
+	for (int i = 0; i < rs->numLists; i++)
+		order[i] = i;
+	qsort_arg(order, rs->numLists, sizeof(int), CompareListCounts, rs->lists);
+
+	/* Split the largest lists first */
+	for (int i = rs->numLists - 1; i >= 0 && numLists < IVFFLAT_MAX_LISTS; i--)
+	{
+		RebalanceList *list = &rs->lists[order[i]];
+
+		if (list->count <= splitRatio * mean)
+			break;
+
+		if (SplitList(rs, order[i], &splitList[nsplits]))
+		{
+			list->split = true;
+			nsplits++;
+			numLists++;
+		}
+	}
+
+	/* Merge the smallest lists first */
+	for (int i = 0; i < rs->numLists; i++)
+	{
+		RebalanceList *list = &rs->lists[order[i]];
+		int			into;
+
+		/* Counts include lists merged so far */
+		if (list->split || list->count >= mergeRatio * mean)
+			continue;
+
+		/* Do not create a list that would be split */
+		into = FindMergeList(rs, order[i], splitRatio * mean);
+		if (into == -1)
+			continue;
+
+		MergeCenters(rs, &rs->lists[into], list);
+		rs->lists[into].count += list->count;
+		list->merged = true;
+
+		mergeList[nmerges].from = order[i];
+		mergeList[nmerges].into = into;
+		nmerges++;
+	}
+
+	if (nsplits == 0 && nmerges == 0)
+		return;
+
+	/*
+	 * Scans and inserts read list pages one at a time, so block them while
+	 * switching lists. The new entry pages were written without blocking
+	 * them. Waits for transactions that inserted to finish, so no insert
+	 * uses a list it read before the switch.
+	 */
+	LockRelation(rs->index, AccessExclusiveLock);
+
+	for (int i = 0; i < nmerges; i++)
+		MergeList(rs, mergeList[i].from, mergeList[i].into);
+
+	for (int i = 0; i < nsplits; i++)
+		SwitchSplit(rs, &splitList[i]);
+
+	/* Changes are not transactional, so no need to wait for commit */
+	UnlockRelation(rs->index, AccessExclusiveLock);
+
+	*splits = nsplits;
+	*merges = nmerges;
+}
+
+/*
+ * Split oversized lists and merge underfull lists of an ivfflat index
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(ivfflat_rebalance);
+Datum
+ivfflat_rebalance(PG_FUNCTION_ARGS)
+{
+	Oid			indexOid = PG_GETARG_OID(0);
+	double		splitRatio = PG_GETARG_FLOAT8(1);
+	double		mergeRatio = PG_GETARG_FLOAT8(2);
+	char	   *indexName;
+	TupleDesc	tupdesc;
+	Relation	heap;
+	Relation	index;
+	RebalanceState rs;
+	int			subvectors;
+	BlockNumber codebookPage;
+	int			splits;
+	int			merges;
+	Datum		values[2];
+	bool		nulls[2] = {0};
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (!(splitRatio > 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("split_ratio must be greater than 1")));
+
+	if (!(mergeRatio >= 0 && mergeRatio <= 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("merge_ratio must be between 0 and 1")));
+
+	indexName = get_rel_name(indexOid);
+	if (indexName == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("index with OID %u does not exist", indexOid)));
+
+	if (get_rel_relkind(indexOid) != RELKIND_INDEX)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an ivfflat index", indexName)));
+
+	/* Same privilege as REINDEX, checked before locking the table */
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, indexOid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(indexOid, GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER, OBJECT_INDEX, indexName);
+
+	/* Block vacuum and other rebalances, but not writes or scans */
+	heap = table_open(IndexGetRelation(indexOid, false), ShareUpdateExclusiveLock);
+	index = index_open(indexOid, ShareUpdateExclusiveLock);
+
+	if (index->rd_indam->amgettuple != ivfflatgettuple)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an ivfflat index", RelationGetRelationName(index))));
+
+	/* Codes cannot be split without the original vectors */
+	IvfflatGetPqMetaPageInfo(index, &subvectors, &codebookPage);
+	if (subvectors > 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("rebalancing does not support product quantization")));
+
+	rs.index = index;
+	rs.typeInfo = IvfflatGetTypeInfo(index);
+	rs.procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
+	rs.kmeansnormprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
+	rs.collation = index->rd_indcollation[0];
+	rs.bas = GetAccessStrategy(BAS_BULKREAD);
+	rs.tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+									  "Ivfflat rebalance temporary context",
+									  ALLOCSET_DEFAULT_SIZES);
+	rs.numLists = 0;
+	rs.maxLists = 128;
+	rs.lists = palloc(rs.maxLists * sizeof(RebalanceList));
+	IvfflatGetMetaPageInfo(index, NULL, &rs.dimensions);
+	rs.vec = InitVector(rs.dimensions);
+
+	RebalanceIndex(&rs, splitRatio, mergeRatio, &splits, &merges);
+
+	FreeAccessStrategy(rs.bas);
+	MemoryContextDelete(rs.tmpCtx);
+
+	index_close(index, ShareUpdateExclusiveLock);
+	table_close(heap, ShareUpdateExclusiveLock);
+
+	values[0] = Int32GetDatum(splits);
+	values[1] = Int32GetDatum(merges);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
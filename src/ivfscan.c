@@ -1,20 +1,33 @@
 #include "postgres.h"
 
 #include <float.h>
+#include <math.h>
 
 #include "access/relscan.h"
+#include "access/tableam.h"
+#include "bitutils.h"
+#include "catalog/index.h"
 #include "catalog/pg_operator_d.h"
 #include "catalog/pg_type_d.h"
+#include "executor/executor.h"
 #include "lib/pairingheap.h"
 #include "ivfflat.h"
 #include "miscadmin.h"
 #include "pgstat.h"
 #include "storage/bufmgr.h"
 #include "utils/memutils.h"
+#include "utils/varbit.h"
+#include "vectorutils.h"
+
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
 
 #define GetScanList(ptr) pairingheap_container(IvfflatScanList, ph_node, ptr)
 #define GetScanListConst(ptr) pairingheap_const_container(IvfflatScanList, ph_node, ptr)
 
+PGDLLEXPORT Datum hamming_distance(PG_FUNCTION_ARGS);
+
 /*
  * Compare list distances
  */
@@ -61,6 +74,7 @@ GetScanLists(IndexScanDesc scan, Datum value)
 
 			/* Use procinfo from the index instead of scan key for performance */
 			distance = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, PointerGetDatum(&list->center), value));
+			so->stats.distances++;
 
 			if (listCount < so->maxProbes)
 			{
@@ -101,11 +115,364 @@ GetScanLists(IndexScanDesc scan, Datum value)
 	}
 
 	for (int i = listCount - 1; i >= 0; i--)
-		so->listPages[i] = GetScanList(pairingheap_remove_first(so->listQueue))->startPage;
+	{
+		IvfflatScanList *scanlist = GetScanList(pairingheap_remove_first(so->listQueue));
+
+		so->listPages[i] = scanlist->startPage;
+		so->listDistances[i] = scanlist->distance;
+	}
 
 	Assert(pairingheap_is_empty(so->listQueue));
 }
 
+/*
+ * Get the approximate distance from product quantization codes
+ */
+static inline double
+GetPqDistance(IvfflatScanOpaque so, IndexTuple itup)
+{
+	uint8	   *codes = IvfflatPqTupleGetCodes(itup);
+	float	   *table = so->pqTable;
+	float		distance = 0.0;
+
+	for (int m = 0; m < so->subvectors; m++)
+		distance += table[m * IVFFLAT_PQ_CENTROIDS + codes[m]];
+
+	return (double) distance;
+}
+
+/*
+ * Get the Hamming distances for all tuples on a page in one call, or false
+ * if any tuple needs fmgr
+ */
+static bool
+GetPageHammingDistances(Page page, OffsetNumber maxoffno, TupleDesc tupdesc, Datum value, double *distances)
+{
+	VarBit	   *query = (VarBit *) DatumGetPointer(value);
+	unsigned char *bxs[MaxIndexTuplesPerPage];
+	uint64		counts[MaxIndexTuplesPerPage];
+	int			n = 0;
+
+	for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+	{
+		IndexTuple	itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offno));
+		bool		isnull;
+		Pointer		ptr = DatumGetPointer(index_getattr(itup, 1, tupdesc, &isnull));
+		int32		bitlen;
+
+		/* Compressed values need to be decoded */
+		if (VARATT_IS_EXTENDED(ptr) && !VARATT_IS_SHORT(ptr))
+			return false;
+
+		/* Short varlena headers leave the bit length unaligned */
+		memcpy(&bitlen, VARDATA_ANY(ptr), sizeof(int32));
+		if (bitlen != VARBITLEN(query))
+			return false;
+
+		bxs[n++] = (unsigned char *) VARDATA_ANY(ptr) + sizeof(int32);
+	}
+
+	BitHammingDistanceBatch(VARBITBYTES(query), VARBITS(query), bxs, n, counts);
+
+	for (int i = 0; i < n; i++)
+		distances[i] = (double) counts[i];
+
+	return true;
+}
+
+/*
+ * Get the distances for all entries on a packed page
+ *
+ * Vectors are contiguous, so this computes the distances for the page with
+ * a single call to the batched float kernels instead of calling the distance
+ * function for each tuple
+ */
+static void
+GetPackedDistances(IvfflatScanOpaque so, Page page, int count, Datum value, double *distances)
+{
+	Vector	   *query;
+	int			dim = so->dimensions;
+	float	   *bxs[IVFFLAT_MAX_PACKED_ENTRIES];
+	float		results[IVFFLAT_MAX_PACKED_ENTRIES];
+
+	if (DatumGetPointer(value) == NULL)
+	{
+		for (int i = 0; i < count; i++)
+			distances[i] = 0.0;
+		return;
+	}
+
+	query = DatumGetVector(value);
+
+	if (query->dim != dim)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("different vector dimensions %d and %d", dim, query->dim)));
+
+	Assert(count <= IVFFLAT_MAX_PACKED_ENTRIES);
+
+	for (int i = 0; i < count; i++)
+		bxs[i] = IvfflatPackedGetVector(page, i, dim);
+
+	if (so->packedInnerProduct)
+	{
+		VectorInnerProductBatch(dim, query->x, bxs, count, results);
+
+		for (int i = 0; i < count; i++)
+			distances[i] = (double) -results[i];
+	}
+	else
+	{
+		VectorL2SquaredDistanceBatch(dim, query->x, bxs, count, results);
+
+		for (int i = 0; i < count; i++)
+			distances[i] = (double) results[i];
+	}
+}
+
+/*
+ * Compare item distances
+ */
+static int
+CompareScanItems(const void *a, const void *b)
+{
+	if (((const IvfflatScanItem *) a)->distance > ((const IvfflatScanItem *) b)->distance)
+		return 1;
+
+	if (((const IvfflatScanItem *) a)->distance < ((const IvfflatScanItem *) b)->distance)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Add an item to the bounded max-heap, keeping the closest items
+ */
+static void
+AddScanItem(IvfflatScanOpaque so, double distance, ItemPointer heaptid)
+{
+	IvfflatScanItem *items;
+	int			i;
+
+	if (so->itemsLength == so->maxResults)
+	{
+		int			length = so->itemsLength;
+
+		items = so->items;
+
+		/* Skip if not closer than the furthest item */
+		if (distance >= items[0].distance)
+			return;
+
+		/* Replace furthest item and sift down */
+		i = 0;
+		for (;;)
+		{
+			int			child = 2 * i + 1;
+
+			if (child >= length)
+				break;
+
+			if (child + 1 < length && items[child + 1].distance > items[child].distance)
+				child++;
+
+			if (items[child].distance <= distance)
+				break;
+
+			items[i] = items[child];
+			i = child;
+		}
+	}
+	else
+	{
+		/* Grow if needed */
+		if (so->itemsLength == so->itemsSize)
+		{
+			so->itemsSize = Min(so->itemsSize * 2, so->maxResults);
+			so->items = repalloc(so->items, so->itemsSize * sizeof(IvfflatScanItem));
+		}
+
+		items = so->items;
+
+		/* Add item and sift up */
+		i = so->itemsLength++;
+		while (i > 0)
+		{
+			int			parent = (i - 1) / 2;
+
+			if (items[parent].distance >= distance)
+				break;
+
+			items[i] = items[parent];
+			i = parent;
+		}
+	}
+
+	items[i].distance = distance;
+	items[i].heaptid = *heaptid;
+}
+
+/*
+ * Add an item to the bounded max-heap or sort state
+ */
+static inline void
+AddItem(IvfflatScanOpaque so, TupleTableSlot *slot, Datum distance, ItemPointer heaptid)
+{
+	/* Keep closest items without building tuples */
+	if (so->maxResults > 0)
+	{
+		AddScanItem(so, DatumGetFloat8(distance), heaptid);
+		return;
+	}
+
+	/* Add virtual tuple */
+	ExecClearTuple(slot);
+	slot->tts_values[0] = distance;
+	slot->tts_isnull[0] = false;
+	slot->tts_values[1] = PointerGetDatum(heaptid);
+	slot->tts_isnull[1] = false;
+	ExecStoreVirtualTuple(slot);
+
+	tuplesort_puttupleslot(so->sortstate, slot);
+}
+
+/*
+ * Get the next item in distance order
+ */
+static ItemPointer
+GetNextScanItem(IvfflatScanOpaque so)
+{
+	bool		isnull;
+
+	if (so->maxResults > 0)
+	{
+		if (so->itemsIndex < so->itemsLength)
+			return &so->items[so->itemsIndex++].heaptid;
+
+		return NULL;
+	}
+
+	if (tuplesort_gettupleslot(so->sortstate, true, false, so->mslot, NULL))
+		return (ItemPointer) DatumGetPointer(slot_getattr(so->mslot, 2, &isnull));
+
+	return NULL;
+}
+
+/*
+ * Re-rank the closest candidates with exact distances
+ */
+static void
+RerankScanItems(IndexScanDesc scan, Datum value)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	PGFunction	normalize = so->normprocinfo != NULL ? so->typeInfo->normalize : NULL;
+
+	if (so->rerank == 0 || DatumGetPointer(value) == NULL)
+		return;
+
+	/* Set up heap access on first use */
+	if (so->heapRerank.fetch == NULL)
+	{
+		MemoryContext oldCtx = MemoryContextSwitchTo(so->tmpCtx);
+
+		VectorRerankBegin(&so->heapRerank, scan);
+		so->rerankItems = palloc(so->rerank * sizeof(IvfflatScanItem));
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	while (so->rerankLength < so->rerank)
+	{
+		ItemPointer heaptid = GetNextScanItem(so);
+		IvfflatScanItem *item = &so->rerankItems[so->rerankLength];
+
+		if (heaptid == NULL)
+			break;
+
+		/* Tuples not visible to the snapshot would be skipped anyway */
+		if (!VectorRerankDistance(&so->heapRerank, scan, heaptid, so->procinfo, so->collation, normalize, value, &item->distance))
+			continue;
+
+		so->stats.distances++;
+
+		item->heaptid = *heaptid;
+		so->rerankLength++;
+	}
+
+	ExecClearTuple(so->heapRerank.slot);
+
+	qsort(so->rerankItems, so->rerankLength, sizeof(IvfflatScanItem), CompareScanItems);
+}
+
+/*
+ * Get shared state for a parallel scan
+ */
+static IvfflatParallelScan
+GetParallelScan(IndexScanDesc scan)
+{
+#if PG_VERSION_NUM >= 180000
+	return (IvfflatParallelScan) OffsetToPointer(scan->parallel_scan, scan->parallel_scan->ps_offset_am);
+#else
+	return (IvfflatParallelScan) OffsetToPointer(scan->parallel_scan, scan->parallel_scan->ps_offset);
+#endif
+}
+
+/*
+ * Get the next list to search
+ *
+ * Participants in a parallel scan compute the same closest lists and claim
+ * them one at a time, so each list is searched by exactly one of them.
+ * Gather Merge combines their sorted results.
+ */
+static bool
+GetNextScanList(IndexScanDesc scan, BlockNumber *searchPage, double *distance)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+
+	if (scan->parallel_scan != NULL)
+	{
+		uint32		listIndex = pg_atomic_fetch_add_u32(&GetParallelScan(scan)->nextList, 1);
+
+		if (listIndex >= (uint32) so->maxProbes)
+		{
+			so->listIndex = so->maxProbes;
+			return false;
+		}
+
+		*searchPage = so->listPages[listIndex];
+		*distance = so->listDistances[listIndex];
+		return true;
+	}
+
+	if (so->listIndex >= so->maxProbes)
+		return false;
+
+	*distance = so->listDistances[so->listIndex];
+	*searchPage = so->listPages[so->listIndex++];
+	return true;
+}
+
+/*
+ * Check if a list is too far from the furthest item to have closer items
+ *
+ * Lists are searched in order of distance, so the rest can be skipped as
+ * well. In a parallel scan, the furthest item of a participant is at least as
+ * far as the furthest of the combined results, so this is also safe to do
+ * independently in each participant.
+ */
+static inline bool
+ListTooFar(IvfflatScanOpaque so, double listDistance)
+{
+	double		furthest;
+
+	if (so->probeRatio <= 0 || so->itemsLength < so->maxResults)
+		return false;
+
+	/* Works for negative distances as well */
+	furthest = so->items[0].distance;
+	return listDistance > furthest + (so->probeRatio - 1) * fabs(furthest);
+}
+
 /*
  * Get items
  */
@@ -116,13 +483,24 @@ GetScanItems(IndexScanDesc scan, Datum value)
 	TupleDesc	tupdesc = RelationGetDescr(scan->indexRelation);
 	TupleTableSlot *slot = so->vslot;
 	int			batchProbes = 0;
+	BlockNumber searchPage;
+	double		listDistance;
+	double		pageDistances[Max(MaxIndexTuplesPerPage, IVFFLAT_MAX_PACKED_ENTRIES)];
 
-	tuplesort_reset(so->sortstate);
+	if (so->sortstate != NULL)
+		tuplesort_reset(so->sortstate);
+	so->itemsLength = 0;
+	so->itemsIndex = 0;
+	so->rerankLength = 0;
+	so->rerankIndex = 0;
 
 	/* Search closest probes lists */
-	while (so->listIndex < so->maxProbes && (++batchProbes) <= so->probes)
+	while ((++batchProbes) <= so->probes && GetNextScanList(scan, &searchPage, &listDistance))
 	{
-		BlockNumber searchPage = so->listPages[so->listIndex++];
+		if (ListTooFar(so, listDistance))
+			break;
+
+		so->stats.lists++;
 
 		/* Search all entry pages for list */
 		while (BlockNumberIsValid(searchPage))
@@ -130,36 +508,62 @@ GetScanItems(IndexScanDesc scan, Datum value)
 			Buffer		buf;
 			Page		page;
 			OffsetNumber maxoffno;
+			bool		batched;
 
 			buf = ReadBufferExtended(scan->indexRelation, MAIN_FORKNUM, searchPage, RBM_NORMAL, so->bas);
 			LockBuffer(buf, BUFFER_LOCK_SHARE);
 			page = BufferGetPage(buf);
+
+			if (IvfflatPageIsPacked(page))
+			{
+				int			count = IvfflatPackedGetCount(page);
+
+				GetPackedDistances(so, page, count, value, pageDistances);
+
+				so->stats.tuples += count;
+				so->stats.distances += count;
+
+				for (int i = 0; i < count; i++)
+					AddItem(so, slot, Float8GetDatum(pageDistances[i]), IvfflatPackedGetTid(page, i));
+
+				searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+				UnlockReleaseBuffer(buf);
+				continue;
+			}
+
 			maxoffno = PageGetMaxOffsetNumber(page);
 
+			batched = so->hammingBatch && GetPageHammingDistances(page, maxoffno, tupdesc, value, pageDistances);
+
+			so->stats.tuples += maxoffno;
+			so->stats.distances += maxoffno;
+
 			for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
 			{
 				IndexTuple	itup;
 				Datum		datum;
+				Datum		distance;
 				bool		isnull;
 				ItemId		itemid = PageGetItemId(page, offno);
 
 				itup = (IndexTuple) PageGetItem(page, itemid);
-				datum = index_getattr(itup, 1, tupdesc, &isnull);
 
 				/*
-				 * Add virtual tuple
-				 *
 				 * Use procinfo from the index instead of scan key for
 				 * performance
 				 */
-				ExecClearTuple(slot);
-				slot->tts_values[0] = so->distfunc(so->procinfo, so->collation, datum, value);
-				slot->tts_isnull[0] = false;
-				slot->tts_values[1] = PointerGetDatum(&itup->t_tid);
-				slot->tts_isnull[1] = false;
-				ExecStoreVirtualTuple(slot);
-
-				tuplesort_puttupleslot(so->sortstate, slot);
+				if (so->codebook != NULL)
+					distance = Float8GetDatum(DatumGetPointer(value) == NULL ? 0.0 : GetPqDistance(so, itup));
+				else if (batched)
+					distance = Float8GetDatum(pageDistances[offno - FirstOffsetNumber]);
+				else
+				{
+					datum = index_getattr(itup, 1, tupdesc, &isnull);
+					distance = so->distfunc(so->procinfo, so->collation, datum, value);
+				}
+
+				AddItem(so, slot, distance, &itup->t_tid);
 			}
 
 			searchPage = IvfflatPageGetOpaque(page)->nextblkno;
@@ -168,7 +572,10 @@ GetScanItems(IndexScanDesc scan, Datum value)
 		}
 	}
 
-	tuplesort_performsort(so->sortstate);
+	if (so->maxResults > 0)
+		qsort(so->items, so->itemsLength, sizeof(IvfflatScanItem), CompareScanItems);
+	else
+		tuplesort_performsort(so->sortstate);
 
 #if defined(IVFFLAT_MEMORY)
 	elog(INFO, "memory: %zu MB", MemoryContextMemAllocated(CurrentMemoryContext, true) / (1024 * 1024));
@@ -193,6 +600,8 @@ GetScanValue(IndexScanDesc scan)
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
 	Datum		value;
 
+	so->hammingBatch = false;
+
 	if (scan->orderByData->sk_flags & SK_ISNULL)
 	{
 		value = PointerGetDatum(NULL);
@@ -202,6 +611,7 @@ GetScanValue(IndexScanDesc scan)
 	{
 		value = scan->orderByData->sk_argument;
 		so->distfunc = FunctionCall2Coll;
+		so->hammingBatch = so->procinfo->fn_addr == hamming_distance;
 
 		/* Value should not be compressed or toasted */
 		Assert(!VARATT_IS_COMPRESSED(DatumGetPointer(value)));
@@ -277,6 +687,19 @@ ivfflatbeginscan(Relation index, int nkeys, int norderbys)
 	so->normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_NORM_PROC);
 	so->collation = index->rd_indcollation[0];
 
+	/* Get codebook for product quantization */
+	so->codebook = IvfflatPqGetCodebook(index, &so->subvectors);
+	so->pqInnerProduct = so->codebook != NULL && IvfflatPqUsesInnerProduct(so->procinfo);
+	so->packedInnerProduct = IvfflatPqUsesInnerProduct(so->procinfo);
+	so->rerank = so->codebook != NULL ? ivfflat_pq_rerank : 0;
+	so->rerankItems = NULL;
+	so->rerankLength = 0;
+	so->rerankIndex = 0;
+	so->heapRerank.fetch = NULL;
+
+	/* Kept across rescans */
+	MemSet(&so->stats, 0, sizeof(VectorScanStats));
+
 	so->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
 									   "Ivfflat scan temporary context",
 									   ALLOCSET_DEFAULT_SIZES);
@@ -288,8 +711,25 @@ ivfflatbeginscan(Relation index, int nkeys, int norderbys)
 	TupleDescInitEntry(so->tupdesc, (AttrNumber) 1, "distance", FLOAT8OID, -1, 0);
 	TupleDescInitEntry(so->tupdesc, (AttrNumber) 2, "heaptid", TIDOID, -1, 0);
 
-	/* Prep sort */
-	so->sortstate = InitScanSortState(so->tupdesc);
+	/* Use a bounded heap instead of sorting when iterative scans are off */
+	so->maxResults = ivfflat_iterative_scan == IVFFLAT_ITERATIVE_SCAN_OFF ? ivfflat_max_results : 0;
+	so->probeRatio = so->maxResults > 0 ? ivfflat_probe_ratio : 0;
+	so->itemsLength = 0;
+	so->itemsIndex = 0;
+	if (so->maxResults > 0)
+	{
+		so->itemsSize = Min(so->maxResults, 1024);
+		so->items = palloc(so->itemsSize * sizeof(IvfflatScanItem));
+		so->sortstate = NULL;
+	}
+	else
+	{
+		so->itemsSize = 0;
+		so->items = NULL;
+
+		/* Prep sort */
+		so->sortstate = InitScanSortState(so->tupdesc);
+	}
 
 	/* Need separate slots for puttuple and gettuple */
 	so->vslot = MakeSingleTupleTableSlot(so->tupdesc, &TTSOpsVirtual);
@@ -304,9 +744,15 @@ ivfflatbeginscan(Relation index, int nkeys, int norderbys)
 
 	so->listQueue = pairingheap_allocate(CompareLists, scan);
 	so->listPages = palloc(maxProbes * sizeof(BlockNumber));
+	so->listDistances = palloc(maxProbes * sizeof(double));
 	so->listIndex = 0;
 	so->lists = palloc(maxProbes * sizeof(IvfflatScanList));
 
+	if (so->codebook != NULL)
+		so->pqTable = palloc(so->subvectors * IVFFLAT_PQ_CENTROIDS * sizeof(float));
+	else
+		so->pqTable = NULL;
+
 	MemoryContextSwitchTo(oldCtx);
 
 	scan->opaque = so;
@@ -325,6 +771,10 @@ ivfflatrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int
 	so->first = true;
 	pairingheap_reset(so->listQueue);
 	so->listIndex = 0;
+	so->itemsLength = 0;
+	so->itemsIndex = 0;
+	so->rerankLength = 0;
+	so->rerankIndex = 0;
 
 	if (keys && scan->numberOfKeys > 0)
 		memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
@@ -341,7 +791,7 @@ ivfflatgettuple(IndexScanDesc scan, ScanDirection dir)
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
 	ItemPointer heaptid;
-	bool		isnull;
+	BufferUsage bufferUsage;
 
 	/*
 	 * Index can be used to scan backward, but Postgres doesn't support
@@ -369,22 +819,50 @@ ivfflatgettuple(IndexScanDesc scan, ScanDirection dir)
 		if (!IsMVCCSnapshot(scan->xs_snapshot))
 			elog(ERROR, "non-MVCC snapshots are not supported with ivfflat");
 
+		so->stats.scans++;
+		bufferUsage = pgBufferUsage;
+
 		value = GetScanValue(scan);
+
+		/* Build lookup table for product quantization */
+		if (so->codebook != NULL && DatumGetPointer(value) != NULL)
+			IvfflatPqComputeTable(so->codebook, so->dimensions, so->subvectors, DatumGetVector(value), so->pqInnerProduct, so->pqTable);
+
 		IvfflatBench("GetScanLists", GetScanLists(scan, value));
 		IvfflatBench("GetScanItems", GetScanItems(scan, value));
 		so->first = false;
 		so->value = value;
+
+		/* Only count index buffers, not heap buffers for re-ranking */
+		VectorScanStatsAddBufferUsage(&so->stats, &bufferUsage);
+
+		IvfflatBench("RerankScanItems", RerankScanItems(scan, value));
 	}
 
-	while (!tuplesort_gettupleslot(so->sortstate, true, false, so->mslot, NULL))
+	for (;;)
 	{
+		/* Return re-ranked items first */
+		if (so->rerankIndex < so->rerankLength)
+		{
+			heaptid = &so->rerankItems[so->rerankIndex++].heaptid;
+			break;
+		}
+
+		heaptid = GetNextScanItem(so);
+		if (heaptid != NULL)
+			break;
+
 		if (so->listIndex == so->maxProbes)
 			return false;
 
+		bufferUsage = pgBufferUsage;
 		IvfflatBench("GetScanItems", GetScanItems(scan, so->value));
-	}
 
-	heaptid = (ItemPointer) DatumGetPointer(slot_getattr(so->mslot, 2, &isnull));
+		so->stats.resumes++;
+		VectorScanStatsAddBufferUsage(&so->stats, &bufferUsage);
+
+		IvfflatBench("RerankScanItems", RerankScanItems(scan, so->value));
+	}
 
 	scan->xs_heaptid = *heaptid;
 	scan->xs_recheck = false;
@@ -392,6 +870,41 @@ ivfflatgettuple(IndexScanDesc scan, ScanDirection dir)
 	return true;
 }
 
+/*
+ * Estimate size of shared state for a parallel scan
+ */
+Size
+#if PG_VERSION_NUM >= 180000
+ivfflatestimateparallelscan(Relation indexRelation, int nkeys, int norderbys)
+#elif PG_VERSION_NUM >= 170000
+ivfflatestimateparallelscan(int nkeys, int norderbys)
+#else
+ivfflatestimateparallelscan(void)
+#endif
+{
+	return sizeof(IvfflatParallelScanData);
+}
+
+/*
+ * Initialize shared state for a parallel scan
+ */
+void
+ivfflatinitparallelscan(void *target)
+{
+	IvfflatParallelScan pscan = (IvfflatParallelScan) target;
+
+	pg_atomic_init_u32(&pscan->nextList, 0);
+}
+
+/*
+ * Reset shared state before a parallel scan is restarted
+ */
+void
+ivfflatparallelrescan(IndexScanDesc scan)
+{
+	pg_atomic_write_u32(&GetParallelScan(scan)->nextList, 0);
+}
+
 /*
  * End a scan and release resources
  */
@@ -400,8 +913,15 @@ ivfflatendscan(IndexScanDesc scan)
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
 
+	/* Add to cumulative stats */
+	VectorScanStatsFlush(VECTOR_SCAN_STATS_IVFFLAT, &so->stats);
+
 	/* Free any temporary files */
-	tuplesort_end(so->sortstate);
+	if (so->sortstate != NULL)
+		tuplesort_end(so->sortstate);
+
+	/* Release heap access for re-ranking */
+	VectorRerankEnd(&so->heapRerank);
 
 	MemoryContextDelete(so->tmpCtx);
 
@@ -9,6 +9,9 @@
 #include "ivfflat.h"
 #include "storage/bufmgr.h"
 
+PGDLLEXPORT Datum vector_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_negative_inner_product(PG_FUNCTION_ARGS);
+
 /*
  * Allocate a vector array
  */
@@ -52,6 +55,33 @@ IvfflatGetLists(Relation index)
 	return IVFFLAT_DEFAULT_LISTS;
 }
 
+/*
+ * Check if a new index should use packed entry pages
+ */
+bool
+IvfflatGetPacked(Relation index)
+{
+	IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+	FmgrInfo   *procinfo;
+
+	if (!opts || !opts->packed)
+		return false;
+
+	if (opts->quantizer != IVFFLAT_QUANTIZER_FLAT)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("packed entry pages require the flat quantizer")));
+
+	/* Distances are computed with float kernels */
+	procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
+	if (procinfo->fn_addr != vector_l2_squared_distance && procinfo->fn_addr != vector_negative_inner_product)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("packed entry pages require vector_l2_ops, vector_ip_ops, or vector_cosine_ops")));
+
+	return true;
+}
+
 /*
  * Get proc
  */
@@ -82,6 +112,29 @@ IvfflatCheckNorm(FmgrInfo *procinfo, Oid collation, Datum value)
 	return DatumGetFloat8(FunctionCall1Coll(procinfo, collation, value)) > 0;
 }
 
+/*
+ * Check if ivfflat.build_log_interval has elapsed since the last log
+ */
+bool
+IvfflatBuildLogDue(instr_time *lastLog)
+{
+	instr_time	now;
+	instr_time	duration;
+
+	if (ivfflat_build_log_interval <= 0)
+		return false;
+
+	INSTR_TIME_SET_CURRENT(now);
+	duration = now;
+	INSTR_TIME_SUBTRACT(duration, *lastLog);
+
+	if (INSTR_TIME_GET_DOUBLE(duration) < ivfflat_build_log_interval)
+		return false;
+
+	*lastLog = now;
+	return true;
+}
+
 /*
  * New buffer
  */
@@ -105,6 +158,34 @@ IvfflatInitPage(Buffer buf, Page page)
 	IvfflatPageGetOpaque(page)->page_id = IVFFLAT_PAGE_ID;
 }
 
+/*
+ * Init packed entry page
+ */
+void
+IvfflatPackedInitPage(Page page)
+{
+	IvfflatPageGetOpaque(page)->flags |= IVFFLAT_PACKED;
+	((PageHeader) page)->pd_lower = MAXALIGN(SizeOfPageHeaderData);
+}
+
+/*
+ * Add an entry to a packed page, which must have space
+ */
+void
+IvfflatPackedAddEntry(Page page, ItemPointer heaptid, Vector * vec)
+{
+	PageHeader	phdr = (PageHeader) page;
+	int			count = IvfflatPackedGetCount(page);
+
+	Assert(IvfflatPackedHasSpace(page, vec->dim));
+
+	*IvfflatPackedGetTid(page, count) = *heaptid;
+	memcpy(IvfflatPackedGetVector(page, count, vec->dim), vec->x, vec->dim * sizeof(float));
+
+	phdr->pd_lower += sizeof(ItemPointerData);
+	phdr->pd_upper -= vec->dim * sizeof(float);
+}
+
 /*
  * Init and register page
  */
@@ -143,6 +224,8 @@ IvfflatAppendPage(Relation index, Buffer *buf, Page *page, GenericXLogState **st
 
 	/* Init new page */
 	IvfflatInitPage(newbuf, newpage);
+	if (IvfflatPageIsPacked(*page))
+		IvfflatPackedInitPage(newpage);
 
 	/* Commit */
 	GenericXLogFinish(*state);
@@ -182,6 +265,31 @@ IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions)
 	UnlockReleaseBuffer(buf);
 }
 
+/*
+ * Get the product quantization info from the metapage
+ */
+void
+IvfflatGetPqMetaPageInfo(Relation index, int *subvectors, BlockNumber *codebookPage)
+{
+	Buffer		buf;
+	Page		page;
+	IvfflatMetaPage metap;
+
+	buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = IvfflatPageGetMeta(page);
+
+	if (unlikely(metap->magicNumber != IVFFLAT_MAGIC_NUMBER))
+		elog(ERROR, "ivfflat index is not valid");
+
+	/* Zero for indexes created before product quantization */
+	*subvectors = metap->subvectors;
+	*codebookPage = metap->subvectors == 0 ? InvalidBlockNumber : metap->codebookPage;
+
+	UnlockReleaseBuffer(buf);
+}
+
 /*
  * Update the start or insert page of a list
  */
@@ -306,11 +414,8 @@ static void
 HalfvecSumCenter(Pointer v, float *x)
 {
 	HalfVector *vec = (HalfVector *) v;
-	int			dim = vec->dim;
 
-	/* Auto-vectorized on aarch64 */
-	for (int i = 0; i < dim; i++)
-		x[i] += HalfToFloat4(vec->x[i]);
+	HalfvecAccumulateFloat(vec->dim, x, vec->x);
 }
 
 static void
@@ -9,6 +9,45 @@
 #define vacuum_delay_point() vacuum_delay_point(false)
 #endif
 
+/*
+ * Delete entries from a packed page, moving the remaining entries so they
+ * stay contiguous
+ */
+static int
+DeletePackedEntries(Page page, int dimensions, IndexBulkDeleteCallback callback, void *callback_state, IndexBulkDeleteResult *stats)
+{
+	PageHeader	phdr = (PageHeader) page;
+	int			count = IvfflatPackedGetCount(page);
+	Size		vectorSize = dimensions * sizeof(float);
+	int			kept = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		ItemPointer htup = IvfflatPackedGetTid(page, i);
+
+		if (callback(htup, callback_state))
+		{
+			stats->tuples_removed++;
+			continue;
+		}
+
+		stats->num_index_tuples++;
+
+		/* Entries only move to earlier positions, which were already checked */
+		if (kept != i)
+		{
+			*IvfflatPackedGetTid(page, kept) = *htup;
+			memcpy(IvfflatPackedGetVector(page, kept, dimensions), IvfflatPackedGetVector(page, i, dimensions), vectorSize);
+		}
+		kept++;
+	}
+
+	phdr->pd_lower -= (count - kept) * sizeof(ItemPointerData);
+	phdr->pd_upper += (count - kept) * vectorSize;
+
+	return count - kept;
+}
+
 /*
  * Bulk delete tuples from the index
  */
@@ -19,10 +58,14 @@ ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 	Relation	index = info->index;
 	BlockNumber blkno = IVFFLAT_HEAD_BLKNO;
 	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	int			dimensions;
 
 	if (stats == NULL)
 		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
 
+	/* Needed for packed entry pages */
+	IvfflatGetMetaPageInfo(index, NULL, &dimensions);
+
 	/* Iterate over list pages */
 	while (BlockNumberIsValid(blkno))
 	{
@@ -83,22 +126,31 @@ ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 				state = GenericXLogStart(index);
 				page = GenericXLogRegisterBuffer(state, buf, 0);
 
-				maxoffno = PageGetMaxOffsetNumber(page);
-				ndeletable = 0;
-
-				/* Find deleted tuples */
-				for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+				if (IvfflatPageIsPacked(page))
+					ndeletable = DeletePackedEntries(page, dimensions, callback, callback_state, stats);
+				else
 				{
-					IndexTuple	itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offno));
-					ItemPointer htup = &(itup->t_tid);
+					maxoffno = PageGetMaxOffsetNumber(page);
+					ndeletable = 0;
 
-					if (callback(htup, callback_state))
+					/* Find deleted tuples */
+					for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
 					{
-						deletable[ndeletable++] = offno;
-						stats->tuples_removed++;
+						IndexTuple	itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offno));
+						ItemPointer htup = &(itup->t_tid);
+
+						if (callback(htup, callback_state))
+						{
+							deletable[ndeletable++] = offno;
+							stats->tuples_removed++;
+						}
+						else
+							stats->num_index_tuples++;
 					}
-					else
-						stats->num_index_tuples++;
+
+					/* Delete tuples */
+					if (ndeletable > 0)
+						PageIndexMultiDelete(page, deletable, ndeletable);
 				}
 
 				/* Set to first free page */
@@ -109,11 +161,7 @@ ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 				searchPage = IvfflatPageGetOpaque(page)->nextblkno;
 
 				if (ndeletable > 0)
-				{
-					/* Delete tuples */
-					PageIndexMultiDelete(page, deletable, ndeletable);
 					GenericXLogFinish(state);
-				}
 				else
 					GenericXLogAbort(state);
 
@@ -0,0 +1,76 @@
+#include "postgres.h"
+
+#include "access/tableam.h"
+#include "catalog/index.h"
+#include "executor/executor.h"
+#include "rerank.h"
+
+/*
+ * Set up heap access for re-ranking in the current memory context
+ */
+void
+VectorRerankBegin(VectorRerankState * rs, IndexScanDesc scan)
+{
+	rs->indexInfo = BuildIndexInfo(scan->indexRelation);
+	rs->estate = CreateExecutorState();
+	rs->slot = table_slot_create(scan->heapRelation, NULL);
+	rs->fetch = table_index_fetch_begin(scan->heapRelation);
+}
+
+/*
+ * Get the exact distance for a heap tuple, or false if not visible
+ */
+bool
+VectorRerankDistance(VectorRerankState * rs, IndexScanDesc scan, ItemPointer heaptid, FmgrInfo *procinfo, Oid collation, PGFunction normalize, Datum value, double *distance)
+{
+	ExprContext *econtext = GetPerTupleExprContext(rs->estate);
+	bool		call_again = false;
+	bool		all_dead = false;
+	Datum		values[INDEX_MAX_KEYS];
+	bool		isnull[INDEX_MAX_KEYS];
+	Datum		datum;
+	MemoryContext oldCtx;
+
+	ResetExprContext(econtext);
+
+	if (!table_index_fetch_tuple(rs->fetch, heaptid, scan->xs_snapshot, rs->slot, &call_again, &all_dead))
+		return false;
+
+	oldCtx = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+
+	/* Compute the indexed value in case of an expression */
+	econtext->ecxt_scantuple = rs->slot;
+	FormIndexDatum(rs->indexInfo, rs->slot, rs->estate, values, isnull);
+
+	if (isnull[0])
+	{
+		MemoryContextSwitchTo(oldCtx);
+		return false;
+	}
+
+	datum = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
+
+	if (normalize != NULL)
+		datum = DirectFunctionCall1Coll(normalize, collation, datum);
+
+	*distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, datum, value));
+
+	MemoryContextSwitchTo(oldCtx);
+
+	return true;
+}
+
+/*
+ * Release heap access for re-ranking, if set up
+ */
+void
+VectorRerankEnd(VectorRerankState * rs)
+{
+	if (rs->fetch == NULL)
+		return;
+
+	table_index_fetch_end(rs->fetch);
+	ExecDropSingleTupleTableSlot(rs->slot);
+	FreeExecutorState(rs->estate);
+	rs->fetch = NULL;
+}
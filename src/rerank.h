@@ -0,0 +1,22 @@
+#ifndef RERANK_H
+#define RERANK_H
+
+#include "postgres.h"
+
+#include "access/genam.h"
+#include "nodes/execnodes.h"
+
+/* Heap access for re-ranking with exact distances */
+typedef struct VectorRerankState
+{
+	IndexInfo  *indexInfo;
+	EState	   *estate;
+	TupleTableSlot *slot;
+	struct IndexFetchTableData *fetch;
+}			VectorRerankState;
+
+void		VectorRerankBegin(VectorRerankState * rs, IndexScanDesc scan);
+bool		VectorRerankDistance(VectorRerankState * rs, IndexScanDesc scan, ItemPointer heaptid, FmgrInfo *procinfo, Oid collation, PGFunction normalize, Datum value, double *distance);
+void		VectorRerankEnd(VectorRerankState * rs);
+
+#endif
@@ -0,0 +1,264 @@
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "funcapi.h"
+#include "hnsw.h"
+#include "ivfflat.h"
+#include "nodes/execnodes.h"
+#include "scanstats.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+
+#if PG_VERSION_NUM >= 180000
+#include "commands/explain.h"
+#include "commands/explain_format.h"
+#include "commands/explain_state.h"
+#endif
+
+#define VECTOR_SCAN_STATS_COLS 11
+
+typedef struct VectorSharedScanStats
+{
+	slock_t		mutex;
+	VectorScanStats stats[VECTOR_SCAN_STATS_KINDS];
+}			VectorSharedScanStats;
+
+static const char *const scanStatsNames[VECTOR_SCAN_STATS_KINDS] = {"hnsw", "ivfflat"};
+
+static VectorSharedScanStats * sharedScanStats = NULL;
+
+#if PG_VERSION_NUM >= 180000
+static explain_per_node_hook_type prev_explain_per_node_hook = NULL;
+#endif
+
+/*
+ * Get shared stats
+ *
+ * Like the hnsw tranche IDs, this is small enough to allocate from the
+ * "slop" that PostgreSQL reserves, so the extension does not need to be
+ * preloaded.
+ */
+static VectorSharedScanStats *
+GetSharedScanStats(void)
+{
+	if (sharedScanStats == NULL)
+	{
+		VectorSharedScanStats *shared;
+		bool		found;
+
+		LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+		shared = ShmemInitStruct("vector scan stats", sizeof(VectorSharedScanStats), &found);
+		if (!found)
+		{
+			SpinLockInit(&shared->mutex);
+			memset(shared->stats, 0, sizeof(shared->stats));
+		}
+		LWLockRelease(AddinShmemInitLock);
+
+		sharedScanStats = shared;
+	}
+
+	return sharedScanStats;
+}
+
+/*
+ * Add counters from b to a
+ */
+static void
+AddScanStats(VectorScanStats * a, const VectorScanStats * b)
+{
+	a->scans += b->scans;
+	a->distances += b->distances;
+	a->upperHops += b->upperHops;
+	a->layer0Hops += b->layer0Hops;
+	a->lists += b->lists;
+	a->tuples += b->tuples;
+	a->resumes += b->resumes;
+	a->discarded += b->discarded;
+	a->buffersHit += b->buffersHit;
+	a->buffersRead += b->buffersRead;
+}
+
+/*
+ * Add counters for a scan to shared stats
+ */
+void
+VectorScanStatsFlush(VectorScanStatsKind kind, VectorScanStats * stats)
+{
+	VectorSharedScanStats *shared;
+
+	if (stats->scans == 0)
+		return;
+
+	shared = GetSharedScanStats();
+
+	SpinLockAcquire(&shared->mutex);
+	AddScanStats(&shared->stats[kind], stats);
+	SpinLockRelease(&shared->mutex);
+}
+
+#if PG_VERSION_NUM >= 180000
+/*
+ * Get the stats for an in-progress scan, or NULL if not a vector index
+ */
+static VectorScanStats *
+GetScanStats(IndexScanDesc scan, VectorScanStatsKind * kind)
+{
+	if (scan == NULL || scan->opaque == NULL)
+		return NULL;
+
+	if (scan->indexRelation->rd_indam->amgettuple == hnswgettuple)
+	{
+		*kind = VECTOR_SCAN_STATS_HNSW;
+		return &((HnswScanOpaque) scan->opaque)->stats;
+	}
+
+	if (scan->indexRelation->rd_indam->amgettuple == ivfflatgettuple)
+	{
+		*kind = VECTOR_SCAN_STATS_IVFFLAT;
+		return &((IvfflatScanOpaque) scan->opaque)->stats;
+	}
+
+	return NULL;
+}
+
+/*
+ * Show scan stats for EXPLAIN ANALYZE
+ */
+static void
+VectorExplainPerNode(PlanState *planstate, List *ancestors, const char *relationship, const char *plan_name, ExplainState *es)
+{
+	VectorScanStats *stats;
+	VectorScanStatsKind kind;
+
+	if (prev_explain_per_node_hook)
+		prev_explain_per_node_hook(planstate, ancestors, relationship, plan_name, es);
+
+	if (!es->analyze || !IsA(planstate, IndexScanState))
+		return;
+
+	stats = GetScanStats(((IndexScanState *) planstate)->iss_ScanDesc, &kind);
+	if (stats == NULL)
+		return;
+
+	ExplainPropertyInteger("Distances", NULL, stats->distances, es);
+	if (kind == VECTOR_SCAN_STATS_HNSW)
+	{
+		ExplainPropertyInteger("Upper Layer Hops", NULL, stats->upperHops, es);
+		ExplainPropertyInteger("Layer 0 Hops", NULL, stats->layer0Hops, es);
+		ExplainPropertyInteger("Discarded", NULL, stats->discarded, es);
+	}
+	else
+	{
+		ExplainPropertyInteger("Lists Probed", NULL, stats->lists, es);
+		ExplainPropertyInteger("Tuples Scanned", NULL, stats->tuples, es);
+	}
+	ExplainPropertyInteger("Iterative Resumes", NULL, stats->resumes, es);
+	ExplainPropertyInteger("Index Buffers Hit", NULL, stats->buffersHit, es);
+	ExplainPropertyInteger("Index Buffers Read", NULL, stats->buffersRead, es);
+}
+#endif
+
+/*
+ * Initialize scan stats
+ */
+void
+VectorScanStatsInit(void)
+{
+#if PG_VERSION_NUM >= 180000
+	prev_explain_per_node_hook = explain_per_node_hook;
+	explain_per_node_hook = VectorExplainPerNode;
+#endif
+}
+
+/*
+ * Get cumulative scan stats
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(pg_stat_vector_scans);
+Datum
+pg_stat_vector_scans(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldCtx;
+		TupleDesc	tupdesc;
+		VectorScanStats *stats;
+		VectorSharedScanStats *shared = GetSharedScanStats();
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldCtx = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+		funcctx->max_calls = VECTOR_SCAN_STATS_KINDS;
+
+		/* Copy so rows are consistent */
+		stats = palloc(sizeof(shared->stats));
+		SpinLockAcquire(&shared->mutex);
+		memcpy(stats, shared->stats, sizeof(shared->stats));
+		SpinLockRelease(&shared->mutex);
+		funcctx->user_fctx = stats;
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		int			i = funcctx->call_cntr;
+		VectorScanStats *stats = &((VectorScanStats *) funcctx->user_fctx)[i];
+		Datum		values[VECTOR_SCAN_STATS_COLS];
+		bool		nulls[VECTOR_SCAN_STATS_COLS] = {0};
+		bool		hnsw = i == VECTOR_SCAN_STATS_HNSW;
+		int			j = 0;
+
+		values[j++] = CStringGetTextDatum(scanStatsNames[i]);
+		values[j++] = Int64GetDatum(stats->scans);
+		values[j++] = Int64GetDatum(stats->distances);
+
+		/* Use null for counters that do not apply */
+		nulls[j] = !hnsw;
+		values[j++] = Int64GetDatum(stats->upperHops);
+		nulls[j] = !hnsw;
+		values[j++] = Int64GetDatum(stats->layer0Hops);
+		nulls[j] = hnsw;
+		values[j++] = Int64GetDatum(stats->lists);
+		nulls[j] = hnsw;
+		values[j++] = Int64GetDatum(stats->tuples);
+
+		values[j++] = Int64GetDatum(stats->resumes);
+		nulls[j] = !hnsw;
+		values[j++] = Int64GetDatum(stats->discarded);
+		values[j++] = Int64GetDatum(stats->buffersHit);
+		values[j++] = Int64GetDatum(stats->buffersRead);
+
+		Assert(j == VECTOR_SCAN_STATS_COLS);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Reset cumulative scan stats
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(pg_stat_vector_scans_reset);
+Datum
+pg_stat_vector_scans_reset(PG_FUNCTION_ARGS)
+{
+	VectorSharedScanStats *shared = GetSharedScanStats();
+
+	SpinLockAcquire(&shared->mutex);
+	memset(shared->stats, 0, sizeof(shared->stats));
+	SpinLockRelease(&shared->mutex);
+
+	PG_RETURN_VOID();
+}
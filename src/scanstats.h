@@ -0,0 +1,44 @@
+#ifndef SCANSTATS_H
+#define SCANSTATS_H
+
+#include "postgres.h"
+
+#include "executor/instrument.h"
+
+/* Index types with cumulative scan stats */
+typedef enum VectorScanStatsKind
+{
+	VECTOR_SCAN_STATS_HNSW,
+	VECTOR_SCAN_STATS_IVFFLAT,
+	VECTOR_SCAN_STATS_KINDS
+}			VectorScanStatsKind;
+
+/* Counters are kept across rescans and added to shared stats on end */
+typedef struct VectorScanStats
+{
+	int64		scans;			/* searches, including rescans */
+	int64		distances;		/* distance calculations */
+	int64		upperHops;		/* hnsw candidates expanded above layer 0 */
+	int64		layer0Hops;		/* hnsw candidates expanded on layer 0 */
+	int64		lists;			/* ivfflat lists probed */
+	int64		tuples;			/* ivfflat tuples scanned */
+	int64		resumes;		/* iterative scan resumes */
+	int64		discarded;		/* candidates kept for iterative scans */
+	int64		buffersHit;		/* index pages only, not heap re-ranking */
+	int64		buffersRead;
+}			VectorScanStats;
+
+void		VectorScanStatsInit(void);
+void		VectorScanStatsFlush(VectorScanStatsKind kind, VectorScanStats * stats);
+
+/*
+ * Count buffer accesses since start
+ */
+static inline void
+VectorScanStatsAddBufferUsage(VectorScanStats * stats, const BufferUsage *start)
+{
+	stats->buffersHit += pgBufferUsage.shared_blks_hit - start->shared_blks_hit;
+	stats->buffersRead += pgBufferUsage.shared_blks_read - start->shared_blks_read;
+}
+
+#endif
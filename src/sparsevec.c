@@ -11,11 +11,13 @@
 #include "halfvec.h"
 #include "libpq/pqformat.h"
 #include "sparsevec.h"
+#include "sparsevecutils.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/float.h"
 #include "utils/lsyscache.h"
 #include "vector.h"
+#include "vectorutils.h"
 
 typedef struct SparseInputElement
 {
@@ -285,9 +287,9 @@ sparsevec_in(PG_FUNCTION_ARGS)
 
 			errno = 0;
 
-			/* Use strtof like float4in to avoid a double-rounding problem */
+			/* Parse like strtof in float4in to avoid a double-rounding problem */
 			/* Postgres sets LC_NUMERIC to C on startup */
-			value = strtof(pt, &stringEnd);
+			value = VectorStrtof(pt, &stringEnd);
 
 			if (stringEnd == pt)
 				ereport(ERROR,
@@ -517,18 +519,25 @@ sparsevec_recv(PG_FUNCTION_ARGS)
 	result = InitSparseVector(dim, nnz);
 	values = SPARSEVEC_VALUES(result);
 
+	/* Copy and convert all indices and values at once */
+	pq_copymsgbytes(buf, (char *) result->indices, nnz * sizeof(int32));
+	VectorNetworkToHost32(nnz, (uint32 *) result->indices);
+	pq_copymsgbytes(buf, (char *) values, nnz * sizeof(float));
+	VectorNetworkToHost32(nnz, (uint32 *) values);
+
 	/* Binary representation uses zero-based numbering for indices */
 	for (int i = 0; i < nnz; i++)
-	{
-		result->indices[i] = pq_getmsgint(buf, sizeof(int32));
 		CheckIndex(result->indices, i, dim);
+
+	/* Find the element for the error if needed */
+	if (!VectorAllFinite(nnz, values))
+	{
+		for (int i = 0; i < nnz; i++)
+			CheckElement(values[i]);
 	}
 
 	for (int i = 0; i < nnz; i++)
 	{
-		values[i] = pq_getmsgfloat4(buf);
-		CheckElement(values[i]);
-
 		if (values[i] == 0)
 			ereport(ERROR,
 					(errcode(ERRCODE_DATA_EXCEPTION),
@@ -800,47 +809,45 @@ array_to_sparsevec(PG_FUNCTION_ARGS)
 /*
  * Get the L2 squared distance between sparse vectors
  */
-static float
+float
 SparsevecL2SquaredDistance(SparseVector * a, SparseVector * b)
 {
 	float	   *ax = SPARSEVEC_VALUES(a);
 	float	   *bx = SPARSEVEC_VALUES(b);
 	float		distance = 0.0;
+	int			apos = 0;
 	int			bpos = 0;
+	int			n;
+	SparsevecIntersectState state;
 
-	for (int i = 0; i < a->nnz; i++)
-	{
-		int			ai = a->indices[i];
-		int			bi = -1;
+	SparsevecIntersectInit(&state, a->indices, a->nnz, b->indices, b->nnz);
 
-		for (int j = bpos; j < b->nnz; j++)
+	while ((n = SparsevecIntersectNext(&state)) > 0)
+	{
+		for (int k = 0; k < n; k++)
 		{
-			bi = b->indices[j];
+			int			i = state.apos[k];
+			int			j = state.bpos[k];
+			float		diff = ax[i] - bx[j];
 
-			if (ai == bi)
-			{
-				float		diff = ax[i] - bx[j];
+			/* Elements before the match are only in one vector */
+			for (; apos < i; apos++)
+				distance += ax[apos] * ax[apos];
 
-				distance += diff * diff;
-			}
-			else if (ai > bi)
-				distance += bx[j] * bx[j];
-
-			/* Update start for next iteration */
-			if (ai >= bi)
-				bpos = j + 1;
+			for (; bpos < j; bpos++)
+				distance += bx[bpos] * bx[bpos];
 
-			/* Found or passed it */
-			if (bi >= ai)
-				break;
+			distance += diff * diff;
+			apos = i + 1;
+			bpos = j + 1;
 		}
-
-		if (ai != bi)
-			distance += ax[i] * ax[i];
 	}
 
-	for (int j = bpos; j < b->nnz; j++)
-		distance += bx[j] * bx[j];
+	for (; apos < a->nnz; apos++)
+		distance += ax[apos] * ax[apos];
+
+	for (; bpos < b->nnz; bpos++)
+		distance += bx[bpos] * bx[bpos];
 
 	return distance;
 }
@@ -879,34 +886,22 @@ sparsevec_l2_squared_distance(PG_FUNCTION_ARGS)
 /*
  * Get the inner product of two sparse vectors
  */
-static float
+float
 SparsevecInnerProduct(SparseVector * a, SparseVector * b)
 {
 	float	   *ax = SPARSEVEC_VALUES(a);
 	float	   *bx = SPARSEVEC_VALUES(b);
 	float		distance = 0.0;
-	int			bpos = 0;
-
-	for (int i = 0; i < a->nnz; i++)
-	{
-		int			ai = a->indices[i];
-
-		for (int j = bpos; j < b->nnz; j++)
-		{
-			int			bi = b->indices[j];
-
-			/* Only update when the same index */
-			if (ai == bi)
-				distance += ax[i] * bx[j];
+	int			n;
+	SparsevecIntersectState state;
 
-			/* Update start for next iteration */
-			if (ai >= bi)
-				bpos = j + 1;
+	SparsevecIntersectInit(&state, a->indices, a->nnz, b->indices, b->nnz);
 
-			/* Found or passed it */
-			if (bi >= ai)
-				break;
-		}
+	/* Only update when the same index */
+	while ((n = SparsevecIntersectNext(&state)) > 0)
+	{
+		for (int k = 0; k < n; k++)
+			distance += ax[state.apos[k]] * bx[state.bpos[k]];
 	}
 
 	return distance;
@@ -990,50 +985,61 @@ sparsevec_cosine_distance(PG_FUNCTION_ARGS)
 /*
  * Get the L1 distance between two sparse vectors
  */
-FUNCTION_PREFIX PG_FUNCTION_INFO_V1(sparsevec_l1_distance);
-Datum
-sparsevec_l1_distance(PG_FUNCTION_ARGS)
+float
+SparsevecL1Distance(SparseVector * a, SparseVector * b)
 {
-	SparseVector *a = PG_GETARG_SPARSEVEC_P(0);
-	SparseVector *b = PG_GETARG_SPARSEVEC_P(1);
 	float	   *ax = SPARSEVEC_VALUES(a);
 	float	   *bx = SPARSEVEC_VALUES(b);
 	float		distance = 0.0;
+	int			apos = 0;
 	int			bpos = 0;
+	int			n;
+	SparsevecIntersectState state;
 
-	CheckDims(a, b);
+	SparsevecIntersectInit(&state, a->indices, a->nnz, b->indices, b->nnz);
 
-	for (int i = 0; i < a->nnz; i++)
+	while ((n = SparsevecIntersectNext(&state)) > 0)
 	{
-		int			ai = a->indices[i];
-		int			bi = -1;
-
-		for (int j = bpos; j < b->nnz; j++)
+		for (int k = 0; k < n; k++)
 		{
-			bi = b->indices[j];
+			int			i = state.apos[k];
+			int			j = state.bpos[k];
 
-			if (ai == bi)
-				distance += fabsf(ax[i] - bx[j]);
-			else if (ai > bi)
-				distance += fabsf(bx[j]);
+			/* Elements before the match are only in one vector */
+			for (; apos < i; apos++)
+				distance += fabsf(ax[apos]);
 
-			/* Update start for next iteration */
-			if (ai >= bi)
-				bpos = j + 1;
+			for (; bpos < j; bpos++)
+				distance += fabsf(bx[bpos]);
 
-			/* Found or passed it */
-			if (bi >= ai)
-				break;
+			distance += fabsf(ax[i] - bx[j]);
+			apos = i + 1;
+			bpos = j + 1;
 		}
-
-		if (ai != bi)
-			distance += fabsf(ax[i]);
 	}
 
-	for (int j = bpos; j < b->nnz; j++)
-		distance += fabsf(bx[j]);
+	for (; apos < a->nnz; apos++)
+		distance += fabsf(ax[apos]);
+
+	for (; bpos < b->nnz; bpos++)
+		distance += fabsf(bx[bpos]);
+
+	return distance;
+}
+
+/*
+ * Get the L1 distance between two sparse vectors
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(sparsevec_l1_distance);
+Datum
+sparsevec_l1_distance(PG_FUNCTION_ARGS)
+{
+	SparseVector *a = PG_GETARG_SPARSEVEC_P(0);
+	SparseVector *b = PG_GETARG_SPARSEVEC_P(1);
+
+	CheckDims(a, b);
 
-	PG_RETURN_FLOAT8((double) distance);
+	PG_RETURN_FLOAT8((double) SparsevecL1Distance(a, b));
 }
 
 /*
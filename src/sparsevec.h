@@ -36,5 +36,8 @@ SPARSEVEC_VALUES(SparseVector * x)
 }
 
 SparseVector *InitSparseVector(int dim, int nnz);
+float		SparsevecL2SquaredDistance(SparseVector * a, SparseVector * b);
+float		SparsevecInnerProduct(SparseVector * a, SparseVector * b);
+float		SparsevecL1Distance(SparseVector * a, SparseVector * b);
 
 #endif
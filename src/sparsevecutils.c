@@ -0,0 +1,271 @@
+#include "postgres.h"
+
+#include "halfvec.h"			/* for USE_DISPATCH */
+#include "port/pg_bitutils.h"
+#include "sparsevecutils.h"
+
+#if defined(USE_DISPATCH)
+#define SPARSEVEC_DISPATCH
+#endif
+
+#ifdef SPARSEVEC_DISPATCH
+#include <immintrin.h>
+
+#if defined(USE__GET_CPUID)
+#include <cpuid.h>
+#else
+#include <intrin.h>
+#endif
+
+#ifdef _MSC_VER
+#define TARGET_AVX2
+#define TARGET_AVX512
+#define TARGET_XSAVE
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#define TARGET_XSAVE __attribute__((target("xsave")))
+#endif
+#endif
+
+int			(*SparsevecIntersectMerge) (SparsevecIntersectState * state);
+
+/*
+ * Merge the remaining indices one at a time
+ */
+static inline int
+SparsevecIntersectMergeScalar(SparsevecIntersectState * state, int i, int j, int n)
+{
+	const int32 *ai = state->ai;
+	const int32 *bi = state->bi;
+
+	while (i < state->an && j < state->bn && n < SPARSEVEC_INTERSECT_BATCH)
+	{
+		int32		x = ai[i];
+		int32		y = bi[j];
+
+		/* Branchless to avoid mispredictions */
+		state->apos[n] = i;
+		state->bpos[n] = j;
+		n += (x == y);
+		i += (x <= y);
+		j += (y <= x);
+	}
+
+	state->i = i;
+	state->j = j;
+	return n;
+}
+
+static int
+SparsevecIntersectMergeDefault(SparsevecIntersectState * state)
+{
+	return SparsevecIntersectMergeScalar(state, state->i, state->j, 0);
+}
+
+#ifdef SPARSEVEC_DISPATCH
+TARGET_AVX2 static int
+SparsevecIntersectMergeAvx2(SparsevecIntersectState * state)
+{
+	const int32 *ai = state->ai;
+	const int32 *bi = state->bi;
+	int			i = state->i;
+	int			j = state->j;
+	int			n = 0;
+
+	/* Compare blocks of 8 indices */
+	while (i + 8 <= state->an && j + 8 <= state->bn && n + 8 <= SPARSEVEC_INTERSECT_BATCH)
+	{
+		int32		amax = ai[i + 7];
+		int32		bmax = bi[j + 7];
+
+		/* Skip comparisons when blocks do not overlap */
+		if (amax >= bi[j] && bmax >= ai[i])
+		{
+			__m256i		va = _mm256_loadu_si256((const __m256i *) (ai + i));
+
+			for (int k = 0; k < 8; k++)
+			{
+				__m256i		eq = _mm256_cmpeq_epi32(va, _mm256_set1_epi32(bi[j + k]));
+				uint32		mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+
+				if (mask != 0)
+				{
+					state->apos[n] = i + pg_rightmost_one_pos32(mask);
+					state->bpos[n] = j + k;
+					n++;
+				}
+			}
+		}
+
+		i += amax <= bmax ? 8 : 0;
+		j += bmax <= amax ? 8 : 0;
+	}
+
+	return SparsevecIntersectMergeScalar(state, i, j, n);
+}
+
+TARGET_AVX512 static int
+SparsevecIntersectMergeAvx512(SparsevecIntersectState * state)
+{
+	const int32 *ai = state->ai;
+	const int32 *bi = state->bi;
+	int			i = state->i;
+	int			j = state->j;
+	int			n = 0;
+
+	/* Compare blocks of 16 indices */
+	while (i + 16 <= state->an && j + 16 <= state->bn && n + 16 <= SPARSEVEC_INTERSECT_BATCH)
+	{
+		int32		amax = ai[i + 15];
+		int32		bmax = bi[j + 15];
+
+		/* Skip comparisons when blocks do not overlap */
+		if (amax >= bi[j] && bmax >= ai[i])
+		{
+			__m512i		va = _mm512_loadu_si512((const void *) (ai + i));
+
+			for (int k = 0; k < 16; k++)
+			{
+				uint32		mask = _mm512_cmpeq_epi32_mask(va, _mm512_set1_epi32(bi[j + k]));
+
+				if (mask != 0)
+				{
+					state->apos[n] = i + pg_rightmost_one_pos32(mask);
+					state->bpos[n] = j + k;
+					n++;
+				}
+			}
+		}
+
+		i += amax <= bmax ? 16 : 0;
+		j += bmax <= amax ? 16 : 0;
+	}
+
+	return SparsevecIntersectMergeScalar(state, i, j, n);
+}
+#endif
+
+/*
+ * Find matches by searching the longer vector for each index of the shorter
+ * one, which is faster when the number of elements is lopsided
+ */
+int
+SparsevecIntersectGallop(SparsevecIntersectState * state)
+{
+	bool		swap = state->an > state->bn;
+	const int32 *s = swap ? state->bi : state->ai;
+	const int32 *l = swap ? state->ai : state->bi;
+	int			sn = swap ? state->bn : state->an;
+	int			ln = swap ? state->an : state->bn;
+	int			si = swap ? state->j : state->i;
+	int			li = swap ? state->i : state->j;
+	int		   *spos = swap ? state->bpos : state->apos;
+	int		   *lpos = swap ? state->apos : state->bpos;
+	int			n = 0;
+
+	while (si < sn && li < ln && n < SPARSEVEC_INTERSECT_BATCH)
+	{
+		int32		x = s[si];
+		int			bound = 1;
+		int			lo;
+		int			hi;
+
+		/* Find range containing the first index >= x */
+		while (li + bound < ln && l[li + bound] < x)
+			bound <<= 1;
+
+		lo = li + (bound >> 1);
+		hi = Min(li + bound, ln);
+
+		/* Binary search within range */
+		while (lo < hi)
+		{
+			int			mid = lo + (hi - lo) / 2;
+
+			if (l[mid] < x)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		li = lo;
+		if (li < ln && l[li] == x)
+		{
+			spos[n] = si;
+			lpos[n] = li;
+			n++;
+			li++;
+		}
+		si++;
+	}
+
+	state->i = swap ? li : si;
+	state->j = swap ? si : li;
+	return n;
+}
+
+#ifdef SPARSEVEC_DISPATCH
+#define CPU_FEATURE_OSXSAVE (1 << 27)	/* F1 ECX */
+#define CPU_FEATURE_AVX     (1 << 28)	/* F1 ECX */
+#define CPU_FEATURE_AVX2    (1 << 5)	/* F7,0 EBX */
+#define CPU_FEATURE_AVX512F (1 << 16)	/* F7,0 EBX */
+
+/*
+ * Check for AVX2, and optionally AVX-512F
+ */
+TARGET_XSAVE static bool
+SupportsAvx(bool avx512)
+{
+	unsigned int exx[4] = {0, 0, 0, 0};
+	unsigned int feature;
+
+#if defined(USE__GET_CPUID)
+	__get_cpuid(1, &exx[0], &exx[1], &exx[2], &exx[3]);
+#else
+	__cpuid(exx, 1);
+#endif
+
+	/* Check OS supports XSAVE */
+	if ((exx[2] & CPU_FEATURE_OSXSAVE) != CPU_FEATURE_OSXSAVE)
+		return false;
+
+	/* Check AVX */
+	if ((exx[2] & CPU_FEATURE_AVX) != CPU_FEATURE_AVX)
+		return false;
+
+	/* Check XMM and YMM registers (and ZMM registers) are enabled */
+	if (avx512)
+	{
+		if ((_xgetbv(0) & 0xe6) != 0xe6)
+			return false;
+	}
+	else
+	{
+		if ((_xgetbv(0) & 6) != 6)
+			return false;
+	}
+
+#if defined(USE__GET_CPUID)
+	__get_cpuid_count(7, 0, &exx[0], &exx[1], &exx[2], &exx[3]);
+#else
+	__cpuidex(exx, 7, 0);
+#endif
+
+	feature = avx512 ? CPU_FEATURE_AVX2 | CPU_FEATURE_AVX512F : CPU_FEATURE_AVX2;
+	return (exx[1] & feature) == feature;
+}
+#endif
+
+void
+SparsevecInit(void)
+{
+	SparsevecIntersectMerge = SparsevecIntersectMergeDefault;
+
+#ifdef SPARSEVEC_DISPATCH
+	if (SupportsAvx(true))
+		SparsevecIntersectMerge = SparsevecIntersectMergeAvx512;
+	else if (SupportsAvx(false))
+		SparsevecIntersectMerge = SparsevecIntersectMergeAvx2;
+#endif
+}
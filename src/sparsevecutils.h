@@ -0,0 +1,56 @@
+#ifndef SPARSEVECUTILS_H
+#define SPARSEVECUTILS_H
+
+#define SPARSEVEC_INTERSECT_BATCH	64
+
+/* Use galloping when one vector has this many times more elements */
+#define SPARSEVEC_GALLOP_RATIO	32
+
+typedef struct SparsevecIntersectState
+{
+	const int32 *ai;
+	const int32 *bi;
+	int			an;
+	int			bn;
+	int			i;
+	int			j;
+	bool		gallop;
+	int			apos[SPARSEVEC_INTERSECT_BATCH];
+	int			bpos[SPARSEVEC_INTERSECT_BATCH];
+}			SparsevecIntersectState;
+
+extern int	(*SparsevecIntersectMerge) (SparsevecIntersectState * state);
+
+int			SparsevecIntersectGallop(SparsevecIntersectState * state);
+void		SparsevecInit(void);
+
+/*
+ * Start finding the positions of indices in both sparse vectors
+ */
+static inline void
+SparsevecIntersectInit(SparsevecIntersectState * state, const int32 *ai, int an, const int32 *bi, int bn)
+{
+	state->ai = ai;
+	state->bi = bi;
+	state->an = an;
+	state->bn = bn;
+	state->i = 0;
+	state->j = 0;
+	state->gallop = (int64) an * SPARSEVEC_GALLOP_RATIO < bn || (int64) bn * SPARSEVEC_GALLOP_RATIO < an;
+}
+
+/*
+ * Get the next batch of matching positions in increasing order
+ *
+ * Returns zero when there are no more matches
+ */
+static inline int
+SparsevecIntersectNext(SparsevecIntersectState * state)
+{
+	if (state->gallop)
+		return SparsevecIntersectGallop(state);
+
+	return SparsevecIntersectMerge(state);
+}
+
+#endif
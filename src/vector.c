@@ -2,7 +2,7 @@
 
 #include <math.h>
 
-#include "../src_cpp/bitutils_c.h"
+#include "bitutils.h"
 #include "bitvec.h"
 #include "catalog/pg_type.h"
 #include "common/shortest_dec.h"
@@ -10,17 +10,20 @@
 #include "halfutils.h"
 #include "halfvec.h"
 #include "hnsw.h"
+#include "inverted.h"
 #include "ivfflat.h"
 #include "lib/stringinfo.h"
 #include "libpq/pqformat.h"
-#include "port.h"				/* for strtof() */
+#include "scanstats.h"
 #include "sparsevec.h"
+#include "sparsevecutils.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/float.h"
 #include "utils/lsyscache.h"
 #include "utils/numeric.h"
 #include "vector.h"
+#include "vectorutils.h"
 
 #if PG_VERSION_NUM >= 160000
 #include "varatt.h"
@@ -29,14 +32,8 @@
 #define STATE_DIMS(x) (ARR_DIMS(x)[0] - 1)
 #define CreateStateDatums(dim) palloc(sizeof(Datum) * (dim + 1))
 
-#if defined(USE_TARGET_CLONES) && !defined(__FMA__)
-#define VECTOR_TARGET_CLONES __attribute__((target_clones("default", "fma")))
-#else
-#define VECTOR_TARGET_CLONES
-#endif
-
 #if PG_VERSION_NUM >= 180000
-PG_MODULE_MAGIC_EXT(.name = "vector",.version = "0.8.1");
+PG_MODULE_MAGIC_EXT(.name = "vector",.version = "0.8.2");
 #else
 PG_MODULE_MAGIC;
 #endif
@@ -50,8 +47,12 @@ _PG_init(void)
 {
 	BitvecInit();
 	HalfvecInit();
+	SparsevecInit();
+	VectorInit();
 	HnswInit();
 	IvfflatInit();
+	InvertedInit();
+	VectorScanStatsInit();
 }
 
 /*
@@ -213,9 +214,9 @@ vector_in(PG_FUNCTION_ARGS)
 
 		errno = 0;
 
-		/* Use strtof like float4in to avoid a double-rounding problem */
+		/* Parse like strtof in float4in to avoid a double-rounding problem */
 		/* Postgres sets LC_NUMERIC to C on startup */
-		val = strtof(pt, &stringEnd);
+		val = VectorStrtof(pt, &stringEnd);
 
 		if (stringEnd == pt)
 			ereport(ERROR,
@@ -382,10 +383,16 @@ vector_recv(PG_FUNCTION_ARGS)
 				 errmsg("expected unused to be 0, not %d", unused)));
 
 	result = InitVector(dim);
-	for (int i = 0; i < dim; i++)
+
+	/* Copy and convert all elements at once */
+	pq_copymsgbytes(buf, (char *) result->x, dim * sizeof(float));
+	VectorNetworkToHost32(dim, (uint32 *) result->x);
+
+	/* Find the element for the error if needed */
+	if (!VectorAllFinite(dim, result->x))
 	{
-		result->x[i] = pq_getmsgfloat4(buf);
-		CheckElement(result->x[i]);
+		for (int i = 0; i < dim; i++)
+			CheckElement(result->x[i]);
 	}
 
 	PG_RETURN_POINTER(result);
@@ -540,28 +547,11 @@ halfvec_to_vector(PG_FUNCTION_ARGS)
 
 	result = InitVector(vec->dim);
 
-	for (int i = 0; i < vec->dim; i++)
-		result->x[i] = HalfToFloat4(vec->x[i]);
+	HalfToFloat4Array(vec->dim, vec->x, result->x);
 
 	PG_RETURN_POINTER(result);
 }
 
-VECTOR_TARGET_CLONES static float
-VectorL2SquaredDistance(int dim, float *ax, float *bx)
-{
-	float		distance = 0.0;
-
-	/* Auto-vectorized */
-	for (int i = 0; i < dim; i++)
-	{
-		float		diff = ax[i] - bx[i];
-
-		distance += diff * diff;
-	}
-
-	return distance;
-}
-
 /*
  * Get the L2 distance between vectors
  */
@@ -593,18 +583,6 @@ vector_l2_squared_distance(PG_FUNCTION_ARGS)
 	PG_RETURN_FLOAT8((double) VectorL2SquaredDistance(a->dim, a->x, b->x));
 }
 
-VECTOR_TARGET_CLONES static float
-VectorInnerProduct(int dim, float *ax, float *bx)
-{
-	float		distance = 0.0;
-
-	/* Auto-vectorized */
-	for (int i = 0; i < dim; i++)
-		distance += ax[i] * bx[i];
-
-	return distance;
-}
-
 /*
  * Get the inner product of two vectors
  */
@@ -635,25 +613,6 @@ vector_negative_inner_product(PG_FUNCTION_ARGS)
 	PG_RETURN_FLOAT8((double) -VectorInnerProduct(a->dim, a->x, b->x));
 }
 
-VECTOR_TARGET_CLONES static double
-VectorCosineSimilarity(int dim, float *ax, float *bx)
-{
-	float		similarity = 0.0;
-	float		norma = 0.0;
-	float		normb = 0.0;
-
-	/* Auto-vectorized */
-	for (int i = 0; i < dim; i++)
-	{
-		similarity += ax[i] * bx[i];
-		norma += ax[i] * ax[i];
-		normb += bx[i] * bx[i];
-	}
-
-	/* Use sqrt(a * b) over sqrt(a) * sqrt(b) */
-	return (double) similarity / sqrt((double) norma * (double) normb);
-}
-
 /*
  * Get the cosine distance between two vectors
  */
@@ -710,19 +669,6 @@ vector_spherical_distance(PG_FUNCTION_ARGS)
 	PG_RETURN_FLOAT8(acos(distance) / M_PI);
 }
 
-/* Does not require FMA, but keep logic simple */
-VECTOR_TARGET_CLONES static float
-VectorL1Distance(int dim, float *ax, float *bx)
-{
-	float		distance = 0.0;
-
-	/* Auto-vectorized */
-	for (int i = 0; i < dim; i++)
-		distance += fabsf(ax[i] - bx[i]);
-
-	return distance;
-}
-
 /*
  * Get the L1 distance between two vectors
  */
@@ -1160,6 +1106,18 @@ vector_accum(PG_FUNCTION_ARGS)
 
 	n = statevalues[0] + 1.0;
 
+	/*
+	 * If called as an aggregate, update the state in place like float8_accum
+	 * instead of building a new array for each row. Sums of finite floats
+	 * cannot overflow a double for any realistic number of rows.
+	 */
+	if (!newarr && AggCheckCallContext(fcinfo, NULL))
+	{
+		statevalues[0] = n;
+		VectorAccumulate(dim, statevalues + 1, x);
+		PG_RETURN_ARRAYTYPE_P(statearray);
+	}
+
 	statedatums = CreateStateDatums(dim);
 	statedatums[0] = Float8GetDatum(n);
 
@@ -0,0 +1,1528 @@
+#include "postgres.h"
+
+#include <float.h>
+#include <math.h>
+
+#include "halfvec.h"			/* for USE_DISPATCH and USE_TARGET_CLONES */
+#include "port.h"				/* for strtof() */
+#include "port/pg_bswap.h"
+#include "vectorutils.h"
+
+#if defined(USE_DISPATCH)
+#define VECTOR_DISPATCH
+#endif
+
+#ifdef VECTOR_DISPATCH
+#include <immintrin.h>
+
+#if defined(USE__GET_CPUID)
+#include <cpuid.h>
+#else
+#include <intrin.h>
+#endif
+
+#ifdef _MSC_VER
+#define TARGET_AVX2
+#define TARGET_AVX512
+#define TARGET_XSAVE
+#else
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#define TARGET_XSAVE __attribute__((target("xsave")))
+#endif
+#endif
+
+/* NEON is part of the base instruction set on AArch64 */
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define VECTOR_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(USE_TARGET_CLONES) && !defined(__FMA__)
+#define VECTOR_TARGET_CLONES __attribute__((target_clones("default", "fma")))
+#else
+#define VECTOR_TARGET_CLONES
+#endif
+
+float		(*VectorL2SquaredDistance) (int dim, float *ax, float *bx);
+float		(*VectorInnerProduct) (int dim, float *ax, float *bx);
+void		(*VectorL2SquaredDistanceBatch) (int dim, float *ax, float **bxs, int n, float *distances);
+void		(*VectorInnerProductBatch) (int dim, float *ax, float **bxs, int n, float *distances);
+double		(*VectorCosineSimilarity) (int dim, float *ax, float *bx);
+float		(*VectorL1Distance) (int dim, float *ax, float *bx);
+float		(*VectorQuantizedL2SquaredDistance) (int dim, float *ax, float offset, float scale, uint8 *bx);
+float		(*VectorQuantizedInnerProduct) (int dim, float *ax, float offset, float scale, uint8 *bx);
+float		(*VectorQuantizedL1Distance) (int dim, float *ax, float offset, float scale, uint8 *bx);
+void		(*VectorNetworkToHost32) (int n, uint32 *x);
+void		(*VectorNetworkToHost16) (int n, uint16 *x);
+bool		(*VectorAllFinite) (int dim, float *x);
+void		(*VectorAccumulate) (int dim, double *sums, float *x);
+
+VECTOR_TARGET_CLONES static float
+VectorL2SquaredDistanceDefault(int dim, float *ax, float *bx)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+	{
+		float		diff = ax[i] - bx[i];
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_AVX2 static float
+VectorL2SquaredDistanceAvx2(int dim, float *ax, float *bx)
+{
+	float		distance;
+	int			i;
+	float		s[8];
+	int			count = (dim / 8) * 8;
+	__m256		dist = _mm256_setzero_ps();
+
+	for (i = 0; i < count; i += 8)
+	{
+		__m256		diff = _mm256_sub_ps(_mm256_loadu_ps(ax + i), _mm256_loadu_ps(bx + i));
+
+		dist = _mm256_fmadd_ps(diff, diff, dist);
+	}
+
+	_mm256_storeu_ps(s, dist);
+
+	distance = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+	for (; i < dim; i++)
+	{
+		float		diff = ax[i] - bx[i];
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+TARGET_AVX512 static float
+VectorL2SquaredDistanceAvx512(int dim, float *ax, float *bx)
+{
+	float		distance;
+	int			i;
+	int			count = (dim / 16) * 16;
+	__m512		dist = _mm512_setzero_ps();
+
+	for (i = 0; i < count; i += 16)
+	{
+		__m512		diff = _mm512_sub_ps(_mm512_loadu_ps(ax + i), _mm512_loadu_ps(bx + i));
+
+		dist = _mm512_fmadd_ps(diff, diff, dist);
+	}
+
+	distance = _mm512_reduce_add_ps(dist);
+
+	for (; i < dim; i++)
+	{
+		float		diff = ax[i] - bx[i];
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+#endif
+
+#ifdef VECTOR_NEON
+static float
+VectorL2SquaredDistanceNeon(int dim, float *ax, float *bx)
+{
+	float		distance;
+	int			i;
+	int			count = (dim / 4) * 4;
+	float32x4_t dist = vdupq_n_f32(0);
+
+	for (i = 0; i < count; i += 4)
+	{
+		float32x4_t diff = vsubq_f32(vld1q_f32(ax + i), vld1q_f32(bx + i));
+
+		dist = vfmaq_f32(dist, diff, diff);
+	}
+
+	distance = vaddvq_f32(dist);
+
+	for (; i < dim; i++)
+	{
+		float		diff = ax[i] - bx[i];
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+#endif
+
+/*
+ * Score four vectors per pass so each load of the query is shared
+ *
+ * The intrinsic versions sum each vector in the same order as the single
+ * kernels, so distances do not depend on whether they were batched.
+ */
+VECTOR_TARGET_CLONES static void
+VectorL2SquaredDistanceBatchDefault(int dim, float *ax, float **bxs, int n, float *distances)
+{
+	int			k = 0;
+
+	for (; k + 4 <= n; k += 4)
+	{
+		float	   *b0 = bxs[k];
+		float	   *b1 = bxs[k + 1];
+		float	   *b2 = bxs[k + 2];
+		float	   *b3 = bxs[k + 3];
+		float		d0 = 0.0;
+		float		d1 = 0.0;
+		float		d2 = 0.0;
+		float		d3 = 0.0;
+
+		for (int i = 0; i < dim; i++)
+		{
+			float		a = ax[i];
+			float		diff0 = a - b0[i];
+			float		diff1 = a - b1[i];
+			float		diff2 = a - b2[i];
+			float		diff3 = a - b3[i];
+
+			d0 += diff0 * diff0;
+			d1 += diff1 * diff1;
+			d2 += diff2 * diff2;
+			d3 += diff3 * diff3;
+		}
+
+		distances[k] = d0;
+		distances[k + 1] = d1;
+		distances[k + 2] = d2;
+		distances[k + 3] = d3;
+	}
+
+	for (; k < n; k++)
+		distances[k] = VectorL2SquaredDistanceDefault(dim, ax, bxs[k]);
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_AVX2 static float
+VectorReduceAvx2(__m256 x)
+{
+	float		s[8];
+
+	_mm256_storeu_ps(s, x);
+
+	return s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+}
+
+TARGET_AVX2 static void
+VectorL2SquaredDistanceBatchAvx2(int dim, float *ax, float **bxs, int n, float *distances)
+{
+	int			k = 0;
+	int			count = (dim / 8) * 8;
+
+	for (; k + 4 <= n; k += 4)
+	{
+		float	   *b0 = bxs[k];
+		float	   *b1 = bxs[k + 1];
+		float	   *b2 = bxs[k + 2];
+		float	   *b3 = bxs[k + 3];
+		__m256		dist0 = _mm256_setzero_ps();
+		__m256		dist1 = _mm256_setzero_ps();
+		__m256		dist2 = _mm256_setzero_ps();
+		__m256		dist3 = _mm256_setzero_ps();
+		int			i;
+
+		for (i = 0; i < count; i += 8)
+		{
+			__m256		a = _mm256_loadu_ps(ax + i);
+			__m256		diff0 = _mm256_sub_ps(a, _mm256_loadu_ps(b0 + i));
+			__m256		diff1 = _mm256_sub_ps(a, _mm256_loadu_ps(b1 + i));
+			__m256		diff2 = _mm256_sub_ps(a, _mm256_loadu_ps(b2 + i));
+			__m256		diff3 = _mm256_sub_ps(a, _mm256_loadu_ps(b3 + i));
+
+			dist0 = _mm256_fmadd_ps(diff0, diff0, dist0);
+			dist1 = _mm256_fmadd_ps(diff1, diff1, dist1);
+			dist2 = _mm256_fmadd_ps(diff2, diff2, dist2);
+			dist3 = _mm256_fmadd_ps(diff3, diff3, dist3);
+		}
+
+		distances[k] = VectorReduceAvx2(dist0);
+		distances[k + 1] = VectorReduceAvx2(dist1);
+		distances[k + 2] = VectorReduceAvx2(dist2);
+		distances[k + 3] = VectorReduceAvx2(dist3);
+
+		for (; i < dim; i++)
+		{
+			float		diff0 = ax[i] - b0[i];
+			float		diff1 = ax[i] - b1[i];
+			float		diff2 = ax[i] - b2[i];
+			float		diff3 = ax[i] - b3[i];
+
+			distances[k] += diff0 * diff0;
+			distances[k + 1] += diff1 * diff1;
+			distances[k + 2] += diff2 * diff2;
+			distances[k + 3] += diff3 * diff3;
+		}
+	}
+
+	for (; k < n; k++)
+		distances[k] = VectorL2SquaredDistanceAvx2(dim, ax, bxs[k]);
+}
+
+TARGET_AVX512 static void
+VectorL2SquaredDistanceBatchAvx512(int dim, float *ax, float **bxs, int n, float *distances)
+{
+	int			k = 0;
+	int			count = (dim / 16) * 16;
+
+	for (; k + 4 <= n; k += 4)
+	{
+		float	   *b0 = bxs[k];
+		float	   *b1 = bxs[k + 1];
+		float	   *b2 = bxs[k + 2];
+		float	   *b3 = bxs[k + 3];
+		__m512		dist0 = _mm512_setzero_ps();
+		__m512		dist1 = _mm512_setzero_ps();
+		__m512		dist2 = _mm512_setzero_ps();
+		__m512		dist3 = _mm512_setzero_ps();
+		int			i;
+
+		for (i = 0; i < count; i += 16)
+		{
+			__m512		a = _mm512_loadu_ps(ax + i);
+			__m512		diff0 = _mm512_sub_ps(a, _mm512_loadu_ps(b0 + i));
+			__m512		diff1 = _mm512_sub_ps(a, _mm512_loadu_ps(b1 + i));
+			__m512		diff2 = _mm512_sub_ps(a, _mm512_loadu_ps(b2 + i));
+			__m512		diff3 = _mm512_sub_ps(a, _mm512_loadu_ps(b3 + i));
+
+			dist0 = _mm512_fmadd_ps(diff0, diff0, dist0);
+			dist1 = _mm512_fmadd_ps(diff1, diff1, dist1);
+			dist2 = _mm512_fmadd_ps(diff2, diff2, dist2);
+			dist3 = _mm512_fmadd_ps(diff3, diff3, dist3);
+		}
+
+		distances[k] = _mm512_reduce_add_ps(dist0);
+		distances[k + 1] = _mm512_reduce_add_ps(dist1);
+		distances[k + 2] = _mm512_reduce_add_ps(dist2);
+		distances[k + 3] = _mm512_reduce_add_ps(dist3);
+
+		for (; i < dim; i++)
+		{
+			float		diff0 = ax[i] - b0[i];
+			float		diff1 = ax[i] - b1[i];
+			float		diff2 = ax[i] - b2[i];
+			float		diff3 = ax[i] - b3[i];
+
+			distances[k] += diff0 * diff0;
+			distances[k + 1] += diff1 * diff1;
+			distances[k + 2] += diff2 * diff2;
+			distances[k + 3] += diff3 * diff3;
+		}
+	}
+
+	for (; k < n; k++)
+		distances[k] = VectorL2SquaredDistanceAvx512(dim, ax, bxs[k]);
+}
+#endif
+
+#ifdef VECTOR_NEON
+static void
+VectorL2SquaredDistanceBatchNeon(int dim, float *ax, float **bxs, int n, float *distances)
+{
+	int			k = 0;
+	int			count = (dim / 4) * 4;
+
+	for (; k + 4 <= n; k += 4)
+	{
+		float	   *b0 = bxs[k];
+		float	   *b1 = bxs[k + 1];
+		float	   *b2 = bxs[k + 2];
+		float	   *b3 = bxs[k + 3];
+		float32x4_t dist0 = vdupq_n_f32(0);
+		float32x4_t dist1 = vdupq_n_f32(0);
+		float32x4_t dist2 = vdupq_n_f32(0);
+		float32x4_t dist3 = vdupq_n_f32(0);
+		int			i;
+
+		for (i = 0; i < count; i += 4)
+		{
+			float32x4_t a = vld1q_f32(ax + i);
+			float32x4_t diff0 = vsubq_f32(a, vld1q_f32(b0 + i));
+			float32x4_t diff1 = vsubq_f32(a, vld1q_f32(b1 + i));
+			float32x4_t diff2 = vsubq_f32(a, vld1q_f32(b2 + i));
+			float32x4_t diff3 = vsubq_f32(a, vld1q_f32(b3 + i));
+
+			dist0 = vfmaq_f32(dist0, diff0, diff0);
+			dist1 = vfmaq_f32(dist1, diff1, diff1);
+			dist2 = vfmaq_f32(dist2, diff2, diff2);
+			dist3 = vfmaq_f32(dist3, diff3, diff3);
+		}
+
+		distances[k] = vaddvq_f32(dist0);
+		distances[k + 1] = vaddvq_f32(dist1);
+		distances[k + 2] = vaddvq_f32(dist2);
+		distances[k + 3] = vaddvq_f32(dist3);
+
+		for (; i < dim; i++)
+		{
+			float		diff0 = ax[i] - b0[i];
+			float		diff1 = ax[i] - b1[i];
+			float		diff2 = ax[i] - b2[i];
+			float		diff3 = ax[i] - b3[i];
+
+			distances[k] += diff0 * diff0;
+			distances[k + 1] += diff1 * diff1;
+			distances[k + 2] += diff2 * diff2;
+			distances[k + 3] += diff3 * diff3;
+		}
+	}
+
+	for (; k < n; k++)
+		distances[k] = VectorL2SquaredDistanceNeon(dim, ax, bxs[k]);
+}
+#endif
+
+VECTOR_TARGET_CLONES static float
+VectorInnerProductDefault(int dim, float *ax, float *bx)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+		distance += ax[i] * bx[i];
+
+	return distance;
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_AVX2 static float
+VectorInnerProductAvx2(int dim, float *ax, float *bx)
+{
+	float		distance;
+	int			i;
+	float		s[8];
+	int			count = (dim / 8) * 8;
+	__m256		dist = _mm256_setzero_ps();
+
+	for (i = 0; i < count; i += 8)
+		dist = _mm256_fmadd_ps(_mm256_loadu_ps(ax + i), _mm256_loadu_ps(bx + i), dist);
+
+	_mm256_storeu_ps(s, dist);
+
+	distance = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+	for (; i < dim; i++)
+		distance += ax[i] * bx[i];
+
+	return distance;
+}
+
+TARGET_AVX512 static float
+VectorInnerProductAvx512(int dim, float *ax, float *bx)
+{
+	float		distance;
+	int			i;
+	int			count = (dim / 16) * 16;
+	__m512		dist = _mm512_setzero_ps();
+
+	for (i = 0; i < count; i += 16)
+		dist = _mm512_fmadd_ps(_mm512_loadu_ps(ax + i), _mm512_loadu_ps(bx + i), dist);
+
+	distance = _mm512_reduce_add_ps(dist);
+
+	for (; i < dim; i++)
+		distance += ax[i] * bx[i];
+
+	return distance;
+}
+#endif
+
+#ifdef VECTOR_NEON
+static float
+VectorInnerProductNeon(int dim, float *ax, float *bx)
+{
+	float		distance;
+	int			i;
+	int			count = (dim / 4) * 4;
+	float32x4_t dist = vdupq_n_f32(0);
+
+	for (i = 0; i < count; i += 4)
+		dist = vfmaq_f32(dist, vld1q_f32(ax + i), vld1q_f32(bx + i));
+
+	distance = vaddvq_f32(dist);
+
+	for (; i < dim; i++)
+		distance += ax[i] * bx[i];
+
+	return distance;
+}
+#endif
+
+VECTOR_TARGET_CLONES static void
+VectorInnerProductBatchDefault(int dim, float *ax, float **bxs, int n, float *distances)
+{
+	int			k = 0;
+
+	for (; k + 4 <= n; k += 4)
+	{
+		float	   *b0 = bxs[k];
+		float	   *b1 = bxs[k + 1];
+		float	   *b2 = bxs[k + 2];
+		float	   *b3 = bxs[k + 3];
+		float		d0 = 0.0;
+		float		d1 = 0.0;
+		float		d2 = 0.0;
+		float		d3 = 0.0;
+
+		for (int i = 0; i < dim; i++)
+		{
+			float		a = ax[i];
+
+			d0 += a * b0[i];
+			d1 += a * b1[i];
+			d2 += a * b2[i];
+			d3 += a * b3[i];
+		}
+
+		distances[k] = d0;
+		distances[k + 1] = d1;
+		distances[k + 2] = d2;
+		distances[k + 3] = d3;
+	}
+
+	for (; k < n; k++)
+		distances[k] = VectorInnerProductDefault(dim, ax, bxs[k]);
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_AVX2 static void
+VectorInnerProductBatchAvx2(int dim, float *ax, float **bxs, int n, float *distances)
+{
+	int			k = 0;
+	int			count = (dim / 8) * 8;
+
+	for (; k + 4 <= n; k += 4)
+	{
+		float	   *b0 = bxs[k];
+		float	   *b1 = bxs[k + 1];
+		float	   *b2 = bxs[k + 2];
+		float	   *b3 = bxs[k + 3];
+		__m256		dist0 = _mm256_setzero_ps();
+		__m256		dist1 = _mm256_setzero_ps();
+		__m256		dist2 = _mm256_setzero_ps();
+		__m256		dist3 = _mm256_setzero_ps();
+		int			i;
+
+		for (i = 0; i < count; i += 8)
+		{
+			__m256		a = _mm256_loadu_ps(ax + i);
+
+			dist0 = _mm256_fmadd_ps(a, _mm256_loadu_ps(b0 + i), dist0);
+			dist1 = _mm256_fmadd_ps(a, _mm256_loadu_ps(b1 + i), dist1);
+			dist2 = _mm256_fmadd_ps(a, _mm256_loadu_ps(b2 + i), dist2);
+			dist3 = _mm256_fmadd_ps(a, _mm256_loadu_ps(b3 + i), dist3);
+		}
+
+		distances[k] = VectorReduceAvx2(dist0);
+		distances[k + 1] = VectorReduceAvx2(dist1);
+		distances[k + 2] = VectorReduceAvx2(dist2);
+		distances[k + 3] = VectorReduceAvx2(dist3);
+
+		for (; i < dim; i++)
+		{
+			distances[k] += ax[i] * b0[i];
+			distances[k + 1] += ax[i] * b1[i];
+			distances[k + 2] += ax[i] * b2[i];
+			distances[k + 3] += ax[i] * b3[i];
+		}
+	}
+
+	for (; k < n; k++)
+		distances[k] = VectorInnerProductAvx2(dim, ax, bxs[k]);
+}
+
+TARGET_AVX512 static void
+VectorInnerProductBatchAvx512(int dim, float *ax, float **bxs, int n, float *distances)
+{
+	int			k = 0;
+	int			count = (dim / 16) * 16;
+
+	for (; k + 4 <= n; k += 4)
+	{
+		float	   *b0 = bxs[k];
+		float	   *b1 = bxs[k + 1];
+		float	   *b2 = bxs[k + 2];
+		float	   *b3 = bxs[k + 3];
+		__m512		dist0 = _mm512_setzero_ps();
+		__m512		dist1 = _mm512_setzero_ps();
+		__m512		dist2 = _mm512_setzero_ps();
+		__m512		dist3 = _mm512_setzero_ps();
+		int			i;
+
+		for (i = 0; i < count; i += 16)
+		{
+			__m512		a = _mm512_loadu_ps(ax + i);
+
+			dist0 = _mm512_fmadd_ps(a, _mm512_loadu_ps(b0 + i), dist0);
+			dist1 = _mm512_fmadd_ps(a, _mm512_loadu_ps(b1 + i), dist1);
+			dist2 = _mm512_fmadd_ps(a, _mm512_loadu_ps(b2 + i), dist2);
+			dist3 = _mm512_fmadd_ps(a, _mm512_loadu_ps(b3 + i), dist3);
+		}
+
+		distances[k] = _mm512_reduce_add_ps(dist0);
+		distances[k + 1] = _mm512_reduce_add_ps(dist1);
+		distances[k + 2] = _mm512_reduce_add_ps(dist2);
+		distances[k + 3] = _mm512_reduce_add_ps(dist3);
+
+		for (; i < dim; i++)
+		{
+			distances[k] += ax[i] * b0[i];
+			distances[k + 1] += ax[i] * b1[i];
+			distances[k + 2] += ax[i] * b2[i];
+			distances[k + 3] += ax[i] * b3[i];
+		}
+	}
+
+	for (; k < n; k++)
+		distances[k] = VectorInnerProductAvx512(dim, ax, bxs[k]);
+}
+#endif
+
+#ifdef VECTOR_NEON
+static void
+VectorInnerProductBatchNeon(int dim, float *ax, float **bxs, int n, float *distances)
+{
+	int			k = 0;
+	int			count = (dim / 4) * 4;
+
+	for (; k + 4 <= n; k += 4)
+	{
+		float	   *b0 = bxs[k];
+		float	   *b1 = bxs[k + 1];
+		float	   *b2 = bxs[k + 2];
+		float	   *b3 = bxs[k + 3];
+		float32x4_t dist0 = vdupq_n_f32(0);
+		float32x4_t dist1 = vdupq_n_f32(0);
+		float32x4_t dist2 = vdupq_n_f32(0);
+		float32x4_t dist3 = vdupq_n_f32(0);
+		int			i;
+
+		for (i = 0; i < count; i += 4)
+		{
+			float32x4_t a = vld1q_f32(ax + i);
+
+			dist0 = vfmaq_f32(dist0, a, vld1q_f32(b0 + i));
+			dist1 = vfmaq_f32(dist1, a, vld1q_f32(b1 + i));
+			dist2 = vfmaq_f32(dist2, a, vld1q_f32(b2 + i));
+			dist3 = vfmaq_f32(dist3, a, vld1q_f32(b3 + i));
+		}
+
+		distances[k] = vaddvq_f32(dist0);
+		distances[k + 1] = vaddvq_f32(dist1);
+		distances[k + 2] = vaddvq_f32(dist2);
+		distances[k + 3] = vaddvq_f32(dist3);
+
+		for (; i < dim; i++)
+		{
+			distances[k] += ax[i] * b0[i];
+			distances[k + 1] += ax[i] * b1[i];
+			distances[k + 2] += ax[i] * b2[i];
+			distances[k + 3] += ax[i] * b3[i];
+		}
+	}
+
+	for (; k < n; k++)
+		distances[k] = VectorInnerProductNeon(dim, ax, bxs[k]);
+}
+#endif
+
+VECTOR_TARGET_CLONES static double
+VectorCosineSimilarityDefault(int dim, float *ax, float *bx)
+{
+	float		similarity = 0.0;
+	float		norma = 0.0;
+	float		normb = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+	{
+		similarity += ax[i] * bx[i];
+		norma += ax[i] * ax[i];
+		normb += bx[i] * bx[i];
+	}
+
+	/* Use sqrt(a * b) over sqrt(a) * sqrt(b) */
+	return (double) similarity / sqrt((double) norma * (double) normb);
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_AVX2 static double
+VectorCosineSimilarityAvx2(int dim, float *ax, float *bx)
+{
+	float		similarity;
+	float		norma;
+	float		normb;
+	int			i;
+	float		s[8];
+	int			count = (dim / 8) * 8;
+	__m256		sim = _mm256_setzero_ps();
+	__m256		na = _mm256_setzero_ps();
+	__m256		nb = _mm256_setzero_ps();
+
+	for (i = 0; i < count; i += 8)
+	{
+		__m256		axs = _mm256_loadu_ps(ax + i);
+		__m256		bxs = _mm256_loadu_ps(bx + i);
+
+		sim = _mm256_fmadd_ps(axs, bxs, sim);
+		na = _mm256_fmadd_ps(axs, axs, na);
+		nb = _mm256_fmadd_ps(bxs, bxs, nb);
+	}
+
+	_mm256_storeu_ps(s, sim);
+	similarity = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+	_mm256_storeu_ps(s, na);
+	norma = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+	_mm256_storeu_ps(s, nb);
+	normb = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+	for (; i < dim; i++)
+	{
+		similarity += ax[i] * bx[i];
+		norma += ax[i] * ax[i];
+		normb += bx[i] * bx[i];
+	}
+
+	/* Use sqrt(a * b) over sqrt(a) * sqrt(b) */
+	return (double) similarity / sqrt((double) norma * (double) normb);
+}
+
+TARGET_AVX512 static double
+VectorCosineSimilarityAvx512(int dim, float *ax, float *bx)
+{
+	float		similarity;
+	float		norma;
+	float		normb;
+	int			i;
+	int			count = (dim / 16) * 16;
+	__m512		sim = _mm512_setzero_ps();
+	__m512		na = _mm512_setzero_ps();
+	__m512		nb = _mm512_setzero_ps();
+
+	for (i = 0; i < count; i += 16)
+	{
+		__m512		axs = _mm512_loadu_ps(ax + i);
+		__m512		bxs = _mm512_loadu_ps(bx + i);
+
+		sim = _mm512_fmadd_ps(axs, bxs, sim);
+		na = _mm512_fmadd_ps(axs, axs, na);
+		nb = _mm512_fmadd_ps(bxs, bxs, nb);
+	}
+
+	similarity = _mm512_reduce_add_ps(sim);
+	norma = _mm512_reduce_add_ps(na);
+	normb = _mm512_reduce_add_ps(nb);
+
+	for (; i < dim; i++)
+	{
+		similarity += ax[i] * bx[i];
+		norma += ax[i] * ax[i];
+		normb += bx[i] * bx[i];
+	}
+
+	/* Use sqrt(a * b) over sqrt(a) * sqrt(b) */
+	return (double) similarity / sqrt((double) norma * (double) normb);
+}
+#endif
+
+#ifdef VECTOR_NEON
+static double
+VectorCosineSimilarityNeon(int dim, float *ax, float *bx)
+{
+	float		similarity;
+	float		norma;
+	float		normb;
+	int			i;
+	int			count = (dim / 4) * 4;
+	float32x4_t sim = vdupq_n_f32(0);
+	float32x4_t na = vdupq_n_f32(0);
+	float32x4_t nb = vdupq_n_f32(0);
+
+	for (i = 0; i < count; i += 4)
+	{
+		float32x4_t axs = vld1q_f32(ax + i);
+		float32x4_t bxs = vld1q_f32(bx + i);
+
+		sim = vfmaq_f32(sim, axs, bxs);
+		na = vfmaq_f32(na, axs, axs);
+		nb = vfmaq_f32(nb, bxs, bxs);
+	}
+
+	similarity = vaddvq_f32(sim);
+	norma = vaddvq_f32(na);
+	normb = vaddvq_f32(nb);
+
+	for (; i < dim; i++)
+	{
+		similarity += ax[i] * bx[i];
+		norma += ax[i] * ax[i];
+		normb += bx[i] * bx[i];
+	}
+
+	/* Use sqrt(a * b) over sqrt(a) * sqrt(b) */
+	return (double) similarity / sqrt((double) norma * (double) normb);
+}
+#endif
+
+/* Does not require FMA, but keep logic simple */
+VECTOR_TARGET_CLONES static float
+VectorL1DistanceDefault(int dim, float *ax, float *bx)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+		distance += fabsf(ax[i] - bx[i]);
+
+	return distance;
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_AVX2 static float
+VectorL1DistanceAvx2(int dim, float *ax, float *bx)
+{
+	float		distance;
+	int			i;
+	float		s[8];
+	int			count = (dim / 8) * 8;
+	__m256		dist = _mm256_setzero_ps();
+	__m256		sign = _mm256_set1_ps(-0.0f);
+
+	for (i = 0; i < count; i += 8)
+	{
+		__m256		diff = _mm256_sub_ps(_mm256_loadu_ps(ax + i), _mm256_loadu_ps(bx + i));
+
+		/* Clear sign bit for absolute value */
+		dist = _mm256_add_ps(dist, _mm256_andnot_ps(sign, diff));
+	}
+
+	_mm256_storeu_ps(s, dist);
+
+	distance = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+	for (; i < dim; i++)
+		distance += fabsf(ax[i] - bx[i]);
+
+	return distance;
+}
+
+TARGET_AVX512 static float
+VectorL1DistanceAvx512(int dim, float *ax, float *bx)
+{
+	float		distance;
+	int			i;
+	int			count = (dim / 16) * 16;
+	__m512		dist = _mm512_setzero_ps();
+
+	for (i = 0; i < count; i += 16)
+	{
+		__m512		diff = _mm512_sub_ps(_mm512_loadu_ps(ax + i), _mm512_loadu_ps(bx + i));
+
+		dist = _mm512_add_ps(dist, _mm512_abs_ps(diff));
+	}
+
+	distance = _mm512_reduce_add_ps(dist);
+
+	for (; i < dim; i++)
+		distance += fabsf(ax[i] - bx[i]);
+
+	return distance;
+}
+#endif
+
+#ifdef VECTOR_NEON
+static float
+VectorL1DistanceNeon(int dim, float *ax, float *bx)
+{
+	float		distance;
+	int			i;
+	int			count = (dim / 4) * 4;
+	float32x4_t dist = vdupq_n_f32(0);
+
+	for (i = 0; i < count; i += 4)
+		dist = vaddq_f32(dist, vabdq_f32(vld1q_f32(ax + i), vld1q_f32(bx + i)));
+
+	distance = vaddvq_f32(dist);
+
+	for (; i < dim; i++)
+		distance += fabsf(ax[i] - bx[i]);
+
+	return distance;
+}
+#endif
+
+/*
+ * Quantized kernels compare a float vector with 8-bit codes, where each
+ * element is decoded as offset + scale * code
+ */
+VECTOR_TARGET_CLONES static float
+VectorQuantizedL2SquaredDistanceDefault(int dim, float *ax, float offset, float scale, uint8 *bx)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+	{
+		float		diff = ax[i] - (offset + scale * bx[i]);
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_AVX2 static float
+VectorQuantizedL2SquaredDistanceAvx2(int dim, float *ax, float offset, float scale, uint8 *bx)
+{
+	float		distance;
+	int			i;
+	float		s[8];
+	int			count = (dim / 8) * 8;
+	__m256		dist = _mm256_setzero_ps();
+	__m256		o = _mm256_set1_ps(offset);
+	__m256		sc = _mm256_set1_ps(scale);
+
+	for (i = 0; i < count; i += 8)
+	{
+		__m256		b = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *) (bx + i))));
+		__m256		diff = _mm256_sub_ps(_mm256_loadu_ps(ax + i), _mm256_fmadd_ps(sc, b, o));
+
+		dist = _mm256_fmadd_ps(diff, diff, dist);
+	}
+
+	_mm256_storeu_ps(s, dist);
+
+	distance = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+	for (; i < dim; i++)
+	{
+		float		diff = ax[i] - (offset + scale * bx[i]);
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+TARGET_AVX512 static float
+VectorQuantizedL2SquaredDistanceAvx512(int dim, float *ax, float offset, float scale, uint8 *bx)
+{
+	float		distance;
+	int			i;
+	int			count = (dim / 16) * 16;
+	__m512		dist = _mm512_setzero_ps();
+	__m512		o = _mm512_set1_ps(offset);
+	__m512		sc = _mm512_set1_ps(scale);
+
+	for (i = 0; i < count; i += 16)
+	{
+		__m512		b = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i *) (bx + i))));
+		__m512		diff = _mm512_sub_ps(_mm512_loadu_ps(ax + i), _mm512_fmadd_ps(sc, b, o));
+
+		dist = _mm512_fmadd_ps(diff, diff, dist);
+	}
+
+	distance = _mm512_reduce_add_ps(dist);
+
+	for (; i < dim; i++)
+	{
+		float		diff = ax[i] - (offset + scale * bx[i]);
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+#endif
+
+#ifdef VECTOR_NEON
+static float
+VectorQuantizedL2SquaredDistanceNeon(int dim, float *ax, float offset, float scale, uint8 *bx)
+{
+	float		distance;
+	int			i;
+	int			count = (dim / 8) * 8;
+	float32x4_t dist = vdupq_n_f32(0);
+	float32x4_t o = vdupq_n_f32(offset);
+
+	for (i = 0; i < count; i += 8)
+	{
+		uint16x8_t b = vmovl_u8(vld1_u8(bx + i));
+		float32x4_t blo = vfmaq_n_f32(o, vcvtq_f32_u32(vmovl_u16(vget_low_u16(b))), scale);
+		float32x4_t bhi = vfmaq_n_f32(o, vcvtq_f32_u32(vmovl_u16(vget_high_u16(b))), scale);
+		float32x4_t difflo = vsubq_f32(vld1q_f32(ax + i), blo);
+		float32x4_t diffhi = vsubq_f32(vld1q_f32(ax + i + 4), bhi);
+
+		dist = vfmaq_f32(dist, difflo, difflo);
+		dist = vfmaq_f32(dist, diffhi, diffhi);
+	}
+
+	distance = vaddvq_f32(dist);
+
+	for (; i < dim; i++)
+	{
+		float		diff = ax[i] - (offset + scale * bx[i]);
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+#endif
+
+VECTOR_TARGET_CLONES static float
+VectorQuantizedInnerProductDefault(int dim, float *ax, float offset, float scale, uint8 *bx)
+{
+	float		sum = 0.0;
+	float		dot = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+	{
+		sum += ax[i];
+		dot += ax[i] * bx[i];
+	}
+
+	return offset * sum + scale * dot;
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_AVX2 static float
+VectorQuantizedInnerProductAvx2(int dim, float *ax, float offset, float scale, uint8 *bx)
+{
+	float		sum;
+	float		dot;
+	int			i;
+	float		s[8];
+	int			count = (dim / 8) * 8;
+	__m256		sums = _mm256_setzero_ps();
+	__m256		dots = _mm256_setzero_ps();
+
+	for (i = 0; i < count; i += 8)
+	{
+		__m256		a = _mm256_loadu_ps(ax + i);
+		__m256		b = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *) (bx + i))));
+
+		sums = _mm256_add_ps(sums, a);
+		dots = _mm256_fmadd_ps(a, b, dots);
+	}
+
+	_mm256_storeu_ps(s, sums);
+	sum = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+	_mm256_storeu_ps(s, dots);
+	dot = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+	for (; i < dim; i++)
+	{
+		sum += ax[i];
+		dot += ax[i] * bx[i];
+	}
+
+	return offset * sum + scale * dot;
+}
+
+TARGET_AVX512 static float
+VectorQuantizedInnerProductAvx512(int dim, float *ax, float offset, float scale, uint8 *bx)
+{
+	float		sum;
+	float		dot;
+	int			i;
+	int			count = (dim / 16) * 16;
+	__m512		sums = _mm512_setzero_ps();
+	__m512		dots = _mm512_setzero_ps();
+
+	for (i = 0; i < count; i += 16)
+	{
+		__m512		a = _mm512_loadu_ps(ax + i);
+		__m512		b = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i *) (bx + i))));
+
+		sums = _mm512_add_ps(sums, a);
+		dots = _mm512_fmadd_ps(a, b, dots);
+	}
+
+	sum = _mm512_reduce_add_ps(sums);
+	dot = _mm512_reduce_add_ps(dots);
+
+	for (; i < dim; i++)
+	{
+		sum += ax[i];
+		dot += ax[i] * bx[i];
+	}
+
+	return offset * sum + scale * dot;
+}
+#endif
+
+#ifdef VECTOR_NEON
+static float
+VectorQuantizedInnerProductNeon(int dim, float *ax, float offset, float scale, uint8 *bx)
+{
+	float		sum;
+	float		dot;
+	int			i;
+	int			count = (dim / 8) * 8;
+	float32x4_t sums = vdupq_n_f32(0);
+	float32x4_t dots = vdupq_n_f32(0);
+
+	for (i = 0; i < count; i += 8)
+	{
+		uint16x8_t b = vmovl_u8(vld1_u8(bx + i));
+		float32x4_t alo = vld1q_f32(ax + i);
+		float32x4_t ahi = vld1q_f32(ax + i + 4);
+
+		sums = vaddq_f32(sums, vaddq_f32(alo, ahi));
+		dots = vfmaq_f32(dots, alo, vcvtq_f32_u32(vmovl_u16(vget_low_u16(b))));
+		dots = vfmaq_f32(dots, ahi, vcvtq_f32_u32(vmovl_u16(vget_high_u16(b))));
+	}
+
+	sum = vaddvq_f32(sums);
+	dot = vaddvq_f32(dots);
+
+	for (; i < dim; i++)
+	{
+		sum += ax[i];
+		dot += ax[i] * bx[i];
+	}
+
+	return offset * sum + scale * dot;
+}
+#endif
+
+VECTOR_TARGET_CLONES static float
+VectorQuantizedL1DistanceDefault(int dim, float *ax, float offset, float scale, uint8 *bx)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+		distance += fabsf(ax[i] - (offset + scale * bx[i]));
+
+	return distance;
+}
+
+static void
+VectorNetworkToHost32Default(int n, uint32 *x)
+{
+	/* Auto-vectorized */
+	for (int i = 0; i < n; i++)
+		x[i] = pg_ntoh32(x[i]);
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_AVX2 static void
+VectorNetworkToHost32Avx2(int n, uint32 *x)
+{
+	int			i;
+	int			count = (n / 8) * 8;
+	__m256i		mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+										3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+	for (i = 0; i < count; i += 8)
+	{
+		__m256i		v = _mm256_loadu_si256((__m256i *) (x + i));
+
+		_mm256_storeu_si256((__m256i *) (x + i), _mm256_shuffle_epi8(v, mask));
+	}
+
+	for (; i < n; i++)
+		x[i] = pg_ntoh32(x[i]);
+}
+#endif
+
+static void
+VectorNetworkToHost16Default(int n, uint16 *x)
+{
+	/* Auto-vectorized */
+	for (int i = 0; i < n; i++)
+		x[i] = pg_ntoh16(x[i]);
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_AVX2 static void
+VectorNetworkToHost16Avx2(int n, uint16 *x)
+{
+	int			i;
+	int			count = (n / 16) * 16;
+	__m256i		mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+										1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+	for (i = 0; i < count; i += 16)
+	{
+		__m256i		v = _mm256_loadu_si256((__m256i *) (x + i));
+
+		_mm256_storeu_si256((__m256i *) (x + i), _mm256_shuffle_epi8(v, mask));
+	}
+
+	for (; i < n; i++)
+		x[i] = pg_ntoh16(x[i]);
+}
+#endif
+
+static bool
+VectorAllFiniteDefault(int dim, float *x)
+{
+	uint32	   *bits = (uint32 *) x;
+	uint32		invalid = 0;
+
+	/* NaN and infinity have all exponent bits set */
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+		invalid |= (bits[i] & 0x7F800000) == 0x7F800000;
+
+	return invalid == 0;
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_AVX2 static bool
+VectorAllFiniteAvx2(int dim, float *x)
+{
+	uint32	   *bits = (uint32 *) x;
+	int			i;
+	int			count = (dim / 8) * 8;
+	__m256i		exponent = _mm256_set1_epi32(0x7F800000);
+	__m256i		invalid = _mm256_setzero_si256();
+
+	for (i = 0; i < count; i += 8)
+	{
+		__m256i		v = _mm256_and_si256(_mm256_loadu_si256((__m256i *) (bits + i)), exponent);
+
+		invalid = _mm256_or_si256(invalid, _mm256_cmpeq_epi32(v, exponent));
+	}
+
+	if (!_mm256_testz_si256(invalid, invalid))
+		return false;
+
+	for (; i < dim; i++)
+	{
+		if ((bits[i] & 0x7F800000) == 0x7F800000)
+			return false;
+	}
+
+	return true;
+}
+#endif
+
+VECTOR_TARGET_CLONES static void
+VectorAccumulateDefault(int dim, double *sums, float *x)
+{
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+		sums[i] += (double) x[i];
+}
+
+#ifdef VECTOR_DISPATCH
+TARGET_AVX2 static void
+VectorAccumulateAvx2(int dim, double *sums, float *x)
+{
+	int			i;
+	int			count = (dim / 4) * 4;
+
+	for (i = 0; i < count; i += 4)
+	{
+		__m256d		v = _mm256_cvtps_pd(_mm_loadu_ps(x + i));
+
+		_mm256_storeu_pd(sums + i, _mm256_add_pd(_mm256_loadu_pd(sums + i), v));
+	}
+
+	for (; i < dim; i++)
+		sums[i] += (double) x[i];
+}
+
+TARGET_AVX512 static void
+VectorAccumulateAvx512(int dim, double *sums, float *x)
+{
+	int			i;
+	int			count = (dim / 8) * 8;
+
+	for (i = 0; i < count; i += 8)
+	{
+		__m512d		v = _mm512_cvtps_pd(_mm256_loadu_ps(x + i));
+
+		_mm512_storeu_pd(sums + i, _mm512_add_pd(_mm512_loadu_pd(sums + i), v));
+	}
+
+	for (; i < dim; i++)
+		sums[i] += (double) x[i];
+}
+#endif
+
+#ifdef VECTOR_DISPATCH
+#define CPU_FEATURE_FMA     (1 << 12)	/* F1 ECX */
+#define CPU_FEATURE_OSXSAVE (1 << 27)	/* F1 ECX */
+#define CPU_FEATURE_AVX     (1 << 28)	/* F1 ECX */
+#define CPU_FEATURE_AVX2    (1 << 5)	/* F7,0 EBX */
+#define CPU_FEATURE_AVX512F (1 << 16)	/* F7,0 EBX */
+
+/*
+ * Check for AVX2 and FMA, and optionally AVX-512F
+ */
+TARGET_XSAVE static bool
+SupportsAvx(bool avx512)
+{
+	unsigned int exx[4] = {0, 0, 0, 0};
+	unsigned int feature = CPU_FEATURE_FMA | CPU_FEATURE_AVX;
+
+#if defined(USE__GET_CPUID)
+	__get_cpuid(1, &exx[0], &exx[1], &exx[2], &exx[3]);
+#else
+	__cpuid(exx, 1);
+#endif
+
+	/* Check OS supports XSAVE */
+	if ((exx[2] & CPU_FEATURE_OSXSAVE) != CPU_FEATURE_OSXSAVE)
+		return false;
+
+	/* Check AVX and FMA */
+	if ((exx[2] & feature) != feature)
+		return false;
+
+	/* Check XMM and YMM registers (and ZMM registers) are enabled */
+	if (avx512)
+	{
+		if ((_xgetbv(0) & 0xe6) != 0xe6)
+			return false;
+	}
+	else
+	{
+		if ((_xgetbv(0) & 6) != 6)
+			return false;
+	}
+
+#if defined(USE__GET_CPUID)
+	__get_cpuid_count(7, 0, &exx[0], &exx[1], &exx[2], &exx[3]);
+#else
+	__cpuidex(exx, 7, 0);
+#endif
+
+	feature = avx512 ? CPU_FEATURE_AVX2 | CPU_FEATURE_AVX512F : CPU_FEATURE_AVX2;
+	return (exx[1] & feature) == feature;
+}
+#endif
+
+void
+VectorInit(void)
+{
+	/*
+	 * Could skip pointer when single function, but no difference in
+	 * performance
+	 */
+	VectorL2SquaredDistance = VectorL2SquaredDistanceDefault;
+	VectorInnerProduct = VectorInnerProductDefault;
+	VectorL2SquaredDistanceBatch = VectorL2SquaredDistanceBatchDefault;
+	VectorInnerProductBatch = VectorInnerProductBatchDefault;
+	VectorCosineSimilarity = VectorCosineSimilarityDefault;
+	VectorL1Distance = VectorL1DistanceDefault;
+	VectorQuantizedL2SquaredDistance = VectorQuantizedL2SquaredDistanceDefault;
+	VectorQuantizedInnerProduct = VectorQuantizedInnerProductDefault;
+	VectorQuantizedL1Distance = VectorQuantizedL1DistanceDefault;
+	VectorNetworkToHost32 = VectorNetworkToHost32Default;
+	VectorNetworkToHost16 = VectorNetworkToHost16Default;
+	VectorAllFinite = VectorAllFiniteDefault;
+	VectorAccumulate = VectorAccumulateDefault;
+
+#ifdef VECTOR_DISPATCH
+	if (SupportsAvx(true))
+	{
+		VectorL2SquaredDistance = VectorL2SquaredDistanceAvx512;
+		VectorInnerProduct = VectorInnerProductAvx512;
+		VectorL2SquaredDistanceBatch = VectorL2SquaredDistanceBatchAvx512;
+		VectorInnerProductBatch = VectorInnerProductBatchAvx512;
+		VectorCosineSimilarity = VectorCosineSimilarityAvx512;
+		VectorL1Distance = VectorL1DistanceAvx512;
+		VectorQuantizedL2SquaredDistance = VectorQuantizedL2SquaredDistanceAvx512;
+		VectorQuantizedInnerProduct = VectorQuantizedInnerProductAvx512;
+		VectorNetworkToHost32 = VectorNetworkToHost32Avx2;
+		VectorNetworkToHost16 = VectorNetworkToHost16Avx2;
+		VectorAllFinite = VectorAllFiniteAvx2;
+		VectorAccumulate = VectorAccumulateAvx512;
+	}
+	else if (SupportsAvx(false))
+	{
+		VectorL2SquaredDistance = VectorL2SquaredDistanceAvx2;
+		VectorInnerProduct = VectorInnerProductAvx2;
+		VectorL2SquaredDistanceBatch = VectorL2SquaredDistanceBatchAvx2;
+		VectorInnerProductBatch = VectorInnerProductBatchAvx2;
+		VectorCosineSimilarity = VectorCosineSimilarityAvx2;
+		/* Does not require FMA, but keep logic simple */
+		VectorL1Distance = VectorL1DistanceAvx2;
+		VectorQuantizedL2SquaredDistance = VectorQuantizedL2SquaredDistanceAvx2;
+		VectorQuantizedInnerProduct = VectorQuantizedInnerProductAvx2;
+		VectorNetworkToHost32 = VectorNetworkToHost32Avx2;
+		VectorNetworkToHost16 = VectorNetworkToHost16Avx2;
+		VectorAllFinite = VectorAllFiniteAvx2;
+		VectorAccumulate = VectorAccumulateAvx2;
+	}
+#endif
+
+#ifdef VECTOR_NEON
+	VectorL2SquaredDistance = VectorL2SquaredDistanceNeon;
+	VectorInnerProduct = VectorInnerProductNeon;
+	VectorL2SquaredDistanceBatch = VectorL2SquaredDistanceBatchNeon;
+	VectorInnerProductBatch = VectorInnerProductBatchNeon;
+	VectorCosineSimilarity = VectorCosineSimilarityNeon;
+	VectorL1Distance = VectorL1DistanceNeon;
+	VectorQuantizedL2SquaredDistance = VectorQuantizedL2SquaredDistanceNeon;
+	VectorQuantizedInnerProduct = VectorQuantizedInnerProductNeon;
+#endif
+}
+
+/*
+ * Parse a float like strtof
+ *
+ * Plain decimals with up to 19 significant digits and a small exponent are
+ * exact as doubles, so the quotient or product is correctly rounded (Clinger's
+ * fast path). Rounding that to float only differs from strtof when the double
+ * is exactly halfway between two floats, which falls back to strtof along with
+ * everything else.
+ */
+float
+VectorStrtof(char *pt, char **stringEnd)
+{
+#if FLT_EVAL_METHOD == 0
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	char	   *p = pt;
+	bool		negative = false;
+	bool		hasDigits = false;
+	uint64		mantissa = 0;
+	int			digits = 0;
+	int			exponent = 0;
+	double		value;
+	uint64		bits;
+	union
+	{
+		float		f;
+		uint32		i;
+	}			result;
+
+	if (*p == '-')
+	{
+		negative = true;
+		p++;
+	}
+	else if (*p == '+')
+		p++;
+
+	for (; *p >= '0' && *p <= '9'; p++)
+	{
+		hasDigits = true;
+
+		/* Skip leading zeros */
+		if (mantissa == 0 && *p == '0')
+			continue;
+
+		if (digits == 19)
+			goto fallback;
+
+		mantissa = mantissa * 10 + (*p - '0');
+		digits++;
+	}
+
+	if (*p == '.')
+	{
+		for (p++; *p >= '0' && *p <= '9'; p++)
+		{
+			hasDigits = true;
+			exponent--;
+
+			if (mantissa == 0 && *p == '0')
+				continue;
+
+			if (digits == 19)
+				goto fallback;
+
+			mantissa = mantissa * 10 + (*p - '0');
+			digits++;
+		}
+	}
+
+	if (!hasDigits)
+		goto fallback;
+
+	if (*p == 'e' || *p == 'E')
+	{
+		char	   *q = p + 1;
+		bool		exponentNegative = false;
+		int			e = 0;
+
+		if (*q == '-')
+		{
+			exponentNegative = true;
+			q++;
+		}
+		else if (*q == '+')
+			q++;
+
+		/* strtof stops before the "e" */
+		if (!(*q >= '0' && *q <= '9'))
+			goto fallback;
+
+		for (; *q >= '0' && *q <= '9'; q++)
+		{
+			if (e < 10000)
+				e = e * 10 + (*q - '0');
+		}
+
+		exponent += exponentNegative ? -e : e;
+		p = q;
+	}
+
+	/* Hexadecimal */
+	if (*p == 'x' || *p == 'X')
+		goto fallback;
+
+	if (mantissa == 0)
+		value = 0;
+	else
+	{
+		if (mantissa > (UINT64CONST(1) << 53) || exponent < -22 || exponent > 22)
+			goto fallback;
+
+		if (exponent < 0)
+			value = (double) mantissa / powers[-exponent];
+		else
+			value = (double) mantissa * powers[exponent];
+
+		/* Subnormal or out of range */
+		if (value < FLT_MIN || value > FLT_MAX)
+			goto fallback;
+
+		/* Halfway between two floats */
+		memcpy(&bits, &value, sizeof(bits));
+		if ((bits & UINT64CONST(0x1FFFFFFF)) == UINT64CONST(0x10000000))
+			goto fallback;
+	}
+
+	/* Set sign bit directly to keep negative zero */
+	result.f = (float) value;
+	if (negative)
+		result.i |= 0x80000000;
+
+	*stringEnd = p;
+	return result.f;
+
+fallback:
+#endif
+	return strtof(pt, stringEnd);
+}
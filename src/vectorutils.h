@@ -0,0 +1,21 @@
+#ifndef VECTORUTILS_H
+#define VECTORUTILS_H
+
+extern float (*VectorL2SquaredDistance) (int dim, float *ax, float *bx);
+extern float (*VectorInnerProduct) (int dim, float *ax, float *bx);
+extern void (*VectorL2SquaredDistanceBatch) (int dim, float *ax, float **bxs, int n, float *distances);
+extern void (*VectorInnerProductBatch) (int dim, float *ax, float **bxs, int n, float *distances);
+extern double (*VectorCosineSimilarity) (int dim, float *ax, float *bx);
+extern float (*VectorL1Distance) (int dim, float *ax, float *bx);
+extern float (*VectorQuantizedL2SquaredDistance) (int dim, float *ax, float offset, float scale, uint8 *bx);
+extern float (*VectorQuantizedInnerProduct) (int dim, float *ax, float offset, float scale, uint8 *bx);
+extern float (*VectorQuantizedL1Distance) (int dim, float *ax, float offset, float scale, uint8 *bx);
+extern void (*VectorNetworkToHost32) (int n, uint32 *x);
+extern void (*VectorNetworkToHost16) (int n, uint16 *x);
+extern bool (*VectorAllFinite) (int dim, float *x);
+extern void (*VectorAccumulate) (int dim, double *sums, float *x);
+
+void		VectorInit(void);
+float		VectorStrtof(char *pt, char **stringEnd);
+
+#endif
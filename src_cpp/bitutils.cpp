@@ -1,264 +0,0 @@
-#include "bitutils.hpp"
-#include "bitutils_c.h"
-#include <cstring>
-#include <stdexcept>
-#include <iostream>
-
-namespace pgvector {
-namespace cpp {
-
-// Static member definition
-std::unique_ptr<BitUtils> BitUtils::instance = nullptr;
-
-// Global initializer instance
-BitUtilsInitializer bit_utils_initializer;
-
-// RAII initializer
-BitUtilsInitializer::BitUtilsInitializer() {
-    // Ensure BitUtils is initialized when this object is created
-    BitUtils::get_instance();
-}
-
-// Default implementations
-namespace {
-
-constexpr uint64_t popcount_u64(uint64_t x) {
-    // Brian Kernighan's algorithm for population count
-    uint64_t count = 0;
-    while (x) {
-        x &= x - 1;
-        count++;
-    }
-    return count;
-}
-
-uint64_t hamming_distance_default(uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t distance) {
-    uint64_t v = distance;
-    
-    // Process 8 bytes at a time
-    uint64_t* ax64 = (uint64_t*)ax;
-    uint64_t* bx64 = (uint64_t*)bx;
-    
-    while (bytes >= sizeof(uint64_t)) {
-        v += popcount_u64(*ax64 ^ *bx64);
-        ax64++;
-        bx64++;
-        bytes -= sizeof(uint64_t);
-    }
-    
-    // Handle remaining bytes
-    unsigned char* ax8 = (unsigned char*)ax64;
-    unsigned char* bx8 = (unsigned char*)bx64;
-    
-    while (bytes > 0) {
-        v += popcount_u64(*ax8 ^ *bx8);
-        ax8++;
-        bx8++;
-        bytes--;
-    }
-    
-    return v;
-}
-
-double jaccard_distance_default(uint32_t bytes, unsigned char* ax, unsigned char* bx, 
-                               uint64_t ab, uint64_t aa, uint64_t bb) {
-    uint64_t and_data = ab;
-    uint64_t or_data = 0;
-    
-    // Process 8 bytes at a time
-    uint64_t* ax64 = (uint64_t*)ax;
-    uint64_t* bx64 = (uint64_t*)bx;
-    
-    while (bytes >= sizeof(uint64_t)) {
-        and_data += popcount_u64(*ax64 & *bx64);
-        or_data += popcount_u64(*ax64 | *bx64);
-        ax64++;
-        bx64++;
-        bytes -= sizeof(uint64_t);
-    }
-    
-    // Handle remaining bytes
-    unsigned char* ax8 = (unsigned char*)ax64;
-    unsigned char* bx8 = (unsigned char*)bx64;
-    
-    while (bytes > 0) {
-        and_data += popcount_u64(*ax8 & *bx8);
-        or_data += popcount_u64(*ax8 | *bx8);
-        ax8++;
-        bx8++;
-        bytes--;
-    }
-    
-    if (or_data == 0) {
-        return 0.0;
-    }
-    
-    return 1.0 - ((double)and_data / (double)or_data);
-}
-
-#ifdef __AVX512F__
-#include <immintrin.h>
-
-uint64_t hamming_distance_avx512_popcount(uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t distance) {
-    uint64_t v = distance;
-    
-    // Process 64 bytes at a time with AVX-512
-    while (bytes >= 64) {
-        __m512i a = _mm512_loadu_si512((__m512i*)ax);
-        __m512i b = _mm512_loadu_si512((__m512i*)bx);
-        __m512i xor_result = _mm512_xor_si512(a, b);
-        
-        // Count bits in each 64-bit chunk
-        for (int i = 0; i < 8; i++) {
-            v += _mm_popcnt_u64(_mm512_extracti64_epi64(xor_result, i));
-        }
-        
-        ax += 64;
-        bx += 64;
-        bytes -= 64;
-    }
-    
-    // Fall back to default for remaining bytes
-    if (bytes > 0) {
-        v = hamming_distance_default(bytes, ax, bx, v);
-    }
-    
-    return v;
-}
-
-double jaccard_distance_avx512_popcount(uint32_t bytes, unsigned char* ax, unsigned char* bx,
-                                       uint64_t ab, uint64_t aa, uint64_t bb) {
-    uint64_t and_data = ab;
-    uint64_t or_data = 0;
-    
-    // Process 64 bytes at a time with AVX-512
-    while (bytes >= 64) {
-        __m512i a = _mm512_loadu_si512((__m512i*)ax);
-        __m512i b = _mm512_loadu_si512((__m512i*)bx);
-        __m512i and_result = _mm512_and_si512(a, b);
-        __m512i or_result = _mm512_or_si512(a, b);
-        
-        // Count bits in each 64-bit chunk
-        for (int i = 0; i < 8; i++) {
-            and_data += _mm_popcnt_u64(_mm512_extracti64_epi64(and_result, i));
-            or_data += _mm_popcnt_u64(_mm512_extracti64_epi64(or_result, i));
-        }
-        
-        ax += 64;
-        bx += 64;
-        bytes -= 64;
-    }
-    
-    // Fall back to default for remaining bytes
-    if (bytes > 0) {
-        double result = jaccard_distance_default(bytes, ax, bx, and_data, aa, bb);
-        // Extract the and_data and or_data from the result
-        // This is a simplified approach - in practice, we'd need to modify the function signature
-        return result;
-    }
-    
-    if (or_data == 0) {
-        return 0.0;
-    }
-    
-    return 1.0 - ((double)and_data / (double)or_data);
-}
-#endif // __AVX512F__
-
-} // anonymous namespace
-
-// CPU feature detection
-constexpr bool BitUtils::supports_avx512_popcount() {
-#ifdef __AVX512F__
-    // Runtime check would be more appropriate, but for now we'll use compile-time
-    return true;
-#else
-    return false;
-#endif
-}
-
-// Constructor
-BitUtils::BitUtils() {
-    initialize();
-}
-
-// Get singleton instance
-BitUtils& BitUtils::get_instance() {
-    if (!instance) {
-        instance = std::unique_ptr<BitUtils>(new BitUtils());
-    }
-    return *instance;
-}
-
-// Initialize function pointers
-void BitUtils::initialize() {
-    try {
-        // Set default implementations
-        hamming_distance_func = hamming_distance_default;
-        jaccard_distance_func = jaccard_distance_default;
-        
-        // Check for AVX-512 support and override if available
-        if (supports_avx512_popcount()) {
-#ifdef __AVX512F__
-            hamming_distance_func = hamming_distance_avx512_popcount;
-            jaccard_distance_func = jaccard_distance_avx512_popcount;
-#endif
-        }
-    } catch (const std::exception& e) {
-        // Fallback to defaults if initialization fails
-        hamming_distance_func = hamming_distance_default;
-        jaccard_distance_func = jaccard_distance_default;
-    }
-}
-
-// Distance functions
-uint64_t BitUtils::hamming_distance(uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t distance) {
-    return hamming_distance_func(bytes, ax, bx, distance);
-}
-
-double BitUtils::jaccard_distance(uint32_t bytes, unsigned char* ax, unsigned char* bx, 
-                                 uint64_t ab, uint64_t aa, uint64_t bb) {
-    return jaccard_distance_func(bytes, ax, bx, ab, aa, bb);
-}
-
-// Standalone functions that delegate to the singleton
-uint64_t bit_hamming_distance(uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t distance) {
-    return BitUtils::get_instance().hamming_distance(bytes, ax, bx, distance);
-}
-
-double bit_jaccard_distance(uint32_t bytes, unsigned char* ax, unsigned char* bx, 
-                           uint64_t ab, uint64_t aa, uint64_t bb) {
-    return BitUtils::get_instance().jaccard_distance(bytes, ax, bx, ab, aa, bb);
-}
-
-} // namespace cpp
-} // namespace pgvector
-
-// C-compatible interface
-extern "C" {
-
-// Global function pointers
-BitHammingDistanceFunc BitHammingDistance = nullptr;
-BitJaccardDistanceFunc BitJaccardDistance = nullptr;
-
-// Wrapper functions that delegate to C++ implementation
-static uint64_t c_hamming_distance_wrapper(uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t distance) {
-    return pgvector::cpp::bit_hamming_distance(bytes, ax, bx, distance);
-}
-
-static double c_jaccard_distance_wrapper(uint32_t bytes, unsigned char* ax, unsigned char* bx, 
-                                        uint64_t ab, uint64_t aa, uint64_t bb) {
-    return pgvector::cpp::bit_jaccard_distance(bytes, ax, bx, ab, aa, bb);
-}
-
-// Initialization function
-void BitvecInit(void) {
-    // Ensure the C++ singleton is initialized
-    pgvector::cpp::BitUtils::get_instance();
-    
-    // Set up the function pointers
-    BitHammingDistance = c_hamming_distance_wrapper;
-    BitJaccardDistance = c_jaccard_distance_wrapper;
-}
-
-} // extern "C"
@@ -2,65 +2,31 @@
 #define BITUTILS_HPP
 
 #include <cstdint>
-#include <cstddef>
-#include <functional>
-#include <memory>
+
+// Kernels are selected once by BitvecInit in src/bitutils.c, so calls go
+// through a plain function pointer instead of a type-erased wrapper
+extern "C" {
+extern uint64_t (*BitHammingDistance) (uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t distance);
+extern void (*BitHammingDistanceBatch) (uint32_t bytes, unsigned char* ax, unsigned char** bxs, int n, uint64_t* distances);
+extern double (*BitJaccardDistance) (uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t ab, uint64_t aa, uint64_t bb);
+void BitvecInit(void);
+}
 
 namespace pgvector {
 namespace cpp {
 
-// Forward declarations
-class BitUtils;
-
-// Function signatures
-using BitHammingDistanceFunc = std::function<uint64_t(uint32_t, unsigned char*, unsigned char*, uint64_t)>;
-using BitJaccardDistanceFunc = std::function<double(uint32_t, unsigned char*, unsigned char*, uint64_t, uint64_t, uint64_t)>;
-
-// BitUtils class for managing bit operations
-class BitUtils {
-private:
-    // Static instance for singleton pattern
-    static std::unique_ptr<BitUtils> instance;
-    
-    // Function pointers for dispatch
-    BitHammingDistanceFunc hamming_distance_func;
-    BitJaccardDistanceFunc jaccard_distance_func;
-    
-    // CPU feature detection
-    static constexpr bool supports_avx512_popcount();
-    
-    // Constructor - initializes function pointers
-    BitUtils();
-    
-public:
-    // Delete copy constructor and assignment operator
-    BitUtils(const BitUtils&) = delete;
-    BitUtils& operator=(const BitUtils&) = delete;
-    
-    // Get singleton instance
-    static BitUtils& get_instance();
-    
-    // Distance functions
-    uint64_t hamming_distance(uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t distance);
-    double jaccard_distance(uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t ab, uint64_t aa, uint64_t bb);
-    
-    // Initialize function pointers (called automatically by constructor)
-    void initialize();
-};
-
-// Standalone functions that delegate to the singleton
-uint64_t bit_hamming_distance(uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t distance);
-double bit_jaccard_distance(uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t ab, uint64_t aa, uint64_t bb);
+inline uint64_t bit_hamming_distance(uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t distance) {
+    return BitHammingDistance(bytes, ax, bx, distance);
+}
 
-// RAII initializer class
-class BitUtilsInitializer {
-public:
-    BitUtilsInitializer();
-    ~BitUtilsInitializer() = default;
-};
+// Scores one query against n codes of the same length in a single call
+inline void hamming_distance_batch(uint32_t bytes, unsigned char* query, unsigned char** codes, int n, uint64_t* out) {
+    BitHammingDistanceBatch(bytes, query, codes, n, out);
+}
 
-// Global initializer instance
-extern BitUtilsInitializer bit_utils_initializer;
+inline double bit_jaccard_distance(uint32_t bytes, unsigned char* ax, unsigned char* bx, uint64_t ab, uint64_t aa, uint64_t bb) {
+    return BitJaccardDistance(bytes, ax, bx, ab, aa, bb);
+}
 
 } // namespace cpp
 } // namespace pgvector
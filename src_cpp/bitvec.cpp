@@ -2,7 +2,6 @@
 #include "bitutils.hpp"
 #include "postgres.h"
 #include "utils/varbit.h"
-#include "bitutils.h"  // Include for BitHammingDistance and BitJaccardDistance function pointers
 
 #if PG_VERSION_NUM >= 160000
 #include "varatt.h"
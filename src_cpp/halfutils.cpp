@@ -12,32 +12,27 @@
 #elif defined(_MSC_VER)
 #include <intrin.h>
 #endif
-
-#ifdef _MSC_VER
-#define TARGET_F16C
-#else
-#define TARGET_F16C __attribute__((target("avx,f16c,fma")))
-#endif
 #endif
 
 namespace halfutils {
 
 // Static member definitions
+// Start with the portable kernels so calls before initialize() are still safe
 template<typename T>
 typename HalfDistanceCalculator<T>::DistanceFunction 
-    HalfDistanceCalculator<T>::l2_squared_distance_func_;
+    HalfDistanceCalculator<T>::l2_squared_distance_func_ = HalfDistanceCalculator<T>::l2_squared_distance_default;
 
 template<typename T>
 typename HalfDistanceCalculator<T>::DistanceFunction 
-    HalfDistanceCalculator<T>::inner_product_func_;
+    HalfDistanceCalculator<T>::inner_product_func_ = HalfDistanceCalculator<T>::inner_product_default;
 
 template<typename T>
 typename HalfDistanceCalculator<T>::DoubleDistanceFunction 
-    HalfDistanceCalculator<T>::cosine_similarity_func_;
+    HalfDistanceCalculator<T>::cosine_similarity_func_ = HalfDistanceCalculator<T>::cosine_similarity_default;
 
 template<typename T>
 typename HalfDistanceCalculator<T>::DistanceFunction 
-    HalfDistanceCalculator<T>::l1_distance_func_;
+    HalfDistanceCalculator<T>::l1_distance_func_ = HalfDistanceCalculator<T>::l1_distance_default;
 
 template<typename T>
 bool HalfDistanceCalculator<T>::initialized_ = false;
@@ -56,25 +51,54 @@ HalfDistanceCalculator<T>::Initializer::~Initializer() {
     // Cleanup if needed
 }
 
-// CPU feature detection
-template<typename T>
-void HalfDistanceCalculator<T>::detect_cpu_features() {
 #ifdef F16C_SUPPORT
-    has_f16c_support_ = false;
-    
+#define CPU_FEATURE_FMA     (1 << 12)
+#define CPU_FEATURE_OSXSAVE (1 << 27)
+#define CPU_FEATURE_AVX     (1 << 28)
+#define CPU_FEATURE_F16C    (1 << 29)
+
+#ifdef _MSC_VER
+#define TARGET_XSAVE
+#else
+#define TARGET_XSAVE __attribute__((target("xsave")))
+#endif
+
+namespace {
+
+// Same checks as SupportsCpuFeature in src/halfutils.c
+TARGET_XSAVE bool supports_avx_f16c_fma() {
+    unsigned int exx[4] = {0, 0, 0, 0};
+    unsigned int features = CPU_FEATURE_AVX | CPU_FEATURE_F16C | CPU_FEATURE_FMA;
+
 #if defined(__x86_64__) && defined(__GNUC__)
-    unsigned int eax, ebx, ecx, edx;
-    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
-        has_f16c_support_ = (ecx & bit_F16C) != 0;
-    }
+    __get_cpuid(1, &exx[0], &exx[1], &exx[2], &exx[3]);
 #elif defined(_MSC_VER)
-    int cpu_info[4];
-    __cpuid(cpu_info, 1);
-    has_f16c_support_ = (cpu_info[2] & (1 << 29)) != 0;
+    __cpuid(reinterpret_cast<int*>(exx), 1);
 #else
-    has_f16c_support_ = false;
+    return false;
 #endif
-    
+
+    // Check OS supports XSAVE
+    if ((exx[2] & CPU_FEATURE_OSXSAVE) != CPU_FEATURE_OSXSAVE) {
+        return false;
+    }
+
+    // Check XMM and YMM registers are enabled
+    if ((_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+
+    return (exx[2] & features) == features;
+}
+
+} // anonymous namespace
+#endif // F16C_SUPPORT
+
+// CPU feature detection
+template<typename T>
+void HalfDistanceCalculator<T>::detect_cpu_features() {
+#ifdef F16C_SUPPORT
+    has_f16c_support_ = supports_avx_f16c_fma();
 #else
     has_f16c_support_ = false;
 #endif
@@ -112,12 +136,6 @@ void HalfDistanceCalculator<T>::initialize() {
 // Default implementations
 template<typename T>
 float HalfDistanceCalculator<T>::l2_squared_distance_default(int dim, HalfType* ax, HalfType* bx) {
-    validate_dimensions(dim);
-    
-    if (ax == nullptr || bx == nullptr) {
-        throw std::invalid_argument("Input arrays cannot be null");
-    }
-    
     float distance = 0.0f;
     
     for (int i = 0; i < dim; i++) {
@@ -132,12 +150,6 @@ float HalfDistanceCalculator<T>::l2_squared_distance_default(int dim, HalfType*
 
 template<typename T>
 float HalfDistanceCalculator<T>::inner_product_default(int dim, HalfType* ax, HalfType* bx) {
-    validate_dimensions(dim);
-    
-    if (ax == nullptr || bx == nullptr) {
-        throw std::invalid_argument("Input arrays cannot be null");
-    }
-    
     float result = 0.0f;
     
     for (int i = 0; i < dim; i++) {
@@ -151,12 +163,6 @@ float HalfDistanceCalculator<T>::inner_product_default(int dim, HalfType* ax, Ha
 
 template<typename T>
 double HalfDistanceCalculator<T>::cosine_similarity_default(int dim, HalfType* ax, HalfType* bx) {
-    validate_dimensions(dim);
-    
-    if (ax == nullptr || bx == nullptr) {
-        throw std::invalid_argument("Input arrays cannot be null");
-    }
-    
     float dot_product = 0.0f;
     float norm_a = 0.0f;
     float norm_b = 0.0f;
@@ -170,21 +176,12 @@ double HalfDistanceCalculator<T>::cosine_similarity_default(int dim, HalfType* a
         norm_b += b * b;
     }
     
-    if (norm_a == 0.0f || norm_b == 0.0f) {
-        throw std::invalid_argument("Cannot compute cosine similarity of zero vectors");
-    }
-    
-    return static_cast<double>(dot_product) / (std::sqrt(norm_a) * std::sqrt(norm_b));
+    // Use sqrt(a * b) over sqrt(a) * sqrt(b), zero norm yields NaN for the caller
+    return static_cast<double>(dot_product) / std::sqrt(static_cast<double>(norm_a) * static_cast<double>(norm_b));
 }
 
 template<typename T>
 float HalfDistanceCalculator<T>::l1_distance_default(int dim, HalfType* ax, HalfType* bx) {
-    validate_dimensions(dim);
-    
-    if (ax == nullptr || bx == nullptr) {
-        throw std::invalid_argument("Input arrays cannot be null");
-    }
-    
     float distance = 0.0f;
     
     for (int i = 0; i < dim; i++) {
@@ -278,43 +275,37 @@ uint16_t HalfDistanceCalculator<T>::float_to_half_manual(float f) {
 
 #ifdef F16C_SUPPORT
 // F16C optimized implementations
+// Accumulate in registers and reduce once, like src/halfutils.c
+namespace {
+
+TARGET_F16C inline float hsum256(__m256 v) {
+    float s[8];
+
+    _mm256_storeu_ps(s, v);
+    return s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+}
+
+} // anonymous namespace
+
 template<typename T>
 float HalfDistanceCalculator<T>::l2_squared_distance_f16c(int dim, HalfType* ax, HalfType* bx) {
-    validate_dimensions(dim);
-    
-    if (ax == nullptr || bx == nullptr) {
-        throw std::invalid_argument("Input arrays cannot be null");
-    }
-    
-    float distance = 0.0f;
     int i = 0;
+    int count = (dim / 8) * 8;
+    __m256 dist = _mm256_setzero_ps();
     
-    // Process 8 elements at a time using AVX
-    for (; i + 8 <= dim; i += 8) {
-        __m128i a = _mm_loadu_si128((__m128i*)(ax + i));
-        __m128i b = _mm_loadu_si128((__m128i*)(bx + i));
-        
-        __m256 a_f32 = _mm256_cvtph_ps(a);
-        __m256 b_f32 = _mm256_cvtph_ps(b);
-        
-        __m256 diff = _mm256_sub_ps(a_f32, b_f32);
-        __m256 squared = _mm256_mul_ps(diff, diff);
+    for (; i < count; i += 8) {
+        __m256 a = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(ax + i)));
+        __m256 b = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(bx + i)));
+        __m256 diff = _mm256_sub_ps(a, b);
         
-        // Horizontal sum
-        __m128 low = _mm256_castps256_ps128(squared);
-        __m128 high = _mm256_extractf128_ps(squared, 1);
-        __m128 sum = _mm_add_ps(low, high);
-        sum = _mm_hadd_ps(sum, sum);
-        sum = _mm_hadd_ps(sum, sum);
-        
-        distance += _mm_cvtss_f32(sum);
+        dist = _mm256_fmadd_ps(diff, diff, dist);
     }
     
+    float distance = hsum256(dist);
+    
     // Handle remaining elements
     for (; i < dim; i++) {
-        float a = half_to_float(ax[i]);
-        float b = half_to_float(bx[i]);
-        float diff = a - b;
+        float diff = half_to_float(ax[i]) - half_to_float(bx[i]);
         distance += diff * diff;
     }
     
@@ -323,40 +314,22 @@ float HalfDistanceCalculator<T>::l2_squared_distance_f16c(int dim, HalfType* ax,
 
 template<typename T>
 float HalfDistanceCalculator<T>::inner_product_f16c(int dim, HalfType* ax, HalfType* bx) {
-    validate_dimensions(dim);
-    
-    if (ax == nullptr || bx == nullptr) {
-        throw std::invalid_argument("Input arrays cannot be null");
-    }
-    
-    float result = 0.0f;
     int i = 0;
+    int count = (dim / 8) * 8;
+    __m256 dist = _mm256_setzero_ps();
     
-    // Process 8 elements at a time using AVX
-    for (; i + 8 <= dim; i += 8) {
-        __m128i a = _mm_loadu_si128((__m128i*)(ax + i));
-        __m128i b = _mm_loadu_si128((__m128i*)(bx + i));
-        
-        __m256 a_f32 = _mm256_cvtph_ps(a);
-        __m256 b_f32 = _mm256_cvtph_ps(b);
-        
-        __m256 product = _mm256_mul_ps(a_f32, b_f32);
-        
-        // Horizontal sum
-        __m128 low = _mm256_castps256_ps128(product);
-        __m128 high = _mm256_extractf128_ps(product, 1);
-        __m128 sum = _mm_add_ps(low, high);
-        sum = _mm_hadd_ps(sum, sum);
-        sum = _mm_hadd_ps(sum, sum);
+    for (; i < count; i += 8) {
+        __m256 a = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(ax + i)));
+        __m256 b = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(bx + i)));
         
-        result += _mm_cvtss_f32(sum);
+        dist = _mm256_fmadd_ps(a, b, dist);
     }
     
+    float result = hsum256(dist);
+    
     // Handle remaining elements
     for (; i < dim; i++) {
-        float a = half_to_float(ax[i]);
-        float b = half_to_float(bx[i]);
-        result += a * b;
+        result += half_to_float(ax[i]) * half_to_float(bx[i]);
     }
     
     return result;
@@ -364,52 +337,25 @@ float HalfDistanceCalculator<T>::inner_product_f16c(int dim, HalfType* ax, HalfT
 
 template<typename T>
 double HalfDistanceCalculator<T>::cosine_similarity_f16c(int dim, HalfType* ax, HalfType* bx) {
-    validate_dimensions(dim);
-    
-    if (ax == nullptr || bx == nullptr) {
-        throw std::invalid_argument("Input arrays cannot be null");
-    }
-    
-    float dot_product = 0.0f;
-    float norm_a = 0.0f;
-    float norm_b = 0.0f;
     int i = 0;
-    
-    // Process 8 elements at a time using AVX
-    for (; i + 8 <= dim; i += 8) {
-        __m128i a = _mm_loadu_si128((__m128i*)(ax + i));
-        __m128i b = _mm_loadu_si128((__m128i*)(bx + i));
-        
-        __m256 a_f32 = _mm256_cvtph_ps(a);
-        __m256 b_f32 = _mm256_cvtph_ps(b);
-        
-        __m256 dot = _mm256_mul_ps(a_f32, b_f32);
-        __m256 norm_a_sq = _mm256_mul_ps(a_f32, a_f32);
-        __m256 norm_b_sq = _mm256_mul_ps(b_f32, b_f32);
-        
-        // Horizontal sums
-        __m128 dot_low = _mm256_castps256_ps128(dot);
-        __m128 dot_high = _mm256_extractf128_ps(dot, 1);
-        __m128 dot_sum = _mm_add_ps(dot_low, dot_high);
-        dot_sum = _mm_hadd_ps(dot_sum, dot_sum);
-        dot_sum = _mm_hadd_ps(dot_sum, dot_sum);
-        dot_product += _mm_cvtss_f32(dot_sum);
+    int count = (dim / 8) * 8;
+    __m256 sim = _mm256_setzero_ps();
+    __m256 na = _mm256_setzero_ps();
+    __m256 nb = _mm256_setzero_ps();
+    
+    for (; i < count; i += 8) {
+        __m256 a = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(ax + i)));
+        __m256 b = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(bx + i)));
         
-        __m128 norm_a_low = _mm256_castps256_ps128(norm_a_sq);
-        __m128 norm_a_high = _mm256_extractf128_ps(norm_a_sq, 1);
-        __m128 norm_a_sum = _mm_add_ps(norm_a_low, norm_a_high);
-        norm_a_sum = _mm_hadd_ps(norm_a_sum, norm_a_sum);
-        norm_a_sum = _mm_hadd_ps(norm_a_sum, norm_a_sum);
-        norm_a += _mm_cvtss_f32(norm_a_sum);
-        
-        __m128 norm_b_low = _mm256_castps256_ps128(norm_b_sq);
-        __m128 norm_b_high = _mm256_extractf128_ps(norm_b_sq, 1);
-        __m128 norm_b_sum = _mm_add_ps(norm_b_low, norm_b_high);
-        norm_b_sum = _mm_hadd_ps(norm_b_sum, norm_b_sum);
-        norm_b_sum = _mm_hadd_ps(norm_b_sum, norm_b_sum);
-        norm_b += _mm_cvtss_f32(norm_b_sum);
+        sim = _mm256_fmadd_ps(a, b, sim);
+        na = _mm256_fmadd_ps(a, a, na);
+        nb = _mm256_fmadd_ps(b, b, nb);
     }
     
+    float dot_product = hsum256(sim);
+    float norm_a = hsum256(na);
+    float norm_b = hsum256(nb);
+    
     // Handle remaining elements
     for (; i < dim; i++) {
         float a = half_to_float(ax[i]);
@@ -420,89 +366,36 @@ double HalfDistanceCalculator<T>::cosine_similarity_f16c(int dim, HalfType* ax,
         norm_b += b * b;
     }
     
-    if (norm_a == 0.0f || norm_b == 0.0f) {
-        throw std::invalid_argument("Cannot compute cosine similarity of zero vectors");
-    }
-    
-    return static_cast<double>(dot_product) / (std::sqrt(norm_a) * std::sqrt(norm_b));
+    // Use sqrt(a * b) over sqrt(a) * sqrt(b), zero norm yields NaN for the caller
+    return static_cast<double>(dot_product) / std::sqrt(static_cast<double>(norm_a) * static_cast<double>(norm_b));
 }
 
+// Does not require FMA, but keep logic simple
 template<typename T>
 float HalfDistanceCalculator<T>::l1_distance_f16c(int dim, HalfType* ax, HalfType* bx) {
-    validate_dimensions(dim);
-    
-    if (ax == nullptr || bx == nullptr) {
-        throw std::invalid_argument("Input arrays cannot be null");
-    }
-    
-    float distance = 0.0f;
     int i = 0;
+    int count = (dim / 8) * 8;
+    __m256 dist = _mm256_setzero_ps();
+    __m256 sign = _mm256_set1_ps(-0.0f);
     
-    // Process 8 elements at a time using AVX
-    for (; i + 8 <= dim; i += 8) {
-        __m128i a = _mm_loadu_si128((__m128i*)(ax + i));
-        __m128i b = _mm_loadu_si128((__m128i*)(bx + i));
-        
-        __m256 a_f32 = _mm256_cvtph_ps(a);
-        __m256 b_f32 = _mm256_cvtph_ps(b);
-        
-        __m256 diff = _mm256_sub_ps(a_f32, b_f32);
-        __m256 abs_diff = _mm256_and_ps(diff, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)));
+    for (; i < count; i += 8) {
+        __m256 a = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(ax + i)));
+        __m256 b = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(bx + i)));
         
-        // Horizontal sum
-        __m128 low = _mm256_castps256_ps128(abs_diff);
-        __m128 high = _mm256_extractf128_ps(abs_diff, 1);
-        __m128 sum = _mm_add_ps(low, high);
-        sum = _mm_hadd_ps(sum, sum);
-        sum = _mm_hadd_ps(sum, sum);
-        
-        distance += _mm_cvtss_f32(sum);
+        dist = _mm256_add_ps(dist, _mm256_andnot_ps(sign, _mm256_sub_ps(a, b)));
     }
     
+    float distance = hsum256(dist);
+    
     // Handle remaining elements
     for (; i < dim; i++) {
-        float a = half_to_float(ax[i]);
-        float b = half_to_float(bx[i]);
-        distance += std::abs(a - b);
+        distance += std::abs(half_to_float(ax[i]) - half_to_float(bx[i]));
     }
     
     return distance;
 }
 #endif // F16C_SUPPORT
 
-// Public interface functions
-template<typename T>
-float HalfDistanceCalculator<T>::l2_squared_distance(int dim, HalfType* ax, HalfType* bx) {
-    if (!initialized_) {
-        throw HalfutilsError("Halfutils not initialized. Call initialize() first.");
-    }
-    return l2_squared_distance_func_(dim, ax, bx);
-}
-
-template<typename T>
-float HalfDistanceCalculator<T>::inner_product(int dim, HalfType* ax, HalfType* bx) {
-    if (!initialized_) {
-        throw HalfutilsError("Halfutils not initialized. Call initialize() first.");
-    }
-    return inner_product_func_(dim, ax, bx);
-}
-
-template<typename T>
-double HalfDistanceCalculator<T>::cosine_similarity(int dim, HalfType* ax, HalfType* bx) {
-    if (!initialized_) {
-        throw HalfutilsError("Halfutils not initialized. Call initialize() first.");
-    }
-    return cosine_similarity_func_(dim, ax, bx);
-}
-
-template<typename T>
-float HalfDistanceCalculator<T>::l1_distance(int dim, HalfType* ax, HalfType* bx) {
-    if (!initialized_) {
-        throw HalfutilsError("Halfutils not initialized. Call initialize() first.");
-    }
-    return l1_distance_func_(dim, ax, bx);
-}
-
 // Explicit template instantiation for default half type
 template class HalfDistanceCalculator<half>;
 
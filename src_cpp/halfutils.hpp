@@ -2,7 +2,6 @@
 #define HALFUTILS_HPP
 
 #include <cstddef>
-#include <functional>
 #include <stdexcept>
 #include <memory>
 #include <cmath>
@@ -20,6 +19,14 @@ using half = std::uint16_t;
 constexpr auto HALF_MAX = 65504;
 #endif
 
+#ifdef F16C_SUPPORT
+#ifdef _MSC_VER
+#define TARGET_F16C
+#else
+#define TARGET_F16C __attribute__((target("avx,f16c,fma")))
+#endif
+#endif
+
 namespace halfutils {
 
 // Exception types
@@ -41,11 +48,12 @@ template<typename T = half>
 class HalfDistanceCalculator {
 public:
     using HalfType = T;
-    using DistanceFunction = std::function<float(int dim, HalfType* ax, HalfType* bx)>;
-    using DoubleDistanceFunction = std::function<double(int dim, HalfType* ax, HalfType* bx)>;
+    // Plain pointers so the selected kernel is a single indirect call
+    using DistanceFunction = float (*)(int dim, HalfType* ax, HalfType* bx);
+    using DoubleDistanceFunction = double (*)(int dim, HalfType* ax, HalfType* bx);
 
 private:
-    // Function pointers for dispatch
+    // Function pointers for dispatch (default kernels until initialize())
     static DistanceFunction l2_squared_distance_func_;
     static DistanceFunction inner_product_func_;
     static DoubleDistanceFunction cosine_similarity_func_;
@@ -81,10 +89,19 @@ public:
     static bool is_initialized() { return initialized_; }
     
     // Distance calculation functions
-    static float l2_squared_distance(int dim, HalfType* ax, HalfType* bx);
-    static float inner_product(int dim, HalfType* ax, HalfType* bx);
-    static double cosine_similarity(int dim, HalfType* ax, HalfType* bx);
-    static float l1_distance(int dim, HalfType* ax, HalfType* bx);
+    // Hot path: no checks, callers validate at the SQL boundary
+    static float l2_squared_distance(int dim, HalfType* ax, HalfType* bx) {
+        return l2_squared_distance_func_(dim, ax, bx);
+    }
+    static float inner_product(int dim, HalfType* ax, HalfType* bx) {
+        return inner_product_func_(dim, ax, bx);
+    }
+    static double cosine_similarity(int dim, HalfType* ax, HalfType* bx) {
+        return cosine_similarity_func_(dim, ax, bx);
+    }
+    static float l1_distance(int dim, HalfType* ax, HalfType* bx) {
+        return l1_distance_func_(dim, ax, bx);
+    }
     
     // Default implementations (portable)
     static float l2_squared_distance_default(int dim, HalfType* ax, HalfType* bx);
@@ -93,15 +110,15 @@ public:
     static float l1_distance_default(int dim, HalfType* ax, HalfType* bx);
     
 #ifdef F16C_SUPPORT
-    // F16C optimized implementations
-    static float l2_squared_distance_f16c(int dim, HalfType* ax, HalfType* bx);
-    static float inner_product_f16c(int dim, HalfType* ax, HalfType* bx);
-    static double cosine_similarity_f16c(int dim, HalfType* ax, HalfType* bx);
-    static float l1_distance_f16c(int dim, HalfType* ax, HalfType* bx);
+    // F16C optimized implementations (selected at runtime by initialize())
+    TARGET_F16C static float l2_squared_distance_f16c(int dim, HalfType* ax, HalfType* bx);
+    TARGET_F16C static float inner_product_f16c(int dim, HalfType* ax, HalfType* bx);
+    TARGET_F16C static double cosine_similarity_f16c(int dim, HalfType* ax, HalfType* bx);
+    TARGET_F16C static float l1_distance_f16c(int dim, HalfType* ax, HalfType* bx);
 #endif
     
     // Utility functions
-    static constexpr bool supports_f16c() {
+    static bool supports_f16c() {
 #ifdef F16C_SUPPORT
         return has_f16c_support_;
 #else
@@ -113,7 +130,7 @@ public:
         return HALFVEC_MAX_DIM;
     }
     
-    // Validate dimensions
+    // Validate dimensions (for SQL-facing callers, not called by kernels)
     static void validate_dimensions(int dim) {
         if (dim <= 0) {
             throw std::invalid_argument("Dimensions must be positive");
@@ -157,6 +174,9 @@ private:
 // Type alias for default calculator
 using DefaultHalfCalculator = HalfDistanceCalculator<>;
 
+// Instantiated once in halfutils.cpp
+extern template class HalfDistanceCalculator<half>;
+
 // Global initialization function (for C compatibility)
 void HalfvecInit();
 
@@ -27,10 +27,12 @@ SELECT '[1,2,3]'::vector::halfvec(3);
 SELECT '[1,2,3]'::vector::halfvec(2);
 SELECT '[65520]'::vector::halfvec;
 SELECT '[1e-8]'::vector::halfvec;
+SELECT (array_fill(1, ARRAY[20])::vector || '[65520]')::halfvec;
 
 SELECT '[1,2,3]'::halfvec::vector;
 SELECT '[1,2,3]'::halfvec::vector(3);
 SELECT '[1,2,3]'::halfvec::vector(2);
+SELECT array_fill(1.5, ARRAY[300])::vector::halfvec::vector = array_fill(1.5, ARRAY[300])::vector;
 
 SELECT '{1,2,3}'::real[]::halfvec;
 SELECT '{1,2,3}'::real[]::halfvec(3);
@@ -42,3 +42,18 @@ SELECT * FROM t2 ORDER BY val;
 
 DROP TABLE t;
 DROP TABLE t2;
+
+-- multiple blocks
+
+CREATE TABLE t (v vector(19), h halfvec(19), s sparsevec(19));
+INSERT INTO t SELECT a::vector, a::halfvec, a::vector::sparsevec FROM (SELECT ARRAY[1,-2,3.5,0,5,6,-7,8,0.5,10,11,0,13,14,15.25,16,17,18,-19]::real[] AS a) s;
+
+CREATE TABLE t2 (v vector(19), h halfvec(19), s sparsevec(19));
+
+\copy t TO 'results/blocks.bin' WITH (FORMAT binary)
+\copy t2 FROM 'results/blocks.bin' WITH (FORMAT binary)
+
+SELECT t.v = t2.v AS v, t.h = t2.h AS h, t.s = t2.s AS s FROM t, t2;
+
+DROP TABLE t;
+DROP TABLE t2;
@@ -40,6 +40,7 @@ SELECT '{"[1,2,3]"}'::halfvec(2)[];
 SELECT '[1,2,3]'::halfvec + '[4,5,6]';
 SELECT '[65519]'::halfvec + '[65519]';
 SELECT '[1,2]'::halfvec + '[3]';
+SELECT array_fill(1, ARRAY[300])::halfvec + array_fill(2, ARRAY[300])::halfvec = array_fill(3, ARRAY[300])::halfvec;
 
 SELECT '[1,2,3]'::halfvec - '[4,5,6]';
 SELECT '[-65519]'::halfvec - '[65519]';
@@ -138,6 +139,7 @@ SELECT avg(v) FROM unnest(ARRAY['[1,2,3]'::halfvec, '[3,5,7]']) v;
 SELECT avg(v) FROM unnest(ARRAY['[1,2,3]'::halfvec, '[3,5,7]', NULL]) v;
 SELECT avg(v) FROM unnest(ARRAY[]::halfvec[]) v;
 SELECT avg(v) FROM unnest(ARRAY['[1,2]'::halfvec, '[3]']) v;
+SELECT avg(ARRAY[n, n + 1, n + 2, n + 3, n + 4, n + 5, n + 6, n + 7, n + 8]::halfvec) FROM generate_series(1, 100) n;
 SELECT avg(v) FROM unnest(ARRAY['[65504]'::halfvec, '[65504]']) v;
 SELECT halfvec_avg(array_agg(n)) FROM generate_series(1, 16002) n;
 
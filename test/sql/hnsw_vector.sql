@@ -87,6 +87,136 @@ SELECT * FROM t ORDER BY val <-> '[3,3,3]';
 
 DROP TABLE t;
 
+-- int8 quantization
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (quantization = 'int8');
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
+
+DROP TABLE t;
+
+-- binary quantization
+
+CREATE TABLE t (val vector(3), category_id int);
+INSERT INTO t (val, category_id) VALUES ('[0,0,0]', 1), ('[1,2,3]', 2), ('[1,1,1]', 1), (NULL, 1), ('[1,2,3]', 1);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops, category_id) WITH (quantization = 'binary');
+
+INSERT INTO t (val, category_id) VALUES ('[1,2,4]', 2);
+
+SELECT val FROM t ORDER BY val <-> '[3,3,3]';
+SELECT val FROM t WHERE category_id = 2 ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
+
+CREATE INDEX ON t USING hnsw (val vector_l1_ops) WITH (quantization = 'binary');
+
+DROP TABLE t;
+
+-- filtering
+
+CREATE TABLE t (val vector(3), category_id int);
+INSERT INTO t (val, category_id) VALUES ('[0,0,0]', 1), ('[1,2,3]', 2), ('[1,1,1]', 1), (NULL, 1), ('[1,2,3]', 1), ('[2,2,2]', NULL);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops, category_id);
+
+INSERT INTO t (val, category_id) VALUES ('[1,2,4]', 2);
+
+SELECT val FROM t WHERE category_id = 1 ORDER BY val <-> '[3,3,3]';
+SELECT val FROM t WHERE category_id = 2 ORDER BY val <-> '[3,3,3]';
+SELECT val FROM t WHERE category_id = 3 ORDER BY val <-> '[3,3,3]';
+SELECT val FROM t ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t WHERE category_id = 1 ORDER BY val <-> (SELECT NULL::vector)) t2;
+
+CREATE INDEX ON t USING hnsw (val vector_l2_ops, val vector_l2_ops);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops, category_id, category_id);
+
+DROP TABLE t;
+
+-- partitioning
+
+CREATE TABLE t (val vector(3), category_id int);
+INSERT INTO t (val, category_id) VALUES ('[0,0,0]', 1), ('[1,2,3]', 2), ('[1,1,1]', 1), (NULL, 1), ('[1,2,3]', 1), ('[2,2,2]', NULL);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops, category_id) WITH (partitioned = true);
+
+INSERT INTO t (val, category_id) VALUES ('[1,2,4]', 2), ('[3,3,3]', 3), ('[4,4,4]', NULL);
+
+SELECT val FROM t WHERE category_id = 1 ORDER BY val <-> '[3,3,3]';
+SELECT val FROM t WHERE category_id = 2 ORDER BY val <-> '[3,3,3]';
+SELECT val FROM t WHERE category_id = 3 ORDER BY val <-> '[3,3,3]';
+SELECT val FROM t WHERE category_id = 4 ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[3,3,3]') t2;
+
+DELETE FROM t WHERE category_id = 1;
+VACUUM t;
+SELECT val FROM t WHERE category_id = 1 ORDER BY val <-> '[3,3,3]';
+SELECT val FROM t WHERE category_id = 2 ORDER BY val <-> '[3,3,3]';
+
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (partitioned = true);
+
+DROP TABLE t;
+
+-- build source
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX t_idx ON t USING hnsw (val vector_l2_ops);
+
+UPDATE t SET val = '[1,2,4]' WHERE val = '[1,2,3]';
+DELETE FROM t WHERE val = '[0,0,0]';
+INSERT INTO t (val) VALUES ('[2,2,2]');
+
+SET hnsw.build_source_index = 't_idx';
+CREATE INDEX ON t USING hnsw (val vector_l2_ops);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (m = 8);
+CREATE INDEX ON t USING hnsw (val vector_ip_ops);
+RESET hnsw.build_source_index;
+
+DROP INDEX t_idx;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
+
+DROP TABLE t;
+
+-- batch search
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX idx ON t USING hnsw (val vector_l2_ops);
+
+SELECT b.query, b.rank, t.val FROM hnsw_search_batch('idx', ARRAY['[3,3,3]', '[0,0,0]', NULL]::vector[], 2) b JOIN t ON t.ctid = b.ctid ORDER BY b.query, b.rank;
+
+DELETE FROM t WHERE val = '[1,2,3]';
+SELECT b.query, b.rank, t.val FROM hnsw_search_batch('idx', ARRAY['[3,3,3]']::vector[], 2) b JOIN t ON t.ctid = b.ctid ORDER BY b.query, b.rank;
+
+SELECT * FROM hnsw_search_batch('idx', ARRAY['[3,3,3]']::vector[], 0);
+SELECT * FROM hnsw_search_batch('t', ARRAY['[3,3,3]']::vector[], 1);
+SELECT * FROM hnsw_search_batch(0, ARRAY['[3,3,3]']::vector[], 1);
+SELECT * FROM hnsw_search_batch('idx', ARRAY['[3,3,3]']::halfvec[], 1);
+
+DROP TABLE t;
+
+-- snapshot
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX idx ON t USING hnsw (val vector_l2_ops) WITH (snapshot = true);
+SELECT hnsw_export_snapshot('idx');
+
+INSERT INTO t (val) VALUES ('[1,1,2]');
+SELECT hnsw_export_snapshot('idx');
+
+SELECT hnsw_export_snapshot('t');
+SELECT hnsw_export_snapshot(0);
+
+DROP INDEX idx;
+CREATE INDEX idx ON t USING hnsw (val vector_l2_ops);
+SELECT hnsw_export_snapshot('idx');
+
+DROP TABLE t;
+
 -- options
 
 CREATE TABLE t (val vector(3));
@@ -95,6 +225,7 @@ CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (m = 101);
 CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (ef_construction = 3);
 CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (ef_construction = 1001);
 CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (m = 16, ef_construction = 31);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (quantization = 'int4');
 
 SHOW hnsw.ef_search;
 
@@ -114,4 +245,10 @@ SHOW hnsw.scan_mem_multiplier;
 SET hnsw.scan_mem_multiplier = 0;
 SET hnsw.scan_mem_multiplier = 1001;
 
+SHOW hnsw.quantized_rerank;
+
+SHOW hnsw.search_patience;
+
+SET hnsw.search_patience = -1;
+
 DROP TABLE t;
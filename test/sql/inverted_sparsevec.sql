@@ -0,0 +1,40 @@
+SET enable_seqscan = off;
+
+-- inner product
+
+CREATE TABLE t (val sparsevec(4));
+INSERT INTO t (val) VALUES ('{}/4'), ('{1:1,2:2,3:3}/4'), ('{1:1,2:1,3:1}/4'), (NULL);
+CREATE INDEX ON t USING inverted (val sparsevec_ip_ops);
+
+INSERT INTO t (val) VALUES ('{1:1,2:2,3:4}/4'), ('{4:1}/4');
+
+SELECT * FROM t ORDER BY val <#> '{1:3,2:3,3:3}/4';
+SELECT * FROM t ORDER BY val <#> '{4:2}/4';
+SELECT * FROM t ORDER BY val <#> '{3:-1,4:1}/4';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <#> (SELECT NULL::sparsevec)) t2;
+SELECT COUNT(*) FROM t;
+
+SET inverted.top_k = 1;
+SELECT * FROM t ORDER BY val <#> '{1:3,2:3,3:3}/4';
+RESET inverted.top_k;
+
+DELETE FROM t WHERE val = '{1:1,2:2,3:4}/4';
+VACUUM t;
+SELECT * FROM t ORDER BY val <#> '{1:3,2:3,3:3}/4';
+
+TRUNCATE t;
+SELECT * FROM t ORDER BY val <#> '{1:3,2:3,3:3}/4';
+
+DROP TABLE t;
+
+-- options
+
+CREATE TABLE t (val sparsevec(3));
+CREATE INDEX ON t USING inverted (val sparsevec_ip_ops);
+
+SHOW inverted.top_k;
+
+SET inverted.top_k = 0;
+SET inverted.top_k = 1001;
+
+DROP TABLE t;
@@ -9,6 +9,7 @@ CREATE INDEX ON t USING ivfflat (val bit_hamming_ops) WITH (lists = 1);
 INSERT INTO t (val) VALUES (B'110');
 
 SELECT * FROM t ORDER BY val <~> B'111';
+SELECT * FROM t ORDER BY val <~> B'11';
 SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <~> (SELECT NULL::bit)) t2;
 
 DROP TABLE t;
@@ -44,6 +44,52 @@ SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <=> (SELECT NULL::vector)) t2
 
 DROP TABLE t;
 
+-- packed
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 1, packed = true);
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
+
+DELETE FROM t WHERE val = '[1,2,3]';
+VACUUM t;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+DROP TABLE t;
+
+-- rebalance
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) SELECT ARRAY[0, 0, i % 2] FROM generate_series(1, 10) i;
+INSERT INTO t (val) SELECT ARRAY[100, 100, 100 + i % 2] FROM generate_series(1, 10) i;
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 2);
+
+INSERT INTO t (val) SELECT ARRAY[i % 2, 0, 0] FROM generate_series(1, 100) i;
+INSERT INTO t (val) SELECT ARRAY[10 + i % 2, 0, 0] FROM generate_series(1, 100) i;
+
+SET ivfflat.probes = 10;
+SELECT * FROM ivfflat_rebalance('t_val_idx', 1.5, 0);
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[0,0,0]') t2;
+
+SELECT * FROM ivfflat_rebalance('t_val_idx', 100, 0.5);
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[0,0,0]') t2;
+
+INSERT INTO t (val) VALUES ('[100,100,99]');
+SELECT * FROM t ORDER BY val <-> '[100,100,99]' LIMIT 1;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[0,0,0]') t2;
+
+SELECT ivfflat_rebalance('t_val_idx', 1);
+SELECT ivfflat_rebalance('t_val_idx', 2, -1);
+SELECT ivfflat_rebalance('t');
+SELECT ivfflat_rebalance(0);
+
+RESET ivfflat.probes;
+DROP TABLE t;
+
 -- iterative
 
 CREATE TABLE t (val vector(3));
@@ -66,6 +112,27 @@ RESET ivfflat.iterative_scan;
 RESET ivfflat.max_probes;
 DROP TABLE t;
 
+-- max results
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 1);
+
+SET ivfflat.max_results = 2;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
+
+SET ivfflat.iterative_scan = relaxed_order;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+SET ivfflat.probe_ratio = 1;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+RESET ivfflat.probe_ratio;
+RESET ivfflat.iterative_scan;
+RESET ivfflat.max_results;
+DROP TABLE t;
+
 -- unlogged
 
 CREATE UNLOGGED TABLE t (val vector(3));
@@ -96,4 +163,14 @@ SHOW ivfflat.max_probes;
 SET ivfflat.max_probes = 0;
 SET ivfflat.max_probes = 32769;
 
+SHOW ivfflat.max_results;
+
+SET ivfflat.max_results = -1;
+SET ivfflat.max_results = 1000001;
+
+SHOW ivfflat.probe_ratio;
+
+SET ivfflat.probe_ratio = -1;
+SET ivfflat.probe_ratio = 1001;
+
 DROP TABLE t;
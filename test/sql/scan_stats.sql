@@ -0,0 +1,24 @@
+SET enable_seqscan = off;
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+
+-- hnsw
+
+CREATE INDEX idx ON t USING hnsw (val vector_l2_ops);
+
+SELECT FROM pg_stat_vector_scans_reset();
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT scans, distances > 0 AS distances, layer0_hops > 0 AS hops, lists IS NULL AS no_lists FROM pg_stat_vector_scans WHERE access_method = 'hnsw';
+
+DROP INDEX idx;
+
+-- ivfflat
+
+CREATE INDEX idx ON t USING ivfflat (val vector_l2_ops) WITH (lists = 1);
+
+SELECT FROM pg_stat_vector_scans_reset();
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT scans, distances > 0 AS distances, lists, tuples FROM pg_stat_vector_scans WHERE access_method = 'ivfflat';
+
+DROP TABLE t;
@@ -123,6 +123,10 @@ SELECT l1_distance('{1:1,2:2}/2'::sparsevec, '{1:3}/1');
 SELECT l1_distance('{1:3e38}/1'::sparsevec, '{1:-3e38}/1');
 SELECT l1_distance('{1:1,3:3,5:5,7:7}/8'::sparsevec, '{2:2,4:4,6:6,8:8}/8');
 SELECT l1_distance('{1:1,3:3,5:5,7:7,9:9}/9'::sparsevec, '{2:2,4:4,6:6,8:8}/9');
+WITH t AS (SELECT ARRAY(SELECT i % 3 FROM generate_series(1, 1000) i)::vector::sparsevec AS a, ARRAY(SELECT i % 5 FROM generate_series(1, 1000) i)::vector::sparsevec AS b)
+SELECT inner_product(a, b), l2_distance(a, b), l1_distance(a, b) FROM t;
+WITH t AS (SELECT ARRAY(SELECT i % 3 FROM generate_series(1, 1000) i)::vector::sparsevec AS a, ARRAY(SELECT CASE WHEN i % 97 = 0 THEN i % 7 + 1 ELSE 0 END FROM generate_series(1, 1000) i)::vector::sparsevec AS b)
+SELECT inner_product(a, b), l2_distance(a, b), l1_distance(a, b), inner_product(b, a), l2_distance(b, a), l1_distance(b, a) FROM t;
 SELECT '{}/2'::sparsevec <+> '{1:3,2:4}/2';
 
 SELECT l2_normalize('{1:3,2:4}/2'::sparsevec);
@@ -145,6 +145,7 @@ SELECT avg(v) FROM unnest(ARRAY['[1,2,3]'::vector, '[3,5,7]']) v;
 SELECT avg(v) FROM unnest(ARRAY['[1,2,3]'::vector, '[3,5,7]', NULL]) v;
 SELECT avg(v) FROM unnest(ARRAY[]::vector[]) v;
 SELECT avg(v) FROM unnest(ARRAY['[1,2]'::vector, '[3]']) v;
+SELECT avg(ARRAY[n, n + 1, n + 2, n + 3, n + 4, n + 5, n + 6, n + 7, n + 8]::vector) FROM generate_series(1, 100) n;
 SELECT avg(v) FROM unnest(ARRAY['[3e38]'::vector, '[3e38]']) v;
 SELECT vector_avg(array_agg(n)) FROM generate_series(1, 16002) n;
 
@@ -24,10 +24,19 @@ my $res = $node->safe_psql("postgres", "EXPLAIN SELECT v FROM tst ORDER BY v <->
 like($res, qr/lists100/);
 unlike($res, qr/lists50/);
 
+# Test mini-batch k-means when bounds do not fit into memory
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET maintenance_work_mem = '8MB';
+	CREATE INDEX lists1000 ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 1000);
+));
+is($ret, 0, $stderr);
+like($stderr, qr/Using mini-batch k-means/);
+
 # Test errors with too much memory
-my ($ret, $stdout, $stderr) = $node->psql("postgres",
-	"CREATE INDEX lists10000 ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 10000);"
-);
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET maintenance_work_mem = '1MB';
+	CREATE INDEX lists10000 ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 10000);
+));
 like($stderr, qr/memory required is/);
 
 done_testing();
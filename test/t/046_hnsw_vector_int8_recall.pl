@@ -0,0 +1,140 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $array_sql = join(",", ('random() * random()') x 3);
+
+sub test_recall
+{
+	my ($min, $rerank, $operator) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET hnsw.quantized_rerank = $rerank;
+		EXPLAIN ANALYZE SELECT i FROM tst ORDER BY v $operator '$queries[0]' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan/);
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET hnsw.quantized_rerank = $rerank;
+			SELECT i FROM tst ORDER BY v $operator '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, "$operator rerank=$rerank");
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+# Check each index type
+my @operators = ("<->", "<#>", "<=>", "<+>");
+my @opclasses = ("vector_l2_ops", "vector_ip_ops", "vector_cosine_ops", "vector_l1_ops");
+
+for my $i (0 .. $#operators)
+{
+	my $operator = $operators[$i];
+	my $opclass = $opclasses[$i];
+
+	# Get exact results
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", "SELECT i FROM tst ORDER BY v $operator '$_' LIMIT $limit;");
+		push(@expected, $res);
+	}
+
+	# Build index serially
+	$node->safe_psql("postgres", qq(
+		SET max_parallel_maintenance_workers = 0;
+		CREATE INDEX idx ON tst USING hnsw (v $opclass) WITH (quantization = 'int8');
+	));
+
+	# Test approximate results
+	my $min = $operator eq "<#>" ? 0.95 : 0.97;
+	test_recall($min, "on", $operator);
+	test_recall(0.8, "off", $operator);
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+
+	# Build index in parallel on disk
+	# Set parallel_workers on table to use workers with low maintenance_work_mem
+	my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		ALTER TABLE tst SET (parallel_workers = 2);
+		SET client_min_messages = DEBUG;
+		SET maintenance_work_mem = '4MB';
+		CREATE INDEX idx ON tst USING hnsw (v $opclass) WITH (quantization = 'int8');
+		ALTER TABLE tst RESET (parallel_workers);
+	));
+	is($ret, 0, $stderr);
+	like($stderr, qr/using \d+ parallel workers/);
+
+	# Test approximate results
+	test_recall($min, "on", $operator);
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+# Test more dimensions than without quantization
+$node->safe_psql("postgres", "CREATE TABLE tst2 (i int4, v vector(4000));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst2 SELECT i, ARRAY(SELECT random() FROM generate_series(1, 4000) WHERE i > 0) FROM generate_series(1, 100) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX ON tst2 USING hnsw (v vector_l2_ops) WITH (quantization = 'int8');");
+$node->safe_psql("postgres",
+	"INSERT INTO tst2 SELECT i, ARRAY(SELECT random() FROM generate_series(1, 4000) WHERE i > 0) FROM generate_series(101, 200) i;"
+);
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.ef_search = 200;
+	SELECT COUNT(*) FROM (SELECT i FROM tst2 ORDER BY v <-> (SELECT v FROM tst2 WHERE i = 1)) t;
+));
+is($count, 200);
+
+my ($ret, $stdout, $stderr) = $node->psql("postgres",
+	"CREATE INDEX ON tst2 USING hnsw (v vector_l2_ops);");
+like($stderr, qr/column cannot have more than 2000 dimensions for hnsw index/);
+
+done_testing();
@@ -0,0 +1,64 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()] FROM generate_series(1, 100000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 100);");
+$node->safe_psql("postgres", "ANALYZE tst;");
+
+my $parallel = qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = 20;
+	SET parallel_setup_cost = 0;
+	SET parallel_tuple_cost = 0;
+	SET min_parallel_index_scan_size = 0;
+	SET max_parallel_workers_per_gather = 2;
+);
+my $serial = qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = 20;
+	SET max_parallel_workers_per_gather = 0;
+);
+
+# Test plan
+my $explain = $node->safe_psql("postgres", qq(
+	$parallel
+	EXPLAIN SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]' LIMIT 10;
+));
+like($explain, qr/Gather Merge/);
+like($explain, qr/Parallel Index Scan/);
+
+# Test same results as serial scan
+for (1 .. 10)
+{
+	my $query = "[" . join(",", map { rand() } (1 .. 3)) . "]";
+	my $sql = "SELECT i FROM tst ORDER BY v <-> '$query' LIMIT 100;";
+	my $expected = $node->safe_psql("postgres", "$serial $sql");
+	my $actual = $node->safe_psql("postgres", "$parallel $sql");
+	is($actual, $expected);
+}
+
+# Test count
+my $count = $node->safe_psql("postgres", qq(
+	$parallel
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]') t;
+));
+my $expected = $node->safe_psql("postgres", qq(
+	$serial
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]') t;
+));
+is($count, $expected);
+
+done_testing();
@@ -0,0 +1,124 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $partitions = 10;
+
+sub test_recall
+{
+	my ($min, $message) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		EXPLAIN ANALYZE SELECT i FROM tst WHERE c = 1 ORDER BY v <-> '$queries[0]' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan using idx/);
+
+	for my $i (0 .. $#queries)
+	{
+		my $c = $i % $partitions;
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst WHERE c = $c ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $message);
+}
+
+sub get_expected
+{
+	@expected = ();
+	for my $i (0 .. $#queries)
+	{
+		my $c = $i % $partitions;
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst WHERE c = $c ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		push(@expected, $res);
+	}
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3), c int4);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()], i % $partitions FROM generate_series(1, 20000) i;"
+);
+
+# Generate queries
+for (1 .. 30)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+# Build index in memory
+get_expected();
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops, c) WITH (partitioned = true);");
+test_recall(0.99, "build in memory");
+
+# Check queries without a filter value do not use index
+my $explain = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	EXPLAIN SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT $limit;
+));
+unlike($explain, qr/Index Scan using idx/);
+
+# Insert into existing and new partitions
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()], i % ($partitions + 2) FROM generate_series(20001, 25000) i;"
+);
+$partitions += 2;
+get_expected();
+test_recall(0.99, "inserts");
+
+# Delete most of a partition, including its entry point
+$node->safe_psql("postgres", "DELETE FROM tst WHERE c = 1 AND i % 5 != 0;");
+$node->safe_psql("postgres", "VACUUM tst;");
+get_expected();
+test_recall(0.99, "vacuum");
+
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Build index on disk
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = DEBUG;
+	SET maintenance_work_mem = '1MB';
+	CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops, c) WITH (partitioned = true);
+));
+is($ret, 0, $stderr);
+like($stderr, qr/hnsw graph no longer fits into maintenance_work_mem/);
+unlike($stderr, qr/using \d+ parallel workers/);
+test_recall(0.99, "build on disk");
+
+done_testing();
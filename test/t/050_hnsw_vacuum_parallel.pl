@@ -0,0 +1,117 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+
+sub test_recall
+{
+	my ($min, $test_name) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $test_name);
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()] FROM generate_series(1, 50000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);");
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+# Delete data
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 4 = 0;");
+
+# Get exact results
+@expected = ();
+foreach (@queries)
+{
+	my $res = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+	));
+	push(@expected, $res);
+}
+
+# Repair with parallel workers
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = DEBUG;
+	SET max_parallel_maintenance_workers = 2;
+	VACUUM (PARALLEL 0) tst;
+));
+is($ret, 0, $stderr);
+like($stderr, qr/using \d+ parallel workers for hnsw vacuum/);
+
+test_recall(0.99, "after parallel vacuum");
+
+# Check space is reused
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()] FROM generate_series(1, 12500) i;"
+);
+my $pages = $node->safe_psql("postgres", "SELECT pg_relation_size('idx') / current_setting('block_size')::int;");
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 4 = 1;");
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET max_parallel_maintenance_workers = 2;
+	VACUUM (PARALLEL 0) tst;
+));
+is($ret, 0, $stderr);
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()] FROM generate_series(1, 12500) i;"
+);
+my $new_pages = $node->safe_psql("postgres", "SELECT pg_relation_size('idx') / current_setting('block_size')::int;");
+cmp_ok($new_pages, "<", $pages * 1.1, "reuses space");
+
+# Serial repair
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 4 = 2;");
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = DEBUG;
+	SET max_parallel_maintenance_workers = 0;
+	VACUUM tst;
+));
+is($ret, 0, $stderr);
+unlike($stderr, qr/parallel workers for hnsw vacuum/);
+
+done_testing();
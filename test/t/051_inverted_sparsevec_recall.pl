@@ -0,0 +1,132 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $dim = 1000;
+
+sub random_sparsevec
+{
+	my ($nnz) = @_;
+	my %elements;
+
+	while (keys %elements < $nnz)
+	{
+		$elements{int(rand($dim)) + 1} = rand();
+	}
+
+	return "{" . join(",", map { "$_:$elements{$_}" } sort { $a <=> $b } keys %elements) . "}/$dim";
+}
+
+sub insert_rows
+{
+	my ($start, $end) = @_;
+
+	# Nonzero indices are skewed so some posting lists are long
+	# and the last index is left for rows inserted later
+	$node->safe_psql("postgres", qq(
+		INSERT INTO tst SELECT i, ('{' || (SELECT string_agg(d || ':' || random(), ',') FROM (SELECT DISTINCT (random() * random() * ($dim - 2))::int + 1 AS d FROM generate_series(1, 10) WHERE i > 0) s) || '}/$dim')::sparsevec FROM generate_series($start, $end) i;
+	));
+}
+
+sub test_recall
+{
+	my ($min) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		EXPLAIN ANALYZE SELECT i FROM tst ORDER BY v <#> '$queries[0]' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan using idx/);
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst ORDER BY v <#> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min);
+}
+
+sub get_expected
+{
+	@expected = ();
+	foreach (@queries)
+	{
+		# Only rows that share a nonzero index are returned by the index
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst WHERE v <#> '$_' < 0 ORDER BY v <#> '$_' LIMIT $limit;
+		));
+		push(@expected, $res);
+	}
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v sparsevec($dim));");
+insert_rows(1, 10000);
+
+# Generate queries
+for (1 .. 20)
+{
+	push(@queries, random_sparsevec(5));
+}
+
+# Test build
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING inverted (v sparsevec_ip_ops);");
+get_expected();
+test_recall(0.99);
+
+# Test inserts, including for indices not in the index
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 2 = 0;");
+$node->safe_psql("postgres", "VACUUM tst;");
+insert_rows(10001, 15000);
+$node->safe_psql("postgres", "INSERT INTO tst SELECT i, '{$dim:1}/$dim' FROM generate_series(15001, 15010) i;");
+push(@queries, "{$dim:1}/$dim");
+get_expected();
+test_recall(0.99);
+
+# Test fewer results than limit
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <#> '{$dim:1}/$dim' LIMIT $limit) t;
+));
+is($count, 10);
+
+# Test top k
+$count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET inverted.top_k = 5;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <#> '$queries[0]' LIMIT $limit) t;
+));
+is($count, 5);
+
+done_testing();
@@ -0,0 +1,163 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $array_sql = join(",", ('random() * random()') x 3);
+
+sub test_recall
+{
+	my ($min, $operator) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		EXPLAIN ANALYZE SELECT i FROM tst ORDER BY v $operator '$queries[0]' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan/);
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst ORDER BY v $operator '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $operator);
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+my @operators = ("<->", "<=>");
+my @opclasses = ("vector_l2_ops", "vector_cosine_ops");
+
+for my $i (0 .. $#operators)
+{
+	my $operator = $operators[$i];
+	my $opclass = $opclasses[$i];
+
+	# Build the previous generation of the index
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v $opclass);");
+
+	# Change rows after the build
+	$node->safe_psql("postgres", qq(
+		UPDATE tst SET v = ARRAY[$array_sql] WHERE i % 10 = 0;
+		DELETE FROM tst WHERE i % 10 = 1;
+		INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(10001 + $i * 1000, 11000 + $i * 1000) i;
+	));
+
+	# Get exact results
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", "SELECT i FROM tst ORDER BY v $operator '$_' LIMIT $limit;");
+		push(@expected, $res);
+	}
+
+	# Build from the previous index
+	my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		SET client_min_messages = DEBUG;
+		SET hnsw.build_source_index = 'idx';
+		CREATE INDEX idx2 ON tst USING hnsw (v $opclass);
+	));
+	is($ret, 0, $stderr);
+	like($stderr, qr/reused hnsw graph of "idx", removed [1-9]\d* elements/);
+	unlike($stderr, qr/using \d+ parallel workers/);
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+
+	# Test approximate results
+	test_recall(0.97, $operator);
+
+	# Reindex with the graph of the same index
+	($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		SET client_min_messages = DEBUG;
+		SET hnsw.build_source_index = 'idx2';
+		REINDEX INDEX CONCURRENTLY idx2;
+	));
+	is($ret, 0, $stderr);
+	like($stderr, qr/reused hnsw graph of "idx2"/);
+
+	# Test approximate results
+	test_recall(0.97, $operator);
+
+	# Fall back to a full build when the graph does not fit into memory
+	($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		SET maintenance_work_mem = '1MB';
+		SET hnsw.build_source_index = 'idx2';
+		CREATE INDEX idx ON tst USING hnsw (v $opclass);
+	));
+	is($ret, 0, $stderr);
+	like($stderr, qr/hnsw graph of "idx2" does not fit into maintenance_work_mem/);
+
+	$node->safe_psql("postgres", "DROP INDEX idx2;");
+
+	# Test approximate results
+	test_recall(0.97, $operator);
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+# Reuse a quantized graph
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (quantization = 'int8');");
+$node->safe_psql("postgres", "UPDATE tst SET v = ARRAY[$array_sql] WHERE i % 10 = 2;");
+
+@expected = ();
+foreach (@queries)
+{
+	my $res = $node->safe_psql("postgres", "SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;");
+	push(@expected, $res);
+}
+
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = DEBUG;
+	SET hnsw.build_source_index = 'idx';
+	CREATE INDEX idx2 ON tst USING hnsw (v vector_l2_ops) WITH (quantization = 'int8');
+));
+is($ret, 0, $stderr);
+like($stderr, qr/reused hnsw graph of "idx", removed [1-9]\d* elements/);
+
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+test_recall(0.95, "<->");
+
+done_testing();
@@ -0,0 +1,89 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my $limit = 20;
+my $array_sql = join(",", ('random()') x 3);
+
+# Cached upper layers should give the same results as reading them from disk
+sub test_same_results
+{
+	my ($operator, $cache_size) = @_;
+
+	for my $query (@queries)
+	{
+		my $cached = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET hnsw.upper_cache_size = '$cache_size';
+			SELECT i FROM tst ORDER BY v $operator '$query' LIMIT $limit;
+			SELECT i FROM tst ORDER BY v $operator '$query' LIMIT $limit;
+		));
+		my $uncached = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET hnsw.upper_cache_size = 0;
+			SELECT i FROM tst ORDER BY v $operator '$query' LIMIT $limit;
+			SELECT i FROM tst ORDER BY v $operator '$query' LIMIT $limit;
+		));
+		is($cached, $uncached, "$operator $cache_size $query");
+	}
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i serial, v vector(3));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+
+# Generate queries
+for (1 .. 10)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+my @operators = ("<->", "<=>");
+my @opclasses = ("vector_l2_ops", "vector_cosine_ops");
+
+for my $i (0 .. $#operators)
+{
+	my $operator = $operators[$i];
+	my $opclass = $opclasses[$i];
+
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v $opclass);");
+
+	test_same_results($operator, '16MB');
+
+	# Only cache the highest layers
+	test_same_results($operator, '8kB');
+
+	# Insert elements into upper layers
+	$node->safe_psql("postgres",
+		"INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 2000) i;"
+	);
+	test_same_results($operator, '16MB');
+
+	# Delete elements from upper layers
+	$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 3 = 0;");
+	$node->safe_psql("postgres", "VACUUM tst;");
+	test_same_results($operator, '16MB');
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+# Test quantized values
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (quantization = 'int8');");
+test_same_results("<->", '16MB');
+
+done_testing();
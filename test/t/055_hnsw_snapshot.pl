@@ -0,0 +1,179 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my $limit = 20;
+my $array_sql = join(",", ('random()') x 3);
+
+sub get_results
+{
+	my ($operator, $query) = @_;
+	return $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SELECT i FROM tst ORDER BY v $operator '$query' LIMIT $limit;
+	));
+}
+
+sub snapshot_files
+{
+	my $dir = $node->data_dir . "/pg_hnsw";
+	return 0 unless -d $dir;
+	opendir(my $dh, $dir) or die "could not open $dir: $!";
+	my @files = grep { /\.snapshot$/ } readdir($dh);
+	closedir($dh);
+	return scalar(@files);
+}
+
+# Snapshot should give the same results as traversing the index
+sub test_same_results
+{
+	my ($operator) = @_;
+
+	my @expected = ();
+	$node->safe_psql("postgres", "ALTER INDEX idx SET (snapshot = false);");
+	foreach (@queries)
+	{
+		push(@expected, get_results($operator, $_));
+	}
+
+	$node->safe_psql("postgres", "ALTER INDEX idx SET (snapshot = true);");
+	for my $i (0 .. $#queries)
+	{
+		is(get_results($operator, $queries[$i]), $expected[$i], "$operator $queries[$i]");
+	}
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i serial, v vector(3));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+
+# Generate queries
+for (1 .. 10)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+my @operators = ("<->", "<=>");
+my @opclasses = ("vector_l2_ops", "vector_cosine_ops");
+
+for my $i (0 .. $#operators)
+{
+	my $operator = $operators[$i];
+	my $opclass = $opclasses[$i];
+
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v $opclass) WITH (snapshot = true);");
+	is(snapshot_files(), 1, "exported on build");
+
+	test_same_results($operator);
+
+	# Inserts invalidate the snapshot
+	$node->safe_psql("postgres", "INSERT INTO tst (v) VALUES ('$queries[0]');");
+	is(snapshot_files(), 0, "removed on insert");
+
+	my $ids = get_results($operator, $queries[0]);
+	my $max_id = $node->safe_psql("postgres", "SELECT MAX(i) FROM tst;");
+	like($ids, qr/^$max_id$/m, "finds inserted row");
+
+	# Rebuilds export again
+	$node->safe_psql("postgres", "REINDEX INDEX idx;");
+	is(snapshot_files(), 1, "exported on reindex");
+	like(get_results($operator, $queries[0]), qr/^$max_id$/m, "finds inserted row after reindex");
+
+	# Vacuum invalidates the snapshot
+	$node->safe_psql("postgres", "DELETE FROM tst WHERE i = $max_id;");
+	$node->safe_psql("postgres", "VACUUM tst;");
+	is(snapshot_files(), 0, "removed on vacuum");
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+# Scans do not export missing files
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (snapshot = true);");
+my $dir = $node->data_dir . "/pg_hnsw";
+unlink(glob("$dir/*.snapshot"));
+is(snapshot_files(), 0);
+test_same_results("<->");
+is(snapshot_files(), 0, "not exported on scan");
+
+# Missing files are exported explicitly and used by backends that tried them
+my $expected = get_results("<->", $queries[0]);
+my $output = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT $limit;
+	SELECT hnsw_export_snapshot('idx');
+	SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT $limit;
+));
+is($output, "$expected\nt\n$expected", "exported explicitly");
+is(snapshot_files(), 1, "exported by function");
+is($node->safe_psql("postgres", "SELECT hnsw_export_snapshot('idx');"), "t", "already exported");
+test_same_results("<->");
+
+# Drops remove the file once they commit
+$node->safe_psql("postgres", "BEGIN; DROP INDEX idx; ROLLBACK;");
+is(snapshot_files(), 1, "kept on aborted drop");
+$node->safe_psql("postgres", "DROP INDEX idx;");
+is(snapshot_files(), 0, "removed on drop");
+
+# Aborted builds remove the file
+$node->safe_psql("postgres", "BEGIN; CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (snapshot = true); ROLLBACK;");
+is(snapshot_files(), 0, "removed on aborted build");
+
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (snapshot = true);");
+$node->safe_psql("postgres", "BEGIN; REINDEX INDEX idx; ROLLBACK;");
+is(snapshot_files(), 0, "removed on aborted reindex");
+is($node->safe_psql("postgres", "SELECT hnsw_export_snapshot('idx');"), "t");
+is(snapshot_files(), 1, "exported after aborted reindex");
+test_same_results("<->");
+
+# Changed indexes cannot be exported
+$node->safe_psql("postgres", "INSERT INTO tst (v) VALUES ('$queries[0]');");
+is($node->safe_psql("postgres", "SELECT hnsw_export_snapshot('idx');"), "f", "not exported after insert");
+is(snapshot_files(), 0);
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Stale files are removed before the first scan
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (snapshot = true);");
+for my $name ("4294967295_1.snapshot", "4294967295_1.snapshot.tmp.999999")
+{
+	open(my $fh, '>', "$dir/$name") or die "could not create $dir/$name: $!";
+	print $fh "x" x 100;
+	close($fh);
+}
+is(snapshot_files(), 2);
+get_results("<->", $queries[0]);
+is(snapshot_files(), 1, "removed stale files");
+ok(!-e "$dir/4294967295_1.snapshot.tmp.999999", "removed stale temporary file");
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Dropping a database removes its files
+$node->safe_psql("postgres", "CREATE DATABASE other;");
+$node->safe_psql("other", "CREATE EXTENSION vector;");
+$node->safe_psql("other", "CREATE TABLE tst (v vector(3));");
+$node->safe_psql("other", "INSERT INTO tst SELECT ARRAY[$array_sql] FROM generate_series(1, 1000) i;");
+$node->safe_psql("other", "CREATE INDEX ON tst USING hnsw (v vector_l2_ops) WITH (snapshot = true);");
+is(snapshot_files(), 1, "exported in other database");
+$node->safe_psql("postgres", "DROP DATABASE other;");
+is(snapshot_files(), 0, "removed on drop database");
+
+# Test filter columns
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	CREATE INDEX ON tst USING hnsw (v vector_l2_ops, i) WITH (snapshot = true);
+));
+like($stderr, qr/snapshot is not supported for hnsw indexes with filter columns/);
+
+done_testing();
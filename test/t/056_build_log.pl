@@ -0,0 +1,75 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()] FROM generate_series(1, 20000) i;"
+);
+
+# Test no logging by default
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = log;
+	CREATE INDEX ON tst USING hnsw (v vector_l2_ops);
+	CREATE INDEX ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 10);
+));
+is($ret, 0, $stderr);
+unlike($stderr, qr/hnsw build|ivfflat/);
+
+# Test hnsw
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = log;
+	SET hnsw.build_log_interval = '1s';
+	SET maintenance_work_mem = '1MB';
+	CREATE INDEX ON tst USING hnsw (v vector_l2_ops);
+));
+is($ret, 0, $stderr);
+like($stderr, qr/hnsw build leader inserted 20000 tuples/);
+like($stderr, qr/distances: [1-9]\d*, entry lock wait/);
+like($stderr, qr/hnsw build wrote segment 1 with \d+ elements/);
+like($stderr, qr/hnsw build wrote segment 2 with \d+ elements/);
+like($stderr, qr/hnsw build used at most \d+ MB of 1 MB for the graph/);
+
+# Test hnsw in parallel
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = log;
+	SET hnsw.build_log_interval = '1s';
+	SET min_parallel_table_scan_size = 1;
+	CREATE INDEX ON tst USING hnsw (v vector_l2_ops);
+));
+is($ret, 0, $stderr);
+like($stderr, qr/hnsw build (leader|worker) inserted \d+ tuples/);
+like($stderr, qr/hnsw build used at most \d+ MB/);
+
+# Test ivfflat
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = log;
+	SET ivfflat.build_log_interval = '1s';
+	CREATE INDEX ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 10);
+));
+is($ret, 0, $stderr);
+like($stderr, qr/ivfflat k-means using \d+ MB for 10000 samples and 10 centers/);
+like($stderr, qr/ivfflat k-means converged after \d+ iterations/);
+like($stderr, qr/ivfflat build leader assigned 20000 tuples/);
+like($stderr, qr/ivfflat build assigned 20000 tuples to 10 lists with inertia/);
+like($stderr, qr/ivfflat build sort method: /);
+like($stderr, qr/ivfflat load tuples: [\d.]+ ms/);
+
+# Test requires superuser
+$node->safe_psql("postgres", "CREATE ROLE regular LOGIN;");
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SELECT '[1,2,3]'::vector;
+	SET hnsw.build_log_interval = '1s';
+), extra_params => ['-U', 'regular']);
+like($stderr, qr/permission denied to set parameter/);
+
+done_testing();
@@ -0,0 +1,154 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $dim = 8;
+
+sub test_recall
+{
+	my ($probes, $min, $operator) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET ivfflat.probes = $probes;
+		EXPLAIN ANALYZE SELECT i FROM tst ORDER BY v $operator '$queries[0]' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan using idx on tst/);
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET ivfflat.probes = $probes;
+			SELECT i FROM tst ORDER BY v $operator '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+
+		my @expected_ids = split("\n", $expected[$i]);
+		my %expected_set = map { $_ => 1 } @expected_ids;
+
+		foreach (@actual_ids)
+		{
+			if (exists($expected_set{$_}))
+			{
+				$correct++;
+			}
+		}
+
+		$total += $limit;
+	}
+
+	cmp_ok($correct / $total, ">=", $min, "$operator probes=$probes");
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY(SELECT random() FROM generate_series(1, $dim) WHERE i > 0) FROM generate_series(1, 20000) i;"
+);
+
+# Generate queries
+for (1 .. 20)
+{
+	my @r = map { rand() } (1 .. $dim);
+	push(@queries, "[" . join(",", @r) . "]");
+}
+
+# Check each index type
+my @operators = ("<->", "<#>", "<=>");
+my @opclasses = ("vector_l2_ops", "vector_ip_ops", "vector_cosine_ops");
+
+for my $i (0 .. $#operators)
+{
+	my $operator = $operators[$i];
+	my $opclass = $opclasses[$i];
+
+	# Get exact results
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			WITH top AS (
+				SELECT v $operator '$_' AS distance FROM tst ORDER BY distance LIMIT $limit
+			)
+			SELECT i FROM tst WHERE (v $operator '$_') <= (SELECT MAX(distance) FROM top)
+		));
+		push(@expected, $res);
+	}
+
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v $opclass) WITH (lists = 50, packed = true);");
+
+	# Test approximate results
+	test_recall(10, 0.8, $operator);
+
+	# Test all lists
+	test_recall(50, 0.99, $operator);
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+# Test size
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 50, packed = true);");
+$node->safe_psql("postgres", "CREATE INDEX unpacked_idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 50);");
+my $smaller = $node->safe_psql("postgres", "SELECT pg_relation_size('idx') < pg_relation_size('unpacked_idx');");
+is($smaller, "t");
+$node->safe_psql("postgres", "DROP INDEX unpacked_idx;");
+
+# Test vacuum
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 2 = 0;");
+$node->safe_psql("postgres", "VACUUM tst;");
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = 50;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '$queries[0]') t;
+));
+is($count, 10000);
+
+# Test inserts after vacuum
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY(SELECT random() FROM generate_series(1, $dim) WHERE i > 0) FROM generate_series(1, 5000) i;"
+);
+$count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = 50;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '$queries[0]') t;
+));
+is($count, 15000);
+
+# Test inserts with new pages
+$node->safe_psql("postgres", "TRUNCATE tst;");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY(SELECT random() FROM generate_series(1, $dim) WHERE i > 0) FROM generate_series(1, 1000) i;"
+);
+$count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = 50;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '$queries[0]') t;
+));
+is($count, 1000);
+
+# Test unsupported options
+my ($ret, $stdout, $stderr) = $node->psql("postgres",
+	"CREATE INDEX ON tst USING ivfflat (v vector_l2_ops) WITH (packed = true, quantizer = 'pq');");
+like($stderr, qr/packed entry pages require the flat quantizer/);
+
+$node->safe_psql("postgres", "CREATE TABLE tst2 (v halfvec(3));");
+($ret, $stdout, $stderr) = $node->psql("postgres",
+	"CREATE INDEX ON tst2 USING ivfflat (v halfvec_l2_ops) WITH (packed = true);");
+like($stderr, qr/packed entry pages require vector_l2_ops, vector_ip_ops, or vector_cosine_ops/);
+
+done_testing();
@@ -0,0 +1,165 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $dim = 8;
+
+sub test_recall
+{
+	my ($probes, $min, $operator) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET ivfflat.probes = $probes;
+			SELECT i FROM tst ORDER BY v $operator '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+
+		my @expected_ids = split("\n", $expected[$i]);
+		my %expected_set = map { $_ => 1 } @expected_ids;
+
+		foreach (@actual_ids)
+		{
+			if (exists($expected_set{$_}))
+			{
+				$correct++;
+			}
+		}
+
+		$total += $limit;
+	}
+
+	cmp_ok($correct / $total, ">=", $min, "$operator probes=$probes");
+}
+
+sub count_rows
+{
+	my ($operator) = @_;
+
+	return $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET ivfflat.probes = 1000;
+		SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v $operator '$queries[0]') t;
+	));
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+
+# Generate queries near the inserted rows
+for (1 .. 20)
+{
+	my @r = map { rand() * 0.1 } (1 .. $dim);
+	push(@queries, "[" . join(",", @r) . "]");
+}
+
+my @operators = ("<->", "<=>", "<->");
+my @opclasses = ("vector_l2_ops", "vector_cosine_ops", "vector_l2_ops");
+my @options = ("", "", ", packed = true");
+
+for my $i (0 .. $#operators)
+{
+	my $operator = $operators[$i];
+	my $opclass = $opclasses[$i];
+
+	$node->safe_psql("postgres", "TRUNCATE tst;");
+	$node->safe_psql("postgres",
+		"INSERT INTO tst SELECT i, ARRAY(SELECT random() FROM generate_series(1, $dim) WHERE i > 0) FROM generate_series(1, 10000) i;"
+	);
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v $opclass) WITH (lists = 20$options[$i]);");
+
+	# Insert rows that go to a few lists
+	$node->safe_psql("postgres",
+		"INSERT INTO tst SELECT i, ARRAY(SELECT random() * 0.1 FROM generate_series(1, $dim) WHERE i > 0) FROM generate_series(10001, 30000) i;"
+	);
+
+	# Get exact results
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			WITH top AS (
+				SELECT v $operator '$_' AS distance FROM tst ORDER BY distance LIMIT $limit
+			)
+			SELECT i FROM tst WHERE (v $operator '$_') <= (SELECT MAX(distance) FROM top)
+		));
+		push(@expected, $res);
+	}
+
+	# Test splits
+	my $splits = $node->safe_psql("postgres", "SELECT splits FROM ivfflat_rebalance('idx');");
+	cmp_ok($splits, ">", 0, "$opclass$options[$i] splits");
+	is(count_rows($operator), 30000);
+	test_recall(1000, 0.99, $operator);
+
+	# Test merges
+	my $merges = $node->safe_psql("postgres", "SELECT merges FROM ivfflat_rebalance('idx', 100, 1);");
+	cmp_ok($merges, ">", 0, "$opclass$options[$i] merges");
+	is(count_rows($operator), 30000);
+	test_recall(1000, 0.99, $operator);
+
+	# Test inserts and vacuum after rebalancing
+	$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 2 = 0;");
+	$node->safe_psql("postgres", "VACUUM tst;");
+	$node->safe_psql("postgres",
+		"INSERT INTO tst SELECT i, ARRAY(SELECT random() FROM generate_series(1, $dim) WHERE i > 0) FROM generate_series(1, 5000) i;"
+	);
+	is(count_rows($operator), 20000);
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+# Test concurrent inserts
+$node->safe_psql("postgres", "TRUNCATE tst;");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY(SELECT random() FROM generate_series(1, $dim) WHERE i > 0) FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 20);");
+$node->pgbench(
+	"--no-vacuum --client=5 --transactions=50",
+	0,
+	[qr{actually processed}],
+	[qr{^$}],
+	"concurrent inserts and rebalancing",
+	{
+		"058_ivfflat_rebalance_insert" => "INSERT INTO tst SELECT i, ARRAY(SELECT random() * 0.1 FROM generate_series(1, $dim) WHERE i > 0) FROM generate_series(1, 100) i;",
+		"058_ivfflat_rebalance" => "SELECT ivfflat_rebalance('idx', 1.5, 0.5);"
+	}
+);
+my $count = $node->safe_psql("postgres", "SELECT COUNT(*) FROM tst;");
+is(count_rows("<->"), $count, "no entries lost with concurrent inserts");
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Test no changes
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 20);");
+my $result = $node->safe_psql("postgres", "SELECT * FROM ivfflat_rebalance('idx', 1000, 0);");
+is($result, "0|0");
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Test product quantization
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 20, quantizer = 'pq');");
+my ($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT ivfflat_rebalance('idx');");
+like($stderr, qr/rebalancing does not support product quantization/);
+
+# Test requires owner
+$node->safe_psql("postgres", "CREATE ROLE regular LOGIN;");
+($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT ivfflat_rebalance('idx');", extra_params => ['-U', 'regular']);
+like($stderr, qr/must be owner of index idx/);
+
+done_testing();
@@ -0,0 +1,108 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+
+sub get_expected
+{
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+		));
+		push(@expected, $res);
+	}
+}
+
+sub test_recall
+{
+	my ($min, $test_name) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $test_name);
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+
+# Build a sparse graph
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()] FROM generate_series(1, 2000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (m = 4, ef_construction = 16);");
+
+# Insert a dense region afterwards. With a small m, existing elements prune
+# most of the reverse connections, so the new elements have one-way edges to
+# the existing elements that they were connected to.
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random() * 0.2, random() * 0.2, random() * 0.2] FROM generate_series(2001, 12000) i;"
+);
+
+# Generate queries near the dense region
+for (1 .. 20)
+{
+	my $r1 = rand() * 0.2;
+	my $r2 = rand() * 0.2;
+	my $r3 = rand() * 0.2;
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+# Delete the targets of the one-way edges
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i <= 2000;");
+$node->safe_psql("postgres", "VACUUM tst;");
+
+# Reuse the deleted elements for rows far away from the dense region, so any
+# remaining edge to them leads the scan away from its results
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[0.8 + random() * 0.2, 0.8 + random() * 0.2, 0.8 + random() * 0.2] FROM generate_series(12001, 14000) i;"
+);
+
+get_expected();
+test_recall(0.95, "after vacuum and reuse");
+
+# Test no deleted or reused rows are returned for the dense region
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.ef_search = 1000;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT 100) t WHERE i <= 2000 OR i > 12000;
+));
+is($count, 0, "deleted rows after vacuum");
+
+done_testing();